@@ -0,0 +1,882 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "mlasm.h"
+#include "mlisa.h"
+
+#include <algorithm>
+#include <set>
+#include <tuple>
+
+// Allocation of coefficient tensors (.ctensor) in coefficient memory, of
+// kernels (.kernel) in code memory and of activation buffers (.buffer) in
+// main memory. It runs at the start of assemble(), before the fixups are
+// resolved, and gives each tensor, kernel and buffer one address for the
+// whole program.
+//
+// Like the static analysis, the allocator follows the sequencer from the
+// entry point and records a trace of the loads of coefficient tensors
+// ("LoadCoeff <tensor>") and kernels ("LoadCode <kernel>", "Execute
+// <kernel>") and of the uses of tensors, kernels and buffers: instructions
+// that reference them, instructions that access memory through a base
+// pointer that was last set from one (e.g. "SetCBP <tensor>" for MACC, or
+// "SetSBP <buffer>" for Store), and the compute code of executed kernels.
+//
+// A coefficient tensor or kernel is live from a load to its last use before
+// the next load, a buffer from its first to its last use. Objects that are
+// live at the same time get disjoint addresses. Then load sites are dropped
+// where the object can stay resident from its previous load every time the
+// site runs and all objects still fit. Coefficient tensor loads are tried
+// in the order of the words they load per run. Kernels are the overlays of
+// code memory: their loads are tried in the order of the words they save
+// per word of code memory that has to stay reserved for them, i.e. the
+// kernel's size plus its reuse distance (the words of the other kernels
+// used since the kernel was last loaded or run). This follows Belady's
+// rule of evicting what is used again furthest in the future, for one
+// address per kernel. Dropped sites are replaced by "AddCBP 0" words,
+// which "mlasm -O" removes.
+
+namespace
+{
+struct event_t {
+	enum { LOAD, KLOAD, USE };
+
+	// LOAD: a is the load site (index in cloads), KLOAD: a is the load site
+	// (index in kloads), USE: a is the object, coefficient tensors first,
+	// followed by the buffers and the kernels
+	int kind, a;
+	int linenr;
+	long long count;
+};
+}
+
+struct MlAsm::alloc_state_t
+{
+	// The trace of a subroutine only depends on its address, the contents
+	// of code memory and the objects the base pointers point to when it is
+	// called, so it is recorded once for each combination. A run of calls of
+	// the same subroutine with the same state is recorded as the first call
+	// followed by one call that counts for the rest, which are the same
+	// because loads are idempotent.
+	typedef std::tuple<int, int, int, int, int, int> key_t;
+
+	struct sub_t {
+		std::vector<event_t> events;
+		int bp_out[4], code_gen_out;
+		std::vector<int> code_out;
+	};
+
+	enum { MAX_EVENTS = 1 << 22 };
+
+	// Coefficient tensors and kernels are placed in the same way, each in
+	// their own memory: the objects first to first+num-1 with their sizes
+	// and banks, the kind of their load events and the object loaded by
+	// each site, and the memory written by loads with fixed addresses
+	// (bank, start, end).
+	struct pool_t {
+		int first = 0, num = 0, size = 0, load_kind = 0;
+		std::vector<int> words, banks, site_object;
+		std::set<std::tuple<int, int, int>> reserved;
+	};
+
+	MlAsm &as;
+	const int maddr_mask;
+	const int num_ctensors, num_buffers, first_kernel;
+
+	std::vector<insn_t> ev_insns;
+	std::vector<std::vector<int>> insn_objects;
+	std::vector<int> site_at, ksite_at, kernel_src;
+	std::map<int, int> at;
+
+	std::map<key_t, int> sub_index;
+	std::vector<sub_t> subs;
+
+	// main memory word index of the word in each code memory entry
+	std::vector<int> code_src;
+	int code_gen = 0, num_code_gens = 1;
+	int bp[4] = {-1, -1, -1, -1};
+
+	pool_t coeffs, code;
+	std::vector<int> object_symbol;
+	std::vector<int> addr;
+
+	alloc_state_t(MlAsm &as) : as(as), maddr_mask(as.arch.maddr_mask()), num_ctensors(as.ctensors.size()),
+			num_buffers(as.buffers.size()), first_kernel(num_ctensors + num_buffers) { }
+
+	void error(int linenr, const char *msg, const char *arg)
+	{
+		fprintf(stderr, "MlAsm coefficient error in line %d: ", linenr);
+		fprintf(stderr, msg, arg);
+		fprintf(stderr, "\n");
+		exit(1);
+	}
+
+	void check_size(const std::vector<event_t> &events)
+	{
+		if (int(events.size()) > MAX_EVENTS) {
+			fprintf(stderr, "MlAsm allocation error: More than %d loads and uses of tensors, "
+					"kernels and buffers in a subroutine.\n", int(MAX_EVENTS));
+			exit(1);
+		}
+	}
+
+	void emit(std::vector<event_t> &events, int kind, int a, int linenr)
+	{
+		if (!events.empty() && events.back().kind == kind && events.back().a == a) {
+			events.back().count++;
+			return;
+		}
+		events.push_back(event_t{kind, a, linenr, 1});
+		check_size(events);
+	}
+
+	// the object of the pool that an event loads or uses, or -1
+	int poolObject(const pool_t &pool, const event_t &e) const
+	{
+		int t = e.kind == pool.load_kind ? pool.site_object[e.a] : e.kind == event_t::USE ? e.a - pool.first : -1;
+		return t >= 0 && t < pool.num ? t : -1;
+	}
+
+	void compute(std::vector<event_t> &events, int word);
+	int walk(int addr, int depth);
+	bool fitPool(const pool_t &pool, const std::vector<event_t> &trace, const std::vector<bool> &dropped);
+	void dropLoads(const pool_t &pool, const std::vector<event_t> &trace, const std::vector<int> &sites,
+			std::vector<bool> &dropped);
+	void removeLoads(const std::vector<std::pair<int, int>> &loads);
+	void placeCoeffs(const std::vector<event_t> &trace);
+	void placeKernels(const std::vector<event_t> &trace);
+	void placeBuffers(const std::vector<event_t> &trace);
+};
+
+// Uses by a compute instruction at the given main memory word, run by the
+// sequencer or by Execute.
+void MlAsm::alloc_state_t::compute(std::vector<event_t> &events, int word)
+{
+	auto it = at.find(4*word);
+	int opcode = it != at.end() ? ev_insns[it->second].opcode :
+			as.data_valid[word] ? as.arch.insn_op(as.data[word]) : -1;
+	const MlIsa::op_t &op = ml_isa_op(opcode);
+	int linenr = it != at.end() ? ev_insns[it->second].linenr : as.data_linenr[word];
+	static const std::vector<int> no_objects;
+	const std::vector<int> &objects = it != at.end() ? insn_objects[it->second] : no_objects;
+
+	if (op.kind == MlIsa::KIND_SETBP) {
+		if (!objects.empty())
+			bp[op.reg] = objects.front();
+		else if ((op.flags & MlIsa::FLAG_ADD) == 0)
+			bp[op.reg] = -1;
+		return;
+	}
+
+	for (int obj : objects)
+		emit(events, event_t::USE, obj, linenr);
+
+	int regs[2] = {-1, -1};
+	if (op.kind == MlIsa::KIND_MACC)
+		regs[0] = MlIsa::REG_VBP, regs[1] = MlIsa::REG_CBP;
+	if (op.kind == MlIsa::KIND_STORE || op.kind == MlIsa::KIND_SAVE)
+		regs[0] = MlIsa::REG_SBP;
+	if (op.kind == MlIsa::KIND_LDACC)
+		regs[0] = MlIsa::REG_LBP;
+
+	for (int r : regs)
+		if (r >= 0 && bp[r] >= 0)
+			emit(events, event_t::USE, bp[r], linenr);
+}
+
+int MlAsm::alloc_state_t::walk(int addr, int depth)
+{
+	key_t key = std::make_tuple(addr, code_gen, bp[0], bp[1], bp[2], bp[3]);
+	auto it = sub_index.find(key);
+
+	if (it != sub_index.end()) {
+		const sub_t &sub = subs[it->second];
+		std::copy(sub.bp_out, sub.bp_out + 4, bp);
+		if (sub.code_gen_out != code_gen) {
+			code_gen = sub.code_gen_out;
+			code_src = sub.code_out;
+		}
+		return it->second;
+	}
+
+	if (depth > as.arch.callstack_size) {
+		fprintf(stderr, "MlAsm allocation error: Call depth exceeds the %d entries "
+				"call stack.\n", as.arch.callstack_size);
+		exit(1);
+	}
+
+	std::vector<event_t> events;
+	int last_sub = -1, last_start = 0, last_end = -1, last_reps = 0;
+
+	while (1)
+	{
+		auto it = at.find(addr);
+		if (it == at.end())
+			break;
+
+		int idx = it->second;
+		const insn_t &insn = ev_insns[idx];
+		const MlIsa::op_t &op = ml_isa_op(insn.opcode);
+
+		if (site_at[idx] >= 0) {
+			const cload_t &ld = as.cloads[site_at[idx]];
+			for (int i = ld.insn_idx; i < ld.insn_idx + ld.len; i++)
+				for (int obj : insn_objects[i])
+					if (obj >= num_ctensors)
+						emit(events, event_t::USE, obj, insn.linenr);
+			emit(events, event_t::LOAD, site_at[idx], insn.linenr);
+			addr += 4*ld.len;
+			continue;
+		}
+
+		if (ksite_at[idx] >= 0) {
+			emit(events, event_t::KLOAD, ksite_at[idx], insn.linenr);
+			addr += 4*as.kloads[ksite_at[idx]].len;
+			continue;
+		}
+
+		if (op.kind == MlIsa::KIND_RETURN)
+			break;
+
+		if (op.kind == MlIsa::KIND_CALL)
+		{
+			int s = walk(insn.maddr & maddr_mask, depth+1);
+
+			if (s == last_sub && last_end == int(events.size()) && last_reps > 1) {
+				for (int i = 0; i < int(subs[s].events.size()); i++)
+					events[last_start + i].count += subs[s].events[i].count;
+			} else {
+				if (s != last_sub || last_end != int(events.size()))
+					last_reps = 0;
+				last_sub = s;
+				last_start = events.size();
+				events.insert(events.end(), subs[s].events.begin(), subs[s].events.end());
+				check_size(events);
+			}
+
+			last_reps++;
+			last_end = events.size();
+			addr += 4;
+			continue;
+		}
+
+		// The caddr of "Execute <kernel>" is relative to the kernel here, its
+		// symbol is 0 while following the sequencer.
+		if (op.kind == MlIsa::KIND_EXECUTE) {
+			int len = insn.maddr & maddr_mask;
+			int k = -1;
+			for (int obj : insn_objects[idx])
+				if (obj >= first_kernel)
+					k = obj - first_kernel;
+			if (k >= 0) {
+				emit(events, event_t::USE, first_kernel + k, insn.linenr);
+				for (int i = std::max(insn.caddr, 0); i < insn.caddr + len && i < as.kernels[k].words; i++)
+					if (kernel_src[k] >= 0)
+						compute(events, kernel_src[k] + i);
+			} else {
+				for (int i = insn.caddr; i < insn.caddr + len && i < as.arch.code_size; i++)
+					if (code_src[i] >= 0)
+						compute(events, code_src[i]);
+			}
+			addr += 4;
+			continue;
+		}
+
+		if (op.kind == MlIsa::KIND_LOAD)
+		{
+			int len = 1;
+			auto next = at.find(addr+4);
+			if (next != at.end() && ev_insns[next->second].opcode == 7) {
+				len += ev_insns[next->second].maddr & maddr_mask;
+				addr += 4;
+			}
+
+			int start = insn.maddr & maddr_mask;
+			bool coeff_ref = false, kernel_ref = false;
+
+			for (int obj : insn_objects[idx]) {
+				emit(events, event_t::USE, obj, insn.linenr);
+				coeff_ref = coeff_ref || obj < num_ctensors;
+				kernel_ref = kernel_ref || obj >= first_kernel;
+			}
+
+			if (op.lanes == 0 && !kernel_ref) {
+				code.reserved.insert(std::make_tuple(0, insn.caddr, insn.caddr + len));
+				bool changed = false;
+				for (int i = 0; i < len && insn.caddr + i < as.arch.code_size; i++) {
+					changed = changed || code_src[insn.caddr + i] != start/4 + i;
+					code_src[insn.caddr + i] = start/4 + i;
+				}
+				if (changed)
+					code_gen = num_code_gens++;
+			} else if (op.lanes != 0 && !coeff_ref) {
+				coeffs.reserved.insert(std::make_tuple(insn.opcode - 5, insn.caddr, insn.caddr + len));
+			}
+
+			addr += 4;
+			continue;
+		}
+
+		if (op.compute())
+			compute(events, addr/4);
+
+		addr += 4;
+	}
+
+	sub_t sub;
+	sub.events.swap(events);
+	std::copy(bp, bp + 4, sub.bp_out);
+	sub.code_gen_out = code_gen;
+	if (code_gen != std::get<1>(key))
+		sub.code_out = code_src;
+
+	subs.push_back(sub);
+	sub_index[key] = subs.size()-1;
+	return subs.size()-1;
+}
+
+// Try to place all objects of the pool with the given load sites dropped,
+// sets addr.
+bool MlAsm::alloc_state_t::fitPool(const pool_t &pool, const std::vector<event_t> &trace, const std::vector<bool> &dropped)
+{
+	std::vector<std::vector<std::pair<int, int>>> live(pool.num);
+
+	for (int i = 0; i < int(trace.size()); i++)
+	{
+		const event_t &e = trace[i];
+		int t = poolObject(pool, e);
+
+		if (t < 0)
+			continue;
+
+		if (e.kind == pool.load_kind && !dropped[e.a]) {
+			live[t].push_back(std::make_pair(i, i));
+			continue;
+		}
+
+		if (live[t].empty())
+			return false;
+		live[t].back().second = i;
+	}
+
+	auto interfere = [&](int a, int b) {
+		if ((pool.banks[a] & pool.banks[b]) == 0)
+			return false;
+		auto p = live[a].begin(), q = live[b].begin();
+		while (p != live[a].end() && q != live[b].end()) {
+			if (p->first <= q->second && q->first <= p->second)
+				return true;
+			if (p->second < q->second)
+				p++;
+			else
+				q++;
+		}
+		return false;
+	};
+
+	std::vector<int> order;
+	for (int t = 0; t < pool.num; t++)
+		order.push_back(t);
+
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return pool.words[a] > pool.words[b];
+	});
+
+	addr.assign(pool.num, -1);
+
+	for (int i = 0; i < int(order.size()); i++)
+	{
+		int t = order[i];
+		std::vector<std::pair<int, int>> used;
+
+		for (auto &r : pool.reserved)
+			if ((pool.banks[t] & (1 << std::get<0>(r))) != 0)
+				used.push_back(std::make_pair(std::get<1>(r), std::get<2>(r)));
+
+		for (int j = 0; j < i; j++)
+			if (interfere(t, order[j]))
+				used.push_back(std::make_pair(addr[order[j]], addr[order[j]] + pool.words[order[j]]));
+
+		std::sort(used.begin(), used.end());
+
+		int a = 0;
+		for (auto &u : used) {
+			if (u.first >= a + pool.words[t])
+				break;
+			a = std::max(a, u.second);
+		}
+
+		if (a + pool.words[t] > pool.size)
+			return false;
+		addr[t] = a;
+	}
+
+	return true;
+}
+
+// Try to drop the load sites in the given order, a site stays dropped when
+// all objects still fit. Sets addr for the final set of dropped sites.
+void MlAsm::alloc_state_t::dropLoads(const pool_t &pool, const std::vector<event_t> &trace,
+		const std::vector<int> &sites, std::vector<bool> &dropped)
+{
+	std::vector<int> best_addr = addr;
+
+	for (int s : sites) {
+		dropped[s] = true;
+		if (fitPool(pool, trace, dropped))
+			best_addr = addr;
+		else
+			dropped[s] = false;
+	}
+
+	addr = best_addr;
+}
+
+// Replace the instructions of dropped load sites (insn_idx, len) by
+// AddCBP 0.
+void MlAsm::alloc_state_t::removeLoads(const std::vector<std::pair<int, int>> &loads)
+{
+	std::vector<bool> nop(as.insns.size());
+	for (auto &ld : loads)
+		for (int i = ld.first; i < ld.first + ld.second; i++) {
+			as.insns[i].opcode = 15;
+			as.insns[i].maddr = 0;
+			as.insns[i].caddr = 0;
+			nop[i] = true;
+		}
+
+	as.fixups.erase(std::remove_if(as.fixups.begin(), as.fixups.end(), [&](const fixup_t &fix) {
+		return nop[fix.insn_idx];
+	}), as.fixups.end());
+}
+
+void MlAsm::alloc_state_t::placeCoeffs(const std::vector<event_t> &trace)
+{
+	std::vector<bool> seen(num_ctensors);
+	for (auto &e : trace) {
+		int t = poolObject(coeffs, e);
+		if (t < 0)
+			continue;
+		if (e.kind == event_t::USE && !seen[t])
+			error(e.linenr, "Tensor %s is used before it is loaded.", as.ctensors[t].name.c_str());
+		seen[t] = true;
+	}
+
+	std::vector<bool> dropped(as.cloads.size());
+	if (!fitPool(coeffs, trace, dropped)) {
+		fprintf(stderr, "MlAsm coefficient error: The tensors that are live at the same time "
+				"do not fit into the %d words of coefficient memory.\n", as.arch.coeff_size);
+		exit(1);
+	}
+
+	// load sites by the number of coefficient words they load per run
+	std::vector<long long> site_words(as.cloads.size());
+	for (auto &e : trace)
+		if (e.kind == event_t::LOAD) {
+			int t = as.cloads[e.a].ctensor;
+			int banks = coeffs.banks[t] == 3 ? 2 : 1;
+			site_words[e.a] += e.count * as.ctensors[t].words * banks;
+		}
+
+	std::vector<int> sites;
+	for (int i = 0; i < int(as.cloads.size()); i++)
+		if (site_words[i] != 0)
+			sites.push_back(i);
+
+	std::stable_sort(sites.begin(), sites.end(), [&](int a, int b) {
+		return site_words[a] > site_words[b];
+	});
+
+	dropLoads(coeffs, trace, sites, dropped);
+
+	for (int t = 0; t < num_ctensors; t++) {
+		as.symbols[object_symbol[t]].position = addr[t];
+		if (as.verbose)
+			printf("coefficient tensor %s at %d (%d words).\n", as.ctensors[t].name.c_str(),
+					addr[t], as.ctensors[t].words);
+	}
+
+	long long total_words = 0, saved_words = 0;
+	std::vector<std::pair<int, int>> loads;
+
+	for (int s : sites) {
+		total_words += site_words[s];
+		if (dropped[s]) {
+			saved_words += site_words[s];
+			loads.push_back(std::make_pair(as.cloads[s].insn_idx, as.cloads[s].len));
+		}
+	}
+
+	removeLoads(loads);
+
+	if (as.verbose)
+		printf("kept coefficient tensors resident at %d of %d load sites, saving %lld of "
+				"%lld coefficient words loaded.\n", int(loads.size()), int(sites.size()), saved_words, total_words);
+}
+
+void MlAsm::alloc_state_t::placeKernels(const std::vector<event_t> &trace)
+{
+	int num_kernels = as.kernels.size();
+
+	std::vector<bool> seen(num_kernels);
+	for (auto &e : trace) {
+		int k = poolObject(code, e);
+		if (k < 0)
+			continue;
+		if (e.kind == event_t::USE && !seen[k])
+			error(e.linenr, "Kernel %s is executed before it is loaded.", as.kernels[k].name.c_str());
+		seen[k] = true;
+	}
+
+	std::vector<bool> dropped(as.kloads.size());
+	if (!fitPool(code, trace, dropped)) {
+		fprintf(stderr, "MlAsm kernel error: The kernels that are live at the same time do not fit "
+				"into the %d words of code memory next to the code loaded by LoadCode.\n", as.arch.code_size);
+		exit(1);
+	}
+
+	// Code words each load site loads per run, and its largest reuse
+	// distance: the words of the other kernels that were loaded or run
+	// since the kernel was last loaded or run. The first load of a kernel
+	// can not be dropped.
+	std::vector<long long> site_words(as.kloads.size()), site_dist(as.kloads.size());
+	std::vector<bool> first_load(as.kloads.size());
+	std::vector<int> last_ref(num_kernels, -1);
+
+	for (int i = 0; i < int(trace.size()); i++)
+	{
+		const event_t &e = trace[i];
+		int k = poolObject(code, e);
+
+		if (k < 0)
+			continue;
+
+		if (e.kind == event_t::KLOAD) {
+			site_words[e.a] += e.count * as.kernels[k].words;
+			if (last_ref[k] < 0) {
+				first_load[e.a] = true;
+			} else {
+				long long dist = 0;
+				for (int j = 0; j < num_kernels; j++)
+					if (j != k && last_ref[j] > last_ref[k])
+						dist += as.kernels[j].words;
+				site_dist[e.a] = std::max(site_dist[e.a], dist);
+			}
+		}
+
+		last_ref[k] = i;
+	}
+
+	std::vector<int> sites;
+	for (int i = 0; i < int(as.kloads.size()); i++)
+		if (site_words[i] != 0)
+			sites.push_back(i);
+
+	auto score = [&](int s) {
+		return first_load[s] ? 0.0 : double(site_words[s]) / (as.kernels[as.kloads[s].kernel].words + site_dist[s]);
+	};
+
+	std::stable_sort(sites.begin(), sites.end(), [&](int a, int b) {
+		return score(a) > score(b);
+	});
+
+	dropLoads(code, trace, sites, dropped);
+
+	for (int k = 0; k < num_kernels; k++) {
+		as.symbols[object_symbol[first_kernel + k]].position = addr[k];
+		if (as.verbose)
+			printf("kernel %s at %d (%d words).\n", as.kernels[k].name.c_str(), addr[k], as.kernels[k].words);
+	}
+
+	long long total_words = 0, saved_words = 0;
+	std::vector<std::pair<int, int>> loads;
+
+	for (int s : sites) {
+		total_words += site_words[s];
+		if (dropped[s]) {
+			saved_words += site_words[s];
+			loads.push_back(std::make_pair(as.kloads[s].insn_idx, as.kloads[s].len));
+		}
+	}
+
+	removeLoads(loads);
+
+	if (as.verbose)
+		printf("kept kernels resident at %d of %d load sites, saving %lld of %lld code words loaded.\n",
+				int(loads.size()), int(sites.size()), saved_words, total_words);
+}
+
+void MlAsm::alloc_state_t::placeBuffers(const std::vector<event_t> &trace)
+{
+	std::vector<int> first(num_buffers, -1), last(num_buffers, -1), align(num_buffers);
+
+	for (int b = 0; b < num_buffers; b++)
+		align[b] = as.buffers[b].align;
+
+	for (int i = 0; i < int(trace.size()); i++) {
+		const event_t &e = trace[i];
+		if (e.kind != event_t::USE || e.a < num_ctensors || e.a >= first_kernel)
+			continue;
+		int b = e.a - num_ctensors;
+		if (first[b] < 0)
+			first[b] = i;
+		last[b] = i;
+	}
+
+	// Main memory that is not available: code, data, and the .input and
+	// .output tensors that are not buffers. Buffers that are tensors are live
+	// from the start or until the end, and are 4-bytes-aligned.
+	std::vector<bool> used_word(as.data.size());
+	for (int k = 0; k < int(as.data.size()); k++)
+		used_word[k] = as.data_valid[k];
+	for (auto &insn : as.insns)
+		if (insn.position >= 0 && insn.position/4 < int(used_word.size()))
+			used_word[insn.position/4] = true;
+
+	for (auto &t : as.tensors)
+	{
+		int idx = as.findSymbol(t.addr_sym);
+		int b = -1;
+		for (int i = 0; idx >= 0 && i < num_buffers; i++)
+			if (object_symbol[num_ctensors + i] == idx)
+				b = i;
+
+		if (b >= 0) {
+			if (t.output) {
+				last[b] = trace.size();
+				if (first[b] < 0)
+					first[b] = last[b];
+			} else {
+				first[b] = 0;
+				if (last[b] < 0)
+					last[b] = 0;
+			}
+			align[b] = std::max(align[b], 4);
+			continue;
+		}
+
+		char *endptr = nullptr;
+		int start = strtol(t.addr_sym.c_str(), &endptr, 0);
+		if (!endptr || *endptr)
+			start = idx < 0 ? -1 : as.symbols[idx].position;
+
+		int size = 1;
+		for (int dim : t.shape)
+			size *= dim;
+
+		for (int k = std::max(start, 0)/4; start >= 0 && k < (start + size + 3)/4 && k < int(used_word.size()); k++)
+			used_word[k] = true;
+	}
+
+	std::vector<std::pair<int, int>> fixed;
+	for (int k = 0; k < int(used_word.size()); k++) {
+		if (!used_word[k])
+			continue;
+		if (!fixed.empty() && fixed.back().second == 4*k)
+			fixed.back().second += 4;
+		else
+			fixed.push_back(std::make_pair(4*k, 4*k + 4));
+	}
+
+	auto interfere = [&](int a, int b) {
+		return first[a] >= 0 && first[b] >= 0 && first[a] <= last[b] && first[b] <= last[a];
+	};
+
+	std::vector<int> order;
+	for (int b = 0; b < num_buffers; b++)
+		order.push_back(b);
+
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return as.buffers[a].size > as.buffers[b].size;
+	});
+
+	std::vector<int> baddr(num_buffers, -1);
+
+	for (int i = 0; i < int(order.size()); i++)
+	{
+		int b = order[i];
+		const buffer_t &buf = as.buffers[b];
+		std::vector<std::pair<int, int>> used = fixed;
+
+		for (int j = 0; j < i; j++)
+			if (interfere(b, order[j]))
+				used.push_back(std::make_pair(baddr[order[j]], baddr[order[j]] + as.buffers[order[j]].size));
+
+		std::sort(used.begin(), used.end());
+
+		int a = 0;
+		for (auto &u : used) {
+			if (u.first >= a + buf.size)
+				break;
+			a = std::max(a, (u.second + align[b] - 1) & ~(align[b] - 1));
+		}
+
+		if (a + buf.size > as.arch.mem_size) {
+			fprintf(stderr, "MlAsm buffer error in line %d: Buffer %s (%d bytes) does not fit "
+					"into main memory next to the code, the data and the buffers that are live at "
+					"the same time.\n", buf.linenr, buf.name.c_str(), buf.size);
+			exit(1);
+		}
+
+		baddr[b] = a;
+	}
+
+	std::vector<bool> used_byte(as.arch.mem_size);
+	int total_size = 0, footprint = 0;
+
+	for (int b = 0; b < num_buffers; b++)
+	{
+		const buffer_t &buf = as.buffers[b];
+		as.symbols[object_symbol[num_ctensors + b]].position = baddr[b];
+		total_size += buf.size;
+
+		for (int k = baddr[b]; k < baddr[b] + buf.size; k++)
+			if (!used_byte[k])
+				used_byte[k] = true, footprint++;
+
+		if (as.verbose)
+			printf("buffer %s at 0x%05x (%d bytes).\n", buf.name.c_str(), baddr[b], buf.size);
+	}
+
+	if (as.verbose)
+		printf("placed %d buffers (%d bytes) in %d bytes of main memory.\n",
+				num_buffers, total_size, footprint);
+}
+
+void MlAsm::allocateMemory()
+{
+	alloc_state_t st(*this);
+
+	auto declare = [&](const std::string &name, int linenr, const char *what) {
+		int idx = addSymbol(name);
+		if (symbols[idx].position >= 0) {
+			fprintf(stderr, "MlAsm %s error in line %d: %s is also defined as symbol in "
+					"line %d.\n", what, linenr, name.c_str(), symbols[idx].linenr);
+			exit(1);
+		}
+
+		// evaluated as 0 while following the sequencer
+		symbols[idx].position = 0;
+		symbols[idx].linenr = linenr;
+		st.object_symbol.push_back(idx);
+	};
+
+	st.coeffs.num = ctensors.size();
+	st.coeffs.size = arch.coeff_size;
+	st.coeffs.load_kind = event_t::LOAD;
+
+	for (auto &t : ctensors) {
+		declare(t.name, t.linenr, "coefficient");
+		st.coeffs.words.push_back(t.words);
+		st.coeffs.banks.push_back((t.src[0].empty() ? 0 : 1) | (t.src[1].empty() ? 0 : 2));
+	}
+
+	for (auto &ld : cloads)
+		st.coeffs.site_object.push_back(ld.ctensor);
+
+	for (auto &buf : buffers)
+		declare(buf.name, buf.linenr, "buffer");
+
+	st.code.first = st.first_kernel;
+	st.code.num = kernels.size();
+	st.code.size = arch.code_size;
+	st.code.load_kind = event_t::KLOAD;
+
+	for (auto &k : kernels) {
+		declare(k.name, k.linenr, "kernel");
+		st.code.words.push_back(k.words);
+		st.code.banks.push_back(1);
+	}
+
+	for (auto &ld : kloads)
+		st.code.site_object.push_back(ld.kernel);
+
+	// undefined symbols are reported by assemble()
+	for (auto &sym : symbols)
+		if (sym.position < 0)
+			return;
+
+	std::vector<int> symbol_object(symbols.size(), -1);
+	for (int obj = 0; obj < int(st.object_symbol.size()); obj++)
+		symbol_object[st.object_symbol[obj]] = obj;
+
+	st.ev_insns = insns;
+	st.insn_objects.resize(insns.size());
+	st.site_at.resize(insns.size(), -1);
+	st.ksite_at.resize(insns.size(), -1);
+
+	for (auto &fix : fixups)
+	{
+		auto &insn = st.ev_insns[fix.insn_idx];
+		int val = evalExpr(fix.expr, fix.linenr);
+
+		if (fix.field == FIELD_MADDR)
+			insn.maddr += val;
+
+		if (fix.field == FIELD_CADDR)
+			insn.caddr += val;
+
+		std::vector<int> stack = {fix.expr};
+		while (!stack.empty()) {
+			const expr_t &e = exprs[stack.back()];
+			stack.pop_back();
+			if (e.op == '$' && symbol_object[e.a] >= 0)
+				st.insn_objects[fix.insn_idx].push_back(symbol_object[e.a]);
+			else if (e.op == '~')
+				stack.push_back(e.a);
+			else if (e.op != '#' && e.op != '$')
+				stack.push_back(e.a), stack.push_back(e.b);
+		}
+	}
+
+	for (int i = 0; i < int(cloads.size()); i++)
+		st.site_at[cloads[i].insn_idx] = i;
+
+	// main memory word of the code of each kernel, from its first load
+	st.kernel_src.resize(kernels.size(), -1);
+	for (int i = 0; i < int(kloads.size()); i++) {
+		st.ksite_at[kloads[i].insn_idx] = i;
+		if (st.kernel_src[kloads[i].kernel] < 0)
+			st.kernel_src[kloads[i].kernel] = (st.ev_insns[kloads[i].insn_idx].maddr & st.maddr_mask) / 4;
+	}
+
+	for (int i = 0; i < int(insns.size()); i++)
+		st.at[insns[i].position] = i;
+
+	int entry_addr = 0;
+	if (!entry_sym.empty()) {
+		char *endptr = nullptr;
+		entry_addr = strtol(entry_sym.c_str(), &endptr, 0);
+		if (!endptr || *endptr) {
+			int idx = findSymbol(entry_sym);
+			entry_addr = idx < 0 ? -1 : symbols[idx].position;
+		}
+	}
+
+	st.code_src.resize(arch.code_size, -1);
+	std::vector<event_t> trace = st.subs[st.walk(entry_addr, 0)].events;
+
+	if (!ctensors.empty())
+		st.placeCoeffs(trace);
+
+	if (!kernels.empty())
+		st.placeKernels(trace);
+
+	if (!buffers.empty())
+		st.placeBuffers(trace);
+}
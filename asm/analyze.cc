@@ -0,0 +1,258 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "mlasm.h"
+#include "mlpipe.h"
+
+#include <string.h>
+
+// Static cycle analysis. MARLANN programs have no conditional branches, so
+// following the sequencer from the entry point through all Call, Execute and
+// load instructions visits exactly the instructions the core will run, in the
+// same order. Only the compute pipeline issue timing (mlpipe.h) is modeled,
+// no data, so the cycle count matches "mlsim -v" as long as the program does
+// not write to its own code or to data loaded by LoadCode later on.
+
+namespace
+{
+struct analyzer_t
+{
+	struct sub_t {
+		long long calls = 0;
+		long long cycles = 0;
+		long long min_cycles = -1;
+		long long max_cycles = 0;
+	};
+
+	const MlArch &arch;
+	const std::vector<uint32_t> &data;
+	const std::vector<bool> &data_valid;
+
+	MlPipe pipe;
+	long long cycles = 0;
+	long long stall_cycles = 0;
+	long long fetch_cycles = 0;
+	long long insn_cnt = 0;
+	int depth = 0, max_depth = 0;
+
+	// main memory word index of the word in each code memory entry
+	std::vector<int> code_src;
+	int code_hw = 0, coeff_hw[2] = {0, 0};
+
+	std::vector<long long> word_cycles;
+	std::map<int, sub_t> subs;
+
+	analyzer_t(const MlArch &arch, const std::vector<uint32_t> &data, const std::vector<bool> &data_valid) :
+			arch(arch), data(data), data_valid(data_valid)
+	{
+		code_src.resize(arch.code_size, -1);
+		word_cycles.resize(data.size());
+	}
+
+	void error(int addr, const char *msg, int arg = 0)
+	{
+		fprintf(stderr, "MlAsm analysis error at 0x%05x: ", addr);
+		fprintf(stderr, msg, arg);
+		fprintf(stderr, "\n");
+		exit(1);
+	}
+
+	void charge(int word, int n)
+	{
+		cycles += n;
+		word_cycles[word] += n;
+	}
+
+	void issue(int word, int op)
+	{
+		int stalls = pipe.issue(op);
+		stall_cycles += stalls;
+		charge(word, stalls + 1);
+		insn_cnt++;
+	}
+
+	uint32_t fetch(int addr)
+	{
+		if (addr < 0 || addr % 4 != 0 || addr/4 >= int(data.size()))
+			error(addr, "Sequencer runs outside of main memory.");
+		if (!data_valid[addr/4])
+			error(addr, "Sequencer runs into uninitialized memory.");
+		fetch_cycles += arch.fetch_cycles;
+		pipe.idle(arch.fetch_cycles);
+		charge(addr/4, arch.fetch_cycles);
+		return data[addr/4];
+	}
+
+	void load(int addr, int op, int maddr, int caddr, int len)
+	{
+		int word_size = op == 4 ? 4 : 8;
+		int mem_size = op == 4 ? arch.code_size : arch.coeff_size;
+
+		if (caddr + len > mem_size)
+			error(addr, "Load beyond the end of code or coefficient memory (%d words).", mem_size);
+		if (maddr + word_size*len > int(4*data.size()))
+			error(addr, "Load beyond the end of main memory.");
+
+		for (int i = 0; i < len; i++) {
+			if (i == 0 || arch.contld_cycles > 0)
+				issue(i == 0 ? addr/4 : addr/4 + 1, op);
+			if (i != 0 && arch.contld_cycles > 1) {
+				pipe.idle(arch.contld_cycles - 1);
+				charge(addr/4 + 1, arch.contld_cycles - 1);
+			}
+			if (op == 4)
+				code_src[caddr + i] = maddr/4 + i;
+		}
+
+		if (op == 4)
+			code_hw = std::max(code_hw, caddr + len);
+		else
+			coeff_hw[op - 5] = std::max(coeff_hw[op - 5], caddr + len);
+	}
+
+	void run(int addr)
+	{
+		while (1)
+		{
+			uint32_t insn = fetch(addr);
+			int op = arch.insn_op(insn);
+			int maddr = arch.insn_maddr(insn);
+			int caddr = arch.insn_caddr(insn);
+
+			// Sync
+			if (op == 0) {
+				pipe.idle(arch.sync_cycles);
+				charge(addr/4, arch.sync_cycles);
+				insn_cnt++;
+				addr += 4;
+				continue;
+			}
+
+			// Call
+			if (op == 1) {
+				if (++depth > arch.callstack_size)
+					error(addr, "Call depth exceeds the %d entries call stack.", arch.callstack_size);
+				max_depth = std::max(max_depth, depth);
+				long long start = cycles;
+				run(maddr);
+				auto &sub = subs[maddr];
+				long long n = cycles - start;
+				sub.calls++;
+				sub.cycles += n;
+				sub.min_cycles = sub.min_cycles < 0 ? n : std::min(sub.min_cycles, n);
+				sub.max_cycles = std::max(sub.max_cycles, n);
+				depth--;
+				addr += 4;
+				continue;
+			}
+
+			// Return
+			if (op == 2)
+				return;
+
+			// Execute
+			if (op == 3) {
+				if (caddr + maddr > arch.code_size)
+					error(addr, "Execute beyond the end of code memory (%d words).", arch.code_size);
+				for (int i = caddr; i < caddr + maddr; i++) {
+					if (code_src[i] < 0)
+						error(addr, "Execute of code memory word %d that was never loaded.", i);
+					int cop = arch.insn_op(data[code_src[i]]);
+					if (!ml_isa_op(cop).compute())
+						error(addr, "Execute of invalid compute instruction (opcode %d).", cop);
+					issue(code_src[i], cop);
+				}
+				addr += 4;
+				continue;
+			}
+
+			// LoadCode, LoadCoeff0, LoadCoeff1 (with optional ContinueLoad)
+			if (op >= 4 && op <= 6) {
+				int len = 1;
+				bool contld = addr/4 + 1 < int(data.size()) && data_valid[addr/4 + 1] &&
+						arch.insn_op(data[addr/4 + 1]) == 7;
+				if (contld)
+					len += arch.insn_maddr(fetch(addr + 4));
+				load(addr, op, maddr, caddr, len);
+				addr += contld ? 8 : 4;
+				continue;
+			}
+
+			if (!ml_isa_op(op).compute())
+				error(addr, "Invalid instruction (opcode %d).", op);
+
+			issue(addr/4, op);
+			addr += 4;
+		}
+	}
+};
+}
+
+long long MlAsm::analyze(FILE *f, bool listing)
+{
+	analyzer_t ana(arch, data, data_valid);
+	ana.run(entry);
+
+	if (f == nullptr)
+		return ana.cycles;
+
+	std::map<int, std::string> names = positionNames();
+
+	auto percent = [&](long long n) { return ana.cycles ? 100.0 * n / ana.cycles : 0.0; };
+
+	fprintf(f, "Static analysis, entry at 0x%05x:\n", entry);
+	fprintf(f, "  cycles         %12lld\n", ana.cycles);
+	fprintf(f, "  stall cycles   %12lld  (%.1f%%)\n", ana.stall_cycles, percent(ana.stall_cycles));
+	fprintf(f, "  fetch cycles   %12lld  (%.1f%%, sequencer)\n", ana.fetch_cycles, percent(ana.fetch_cycles));
+	fprintf(f, "  instructions   %12lld\n", ana.insn_cnt);
+	fprintf(f, "  call depth     %12d  of %d\n", ana.max_depth, arch.callstack_size);
+	fprintf(f, "  code memory    %12d  of %d words\n", ana.code_hw, arch.code_size);
+	fprintf(f, "  coeff0 memory  %12d  of %d words\n", ana.coeff_hw[0], arch.coeff_size);
+	fprintf(f, "  coeff1 memory  %12d  of %d words\n", ana.coeff_hw[1], arch.coeff_size);
+
+	if (!ana.subs.empty()) {
+		fprintf(f, "\n");
+		fprintf(f, "Subroutines (cycles including callees):\n");
+		fprintf(f, "  %8s %12s %12s %12s %7s  %s\n", "calls", "min/call", "max/call", "total", "%", "name");
+		for (auto &it : ana.subs) {
+			std::string name = names.count(it.first) ? names.at(it.first) : "";
+			fprintf(f, "  %8lld %12lld %12lld %12lld %6.1f%%  0x%05x %s\n", it.second.calls,
+					it.second.min_cycles, it.second.max_cycles, it.second.cycles,
+					percent(it.second.cycles), it.first, name.c_str());
+		}
+	}
+
+	std::vector<long long> line_cycles(source_lines.size() + 1);
+	for (int i = 0; i < int(ana.word_cycles.size()); i++)
+		if (ana.word_cycles[i] != 0)
+			line_cycles.at(data_linenr[i]) += ana.word_cycles[i];
+
+	if (listing) {
+		fprintf(f, "\n");
+		fprintf(f, "Source listing (cycles spent in the instruction on each line):\n");
+		for (int i = 0; i < int(source_lines.size()); i++) {
+			if (line_cycles[i+1] != 0)
+				fprintf(f, "%12lld %6.2f%% %5d: %.*s\n", line_cycles[i+1],
+						percent(line_cycles[i+1]), i+1, source_lines[i].len, source_lines[i].p);
+			else
+				fprintf(f, "%12s %7s %5d: %.*s\n", "", "", i+1, source_lines[i].len, source_lines[i].p);
+		}
+	}
+
+	return ana.cycles;
+}
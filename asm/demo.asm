@@ -1,6 +1,10 @@
 .sym outdata 0x10000
 .sym maxout  0x11880
 
+.input  indata,  indata,  32x32x8, hwc
+.output outdata, outdata, 28x28x8, hwc
+.output maxout,  maxout,  4,       c
+
 .code 0x00000
 SetLBP 0
 SetVBP 0
@@ -16,7 +16,9 @@
  */
 
 #include "mlasm.h"
+#include "mlfile.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,19 +41,72 @@ void help(const char *progname, int rc)
 	printf("  -b filename\n");
 	printf("    write binary file\n");
 	printf("\n");
+	printf("  -i filename\n");
+	printf("    write program image (.mli) file\n");
+	printf("\n");
+	printf("  -H filename\n");
+	printf("    write C/C++ header with the entry point and input/output tensor offsets\n");
+	printf("\n");
+	printf("  -P prefix\n");
+	printf("    prefix for the names in the -H header (default = header file name)\n");
+	printf("\n");
+	printf("  -c filename\n");
+	printf("    write relocatable object (.mlo) file for mlld instead of assembling,\n");
+	printf("    unchanged if the file is an object of the same source text\n");
+	printf("\n");
+	printf("  -m filename\n");
+	printf("    write .sym definitions of the allocated buffers, coefficient tensors and kernels\n");
+	printf("\n");
+	printf("  -g filename\n");
+	printf("    write debug map (source line of each main memory word, see sim/annotate.py)\n");
+	printf("\n");
+	printf("  -s filename\n");
+	printf("    write static cycle analysis report (cycles, call depth, memory usage)\n");
+	printf("\n");
+	printf("  -l\n");
+	printf("    include the source listing annotated with cycles in the -s report\n");
+	printf("\n");
+	printf("  -d cycles\n");
+	printf("    fail if the static analysis exceeds this number of cycles\n");
+	printf("\n");
+	printf("  -O\n");
+	printf("    optimize sequencer code (see docs/asm.md)\n");
+	printf("\n");
+	printf("  -j threads\n");
+	printf("    number of threads for parsing large inputs (default = 1)\n");
+	printf("\n");
+	printf("  -a filename\n");
+	printf("    read architecture description file\n");
+	printf("\n");
+	printf("  -p name=value\n");
+	printf("    set architecture parameter (overrides -a for later options)\n");
+	printf("\n");
 	exit(rc);
 }
 
 int main(int argc, char **argv)
 {
 	int opt;
-	char buffer[4096];
-	FILE *fIn = stdin;
+	const char *input_filename = nullptr;
+	int threads = 1;
 	bool verbose = false;
 	std::string hex_filename;
 	std::string bin_filename;
+	std::string image_filename;
+	std::string header_filename;
+	std::string header_prefix;
+	bool header_prefix_set = false;
+	std::string report_filename;
+	std::string map_filename;
+	std::string plan_filename;
+	std::string object_filename;
+	std::string source_filename = "-";
+	bool report_listing = false;
+	long long deadline = -1;
+	bool optimize = false;
+	MlArch arch;
 
-	while ((opt = getopt(argc, argv, "hvo:b:")) != -1)
+	while ((opt = getopt(argc, argv, "hvo:b:i:H:P:c:m:g:s:ld:Oj:a:p:")) != -1)
 	{
 		switch (opt)
 		{
@@ -67,33 +122,127 @@ int main(int argc, char **argv)
 		case 'b':
 			bin_filename = optarg;
 			break;
+		case 'i':
+			image_filename = optarg;
+			break;
+		case 'H':
+			header_filename = optarg;
+			break;
+		case 'P':
+			header_prefix = optarg;
+			header_prefix_set = true;
+			break;
+		case 'c':
+			object_filename = optarg;
+			break;
+		case 'm':
+			plan_filename = optarg;
+			break;
+		case 'g':
+			map_filename = optarg;
+			break;
+		case 's':
+			report_filename = optarg;
+			break;
+		case 'l':
+			report_listing = true;
+			break;
+		case 'd':
+			deadline = atoll(optarg);
+			break;
+		case 'O':
+			optimize = true;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case 'a':
+			arch.readFile(optarg);
+			break;
+		case 'p':
+			arch.parseParam(optarg);
+			break;
 		default:
 			help(argv[0], 1);
 		}
 	}
 
 	if (optind+1 == argc)
-	{
-		fIn = fopen(argv[optind++], "r");
-		if (fIn == nullptr) {
-			perror("Open input file");
-			exit(1);
-		}
-	}
+		source_filename = input_filename = argv[optind++];
 
-	if (optind != argc)
+	if (optind != argc || threads < 1)
 		help(argv[0], 1);
 	
-	MlAsm worker;
+	arch.check();
+
+	MlAsm worker(arch);
 
 	if (verbose)
 		worker.verbose = true;
 
-	while (fgets(buffer, 4096, fIn))
-		worker.parseLine(buffer);
-	
+	if (optimize)
+		worker.optimize = true;
+
+	size_t input_len = 0;
+	std::vector<uint8_t> input_buffer;
+	const char *input = (const char*)ml_map_file(input_filename, input_len, input_buffer, "input");
+
+	if (!object_filename.empty())
+	{
+		if (!hex_filename.empty() || !bin_filename.empty() || !image_filename.empty() ||
+				!header_filename.empty() || !plan_filename.empty() || !map_filename.empty() ||
+				!report_filename.empty() || deadline >= 0 || optimize) {
+			fprintf(stderr, "MlAsm error: Objects are not assembled, use mlld for the "
+					"other outputs.\n");
+			exit(1);
+		}
+
+		uint64_t hash = MlAsm::objectHash(arch, input, input_len);
+		if (object_filename != "-" && MlAsm::checkObjectFile(object_filename.c_str(), hash)) {
+			if (verbose)
+				printf("object %s is up to date.\n", object_filename.c_str());
+			return 0;
+		}
+
+		worker.parseText(input, input_len, threads);
+
+		FILE *fOut = stdout;
+		if (object_filename != "-") {
+			fOut = fopen(object_filename.c_str(), "wt");
+			if (fOut == nullptr) {
+				perror("Open output object file");
+				exit(1);
+			}
+		}
+		worker.writeObjectFile(fOut, hash);
+		if (object_filename != "-")
+			fclose(fOut);
+		return 0;
+	}
+
+	worker.parseText(input, input_len, threads);
+
 	worker.assemble();
 
+	if (!report_filename.empty() || deadline >= 0) {
+		FILE *fOut = report_filename.empty() ? nullptr : stdout;
+		if (fOut != nullptr && report_filename != "-") {
+			fOut = fopen(report_filename.c_str(), "wt");
+			if (fOut == nullptr) {
+				perror("Open output report file");
+				exit(1);
+			}
+		}
+		long long cycles = worker.analyze(fOut, report_listing);
+		if (fOut != nullptr && fOut != stdout)
+			fclose(fOut);
+		if (deadline >= 0 && cycles > deadline) {
+			fprintf(stderr, "MlAsm analysis error: Program takes %lld cycles, exceeding "
+					"the deadline of %lld cycles.\n", cycles, deadline);
+			exit(1);
+		}
+	}
+
 	if (!hex_filename.empty()) {
 		FILE *fOut = stdout;
 		if (hex_filename != "-") {
@@ -122,5 +271,67 @@ int main(int argc, char **argv)
 			fclose(fOut);
 	}
 
+	if (!image_filename.empty()) {
+		FILE *fOut = stdout;
+		if (image_filename != "-") {
+			fOut = fopen(image_filename.c_str(), "wb");
+			if (fOut == nullptr) {
+				perror("Open output image file");
+				exit(1);
+			}
+		}
+		worker.writeImageFile(fOut);
+		if (image_filename != "-")
+			fclose(fOut);
+	}
+
+	if (!map_filename.empty()) {
+		FILE *fOut = fopen(map_filename.c_str(), "wt");
+		if (fOut == nullptr) {
+			perror("Open output map file");
+			exit(1);
+		}
+		worker.writeDebugMap(fOut, source_filename);
+		fclose(fOut);
+	}
+
+	if (!plan_filename.empty()) {
+		FILE *fOut = stdout;
+		if (plan_filename != "-") {
+			fOut = fopen(plan_filename.c_str(), "wt");
+			if (fOut == nullptr) {
+				perror("Open output plan file");
+				exit(1);
+			}
+		}
+		worker.writePlanFile(fOut);
+		if (plan_filename != "-")
+			fclose(fOut);
+	}
+
+	if (!header_filename.empty()) {
+		FILE *fOut = stdout;
+		if (header_filename != "-") {
+			fOut = fopen(header_filename.c_str(), "wt");
+			if (fOut == nullptr) {
+				perror("Open output header file");
+				exit(1);
+			}
+		}
+		if (!header_prefix_set) {
+			// "path/demo_prog.h" -> "demo_prog_"
+			std::string base = header_filename.substr(header_filename.find_last_of('/') + 1);
+			base = base.substr(0, base.find('.'));
+			header_prefix.clear();
+			for (char ch : base)
+				header_prefix += isalnum(ch) ? ch : '_';
+			if (!header_prefix.empty())
+				header_prefix += "_";
+		}
+		worker.writeHeaderFile(fOut, header_prefix);
+		if (header_filename != "-")
+			fclose(fOut);
+	}
+
 	return 0;
 }
@@ -16,64 +16,355 @@
  */
 
 #include "mlasm.h"
-
+#include "mlimage.h"
+#include "mlisa.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <memory>
+#include <set>
+#include <stdarg.h>
 #include <string.h>
+#include <thread>
 
-void MlAsm::parseArg(const std::string &s, field_t field, int factor, int divider)
+// Like strtol(p, &endptr, 0) for the text between p and end, which does not
+// need to be null-terminated. Returns endptr (p if there are no digits).
+static const char *scan_int(const char *p, const char *end, int &value)
 {
-	for (int i = 1; i < int(s.size()); i++) {
-		if (s[i] == '+' || s[i] == '-') {
-			parseArg(s.substr(0, i), field, factor);
-			parseArg(s.substr(i), field, factor);
-			return;
-		}
-	}
+	const char *start = p;
+	bool negative = false;
+	int base = 10;
 
-	const char *p = s.c_str();
-	int poffset = 0;
+	if (p < end && (*p == '+' || *p == '-'))
+		negative = *p++ == '-';
 
-	if (*p == '-') {
-		factor *= -1;
-		poffset = 1;
-		p++;
-	} else
-	if (*p == '+') {
-		poffset = 1;
-		p++;
+	if (end-p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && isxdigit(uint8_t(p[2])))
+		base = 16, p += 2;
+	else if (p < end && *p == '0')
+		base = 8;
+
+	const char *digits = p;
+	uint32_t v = 0;
+
+	for (; p < end; p++) {
+		int d = isdigit(uint8_t(*p)) ? *p - '0' : isalpha(uint8_t(*p)) ? tolower(*p) - 'a' + 10 : base;
+		if (d >= base)
+			break;
+		v = v*base + d;
 	}
 
-	int scan_start = strlen(p) - 1;
-	for (int i = scan_start; i > 0; i--) {
-		if (p[i] == '*' && i < scan_start) {
-			parseArg(s.substr(poffset, i), field,
-					factor*atoi(p+i+1), divider);
+	if (p == digits)
+		return start;
+
+	value = negative ? -v : v;
+	return p;
+}
+
+static bool parse_int(const char *p, const char *end, int &value)
+{
+	return p < end && scan_int(p, end, value) == end;
+}
+
+static bool is_blank(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\r';
+}
+
+// Token stream of an operand expression. Identifiers are runs of characters
+// other than whitespace, operators and parentheses, and are integers if they
+// parse as integer as a whole.
+struct MlAsm::lexer_t
+{
+	const char *p, *end;
+	char kind = 0;  // 0 = end, 'n' = integer, 'i' = identifier, otherwise operator
+	const char *tok = nullptr;
+	int len = 0;
+	int value = 0;
+
+	lexer_t(strref_t s) : p(s.p), end(s.p + s.len) { next(); }
+
+	static bool is_op(char ch) { return ch == '+' || ch == '-' || ch == '*' || ch == '/' || ch == '(' || ch == ')'; }
+
+	void next()
+	{
+		while (p < end && is_blank(*p))
+			p++;
+
+		tok = p;
+		len = 0;
+
+		if (p == end) {
+			kind = 0;
 			return;
 		}
-		if (p[i] == '/' && i < scan_start) {
-			parseArg(s.substr(poffset, i), field,
-					factor, divider*atoi(p+i+1));
+
+		if (is_op(*p)) {
+			kind = *p++;
+			len = 1;
 			return;
 		}
-		if (p[i] < '0' || p[i] > '9')
-			break;
+
+		while (p < end && !is_op(*p) && !is_blank(*p))
+			p++;
+
+		len = p - tok;
+		kind = isdigit(uint8_t(*tok)) && parse_int(tok, p, value) ? 'n' : 'i';
+	}
+};
+
+void MlAsm::error(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+
+	if (!defer_errors) {
+		vfprintf(stderr, fmt, ap);
+		exit(1);
+	}
+
+	if (error_msg.empty()) {
+		char buffer[1024];
+		vsnprintf(buffer, sizeof(buffer), fmt, ap);
+		error_msg = buffer;
 	}
 
-	char *endptr = nullptr;
-	int val = strtol(p, &endptr, 0) * factor;
+	va_end(ap);
+}
 
-	if (!endptr || *endptr)
+static uint32_t symbol_hash_fn(const char *name, int len)
+{
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < len; i++)
+		h = (h ^ uint8_t(name[i])) * 16777619u;
+	return h;
+}
+
+int MlAsm::findSymbol(const char *name, int len, bool create)
+{
+	if (create && 2*(symbols.size()+1) > symbol_hash.size())
 	{
-		symaction_t act;
-		act.insn_idx = insns.size()-1;
-		act.factor = factor;
-		act.divider = divider;
-		act.field = field;
+		symbol_hash.assign(std::max(size_t(1024), 2*symbol_hash.size()), -1);
+		int mask = symbol_hash.size() - 1;
+
+		for (int idx = 0; idx < int(symbols.size()); idx++) {
+			int i = symbols[idx].hash & mask;
+			while (symbol_hash[i] >= 0)
+				i = (i+1) & mask;
+			symbol_hash[i] = idx;
+		}
+	}
+
+	if (symbol_hash.empty())
+		return -1;
 
-		symbols[p].actions.push_back(act);
+	uint32_t hash = symbol_hash_fn(name, len);
+	int mask = symbol_hash.size() - 1;
+
+	for (int i = hash & mask;; i = (i+1) & mask)
+	{
+		int idx = symbol_hash[i];
+
+		if (idx < 0) {
+			if (!create)
+				return -1;
+			symbol_hash[i] = symbols.size();
+			symbols.push_back(symbol_t());
+			symbols.back().name.assign(name, len);
+			symbols.back().hash = hash;
+			return symbol_hash[i];
+		}
+
+		auto &sym = symbols[idx];
+		if (sym.hash == hash && int(sym.name.size()) == len && !memcmp(sym.name.data(), name, len))
+			return idx;
+	}
+}
+
+// The symbols of coefficient tensors and kernels, which are coefficient and
+// code memory addresses rather than main memory positions.
+std::vector<bool> MlAsm::allocSymbols() const
+{
+	std::set<std::string> names;
+	for (auto &t : ctensors)
+		names.insert(t.name);
+	for (auto &k : kernels)
+		names.insert(k.name);
+
+	std::vector<bool> alloc_symbol(symbols.size());
+	for (int idx = 0; idx < int(symbols.size()); idx++)
+		alloc_symbol[idx] = names.count(symbols[idx].name) != 0;
+	return alloc_symbol;
+}
+
+// Map from address to the last defined symbol pointing to it (so that "foo:"
+// wins over a preceding "previous_end:").
+std::map<int, std::string> MlAsm::positionNames() const
+{
+	std::vector<bool> alloc_symbol = allocSymbols();
+	std::vector<int> order;
+	for (int idx = 0; idx < int(symbols.size()); idx++)
+		if (!alloc_symbol[idx])
+			order.push_back(idx);
+
+	std::sort(order.begin(), order.end(), [&](int a, int b) {
+		if (symbols[a].position != symbols[b].position)
+			return symbols[a].position < symbols[b].position;
+		return symbols[a].linenr < symbols[b].linenr;
+	});
+
+	std::map<int, std::string> names;
+	for (int i = 0; i < int(order.size()); i++) {
+		auto &sym = symbols[order[i]];
+		if (i+1 == int(order.size()) || symbols[order[i+1]].position != sym.position)
+			names.emplace_hint(names.end(), sym.position, sym.name);
+	}
+	return names;
+}
+
+// expr: term | expr "+" term | expr "-" term
+int MlAsm::parseExpr(lexer_t &lex, bool &symbolic)
+{
+	int left = parseTerm(lex, symbolic);
+
+	while (left >= 0 && (lex.kind == '+' || lex.kind == '-')) {
+		char op = lex.kind;
+		lex.next();
+		int right = parseTerm(lex, symbolic);
+		if (right < 0)
+			return -1;
+		exprs.push_back(expr_t{op, left, right});
+		left = exprs.size()-1;
+	}
+
+	return left;
+}
+
+// term: unary | term "*" unary | term "/" unary
+int MlAsm::parseTerm(lexer_t &lex, bool &symbolic)
+{
+	int left = parseUnary(lex, symbolic);
+
+	while (left >= 0 && (lex.kind == '*' || lex.kind == '/')) {
+		char op = lex.kind;
+		lex.next();
+		int right = parseUnary(lex, symbolic);
+		if (right < 0)
+			return -1;
+		exprs.push_back(expr_t{op, left, right});
+		left = exprs.size()-1;
+	}
+
+	return left;
+}
+
+// unary: integer | label | "(" expr ")" | "+" unary | "-" unary
+int MlAsm::parseUnary(lexer_t &lex, bool &symbolic)
+{
+	if (lex.kind == '+') {
+		lex.next();
+		return parseUnary(lex, symbolic);
+	}
+
+	if (lex.kind == '-') {
+		lex.next();
+		int arg = parseUnary(lex, symbolic);
+		if (arg < 0)
+			return -1;
+		exprs.push_back(expr_t{'~', arg, 0});
+		return exprs.size()-1;
+	}
+
+	if (lex.kind == '(') {
+		lex.next();
+		int arg = parseExpr(lex, symbolic);
+		if (arg < 0 || lex.kind != ')')
+			return -1;
+		lex.next();
+		return arg;
+	}
+
+	if (lex.kind == 'n') {
+		exprs.push_back(expr_t{'#', lex.value, 0});
+		lex.next();
+		return exprs.size()-1;
+	}
+
+	if (lex.kind == 'i') {
+		exprs.push_back(expr_t{'$', findSymbol(lex.tok, lex.len, true), 0});
+		symbolic = true;
+		lex.next();
+		return exprs.size()-1;
+	}
+
+	return -1;
+}
+
+int MlAsm::evalExpr(int idx, int linenr)
+{
+	const expr_t &e = exprs[idx];
+
+	if (e.op == '#')
+		return e.a;
+
+	if (e.op == '$')
+		return symbols[e.a].position;
+
+	if (e.op == '~')
+		return -evalExpr(e.a, linenr);
+
+	int a = evalExpr(e.a, linenr);
+	int b = evalExpr(e.b, linenr);
+
+	if (e.op == '+')
+		return a + b;
+
+	if (e.op == '-')
+		return a - b;
+
+	if (e.op == '*')
+		return a * b;
+
+	if (b == 0) {
+		error("MlAsm expression error in line %d: %d is divided by zero.\n", linenr, a);
+		return 0;
+	}
+
+	if (a % b != 0) {
+		error("MlAsm expression error in line %d: %d is divided by %d but "
+				"is not a multiple of %d.\n", linenr, a, b, b);
+		return 0;
+	}
+
+	return a / b;
+}
+
+// Parse an operand and add its value to the given field of the last
+// instruction. Operands that reference symbols become fixups, the nodes
+// of constant operands are discarded right away.
+bool MlAsm::parseArg(strref_t s, field_t field)
+{
+	lexer_t lex(s);
+	bool symbolic = false;
+	int expr_start = exprs.size();
+	int expr = parseExpr(lex, symbolic);
+
+	if (expr < 0 || lex.kind != 0)
+		return false;
+
+	if (symbolic)
+	{
+		fixup_t fix;
+		fix.insn_idx = insns.size()-1;
+		fix.expr = expr;
+		fix.linenr = linenr;
+		fix.field = field;
+		fixups.push_back(fix);
 	}
 	else
 	{
 		auto &insn = insns.back();
+		int val = evalExpr(expr, linenr);
+		exprs.resize(expr_start);
 
 		if (field == FIELD_MADDR)
 			insn.maddr += val;
@@ -81,56 +372,247 @@ void MlAsm::parseArg(const std::string &s, field_t field, int factor, int divide
 		if (field == FIELD_CADDR)
 			insn.caddr += val;
 	}
+
+	return true;
 }
 
-void MlAsm::parseLine(const char *line)
+int MlAsm::findCTensor(strref_t name) const
 {
-	char *strtok_saveptr;
-	char *p = strdup(line);
+	for (int i = 0; i < int(ctensors.size()); i++)
+		if (name == ctensors[i].name.c_str())
+			return i;
+	return -1;
+}
 
-	char *cmd_p = strtok_r(p, " \t\r\n", &strtok_saveptr);
-	std::string cmd = cmd_p ? cmd_p : "";
-	std::vector<std::string> args;
+// .ctensor <name>, <words>, <bank 0 maddr>[, <bank 1 maddr>], where "-"
+// stands for a bank without data.
+bool MlAsm::parseCTensor(const std::vector<strref_t> &args)
+{
+	ctensor_t t;
+	t.linenr = linenr;
+	t.name = args[0].str();
 
-	while (1) {
-		const char *args_delim = ",\r\n";
+	if (!parse_int(args[1].p, args[1].p + args[1].len, t.words) || t.words <= 0)
+		return false;
 
-		if (state == STATE_DATA || cmd.empty() || cmd[0] == '.')
-			args_delim = " \t\r\n";
+	for (int bank = 0; bank < 2 && bank+2 < int(args.size()); bank++)
+		if (args[bank+2] != "-")
+			t.src[bank] = args[bank+2];
 
-		char *t = strtok_r(nullptr, args_delim, &strtok_saveptr);
+	if (t.src[0].empty() && t.src[1].empty())
+		return false;
 
-		if (t == nullptr)
-			break;
+	if (t.words > arch.coeff_size) {
+		error("MlAsm coefficient error in line %d: Tensor %s has %d words, but coefficient "
+				"memory only has %d words.\n", linenr, t.name.c_str(), t.words, arch.coeff_size);
+		return true;
+	}
 
-		for (int i = 0, j = 0;; i++) {
-			t[j] = t[i];
-			if (t[i] != ' ' && t[i] != '\t')
-				j++;
-			if (t[i] == 0)
-				break;
-		}
+	// Declarations are parsed once more by the chunk that contains them
+	// when parseText() collected them upfront.
+	int idx = findCTensor(args[0]);
+	if (idx >= 0) {
+		if (ctensors[idx].linenr != linenr)
+			error("MlAsm coefficient error in line %d: Multiple definitions of "
+					"tensor %s.\n", linenr, t.name.c_str());
+		return true;
+	}
 
-		args.push_back(t);
+	ctensors.push_back(t);
+	return true;
+}
+
+int MlAsm::findKernel(strref_t name) const
+{
+	for (int i = 0; i < int(kernels.size()); i++)
+		if (name == kernels[i].name.c_str())
+			return i;
+	return -1;
+}
+
+// .kernel <name>, <words>, <maddr>
+bool MlAsm::parseKernel(const std::vector<strref_t> &args)
+{
+	kernel_t k;
+	k.linenr = linenr;
+	k.name = args[0].str();
+	k.src = args[2];
+
+	if (!parse_int(args[1].p, args[1].p + args[1].len, k.words) || k.words <= 0)
+		return false;
+
+	if (k.words > arch.code_size) {
+		error("MlAsm kernel error in line %d: Kernel %s has %d words, but code memory "
+				"only has %d words.\n", linenr, k.name.c_str(), k.words, arch.code_size);
+		return true;
+	}
+
+	int idx = findKernel(args[0]);
+	if (idx >= 0) {
+		if (kernels[idx].linenr != linenr)
+			error("MlAsm kernel error in line %d: Multiple definitions of "
+					"kernel %s.\n", linenr, k.name.c_str());
+		return true;
 	}
 
+	kernels.push_back(k);
+	return true;
+}
+
+// LoadCode <kernel> loads the code of the kernel to the address that
+// allocateMemory() chooses for it.
+bool MlAsm::parseKLoad(int kernel, strref_t name)
+{
+	const kernel_t &k = kernels[kernel];
+	kload_t ld;
+	ld.insn_idx = insns.size();
+	ld.kernel = kernel;
+
+	insns.push_back(insn_t());
+	insns.back().position = cursor;
+	insns.back().linenr = linenr;
+	insns.back().opcode = 4;
+	cursor += 4;
+
+	if (!parseArg(k.src, FIELD_MADDR) || !parseArg(name, FIELD_CADDR))
+		return false;
+
+	if (k.words > 1) {
+		insns.push_back(insn_t());
+		insns.back().position = cursor;
+		insns.back().linenr = linenr;
+		insns.back().opcode = 7;
+		insns.back().maddr = k.words - 1;
+		cursor += 4;
+	}
+
+	ld.len = insns.size() - ld.insn_idx;
+	kloads.push_back(ld);
+	return true;
+}
+
+void MlAsm::parseLine(const char *begin, const char *end)
+{
+	if (!error_msg.empty())
+		return;
+
+	while (end > begin && (end[-1] == '\r' || end[-1] == '\n'))
+		end--;
+
 	linenr++;
-	free(p);
+	source_lines.push_back(strref_t(begin, end-begin));
+
+	// The first token is the command. The arguments of instructions and of
+	// .input/.output are separated by commas, all others by whitespace.
+	const char *p = begin;
+	while (p < end && is_blank(*p))
+		p++;
+
+	const char *q = p;
+	while (q < end && !is_blank(*q))
+		q++;
 
-	if (cmd == "")
+	strref_t cmd(p, q-p);
+	auto &args = line_args;
+	args.clear();
+
+	bool comma_args = !cmd.empty() && (cmd.p[0] == '.' ? cmd == ".input" || cmd == ".output" ||
+			cmd == ".ctensor" || cmd == ".kernel" || cmd == ".buffer" : state != STATE_DATA);
+
+	for (p = q; p < end;)
+	{
+		while (p < end && (is_blank(*p) || (comma_args && *p == ',')))
+			p++;
+
+		for (q = p; q < end && (comma_args ? *q != ',' : !is_blank(*q)); q++) { }
+
+		const char *t = q;
+		while (t > p && is_blank(t[-1]))
+			t--;
+
+		if (t > p)
+			args.push_back(strref_t(p, t-p));
+		p = q;
+	}
+
+	if (cmd.empty())
 		return;
 	
-	if (cmd == "//" || cmd[0] == '#')
+	if (cmd == "//" || cmd.p[0] == '#')
 		return;
 	
 	if (cmd == ".sym" && args.size() == 2)
 	{
-		char *endptr = nullptr;
-		int p = strtol(args[1].c_str(), &endptr, 0);
-		if (!endptr || *endptr)
+		int p;
+		if (!parse_int(args[1].p, args[1].p + args[1].len, p))
+			goto syntax_error;
+
+		int idx = findSymbol(args[0].p, args[0].len, true);
+		symbols[idx].position = p;
+		symbols[idx].linenr = linenr;
+		return;
+	}
+
+	if ((cmd == ".input" || cmd == ".output") && (args.size() == 3 || args.size() == 4))
+	{
+		tensor_t t;
+		t.linenr = linenr;
+		t.output = cmd == ".output";
+		t.name = args[0].str();
+		t.addr_sym = args[1].str();
+
+		if (args.size() == 4)
+			t.layout = args[3].str();
+
+		const char *shape_end = args[2].p + args[2].len;
+		for (const char *p = args[2].p; p < shape_end;) {
+			int dim = 0;
+			const char *endptr = scan_int(p, shape_end, dim);
+			if (endptr == p || dim <= 0 || t.shape.size() == 4 || (endptr < shape_end && *endptr != 'x'))
+				goto syntax_error;
+			t.shape.push_back(dim);
+			p = endptr < shape_end ? endptr+1 : endptr;
+		}
+
+		tensors.push_back(t);
+		return;
+	}
+
+	if (cmd == ".ctensor" && (args.size() == 3 || args.size() == 4))
+	{
+		if (!parseCTensor(args))
+			goto syntax_error;
+		return;
+	}
+
+	if (cmd == ".kernel" && args.size() == 3)
+	{
+		if (!parseKernel(args))
+			goto syntax_error;
+		return;
+	}
+
+	if (cmd == ".buffer" && (args.size() == 2 || args.size() == 3))
+	{
+		buffer_t buf;
+		buf.linenr = linenr;
+		buf.name = args[0].str();
+
+		if (!parse_int(args[1].p, args[1].p + args[1].len, buf.size) || buf.size <= 0)
 			goto syntax_error;
 
-		symbols[args[0]].position = p;
+		if (args.size() == 3 && (!parse_int(args[2].p, args[2].p + args[2].len, buf.align) ||
+				buf.align < 2 || (buf.align & (buf.align-1)) != 0))
+			return error("MlAsm buffer error in line %d: Alignment of buffer %s must be a "
+					"power of two and at least 2.\n", linenr, buf.name.c_str());
+
+		buffers.push_back(buf);
+		return;
+	}
+
+	if (cmd == ".entry" && args.size() == 1)
+	{
+		entry_sym = args[0].str();
 		return;
 	}
 
@@ -146,22 +628,21 @@ void MlAsm::parseLine(const char *line)
 
 		if (args.size() == 1)
 		{
-			char *endptr = nullptr;
-			int p = strtol(args[0].c_str(), &endptr, 0);
-			if (!endptr || *endptr)
+			int p;
+			if (!parse_int(args[0].p, args[0].p + args[0].len, p))
 				goto syntax_error;
 
-			if (cursor > p) {
-				fprintf(stderr, "MlAsm cursor error in line %d: New position is %d "
+			if (cursor > p)
+				return error("MlAsm cursor error in line %d: New position is %d "
 						"but cursor is already at %d\n", linenr, p, cursor);
-				exit(1);
-			}
 
-			if (p % 4 != 0) {
-				fprintf(stderr, "MlAsm cursor error in line %d: New position %d is "
+			if (p % 4 != 0)
+				return error("MlAsm cursor error in line %d: New position %d is "
 						"not divisible by 4.\n", linenr, p);
-				exit(1);
-			}
+
+			if (p >= arch.mem_size)
+				return error("MlAsm cursor error in line %d: New position %d is "
+						"outside of the %d bytes main memory.\n", linenr, p, arch.mem_size);
 
 			cursor = p;
 		}
@@ -169,17 +650,86 @@ void MlAsm::parseLine(const char *line)
 		return;
 	}
 
-	if (cmd.size() > 1 && cmd[cmd.size()-1] == ':' && args.size() == 0)
+	if (cmd.len > 1 && cmd.p[cmd.len-1] == ':' && args.size() == 0)
 	{
-		std::string sym = cmd.substr(0, cmd.size()-1);
+		auto &sym = symbols[findSymbol(cmd.p, cmd.len-1, true)];
 
-		if (symbols[sym].position != -1) {
-			fprintf(stderr, "MlAsm symbol error in line %d: Multiple definitions of "
-					"symbol %s.\n", linenr, sym.c_str());
-			exit(1);
+		if (sym.position != -1)
+			return error("MlAsm symbol error in line %d: Multiple definitions of "
+					"symbol %s.\n", linenr, sym.name.c_str());
+
+		sym.position = cursor;
+		sym.linenr = linenr;
+		sym.label_linenr = linenr;
+		return;
+	}
+
+	// LoadCoeff <tensor> loads the data of all banks of the tensor to the
+	// address that allocateMemory() chooses for it.
+	if (state == STATE_CODE && cmd == "LoadCoeff" && args.size() == 1)
+	{
+		int t = findCTensor(args[0]);
+		if (t < 0)
+			return error("MlAsm coefficient error in line %d: Tensor %.*s is not declared "
+					"with .ctensor.\n", linenr, args[0].len, args[0].p);
+
+		cload_t ld;
+		ld.insn_idx = insns.size();
+		ld.ctensor = t;
+
+		for (int bank = 0; bank < 2; bank++)
+		{
+			const ctensor_t &ct = ctensors[t];
+			if (ct.src[bank].empty())
+				continue;
+
+			insns.push_back(insn_t());
+			insns.back().position = cursor;
+			insns.back().linenr = linenr;
+			insns.back().opcode = 5 + bank;
+			cursor += 4;
+
+			if (!parseArg(ct.src[bank], FIELD_MADDR) || !parseArg(args[0], FIELD_CADDR))
+				goto syntax_error;
+
+			if (ct.words > 1) {
+				insns.push_back(insn_t());
+				insns.back().position = cursor;
+				insns.back().linenr = linenr;
+				insns.back().opcode = 7;
+				insns.back().maddr = ct.words - 1;
+				cursor += 4;
+			}
 		}
 
-		symbols[sym].position = cursor;
+		ld.len = insns.size() - ld.insn_idx;
+		cloads.push_back(ld);
+		return;
+	}
+
+	// LoadCode <kernel> and Execute <kernel>, which loads the kernel first.
+	// allocateMemory() drops the loads that are not needed.
+	if (state == STATE_CODE && (cmd == "LoadCode" || cmd == "Execute") && args.size() == 1)
+	{
+		int k = findKernel(args[0]);
+		if (k < 0)
+			return error("MlAsm kernel error in line %d: Kernel %.*s is not declared "
+					"with .kernel.\n", linenr, args[0].len, args[0].p);
+
+		if (!parseKLoad(k, args[0]))
+			goto syntax_error;
+
+		if (cmd == "Execute") {
+			insns.push_back(insn_t());
+			insns.back().position = cursor;
+			insns.back().linenr = linenr;
+			insns.back().opcode = 3;
+			insns.back().maddr = kernels[k].words;
+			cursor += 4;
+
+			if (!parseArg(args[0], FIELD_CADDR))
+				goto syntax_error;
+		}
 		return;
 	}
 
@@ -189,271 +739,507 @@ void MlAsm::parseLine(const char *line)
 		auto &insn = insns.back();
 
 		insn.position = cursor;
+		insn.linenr = linenr;
 		cursor += 4;
 
-		if (cmd == "Sync" && args.size() == 0)
-		{
-			insn.opcode = 0;
-			return;
-		}
+		const MlIsa::op_t *isa = ml_isa_lookup(cmd.p, cmd.len);
 
-		if (cmd == "Call" && args.size() == 1)
+		if (isa != nullptr && int(args.size()) == isa->nargs())
 		{
-			insn.opcode = 1;
-			parseArg(args[0], FIELD_MADDR);
-			return;
-		}
+			insn.opcode = isa->opcode;
 
-		if (cmd == "Return" && args.size() == 0)
-		{
-			insn.opcode = 2;
+			for (int i = 0; i < isa->nargs(); i++) {
+				bool maddr = isa->args[i] == MlIsa::ARG_MADDR || isa->args[i] == MlIsa::ARG_LEN;
+				if (!parseArg(args[i], maddr ? FIELD_MADDR : FIELD_CADDR))
+					goto syntax_error;
+			}
 			return;
 		}
 
-		if (cmd == "Execute" && args.size() == 2)
-		{
-			insn.opcode = 3;
-			parseArg(args[0], FIELD_CADDR);
-			parseArg(args[1], FIELD_MADDR);
-			return;
-		}
+		insns.pop_back();
+		cursor -= 4;
+	}
 
-		if (cmd == "LoadCode" && args.size() == 2)
-		{
-			insn.opcode = 4;
-			parseArg(args[0], FIELD_MADDR);
-			parseArg(args[1], FIELD_CADDR);
-			return;
-		}
+	if (state == STATE_DATA)
+	{
+		args.insert(args.begin(), cmd);
 
-		if (cmd == "LoadCoeff0" && args.size() == 2)
-		{
-			insn.opcode = 5;
-			parseArg(args[0], FIELD_MADDR);
-			parseArg(args[1], FIELD_CADDR);
-			return;
-		}
+		if (args.size() % 4 != 0)
+			return error("MlAsm data error in line %d: Data section must contain "
+					"multiples of 4 bytes per lines.\n", linenr);
 
-		if (cmd == "LoadCoeff1" && args.size() == 2)
-		{
-			insn.opcode = 6;
-			parseArg(args[0], FIELD_MADDR);
-			parseArg(args[1], FIELD_CADDR);
-			return;
-		}
+		if (cursor + 4*int(args.size()/4) > arch.mem_size)
+			return error("MlAsm data error in line %d: Data section exceeds the "
+					"%d bytes main memory.\n", linenr, arch.mem_size);
 
-		if (cmd == "ContinueLoad" && args.size() == 1)
+		for (int i = 0; i < int(args.size()); i += 4)
 		{
-			insn.opcode = 7;
-			parseArg(args[0], FIELD_MADDR);
-			return;
+			uint32_t w = 0;
+
+			for (int j = 0; j < 4; j++)
+			{
+				int v;
+				if (!parse_int(args[i+j].p, args[i+j].p + args[i+j].len, v))
+					goto syntax_error;
+
+				w |= uint32_t(uint8_t(v)) << (j*8);
+			}
+
+			data[cursor / 4] = w;
+			data_valid[cursor / 4] = true;
+			data_type[cursor / 4] = MLIMG_SEC_DATA;
+			data_linenr[cursor / 4] = linenr;
+			cursor += 4;
 		}
 
-		if ((cmd == "SetVBP" || cmd == "AddVBP" || cmd == "SetLBP" || cmd == "AddLBP" || cmd == "SetSBP" || cmd == "AddSBP") && args.size() == 1)
-		{
-			if (cmd == "SetVBP")
-				insn.opcode = 8;
+		return;
+	}
 
-			if (cmd == "AddVBP")
-				insn.opcode = 9;
+syntax_error:
+	error("MlAsm syntax error in line %d: %.*s\n", linenr, int(end-begin), begin);
+}
 
-			if (cmd == "SetLBP")
-				insn.opcode = 10;
+void MlAsm::parseLines(const char *begin, const char *end)
+{
+	while (begin < end) {
+		const char *eol = (const char*)memchr(begin, '\n', end-begin);
+		if (eol == nullptr)
+			eol = end;
+		parseLine(begin, eol);
+		begin = eol+1;
+	}
+}
 
-			if (cmd == "AddLBP")
-				insn.opcode = 11;
+// Returns the address of a ".code <addr>" or ".data <addr>" line, or -1.
+// These lines set the cursor and state, so parsing can start from them.
+static int chunk_start(const char *p, const char *end)
+{
+	const char *eol = (const char*)memchr(p, '\n', end-p);
+	if (eol == nullptr)
+		eol = end;
 
-			if (cmd == "SetSBP")
-				insn.opcode = 12;
+	while (p < eol && is_blank(*p))
+		p++;
 
-			if (cmd == "AddSBP")
-				insn.opcode = 13;
+	if (eol-p < 6 || (strncmp(p, ".code", 5) && strncmp(p, ".data", 5)) || !is_blank(p[5]))
+		return -1;
 
-			parseArg(args[0], FIELD_MADDR);
-			return;
-		}
+	for (p += 5; p < eol && is_blank(*p); p++) { }
+	while (eol > p && is_blank(eol[-1]))
+		eol--;
 
-		if ((cmd == "SetCBP" || cmd == "AddCBP") && args.size() == 1)
-		{
-			if (cmd == "SetCBP")
-				insn.opcode = 14;
+	int addr;
+	if (!parse_int(p, eol, addr))
+		return -1;
+	return addr;
+}
 
-			if (cmd == "AddCBP")
-				insn.opcode = 15;
+void MlAsm::parseText(const char *text, size_t len, int threads)
+{
+	const char *end = text + len;
 
-			parseArg(args[0], FIELD_CADDR);
-			return;
-		}
+	// Split at ".code <addr>" or ".data <addr>" lines near equally sized
+	// chunks. Small inputs are not split.
+	const size_t min_chunk_size = 1 << 20;
+	std::vector<const char*> starts = {text};
+	std::vector<int> addrs = {0};
 
-		if ((cmd == "Store" || cmd == "Store0" || cmd == "Store1" ||
-				cmd == "ReLU" || cmd == "ReLU0" || cmd == "ReLU1") && args.size() == 2)
-		{
-			if (cmd == "Store")
-				insn.opcode = 16;
+	for (int i = 1; i < threads && len / threads >= min_chunk_size; i++)
+	{
+		const char *p = std::max(text + len * i / threads, starts.back());
+		while (p < end) {
+			const char *eol = (const char*)memchr(p, '\n', end-p);
+			if (eol == nullptr)
+				break;
+			p = eol+1;
+			int addr = chunk_start(p, end);
+			if (addr >= 0) {
+				starts.push_back(p);
+				addrs.push_back(addr);
+				break;
+			}
+		}
+	}
+	starts.push_back(end);
 
-			if (cmd == "Store0")
-				insn.opcode = 17;
+	if (starts.size() == 2) {
+		parseLines(text, end);
+		return;
+	}
 
-			if (cmd == "Store1")
-				insn.opcode = 18;
+	// LoadCoeff <tensor> and LoadCode <kernel> need the declaration to know
+	// how many instructions they expand to, so all chunks get the .ctensor
+	// and .kernel lines of the whole text upfront.
+	MlAsm decls(arch);
+	decls.linenr = linenr;
+	decls.ctensors = ctensors;
+	decls.kernels = kernels;
 
-			if (cmd == "ReLU")
-				insn.opcode = 20;
+	for (const char *p = text; p < end;)
+	{
+		const char *eol = (const char*)memchr(p, '\n', end-p);
+		if (eol == nullptr)
+			eol = end;
 
-			if (cmd == "ReLU0")
-				insn.opcode = 21;
+		const char *q = p;
+		while (q < eol && is_blank(*q))
+			q++;
 
-			if (cmd == "ReLU1")
-				insn.opcode = 22;
+		if ((eol-q > 8 && !strncmp(q, ".ctensor", 8) && is_blank(q[8])) ||
+				(eol-q > 7 && !strncmp(q, ".kernel", 7) && is_blank(q[7])))
+			decls.parseLine(p, eol);
+		else
+			decls.linenr++;
+		p = eol+1;
+	}
 
-			parseArg(args[0], FIELD_MADDR);
-			parseArg(args[1], FIELD_CADDR);
-			return;
-		}
+	ctensors = decls.ctensors;
+	kernels = decls.kernels;
 
-		if ((cmd == "Save" || cmd == "Save0" || cmd == "Save1" ||
-				cmd == "LdSet" || cmd == "LdSet0" || cmd == "LdSet1" ||
-				cmd == "LdAdd" || cmd == "LdAdd0" || cmd == "LdAdd1") && args.size() == 1)
-		{
-			if (cmd == "Save")
-				insn.opcode = 24;
+	std::vector<std::unique_ptr<MlAsm>> chunks;
+	std::vector<std::thread> workers;
 
-			if (cmd == "Save0")
-				insn.opcode = 25;
+	for (int i = 0; i+1 < int(starts.size()); i++) {
+		chunks.emplace_back(new MlAsm(arch));
+		chunks.back()->defer_errors = true;
+		chunks.back()->ctensors = ctensors;
+		chunks.back()->kernels = kernels;
+		chunks.back()->linenr = i ? chunks[i-1]->linenr + std::count(starts[i-1], starts[i], '\n') : linenr;
+	}
 
-			if (cmd == "Save1")
-				insn.opcode = 26;
+	chunks[0]->cursor = cursor;
+	chunks[0]->state = state;
 
-			if (cmd == "LdSet")
-				insn.opcode = 28;
+	for (int i = 0; i < int(chunks.size()); i++)
+		workers.push_back(std::thread(&MlAsm::parseLines, chunks[i].get(), starts[i], starts[i+1]));
 
-			if (cmd == "LdSet0")
-				insn.opcode = 29;
+	for (int i = 0; i < int(chunks.size()); i++) {
+		workers[i].join();
+		merge(*chunks[i], i ? addrs[i] : -1);
+		chunks[i].reset();
+	}
+}
 
-			if (cmd == "LdSet1")
-				insn.opcode = 30;
+// Append the results of a chunk parsed by parseLines() in a separate MlAsm
+// object, in the same way as if its lines were parsed by this object.
+void MlAsm::merge(MlAsm &chunk, int chunk_addr)
+{
+	if (chunk_addr >= 0 && cursor > chunk_addr) {
+		fprintf(stderr, "MlAsm cursor error in line %d: New position is %d "
+				"but cursor is already at %d\n", linenr+1, chunk_addr, cursor);
+		exit(1);
+	}
 
-			if (cmd == "LdAdd")
-				insn.opcode = 32;
+	if (!chunk.error_msg.empty()) {
+		fputs(chunk.error_msg.c_str(), stderr);
+		exit(1);
+	}
 
-			if (cmd == "LdAdd0")
-				insn.opcode = 33;
+	int first_word = std::max(chunk_addr, 0) / 4;
+	for (int k = first_word; k < chunk.cursor/4; k++) {
+		if (!chunk.data_valid[k])
+			continue;
+		data[k] = chunk.data[k];
+		data_valid[k] = true;
+		data_type[k] = chunk.data_type[k];
+		data_linenr[k] = chunk.data_linenr[k];
+	}
 
-			if (cmd == "LdAdd1")
-				insn.opcode = 34;
+	std::vector<int> symbol_map;
+	for (auto &csym : chunk.symbols)
+	{
+		int idx = findSymbol(csym.name.c_str(), csym.name.size(), true);
+		auto &sym = symbols[idx];
+		symbol_map.push_back(idx);
 
-			parseArg(args[0], FIELD_MADDR);
-			return;
+		if (csym.label_linenr != 0 && sym.position != -1) {
+			fprintf(stderr, "MlAsm symbol error in line %d: Multiple definitions of "
+					"symbol %s.\n", csym.label_linenr, sym.name.c_str());
+			exit(1);
 		}
 
-		if ((cmd == "MACC" || cmd == "MMAX" || cmd == "MACCZ" || cmd == "MMAXZ" || cmd == "MMAXN" ) && args.size() == 2)
-		{
-			if (cmd == "MACC")
-				insn.opcode = 40;
+		if (csym.position != -1) {
+			sym.position = csym.position;
+			sym.linenr = csym.linenr;
+			sym.label_linenr = csym.label_linenr;
+		}
+	}
 
-			if (cmd == "MMAX")
-				insn.opcode = 41;
+	int insn_offset = insns.size();
+	int expr_offset = exprs.size();
 
-			if (cmd == "MACCZ")
-				insn.opcode = 42;
+	insns.insert(insns.end(), chunk.insns.begin(), chunk.insns.end());
 
-			if (cmd == "MMAXZ")
-				insn.opcode = 43;
+	for (auto e : chunk.exprs) {
+		if (e.op == '$')
+			e.a = symbol_map[e.a];
+		else if (e.op != '#')
+			e.a += expr_offset, e.b += expr_offset;
+		exprs.push_back(e);
+	}
 
-			if (cmd == "MMAXN")
-				insn.opcode = 45;
+	for (auto fix : chunk.fixups) {
+		fix.insn_idx += insn_offset;
+		fix.expr += expr_offset;
+		fixups.push_back(fix);
+	}
 
-			parseArg(args[0], FIELD_MADDR);
-			parseArg(args[1], FIELD_CADDR);
-			return;
+	// Chunks of the same text share the declarations, objects linked by
+	// mlld may declare the same tensor again.
+	std::vector<int> ctensor_map;
+	for (auto &ct : chunk.ctensors)
+	{
+		int idx = findCTensor(strref_t(ct.name.c_str(), ct.name.size()));
+
+		if (idx < 0) {
+			idx = ctensors.size();
+			ctensors.push_back(ct);
+		} else if (ctensors[idx].words != ct.words || ctensors[idx].src[0].str() != ct.src[0].str() ||
+				ctensors[idx].src[1].str() != ct.src[1].str()) {
+			fprintf(stderr, "MlAsm coefficient error in line %d: Conflicting definitions of "
+					"tensor %s.\n", ct.linenr, ct.name.c_str());
+			exit(1);
 		}
 
-		insns.pop_back();
-		cursor -= 4;
+		ctensor_map.push_back(idx);
 	}
 
-	if (state == STATE_DATA)
-	{
-		args.insert(args.begin(), cmd);
+	for (auto ld : chunk.cloads) {
+		ld.insn_idx += insn_offset;
+		ld.ctensor = ctensor_map[ld.ctensor];
+		cloads.push_back(ld);
+	}
 
-		if (args.size() % 4 != 0) {
-			fprintf(stderr, "MlAsm data error in line %d: Data section must contain "
-					"multiples of 4 bytes per lines.\n", linenr);
+	std::vector<int> kernel_map;
+	for (auto &k : chunk.kernels)
+	{
+		int idx = findKernel(strref_t(k.name.c_str(), k.name.size()));
+
+		if (idx < 0) {
+			idx = kernels.size();
+			kernels.push_back(k);
+		} else if (kernels[idx].words != k.words || kernels[idx].src.str() != k.src.str()) {
+			fprintf(stderr, "MlAsm kernel error in line %d: Conflicting definitions of "
+					"kernel %s.\n", k.linenr, k.name.c_str());
 			exit(1);
 		}
 
-		for (int i = 0; i < int(args.size()); i += 4)
-		{
-			uint32_t w = 0;
-
-			for (int j = 0; j < 4; j++)
-			{
-				char *endptr = nullptr;
-				uint8_t v = strtol(args[i+j].c_str(), &endptr, 0);
+		kernel_map.push_back(idx);
+	}
 
-				if (!endptr || *endptr)
-					goto syntax_error;
+	for (auto ld : chunk.kloads) {
+		ld.insn_idx += insn_offset;
+		ld.kernel = kernel_map[ld.kernel];
+		kloads.push_back(ld);
+	}
 
-				w |= v << (j*8);
-			}
+	buffers.insert(buffers.end(), chunk.buffers.begin(), chunk.buffers.end());
 
-			data[cursor / 4] = w;
-			data_valid[cursor / 4] = true;
-			cursor += 4;
-		}
+	source_lines.insert(source_lines.end(), chunk.source_lines.begin(), chunk.source_lines.end());
+	tensors.insert(tensors.end(), chunk.tensors.begin(), chunk.tensors.end());
 
-		return;
-	}
+	if (!chunk.entry_sym.empty())
+		entry_sym = chunk.entry_sym;
 
-syntax_error:
-	fprintf(stderr, "MlAsm syntax error in line %d: %s\n", linenr, line);
-	exit(1);
+	cursor = chunk.cursor;
+	linenr = chunk.linenr;
+	state = chunk.state;
 }
 
 void MlAsm::assemble()
 {
-	for (auto &sym_it : symbols) {
-		auto &sym_name = sym_it.first;
-		auto &sym = sym_it.second;
+	if (!ctensors.empty() || !kernels.empty() || !buffers.empty())
+		allocateMemory();
 
+	for (auto &sym : symbols) {
 		if (sym.position < 0) {
 			fprintf(stderr, "MlAsm symbol error: Symbol %s is used but not defined.\n",
-					sym_name.c_str());
+					sym.name.c_str());
 			exit(1);
 		}
 
 		if (verbose)
-			printf("symbol %s at %d (0x%05x).\n", sym_name.c_str(), sym.position, sym.position);
+			printf("symbol %s at %d (0x%05x).\n", sym.name.c_str(), sym.position, sym.position);
+	}
 
-		for (auto &act : sym.actions) {
-			auto &insn = insns[act.insn_idx];
-			int val = sym.position * act.factor;
+	for (auto &fix : fixups) {
+		auto &insn = insns[fix.insn_idx];
+		int val = evalExpr(fix.expr, fix.linenr);
+		fix.value = val;
 
-			if (val % act.divider != 0) {
-				fprintf(stderr, "MlAsm symbol error: Symbol %s is divided by %d but is not a multiple of %d (%d).\n",
-						sym_name.c_str(), act.divider, act.divider, val);
+		if (fix.field == FIELD_MADDR)
+			insn.maddr += val;
+
+		if (fix.field == FIELD_CADDR)
+			insn.caddr += val;
+	}
+
+	if (optimize)
+		optimizeCode();
+
+	for (auto &insn : insns)
+	{
+		if (insn.position >= arch.mem_size) {
+			fprintf(stderr, "MlAsm cursor error: Instruction at %d is outside of the "
+					"%d bytes main memory.\n", insn.position, arch.mem_size);
+			exit(1);
+		}
+
+		data.at(insn.position/4) = arch.insn_encode(insn.opcode, insn.maddr, insn.caddr);
+		data_valid.at(insn.position/4) = true;
+		data_type.at(insn.position/4) = MLIMG_SEC_SEQ;
+		data_linenr.at(insn.position/4) = insn.linenr;
+	}
+
+	if (!entry_sym.empty())
+	{
+		char *endptr = nullptr;
+		entry = strtol(entry_sym.c_str(), &endptr, 0);
+
+		if (!endptr || *endptr) {
+			int idx = findSymbol(entry_sym);
+			if (idx < 0) {
+				fprintf(stderr, "MlAsm symbol error: Entry symbol %s is not defined.\n",
+						entry_sym.c_str());
 				exit(1);
 			}
+			entry = symbols[idx].position;
+		}
 
-			val /= act.divider;
+		if (entry % 4 != 0 || entry < 0 || entry >= arch.mem_size) {
+			fprintf(stderr, "MlAsm cursor error: Entry point %d is not a valid "
+					"instruction address.\n", entry);
+			exit(1);
+		}
+	}
 
-			if (act.field == FIELD_MADDR)
-				insn.maddr += val;
+	// Words loaded by LoadCode are compute code and words loaded by
+	// LoadCoeff0/LoadCoeff1 are coefficients, regardless of whether they
+	// were written in a .code or .data section.
+	for (int i = 0; i < int(insns.size()); i++)
+	{
+		auto &insn = insns[i];
+
+		if (insn.opcode < 4 || insn.opcode > 6)
+			continue;
+
+		int len = 1;
+		if (i+1 < int(insns.size()) && insns[i+1].opcode == 7 && insns[i+1].position == insn.position+4)
+			len += insns[i+1].maddr & arch.maddr_mask();
+
+		int start = insn.maddr & arch.maddr_mask();
+		int end = start + (insn.opcode == 4 ? 4 : 8) * len;
+
+		for (int k = start/4; k < end/4 && k < int(data_valid.size()); k++)
+			if (data_valid[k])
+				data_type[k] = insn.opcode == 4 ? MLIMG_SEC_CODE : MLIMG_SEC_COEFF;
+	}
 
-			if (act.field == FIELD_CADDR)
-				insn.caddr += val;
+	// Split main memory into sections of the same type, named after the
+	// symbol pointing to their start address.
+	std::map<int, std::string> position_names = positionNames();
+
+	// Tensors declared with .input/.output get a section of their own. Input
+	// sections take over the words in their range, output sections only
+	// describe a range and may overlap other sections.
+	std::vector<section_t> tensor_sections;
+	std::vector<bool> input_words(data_valid.size());
+
+	for (auto &t : tensors)
+	{
+		section_t sec;
+		sec.type = t.output ? MLIMG_SEC_OUTPUT : MLIMG_SEC_INPUT;
+		sec.name = t.name;
+		sec.layout = t.layout;
+		sec.shape = t.shape;
+
+		char *endptr = nullptr;
+		sec.addr = strtol(t.addr_sym.c_str(), &endptr, 0);
+
+		if (!endptr || *endptr) {
+			int idx = findSymbol(t.addr_sym);
+			if (idx < 0 || symbols[idx].position < 0) {
+				fprintf(stderr, "MlAsm tensor error in line %d: Symbol %s is not defined.\n",
+						t.linenr, t.addr_sym.c_str());
+				exit(1);
+			}
+			sec.addr = symbols[idx].position;
+		}
+
+		sec.size = 1;
+		for (int dim : t.shape)
+			sec.size *= dim;
+		sec.size = (sec.size + 3) & ~3;
+
+		if (sec.addr % 4 != 0 || sec.addr < 0 || sec.addr + sec.size > arch.mem_size) {
+			fprintf(stderr, "MlAsm tensor error in line %d: %d bytes at %d are not a "
+					"4-bytes-aligned range in the %d bytes main memory.\n",
+					t.linenr, sec.size, sec.addr, arch.mem_size);
+			exit(1);
+		}
+
+		for (auto &other : tensor_sections) {
+			if (other.name == sec.name) {
+				fprintf(stderr, "MlAsm tensor error in line %d: Multiple definitions of "
+						"tensor %s.\n", t.linenr, sec.name.c_str());
+				exit(1);
+			}
+			if (other.addr < sec.addr + sec.size && sec.addr < other.addr + other.size) {
+				fprintf(stderr, "MlAsm tensor error in line %d: Tensor %s overlaps "
+						"tensor %s.\n", t.linenr, sec.name.c_str(), other.name.c_str());
+				exit(1);
+			}
 		}
+
+		if (!t.output)
+			for (int k = sec.addr/4; k < (sec.addr + sec.size)/4; k++)
+				input_words[k] = true;
+
+		tensor_sections.push_back(sec);
 	}
 
-	for (auto &insn : insns)
+	sections.clear();
+	for (int i = 0; i < int(data_valid.size());)
 	{
-		uint32_t maddr = insn.maddr & 0x1ffff;
-		uint32_t caddr = insn.caddr & 0x1ff;
-		uint32_t opcode = insn.opcode & 0x3f;
+		if (!data_valid[i] || input_words[i]) {
+			i++;
+			continue;
+		}
 
-		data.at(insn.position/4) = (maddr << 15) | (caddr << 6) | opcode;
-		data_valid.at(insn.position/4) = true;
+		int j = i+1;
+		while (j < int(data_valid.size()) && data_valid[j] && !input_words[j] && data_type[j] == data_type[i])
+			j++;
+
+		section_t sec;
+		sec.type = data_type[i];
+		sec.addr = 4*i;
+		sec.size = 4*(j-i);
+
+		if (position_names.count(sec.addr)) {
+			sec.name = position_names.at(sec.addr);
+		} else {
+			char buffer[64];
+			snprintf(buffer, 64, "%s_%05x", mlimg_type_name(sec.type), sec.addr);
+			sec.name = buffer;
+		}
+
+		if (verbose)
+			printf("%s section %s at 0x%05x (%d bytes).\n", mlimg_type_name(sec.type),
+					sec.name.c_str(), sec.addr, sec.size);
+
+		sections.push_back(sec);
+		i = j;
+	}
+
+	for (auto &sec : tensor_sections) {
+		if (verbose)
+			printf("%s section %s at 0x%05x (%d bytes).\n", mlimg_type_name(sec.type),
+					sec.name.c_str(), sec.addr, sec.size);
+		sections.push_back(sec);
 	}
+
+	std::stable_sort(sections.begin(), sections.end(),
+			[](const section_t &a, const section_t &b) { return a.addr < b.addr; });
 }
 
 void MlAsm::writeHexFile(FILE *f)
@@ -502,3 +1288,224 @@ void MlAsm::writeBinFile(FILE *f)
 
 	fwrite(buffer, 4*sz, 1, f);
 }
+
+void MlAsm::writeImageFile(FILE *f)
+{
+	auto align = [](int n) { return (n + MLIMG_ALIGN - 1) & ~(MLIMG_ALIGN - 1); };
+
+	std::string strtab(1, 0);
+	auto add_string = [&](const std::string &s) {
+		if (s.empty())
+			return 0;
+		int offset = strtab.size();
+		strtab += s;
+		strtab += char(0);
+		return offset;
+	};
+
+	std::vector<mlimg_section> sectab;
+	std::vector<mlimg_symbol> symtab;
+
+	for (auto &sec : sections) {
+		mlimg_section s;
+		memset(&s, 0, sizeof(s));
+		s.type = sec.type;
+		s.name = add_string(sec.name);
+		s.addr = sec.addr;
+		s.size = sec.size;
+		s.layout = add_string(sec.layout);
+		for (int i = 0; i < int(sec.shape.size()); i++)
+			s.shape[i] = sec.shape[i];
+		sectab.push_back(s);
+	}
+
+	// main memory the program may write outside of its output tensors, a
+	// loader can not keep sections there from one run to the next
+	std::vector<bool> stored = storedBytes();
+	for (auto &sec : sections)
+		if (sec.type == MLIMG_SEC_OUTPUT)
+			std::fill(stored.begin() + sec.addr, stored.begin() + sec.addr + sec.size, false);
+
+	auto stored_word = [&](int k) {
+		return stored[4*k] || stored[4*k+1] || stored[4*k+2] || stored[4*k+3];
+	};
+
+	for (int i = 0; i < arch.mem_size/4;)
+	{
+		if (!stored_word(i)) {
+			i++;
+			continue;
+		}
+
+		int j = i+1;
+		while (j < arch.mem_size/4 && stored_word(j))
+			j++;
+
+		char buffer[64];
+		snprintf(buffer, 64, "%s_%05x", mlimg_type_name(MLIMG_SEC_SCRATCH), 4*i);
+
+		mlimg_section s;
+		memset(&s, 0, sizeof(s));
+		s.type = MLIMG_SEC_SCRATCH;
+		s.name = add_string(buffer);
+		s.addr = 4*i;
+		s.size = 4*(j-i);
+		sectab.push_back(s);
+
+		if (verbose)
+			printf("%s section %s at 0x%05x (%d bytes).\n", mlimg_type_name(s.type),
+					buffer, int(s.addr), int(s.size));
+		i = j;
+	}
+
+	// symbol table sorted by name, without coefficient and code memory
+	// addresses
+	std::vector<bool> alloc_symbol = allocSymbols();
+	std::vector<const symbol_t*> sorted_symbols;
+	for (int idx = 0; idx < int(symbols.size()); idx++)
+		if (!alloc_symbol[idx])
+			sorted_symbols.push_back(&symbols[idx]);
+	std::sort(sorted_symbols.begin(), sorted_symbols.end(),
+			[](const symbol_t *a, const symbol_t *b) { return a->name < b->name; });
+
+	for (auto sym : sorted_symbols) {
+		mlimg_symbol s;
+		memset(&s, 0, sizeof(s));
+		s.name = add_string(sym->name);
+		s.value = sym->position;
+		s.section = -1;
+		for (int i = 0; i < int(sections.size()); i++)
+			if (sections[i].addr <= sym->position && sym->position < sections[i].addr + sections[i].size)
+				s.section = i;
+		symtab.push_back(s);
+	}
+
+	mlimg_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MLIMG_MAGIC;
+	hdr.version = MLIMG_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.entry = entry;
+	hdr.mem_size = arch.mem_size;
+	hdr.sec_offset = align(sizeof(hdr));
+	hdr.sec_count = sectab.size();
+	hdr.sym_offset = align(hdr.sec_offset + sizeof(mlimg_section) * sectab.size());
+	hdr.sym_count = symtab.size();
+	hdr.str_offset = align(hdr.sym_offset + sizeof(mlimg_symbol) * symtab.size());
+	hdr.str_size = strtab.size();
+
+	int cursor = align(hdr.str_offset + strtab.size());
+
+	for (auto &s : sectab) {
+		if (!mlimg_has_content(s.type))
+			continue;
+		s.offset = cursor;
+		cursor = align(cursor + s.size);
+	}
+
+	hdr.file_size = cursor;
+
+	std::vector<uint8_t> buffer(hdr.file_size);
+	memcpy(buffer.data(), &hdr, sizeof(hdr));
+	memcpy(buffer.data() + hdr.sym_offset, symtab.data(), sizeof(mlimg_symbol) * symtab.size());
+	memcpy(buffer.data() + hdr.str_offset, strtab.data(), strtab.size());
+
+	for (auto &s : sectab) {
+		if (s.offset == 0)
+			continue;
+		uint8_t *p = buffer.data() + s.offset;
+		for (uint32_t i = 0; i < s.size; i += 4) {
+			uint32_t w = data[(s.addr + i) / 4];
+			p[i] = w;
+			p[i+1] = w >> 8;
+			p[i+2] = w >> 16;
+			p[i+3] = w >> 24;
+		}
+		s.hash = mlimg_hash(p, s.size);
+	}
+
+	memcpy(buffer.data() + hdr.sec_offset, sectab.data(), sizeof(mlimg_section) * sectab.size());
+
+	if (verbose)
+		printf("writing %d bytes image file with %d sections and %d symbols.\n",
+				int(hdr.file_size), int(hdr.sec_count), int(hdr.sym_count));
+
+	fwrite(buffer.data(), buffer.size(), 1, f);
+}
+
+void MlAsm::writeHeaderFile(FILE *f, const std::string &prefix)
+{
+	std::string guard;
+	for (char ch : prefix + "MLASM_H")
+		guard += isalnum(ch) ? toupper(ch) : '_';
+
+	fprintf(f, "// Generated by mlasm, do not edit.\n");
+	fprintf(f, "\n");
+	fprintf(f, "#ifndef %s\n", guard.c_str());
+	fprintf(f, "#define %s\n", guard.c_str());
+	fprintf(f, "\n");
+	fprintf(f, "#ifndef MLASM_CONST\n");
+	fprintf(f, "#  ifdef __cplusplus\n");
+	fprintf(f, "#    define MLASM_CONST(name, value) constexpr int name = value;\n");
+	fprintf(f, "#  else\n");
+	fprintf(f, "#    define MLASM_CONST(name, value) enum { name = value };\n");
+	fprintf(f, "#  endif\n");
+	fprintf(f, "#endif\n");
+	fprintf(f, "\n");
+	fprintf(f, "MLASM_CONST(%sentry, 0x%05x)\n", prefix.c_str(), entry);
+
+	for (auto &sec : sections)
+	{
+		if (sec.type != MLIMG_SEC_INPUT && sec.type != MLIMG_SEC_OUTPUT)
+			continue;
+
+		std::string shape;
+		for (int dim : sec.shape)
+			shape += (shape.empty() ? "" : "x") + std::to_string(dim);
+
+		fprintf(f, "\n");
+		fprintf(f, "// %s %s: %s%s%s\n", mlimg_type_name(sec.type), sec.name.c_str(),
+				shape.c_str(), sec.layout.empty() ? "" : " ", sec.layout.c_str());
+		fprintf(f, "MLASM_CONST(%s%s_addr, 0x%05x)\n", prefix.c_str(), sec.name.c_str(), sec.addr);
+		fprintf(f, "MLASM_CONST(%s%s_size, %d)\n", prefix.c_str(), sec.name.c_str(), sec.size);
+		for (int i = 0; i < int(sec.shape.size()); i++)
+			fprintf(f, "MLASM_CONST(%s%s_dim%d, %d)\n", prefix.c_str(), sec.name.c_str(), i, sec.shape[i]);
+	}
+
+	fprintf(f, "\n");
+	fprintf(f, "#endif\n");
+}
+
+void MlAsm::writePlanFile(FILE *f)
+{
+	fprintf(f, "// Generated by mlasm, do not edit.\n");
+
+	for (auto &buf : buffers) {
+		fprintf(f, "\n");
+		fprintf(f, "// buffer, %d bytes\n", buf.size);
+		fprintf(f, ".sym %s 0x%05x\n", buf.name.c_str(), symbols[findSymbol(buf.name)].position);
+	}
+
+	for (auto &t : ctensors) {
+		fprintf(f, "\n");
+		fprintf(f, "// coefficient tensor, %d words in bank%s\n", t.words,
+				t.src[0].empty() ? " 1" : t.src[1].empty() ? " 0" : "s 0 and 1");
+		fprintf(f, ".sym %s %d\n", t.name.c_str(), symbols[findSymbol(t.name)].position);
+	}
+
+	for (auto &k : kernels) {
+		fprintf(f, "\n");
+		fprintf(f, "// kernel, %d words of compute code\n", k.words);
+		fprintf(f, ".sym %s %d\n", k.name.c_str(), symbols[findSymbol(k.name)].position);
+	}
+}
+
+void MlAsm::writeDebugMap(FILE *f, const std::string &source)
+{
+	fprintf(f, "# mlasm debug map: address line\n");
+	fprintf(f, "source %s\n", source.c_str());
+
+	for (int i = 0; i < int(data_valid.size()); i++)
+		if (data_valid[i] && data_linenr[i] > 0)
+			fprintf(f, "%05x %d\n", 4*i, data_linenr[i]);
+}
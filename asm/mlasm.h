@@ -20,10 +20,13 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <vector>
 #include <string>
 #include <map>
 
+#include "mlarch.h"
+
 class MlAsm
 {
 private:
@@ -39,21 +42,117 @@ private:
 		STATE_DATA = 2
 	};
 
+	// Range of the source text. The text passed to parseText() must stay
+	// valid as long as the MlAsm object is used.
+	struct strref_t {
+		const char *p = nullptr;
+		int len = 0;
+
+		strref_t() { }
+		strref_t(const char *p, int len) : p(p), len(len) { }
+
+		bool empty() const { return len == 0; }
+		std::string str() const { return std::string(p, len); }
+		bool operator==(const char *s) const { return !strncmp(p, s, len) && s[len] == 0; }
+		bool operator!=(const char *s) const { return !(*this == s); }
+	};
+
 	struct insn_t {
 		int position = -1;
+		int linenr = 0;
 		int opcode = -1;
 		int maddr = 0;
 		int caddr = 0;
 	};
 
-	struct symaction_t {
-		int insn_idx, factor, divider;
+	// Symbol names are interned: each name is stored once in symbols and
+	// referred to by its index. symbol_hash is an open addressing hash table
+	// (linear probing) of symbol indices, -1 marks empty slots.
+	struct symbol_t {
+		std::string name;
+		uint32_t hash = 0;
+		int position = -1;
+		int linenr = 0;
+		int label_linenr = 0;
+	};
+
+	// Operand expressions are parsed into a tree of expr_t nodes. Leaves are
+	// integers ('#', a = value) and symbols ('$', a = symbol index), inner
+	// nodes are negations ('~', a = operand) and the binary operators '+',
+	// '-', '*' and '/' (a and b = operands).
+	struct expr_t {
+		char op;
+		int a, b;
+	};
+
+	// Operands that reference symbols are added to the instruction field
+	// once all symbols are known, in a single pass over fixups in assemble().
+	// value is the value that was added, so that the optimizer can evaluate
+	// the fixups again after moving labels.
+	struct fixup_t {
+		int insn_idx, expr, linenr;
 		field_t field;
+		int value = 0;
 	};
 
-	struct symbol_t {
-		int position = -1;
-		std::vector<symaction_t> actions;
+	struct section_t {
+		int type = 0;
+		int addr = 0;
+		int size = 0;
+		std::string name;
+		std::string layout;
+		std::vector<int> shape;
+	};
+
+	struct tensor_t {
+		int linenr = 0;
+		bool output = false;
+		std::string name;
+		std::string addr_sym;
+		std::string layout;
+		std::vector<int> shape;
+	};
+
+	// Coefficient tensors declared with .ctensor. The name is a symbol that
+	// gets the coefficient memory address chosen by allocateMemory(). src
+	// are the operands with the main memory address of the data for bank 0
+	// and bank 1, empty for a bank that is not used.
+	struct ctensor_t {
+		int linenr = 0;
+		int words = 0;
+		std::string name;
+		strref_t src[2];
+	};
+
+	// "LoadCoeff <tensor>" lines, expanded to the len instructions starting
+	// at insns[insn_idx].
+	struct cload_t {
+		int insn_idx, len, ctensor;
+	};
+
+	// Compute code declared with .kernel, the name is a symbol that gets the
+	// code memory address chosen by allocateMemory(). src is the operand
+	// with the main memory address of the code.
+	struct kernel_t {
+		int linenr = 0;
+		int words = 0;
+		std::string name;
+		strref_t src;
+	};
+
+	// "LoadCode <kernel>" lines and the loads of "Execute <kernel>" lines,
+	// the len instructions starting at insns[insn_idx].
+	struct kload_t {
+		int insn_idx, len, kernel;
+	};
+
+	// Activation buffers declared with .buffer, the name is a symbol that
+	// gets the main memory address chosen by allocateMemory().
+	struct buffer_t {
+		int linenr = 0;
+		int size = 0;
+		int align = 2;
+		std::string name;
 	};
 
 	int cursor = 0;
@@ -62,25 +161,98 @@ private:
 
 	std::vector<uint32_t> data;
 	std::vector<bool> data_valid;
+	std::vector<uint8_t> data_type;
+	std::vector<int> data_linenr;
+	std::vector<strref_t> source_lines;
+	std::vector<strref_t> line_args;
+
+	// Chunks parsed by worker threads record their first error instead of
+	// exiting, parseText() reports it when merging the chunk.
+	bool defer_errors = false;
+	std::string error_msg;
+
+	std::string entry_sym;
+	int entry = 0;
+	std::vector<section_t> sections;
+	std::vector<tensor_t> tensors;
+	std::vector<ctensor_t> ctensors;
+	std::vector<cload_t> cloads;
+	std::vector<buffer_t> buffers;
+	std::vector<kernel_t> kernels;
+	std::vector<kload_t> kloads;
 
 	std::vector<insn_t> insns;
-	std::map<std::string, symbol_t> symbols;
+	std::vector<symbol_t> symbols;
+	std::vector<int> symbol_hash;
+	std::vector<expr_t> exprs;
+	std::vector<fixup_t> fixups;
+
+	void error(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+	int findSymbol(const char *name, int len, bool create);
+	int findSymbol(const std::string &name) { return findSymbol(name.c_str(), name.size(), false); }
+	int addSymbol(const std::string &name) { return findSymbol(name.c_str(), name.size(), true); }
+	std::vector<bool> allocSymbols() const;
+	std::map<int, std::string> positionNames() const;
+
+	struct lexer_t;
+	int parseExpr(lexer_t &lex, bool &symbolic);
+	int parseTerm(lexer_t &lex, bool &symbolic);
+	int parseUnary(lexer_t &lex, bool &symbolic);
+	int evalExpr(int idx, int linenr);
+	bool parseArg(strref_t s, field_t field);
 
-	void parseArg(const std::string &s, field_t field, int factor = 1, int divider = 1);
+	int findCTensor(strref_t name) const;
+	bool parseCTensor(const std::vector<strref_t> &args);
+	int findKernel(strref_t name) const;
+	bool parseKernel(const std::vector<strref_t> &args);
+	bool parseKLoad(int kernel, strref_t name);
+	void parseLine(const char *begin, const char *end);
+	void parseLines(const char *begin, const char *end);
+	void merge(MlAsm &chunk, int chunk_addr);
+	void readObjectFile(const char *text, size_t len, const char *filename);
+
+	// coefficient tensor, kernel and buffer allocation, see alloc.cc
+	struct alloc_state_t;
+	void allocateMemory();
+
+	// optimization passes, see optimize.cc
+	struct opt_state_t;
+	void optimizeCode();
+	std::vector<bool> storedBytes();
 
 public:
+	const MlArch arch;
 	bool verbose = false;
+	bool optimize = false;
 
-	MlAsm()
+	MlAsm(const MlArch &arch = MlArch()) : arch(arch)
 	{
-		data.resize(128 * 1024);
-		data_valid.resize(128 * 1024);
+		data.resize(arch.mem_size / 4);
+		data_valid.resize(arch.mem_size / 4);
+		data_type.resize(arch.mem_size / 4);
+		data_linenr.resize(arch.mem_size / 4);
 	}
 
-	void parseLine(const char *line);
+	// Parse the source text, split into up to the given number of chunks
+	// at ".code <addr>" and ".data <addr>" lines that are parsed in parallel.
+	void parseText(const char *text, size_t len, int threads = 1);
 	void assemble();
 	void writeHexFile(FILE *f);
 	void writeBinFile(FILE *f);
+	void writeImageFile(FILE *f);
+	void writeHeaderFile(FILE *f, const std::string &prefix);
+	void writePlanFile(FILE *f);
+	void writeDebugMap(FILE *f, const std::string &source);
+
+	// relocatable objects for mlld, see object.cc
+	static uint64_t objectHash(const MlArch &arch, const char *text, size_t len);
+	static bool checkObjectFile(const char *filename, uint64_t hash);
+	void writeObjectFile(FILE *f, uint64_t hash);
+	void linkObject(const char *text, size_t len, const char *filename, int base = -1);
+
+	// static cycle analysis, see analyze.cc
+	long long analyze(FILE *f, bool listing);
 };
 
 #endif
@@ -0,0 +1,470 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "mlasm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Relocatable objects ("mlasm -c"), linked with mlld. An object is the
+// state of the parser before assemble(): the words of the .data sections,
+// the instructions with the constant part of their fields, the symbols and
+// the operand expressions that reference them, and the declarations of
+// tensors, coefficient tensors, kernels and buffers. Symbols without a position are
+// imports, all labels and .sym definitions are exports.
+//
+// The fixups are the relocations. They are evaluated with the same
+// expression trees when the linked program is assembled, so scaling and
+// division of addresses ("end/4 - begin/4 - 1") work across objects.
+//
+// The file is text, one record per line, followed by the source text:
+//
+//   mlobj 1 <hash>
+//   arch <mem_size>
+//   cursor <addr>
+//   linenr <lines>
+//   entry <str>
+//   symbol <name> <position> <linenr> <label_linenr>
+//   expr <op> <a> <b>
+//   insn <position> <linenr> <opcode> <maddr> <caddr>
+//   fixup <insn> <expr> <linenr> <field>
+//   word <index> <hex> <type> <linenr>
+//   tensor <linenr> <output> <name> <addr_sym> <layout> <dims> <dim>...
+//   ctensor <linenr> <words> <name> <src0> <src1>
+//   cload <insn> <len> <ctensor>
+//   kernel <linenr> <words> <name> <src>
+//   kload <insn> <len> <kernel>
+//   buffer <linenr> <size> <align> <name>
+//   source <len>
+//
+// Strings that may be empty or contain blanks are written as <len>:<bytes>.
+// The hash covers the source text and the architecture, so that "mlasm -c"
+// can skip inputs that did not change since the object was written.
+
+uint64_t MlAsm::objectHash(const MlArch &arch, const char *text, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+	auto add = [&](const void *p, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			h = (h ^ ((const uint8_t*)p)[i]) * 1099511628211ull;
+	};
+
+	int params[] = {arch.mem_size, arch.maddr_bits, arch.caddr_bits, arch.code_size, arch.coeff_size};
+	add(params, sizeof(params));
+	add(text, len);
+	return h;
+}
+
+bool MlAsm::checkObjectFile(const char *filename, uint64_t hash)
+{
+	FILE *f = fopen(filename, "r");
+	if (f == nullptr)
+		return false;
+
+	unsigned long long h = 0;
+	int version = 0;
+	bool ok = fscanf(f, "mlobj %d %llx", &version, &h) == 2 && version == 1 && h == hash;
+
+	fclose(f);
+	return ok;
+}
+
+static void write_str(FILE *f, const char *p, int len)
+{
+	fprintf(f, " %d:%.*s", len, len, p);
+}
+
+void MlAsm::writeObjectFile(FILE *f, uint64_t hash)
+{
+	fprintf(f, "mlobj 1 %016llx\n", (unsigned long long)hash);
+	fprintf(f, "arch %d\n", arch.mem_size);
+	fprintf(f, "cursor %d\n", cursor);
+	fprintf(f, "linenr %d\n", linenr);
+
+	fprintf(f, "entry");
+	write_str(f, entry_sym.c_str(), entry_sym.size());
+	fprintf(f, "\n");
+
+	for (auto &sym : symbols)
+		fprintf(f, "symbol %s %d %d %d\n", sym.name.c_str(), sym.position, sym.linenr, sym.label_linenr);
+
+	for (auto &e : exprs)
+		fprintf(f, "expr %c %d %d\n", e.op, e.a, e.b);
+
+	for (auto &insn : insns)
+		fprintf(f, "insn %d %d %d %d %d\n", insn.position, insn.linenr, insn.opcode, insn.maddr, insn.caddr);
+
+	for (auto &fix : fixups)
+		fprintf(f, "fixup %d %d %d %d\n", fix.insn_idx, fix.expr, fix.linenr, int(fix.field));
+
+	for (int i = 0; i < int(data_valid.size()); i++)
+		if (data_valid[i])
+			fprintf(f, "word %d %08x %d %d\n", i, data[i], data_type[i], data_linenr[i]);
+
+	for (auto &t : tensors) {
+		fprintf(f, "tensor %d %d %s %s", t.linenr, t.output, t.name.c_str(), t.addr_sym.c_str());
+		write_str(f, t.layout.c_str(), t.layout.size());
+		fprintf(f, " %d", int(t.shape.size()));
+		for (int dim : t.shape)
+			fprintf(f, " %d", dim);
+		fprintf(f, "\n");
+	}
+
+	for (auto &t : ctensors) {
+		fprintf(f, "ctensor %d %d %s", t.linenr, t.words, t.name.c_str());
+		write_str(f, t.src[0].p, t.src[0].len);
+		write_str(f, t.src[1].p, t.src[1].len);
+		fprintf(f, "\n");
+	}
+
+	for (auto &ld : cloads)
+		fprintf(f, "cload %d %d %d\n", ld.insn_idx, ld.len, ld.ctensor);
+
+	for (auto &k : kernels) {
+		fprintf(f, "kernel %d %d %s", k.linenr, k.words, k.name.c_str());
+		write_str(f, k.src.p, k.src.len);
+		fprintf(f, "\n");
+	}
+
+	for (auto &ld : kloads)
+		fprintf(f, "kload %d %d %d\n", ld.insn_idx, ld.len, ld.kernel);
+
+	for (auto &buf : buffers)
+		fprintf(f, "buffer %d %d %d %s\n", buf.linenr, buf.size, buf.align, buf.name.c_str());
+
+	size_t len = 0;
+	for (auto &line : source_lines)
+		len += line.len + 1;
+
+	fprintf(f, "source %zu\n", len);
+	for (auto &line : source_lines)
+		fprintf(f, "%.*s\n", line.len, line.p);
+}
+
+namespace
+{
+// Reader for the records of an object file, that is not necessarily
+// terminated by a zero byte.
+struct objreader_t
+{
+	const char *p, *end;
+	const char *filename;
+	int linenr = 0;
+
+	[[noreturn]] void fail()
+	{
+		fprintf(stderr, "MlAsm object error in %s line %d: Invalid object file.\n", filename, linenr);
+		exit(1);
+	}
+
+	bool next(std::string &kind)
+	{
+		if (p >= end)
+			return false;
+		linenr++;
+		kind = word();
+		return true;
+	}
+
+	std::string word()
+	{
+		while (p < end && *p == ' ')
+			p++;
+		const char *q = p;
+		while (q < end && *q != ' ' && *q != '\n')
+			q++;
+		if (q == p)
+			fail();
+		std::string s(p, q);
+		p = q;
+		return s;
+	}
+
+	long long num(int base = 10)
+	{
+		std::string s = word();
+		char *endptr = nullptr;
+		long long v = strtoll(s.c_str(), &endptr, base);
+		if (*endptr)
+			fail();
+		return v;
+	}
+
+	// <len>:<bytes>, returns a pointer into the object file
+	const char *str(int &len)
+	{
+		while (p < end && *p == ' ')
+			p++;
+		len = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+			len = 10*len + (*p++ - '0');
+		if (p >= end || *p != ':' || end-p-1 < len)
+			fail();
+		const char *s = p+1;
+		p = s + len;
+		return s;
+	}
+
+	void eol()
+	{
+		if (p >= end || *p != '\n')
+			fail();
+		p++;
+	}
+};
+}
+
+void MlAsm::readObjectFile(const char *text, size_t len, const char *filename)
+{
+	objreader_t rd;
+	rd.p = text;
+	rd.end = text + len;
+	rd.filename = filename;
+
+	std::string kind;
+	int n;
+
+	if (!rd.next(kind) || kind != "mlobj" || rd.num() != 1) {
+		fprintf(stderr, "MlAsm object error: %s is not an mlasm object file.\n", filename);
+		exit(1);
+	}
+	rd.num(16);
+	rd.eol();
+
+	while (rd.next(kind))
+	{
+		if (kind == "arch") {
+			int mem_size = rd.num();
+			if (mem_size != arch.mem_size) {
+				fprintf(stderr, "MlAsm object error: %s was assembled for %d bytes main memory, "
+						"not %d bytes.\n", filename, mem_size, arch.mem_size);
+				exit(1);
+			}
+		} else if (kind == "cursor") {
+			cursor = rd.num();
+		} else if (kind == "linenr") {
+			linenr = rd.num();
+		} else if (kind == "entry") {
+			const char *s = rd.str(n);
+			entry_sym = std::string(s, n);
+		} else if (kind == "symbol") {
+			symbol_t sym;
+			sym.name = rd.word();
+			sym.position = rd.num();
+			sym.linenr = rd.num();
+			sym.label_linenr = rd.num();
+			int idx = addSymbol(sym.name);
+			if (idx != int(symbols.size())-1 || symbols[idx].position != -1)
+				rd.fail();
+			symbols[idx].position = sym.position;
+			symbols[idx].linenr = sym.linenr;
+			symbols[idx].label_linenr = sym.label_linenr;
+		} else if (kind == "expr") {
+			expr_t e;
+			std::string op = rd.word();
+			e.op = op[0];
+			e.a = rd.num();
+			e.b = rd.num();
+			if (op.size() != 1 || !strchr("#$~+-*/", e.op))
+				rd.fail();
+			if (e.op == '$' ? e.a < 0 || e.a >= int(symbols.size()) :
+					e.op != '#' && (e.a < 0 || e.a >= int(exprs.size()) || e.b < 0 || e.b >= int(exprs.size())))
+				rd.fail();
+			exprs.push_back(e);
+		} else if (kind == "insn") {
+			insn_t insn;
+			insn.position = rd.num();
+			insn.linenr = rd.num();
+			insn.opcode = rd.num();
+			insn.maddr = rd.num();
+			insn.caddr = rd.num();
+			if (insn.position < 0 || insn.position % 4 != 0 || insn.position >= cursor)
+				rd.fail();
+			insns.push_back(insn);
+		} else if (kind == "fixup") {
+			fixup_t fix;
+			fix.insn_idx = rd.num();
+			fix.expr = rd.num();
+			fix.linenr = rd.num();
+			fix.field = field_t(rd.num());
+			if (fix.insn_idx < 0 || fix.insn_idx >= int(insns.size()) || fix.expr < 0 || fix.expr >= int(exprs.size()))
+				rd.fail();
+			fixups.push_back(fix);
+		} else if (kind == "word") {
+			int idx = rd.num();
+			uint32_t w = rd.num(16);
+			int type = rd.num();
+			int line = rd.num();
+			if (idx < 0 || idx >= cursor/4)
+				rd.fail();
+			data[idx] = w;
+			data_valid[idx] = true;
+			data_type[idx] = type;
+			data_linenr[idx] = line;
+		} else if (kind == "tensor") {
+			tensor_t t;
+			t.linenr = rd.num();
+			t.output = rd.num();
+			t.name = rd.word();
+			t.addr_sym = rd.word();
+			const char *s = rd.str(n);
+			t.layout = std::string(s, n);
+			for (int i = rd.num(); i > 0; i--)
+				t.shape.push_back(rd.num());
+			tensors.push_back(t);
+		} else if (kind == "ctensor") {
+			ctensor_t t;
+			t.linenr = rd.num();
+			t.words = rd.num();
+			t.name = rd.word();
+			for (int bank = 0; bank < 2; bank++) {
+				const char *s = rd.str(n);
+				t.src[bank] = strref_t(s, n);
+			}
+			ctensors.push_back(t);
+		} else if (kind == "cload") {
+			cload_t ld;
+			ld.insn_idx = rd.num();
+			ld.len = rd.num();
+			ld.ctensor = rd.num();
+			if (ld.insn_idx < 0 || ld.len < 0 || ld.insn_idx + ld.len > int(insns.size()) ||
+					ld.ctensor < 0 || ld.ctensor >= int(ctensors.size()))
+				rd.fail();
+			cloads.push_back(ld);
+		} else if (kind == "kernel") {
+			kernel_t k;
+			k.linenr = rd.num();
+			k.words = rd.num();
+			k.name = rd.word();
+			const char *s = rd.str(n);
+			k.src = strref_t(s, n);
+			kernels.push_back(k);
+		} else if (kind == "kload") {
+			kload_t ld;
+			ld.insn_idx = rd.num();
+			ld.len = rd.num();
+			ld.kernel = rd.num();
+			if (ld.insn_idx < 0 || ld.len < 0 || ld.insn_idx + ld.len > int(insns.size()) ||
+					ld.kernel < 0 || ld.kernel >= int(kernels.size()))
+				rd.fail();
+			kloads.push_back(ld);
+		} else if (kind == "buffer") {
+			buffer_t buf;
+			buf.linenr = rd.num();
+			buf.size = rd.num();
+			buf.align = rd.num();
+			buf.name = rd.word();
+			buffers.push_back(buf);
+		} else if (kind == "source") {
+			long long size = rd.num();
+			rd.eol();
+			if (rd.end - rd.p != size)
+				rd.fail();
+			for (const char *p = rd.p; p < rd.end;) {
+				const char *eol = (const char*)memchr(p, '\n', rd.end-p);
+				source_lines.push_back(strref_t(p, eol-p));
+				p = eol+1;
+			}
+			if (int(source_lines.size()) != linenr)
+				rd.fail();
+			return;
+		} else {
+			rd.fail();
+		}
+		rd.eol();
+	}
+
+	rd.fail();
+}
+
+// Read an object and add it to the program at base, or at the next 64-byte
+// boundary after the previous object when base is -1. Instructions, labels,
+// data words and the location counter move by base, .sym values and tensor
+// addresses stay as they are.
+void MlAsm::linkObject(const char *text, size_t len, const char *filename, int base)
+{
+	MlAsm obj(arch);
+	obj.readObjectFile(text, len, filename);
+
+	if (base < 0)
+		base = (cursor + 63) & ~63;
+
+	if (base % 4 != 0) {
+		fprintf(stderr, "MlAsm object error: Cannot place %s at %d, objects must start "
+				"at a multiple of 4 bytes.\n", filename, base);
+		exit(1);
+	}
+
+	if (base < cursor || base + obj.cursor > arch.mem_size) {
+		fprintf(stderr, "MlAsm object error: Cannot place %s (%d bytes) at %d, the location "
+				"counter is at %d and main memory has %d bytes.\n", filename, obj.cursor,
+				base, cursor, arch.mem_size);
+		exit(1);
+	}
+
+	if (verbose)
+		printf("object %s at 0x%05x (%d bytes).\n", filename, base, obj.cursor);
+
+	int offset = linenr;
+	auto reloc_line = [&](int &l) { if (l > 0) l += offset; };
+
+	for (int k = obj.cursor/4 - 1; k >= 0; k--) {
+		obj.data[k + base/4] = obj.data[k];
+		obj.data_valid[k + base/4] = obj.data_valid[k];
+		obj.data_type[k + base/4] = obj.data_type[k];
+		obj.data_linenr[k + base/4] = obj.data_linenr[k];
+		if (base != 0)
+			obj.data_valid[k] = false;
+		reloc_line(obj.data_linenr[k + base/4]);
+	}
+
+	for (auto &sym : obj.symbols) {
+		if (sym.label_linenr != 0)
+			sym.position += base;
+		reloc_line(sym.linenr);
+		reloc_line(sym.label_linenr);
+	}
+
+	for (auto &insn : obj.insns) {
+		insn.position += base;
+		reloc_line(insn.linenr);
+	}
+
+	for (auto &fix : obj.fixups)
+		reloc_line(fix.linenr);
+	for (auto &t : obj.tensors)
+		reloc_line(t.linenr);
+	for (auto &t : obj.ctensors)
+		reloc_line(t.linenr);
+	for (auto &k : obj.kernels)
+		reloc_line(k.linenr);
+	for (auto &buf : obj.buffers)
+		reloc_line(buf.linenr);
+
+	if (!obj.entry_sym.empty()) {
+		char *endptr = nullptr;
+		int addr = strtol(obj.entry_sym.c_str(), &endptr, 0);
+		if (endptr && !*endptr)
+			obj.entry_sym = std::to_string(addr + base);
+	}
+
+	obj.cursor += base;
+	obj.linenr += offset;
+
+	merge(obj, base);
+}
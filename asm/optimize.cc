@@ -0,0 +1,3077 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "mlasm.h"
+#include "mlisa.h"
+#include "mlpipe.h"
+
+#include <algorithm>
+#include <set>
+#include <tuple>
+#include <limits.h>
+
+// Optimization passes (mlasm -O). They run in assemble() after the fixups are
+// resolved and before the instructions are encoded, and only touch sequencer
+// code: the instructions found by following the sequencer from the entry
+// point (like the static analysis does) that are not loaded by LoadCode or
+// LoadCoeff*. Runs of consecutive sequencer instructions form segments. The
+// passes edit the instruction lists of the segments, afterwards the
+// instructions are placed again from the start of each segment. Segments
+// never grow, everything outside of them keeps its address. Labels in a
+// segment move with the instruction they point to, and all fixups are
+// evaluated again with the new label positions.
+
+struct MlAsm::opt_state_t
+{
+	struct segment_t {
+		int start = 0;
+		int limit = 0;
+
+		// instruction indices, chunks[0] is the code of the segment and
+		// chunks[1..] are subroutines added by the passes
+		std::vector<std::vector<int>> chunks;
+
+		int size() const {
+			int n = 0;
+			for (auto &c : chunks)
+				n += c.size();
+			return n;
+		}
+	};
+
+	// Call/Return cost two additional sequencer fetches for each call site,
+	// so only sequences of at least this many instructions are outlined.
+	enum { OUTLINE_MIN_LEN = 4, OUTLINE_ROUNDS = 16, OUTLINE_CANDIDATES = 256 };
+
+	MlAsm &as;
+	const int maddr_mask;
+
+	std::vector<segment_t> segments;
+	std::vector<std::vector<int>> insn_fixups;
+	std::vector<bool> no_outline;
+
+	// labels pointing to an instruction, they move with it
+	std::map<int, std::vector<int>> anchors;
+	std::vector<bool> movable;
+
+	// what the sequencer runs and loads, filled in by walk()
+	struct load_t {
+		int maddr, caddr, len;
+	};
+	std::map<int, int> at;
+	std::vector<int> seen_depth;
+	std::vector<bool> reached, loaded;
+	std::vector<load_t> code_loads;
+	std::vector<std::pair<int, int>> executes;
+	int entry_addr = 0, entry_symbol = -1;
+	int max_depth = 0;
+
+	opt_state_t(MlAsm &as) : as(as), maddr_mask(as.arch.maddr_mask()) { }
+
+	int addInsn(int opcode, int maddr, int caddr, int linenr)
+	{
+		insn_t insn;
+		insn.opcode = opcode;
+		insn.maddr = maddr;
+		insn.caddr = caddr;
+		insn.linenr = linenr;
+		as.insns.push_back(insn);
+		insn_fixups.emplace_back();
+		no_outline.push_back(false);
+		return as.insns.size()-1;
+	}
+
+	void addFixup(int idx, int expr, field_t field)
+	{
+		fixup_t fix;
+		fix.insn_idx = idx;
+		fix.expr = expr;
+		fix.linenr = as.insns[idx].linenr;
+		fix.field = field;
+		insn_fixups[idx].push_back(as.fixups.size());
+		as.fixups.push_back(fix);
+	}
+
+	int cloneInsn(int idx)
+	{
+		insn_t insn = as.insns[idx];
+		int n = addInsn(insn.opcode, insn.maddr, insn.caddr, insn.linenr);
+		for (int f : insn_fixups[idx]) {
+			fixup_t fix = as.fixups[f];
+			fix.insn_idx = n;
+			insn_fixups[n].push_back(as.fixups.size());
+			as.fixups.push_back(fix);
+		}
+		return n;
+	}
+
+	void killInsn(int idx)
+	{
+		for (int f : insn_fixups[idx])
+			as.fixups[f].insn_idx = -1;
+		insn_fixups[idx].clear();
+		as.insns[idx].opcode = -1;
+		as.insns[idx].position = -1;
+	}
+
+	void moveAnchors(int from, int to)
+	{
+		auto it = anchors.find(from);
+		if (it == anchors.end())
+			return;
+		std::vector<int> syms = std::move(it->second);
+		anchors.erase(it);
+		auto &dst = anchors[to];
+		dst.insert(dst.end(), syms.begin(), syms.end());
+	}
+
+	// New label pointing to the given instruction, named prefix<n> with the
+	// first n that is not used by the program yet.
+	int addLabel(const char *prefix, int idx)
+	{
+		std::string name;
+		for (int i = 0; name.empty() || as.findSymbol(name) >= 0; i++)
+			name = prefix + std::to_string(i);
+
+		int sym = as.addSymbol(name);
+		as.symbols[sym].position = 0;
+		as.symbols[sym].linenr = as.insns[idx].linenr;
+		as.symbols[sym].label_linenr = as.insns[idx].linenr;
+		anchors[idx].push_back(sym);
+		movable.resize(as.symbols.size());
+		movable[sym] = true;
+		return sym;
+	}
+
+	// Operand values of instructions that do not reference moving labels
+	// are final, passes can compute with them.
+	bool fixedExpr(int idx) const
+	{
+		const expr_t &e = as.exprs[idx];
+		if (e.op == '#')
+			return true;
+		if (e.op == '$')
+			return !movable[e.a];
+		return fixedExpr(e.a) && (e.op == '~' || fixedExpr(e.b));
+	}
+
+	bool fixedInsn(int idx) const
+	{
+		for (int f : insn_fixups[idx])
+			if (!fixedExpr(as.fixups[f].expr))
+				return false;
+		return true;
+	}
+
+	// Replace an operand by a constant value
+	void setField(int idx, field_t field, int value)
+	{
+		std::vector<int> keep;
+		for (int f : insn_fixups[idx]) {
+			if (as.fixups[f].field == field)
+				as.fixups[f].insn_idx = -1;
+			else
+				keep.push_back(f);
+		}
+		insn_fixups[idx].swap(keep);
+
+		if (field == FIELD_MADDR)
+			as.insns[idx].maddr = value;
+		else
+			as.insns[idx].caddr = value;
+	}
+
+	// Key that is equal for instructions that do the same when run at any
+	// address: the operands and the expressions they were computed from.
+	std::string exprKey(int idx) const
+	{
+		const expr_t &e = as.exprs[idx];
+		if (e.op == '#')
+			return std::to_string(e.a);
+		if (e.op == '$')
+			return "$" + std::to_string(e.a);
+		if (e.op == '~')
+			return "~(" + exprKey(e.a) + ")";
+		return "(" + exprKey(e.a) + e.op + exprKey(e.b) + ")";
+	}
+
+	std::string insnKey(int idx) const
+	{
+		const insn_t &insn = as.insns[idx];
+		std::string key = std::to_string(insn.opcode) + " " + std::to_string(insn.maddr) +
+				" " + std::to_string(insn.caddr);
+		for (int f : insn_fixups[idx])
+			key += (as.fixups[f].field == FIELD_MADDR ? " m" : " c") + exprKey(as.fixups[f].expr);
+		return key;
+	}
+
+	bool prepare();
+	void walk(int addr, int depth);
+	void finish();
+
+	// state of the walk in sparsity(): the sequencer is followed with the
+	// value of CBP and the main memory words in code memory (byte address,
+	// -1 = unknown) and in coefficient memory (bank*coeff_size + entry)
+	struct zero_sub_t {
+		int cbp, code_gen, coeff_gen;
+		std::vector<int> code_src, coeff_src;
+	};
+	std::map<std::tuple<int, int, int, int>, zero_sub_t> zero_subs;
+	std::vector<int> code_src, coeff_src;
+	int cbp = -1, code_gen = 0, coeff_gen = 0, num_gens = 1;
+
+	// MACCs that run at least once, and that read a non-zero coefficient
+	// word at least once; the MACCs that read each coefficient memory
+	// entry (-1 for compute words that are not instructions)
+	std::vector<bool> macc_seen, macc_needed;
+	std::vector<std::set<int>> coeff_readers;
+	bool coeff_read_all = false;
+
+	// LoadCode sites (load, ContinueLoad or -1, first word, len), Execute
+	// sites (execute, first word or -1 if not consecutive words, len), words
+	// run by such Executes, by the sequencer or loaded by LoadCoeff
+	std::set<std::tuple<int, int, int, int>> code_sites;
+	std::set<std::tuple<int, int, int>> exec_sites;
+	std::vector<bool> partial_exec, seq_run, coeff_word, tensor_word;
+
+	bool zeroCoeffs(int addr) const;
+	void zeroCompute(int word);
+	bool zeroWalk(int addr, int depth);
+	bool zeroBlock(std::vector<int> &block, bool seq);
+	void sparsity();
+
+	// compute code loaded by LoadCode that is always loaded and run as a
+	// whole: first word and length, instructions, LoadCode instructions with
+	// their ContinueLoads, Executes
+	struct code_block_t {
+		int first = 0, len = 0;
+		std::vector<int> insns, loads, cls, execs;
+	};
+	std::vector<code_block_t> findBlocks();
+
+	template<typename F>
+	void editBlocks(F edit);
+
+	// state of the simulation in dataflow(): the base pointers, the load
+	// (instruction and offset) that wrote each code and coefficient memory
+	// entry, the Store/Save that wrote each main memory byte (-1 = none,
+	// -2 = not an instruction) and the LdSet that set each accumulator.
+	// mem_stored are the bytes written at any time, valid when flow_done.
+	enum { FLOW_MAX_STEPS = 1 << 25 };
+	int flow_bp[4] = {-1, -1, -1, -1};
+	int acc_def[2] = {-1, -1};
+	long long flow_steps = 0;
+	bool flow_done = false;
+	std::vector<bool> mem_stored;
+	std::vector<int> entry_load, entry_offset, mem_writer, load_used;
+	std::vector<long long> runs;
+	std::vector<bool> store_needed, ldset_needed;
+	std::map<int, std::set<int>> store_ldsets;
+
+	bool flowRead(int addr, int len, int ldset);
+	bool flowWrite(int addr, int len, int store);
+	void flowUse(int entry);
+	void flowAcc(int lanes);
+	bool flowCompute(int word);
+	bool flowWalk(int addr, int depth);
+	void flowReset();
+	void dataflow();
+
+	// state of rebase(): the blocks of compute code, the blocks that are run
+	// as another block with shifted base pointers, their Executes and the
+	// loads that are dropped, and the code memory addresses that have the
+	// other block at every run of such an Execute
+	struct rebase_t {
+		int block = -1, target = -1;
+		int shift[4] = {0, 0, 0, 0};
+		bool uses[4] = {false, false, false, false};
+	};
+	std::vector<code_block_t> blocks;
+	std::vector<rebase_t> rebased;
+	std::map<int, int> rebase_exec;
+	std::set<int> rebase_skip;
+	std::map<int, std::set<int>> rebase_caddr;
+
+	bool rebaseMatch(const code_block_t &a, const code_block_t &b, rebase_t &rb) const;
+	bool rebaseWalk(int addr, int depth);
+	int rebaseChunk(std::vector<int> &chunk, bool apply);
+	void rebase();
+
+	void prefetch();
+
+	void peephole();
+	void peepholeChunk(std::vector<int> &chunk);
+
+	struct repeat_t {
+		int len = 0, saved = 0;
+		std::vector<int> pos;
+	};
+	std::vector<repeat_t> findRepeats(const std::vector<int> &text, int min_len, int max_candidates);
+
+	void outline();
+	bool outlineRound();
+
+	void schedule();
+
+	void place();
+	bool scheduleBlock(std::vector<int> &block);
+
+	int zero_maccs = 0, zero_converted = 0, trimmed_words = 0, trimmed_loads = 0;
+	int dead_stores = 0, dead_loads = 0, dead_words = 0, dead_bursts = 0;
+	long long dead_runs = 0;
+	int rebased_sites = 0, rebased_writes = 0, rebased_loads = 0, rebased_words = 0;
+	int prefetched_loads = 0, prefetched_words = 0, prefetched_syncs = 0;
+	int merged_loads = 0, folded_writes = 0, dropped_syncs = 0;
+	int scheduled_blocks = 0, saved_stalls = 0;
+};
+
+void MlAsm::opt_state_t::walk(int addr, int depth)
+{
+	max_depth = std::max(max_depth, depth);
+	if (depth > as.arch.callstack_size)
+		return;
+
+	while (1)
+	{
+		auto it = at.find(addr);
+		if (it == at.end())
+			return;
+
+		// nothing new to find when running this code again at the same depth
+		int idx = it->second;
+		if (seen_depth[idx] >= depth)
+			return;
+		seen_depth[idx] = depth;
+		reached[idx] = true;
+
+		const insn_t &insn = as.insns[idx];
+		const MlIsa::op_t &op = ml_isa_op(insn.opcode);
+
+		if (op.kind == MlIsa::KIND_RETURN || op.kind == MlIsa::KIND_CONTLOAD)
+			return;
+
+		if (op.kind == MlIsa::KIND_CALL)
+			walk(insn.maddr & maddr_mask, depth+1);
+
+		if (op.kind == MlIsa::KIND_LOAD)
+		{
+			int len = 1;
+			auto next = at.find(addr+4);
+			if (next != at.end() && as.insns[next->second].opcode == 7) {
+				reached[next->second] = true;
+				len += as.insns[next->second].maddr & maddr_mask;
+				addr += 4;
+			}
+
+			int start = insn.maddr & maddr_mask;
+			int end = start + (op.lanes == 0 ? 4 : 8) * len;
+			for (int k = start/4; k < end/4 && k < int(loaded.size()); k++)
+				loaded[k] = true;
+
+			if (op.lanes == 0)
+				code_loads.push_back(load_t{start, insn.caddr, len});
+		}
+
+		if (op.kind == MlIsa::KIND_EXECUTE)
+			executes.push_back(std::make_pair(insn.caddr, insn.maddr & maddr_mask));
+
+		addr += 4;
+	}
+}
+
+bool MlAsm::opt_state_t::prepare()
+{
+	int num_insns = as.insns.size();
+	insn_fixups.resize(num_insns);
+	no_outline.resize(num_insns);
+
+	for (int i = 0; i < int(as.fixups.size()); i++)
+		insn_fixups[as.fixups[i].insn_idx].push_back(i);
+
+	int &entry = entry_addr;
+	bool entry_label = false;
+
+	if (!as.entry_sym.empty())
+	{
+		char *endptr = nullptr;
+		entry = strtol(as.entry_sym.c_str(), &endptr, 0);
+
+		if (!endptr || *endptr) {
+			int idx = as.findSymbol(as.entry_sym);
+			if (idx < 0)
+				return false;
+			entry = as.symbols[idx].position;
+			entry_label = as.symbols[idx].label_linenr != 0;
+			entry_symbol = idx;
+		}
+	}
+
+	for (int i = 0; i < num_insns; i++)
+		at[as.insns[i].position] = i;
+
+	seen_depth.resize(num_insns, -1);
+	reached.resize(num_insns);
+	loaded.resize(as.data.size());
+	walk(entry, 0);
+
+	if (max_depth > as.arch.callstack_size)
+		return false;
+
+	// runs of consecutive sequencer instructions
+	for (auto &it : at)
+	{
+		int idx = it.second;
+		const insn_t &insn = as.insns[idx];
+
+		if (!reached[idx] || loaded[insn.position/4])
+			continue;
+
+		if (segments.empty() || segments.back().limit != insn.position) {
+			segments.push_back(segment_t());
+			segments.back().start = insn.position;
+			segments.back().chunks.resize(1);
+		}
+
+		segments.back().limit = insn.position + 4;
+		segments.back().chunks[0].push_back(idx);
+	}
+
+	auto find_segment = [&](int addr) {
+		auto it = std::upper_bound(segments.begin(), segments.end(), addr,
+				[](int a, const segment_t &seg) { return a < seg.start; });
+		if (it == segments.begin() || addr >= (it-1)->limit)
+			return -1;
+		return int(it - segments.begin()) - 1;
+	};
+
+	// Segments can only be changed when all references to addresses inside
+	// of them are labels that can be moved: no .sym symbols, no numeric entry
+	// point or Call target, and no expressions computed from labels. The
+	// symbols of coefficient tensors and kernels are coefficient and code
+	// memory addresses.
+	std::vector<bool> excluded(segments.size());
+	std::vector<bool> alloc_symbol = as.allocSymbols();
+
+	for (int sym = 0; sym < int(as.symbols.size()); sym++) {
+		int s = alloc_symbol[sym] ? -1 : find_segment(as.symbols[sym].position);
+		if (s >= 0 && as.symbols[sym].label_linenr == 0 && as.symbols[sym].position != segments[s].start)
+			excluded[s] = true;
+	}
+
+	// Segments must end with Return, the sequencer must not run past the
+	// end of a segment that shrinks.
+	for (int s = 0; s < int(segments.size()); s++)
+		if (as.insns[segments[s].chunks[0].back()].opcode != 2)
+			excluded[s] = true;
+
+	int entry_seg = find_segment(entry);
+	if (entry_seg >= 0 && !entry_label && entry != segments[entry_seg].start)
+		excluded[entry_seg] = true;
+
+	std::vector<bool> bare_ref(num_insns);
+	for (auto &fix : as.fixups) {
+		const expr_t &e = as.exprs[fix.expr];
+		if (e.op == '$') {
+			bare_ref[fix.insn_idx] = true;
+			continue;
+		}
+		std::vector<int> stack = {fix.expr};
+		while (!stack.empty()) {
+			const expr_t &n = as.exprs[stack.back()];
+			stack.pop_back();
+			if (n.op == '$') {
+				int s = alloc_symbol[n.a] ? -1 : find_segment(as.symbols[n.a].position);
+				if (s >= 0)
+					excluded[s] = true;
+			} else if (n.op != '#') {
+				stack.push_back(n.a);
+				if (n.op != '~')
+					stack.push_back(n.b);
+			}
+		}
+	}
+
+	for (int i = 0; i < num_insns; i++) {
+		const insn_t &insn = as.insns[i];
+		if (!reached[i] || insn.opcode != 1 || bare_ref[i])
+			continue;
+		int s = find_segment(insn.maddr & maddr_mask);
+		if (s >= 0 && (insn.maddr & maddr_mask) != segments[s].start)
+			excluded[s] = true;
+	}
+
+	std::vector<segment_t> kept;
+	for (int s = 0; s < int(segments.size()); s++)
+		if (!excluded[s])
+			kept.push_back(std::move(segments[s]));
+	segments.swap(kept);
+
+	movable.resize(as.symbols.size());
+	for (int sym = 0; sym < int(as.symbols.size()); sym++) {
+		int s = alloc_symbol[sym] ? -1 : find_segment(as.symbols[sym].position);
+		if (s >= 0) {
+			anchors[at.at(as.symbols[sym].position)].push_back(sym);
+			movable[sym] = true;
+		}
+	}
+
+	return true;
+}
+
+void MlAsm::opt_state_t::finish()
+{
+	int old_size = 0, new_size = 0;
+
+	for (auto &seg : segments)
+	{
+		old_size += (seg.limit - seg.start) / 4;
+		new_size += seg.size();
+
+		int pos = seg.start;
+		for (auto &chunk : seg.chunks)
+			for (int idx : chunk) {
+				as.insns[idx].position = pos;
+				pos += 4;
+			}
+
+		if (pos > seg.limit) {
+			fprintf(stderr, "MlAsm internal error: Optimized code at %d does not fit.\n", seg.start);
+			exit(1);
+		}
+	}
+
+	for (auto &it : anchors)
+		for (int sym : it.second)
+			as.symbols[sym].position = as.insns[it.first].position;
+
+	for (auto &fix : as.fixups)
+	{
+		if (fix.insn_idx < 0)
+			continue;
+
+		auto &insn = as.insns[fix.insn_idx];
+		int val = as.evalExpr(fix.expr, fix.linenr);
+
+		if (fix.field == FIELD_MADDR)
+			insn.maddr += val - fix.value;
+
+		if (fix.field == FIELD_CADDR)
+			insn.caddr += val - fix.value;
+
+		fix.value = val;
+	}
+
+	// Put the instructions back into address order, later steps in
+	// assemble() expect a ContinueLoad right after its load.
+	std::vector<int> order;
+	for (int i = 0; i < int(as.insns.size()); i++)
+		if (as.insns[i].opcode >= 0)
+			order.push_back(i);
+
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+		return as.insns[a].position < as.insns[b].position;
+	});
+
+	std::vector<int> new_idx(as.insns.size(), -1);
+	std::vector<insn_t> new_insns;
+	for (int idx : order) {
+		new_idx[idx] = new_insns.size();
+		new_insns.push_back(as.insns[idx]);
+	}
+	as.insns.swap(new_insns);
+
+	std::vector<fixup_t> new_fixups;
+	for (auto fix : as.fixups)
+		if (fix.insn_idx >= 0) {
+			fix.insn_idx = new_idx[fix.insn_idx];
+			new_fixups.push_back(fix);
+		}
+	as.fixups.swap(new_fixups);
+
+	if (as.verbose)
+		printf("optimized %d words of sequencer code in %d segments to %d words.\n",
+				old_size, int(segments.size()), new_size);
+}
+
+// Compute code loaded by LoadCode that is always loaded and run as a whole:
+// all LoadCode/ContinueLoad instructions and Executes that load or run any
+// of its words do so for exactly its range (and for no other block), and no
+// symbol points inside of it. Uses the sites recorded by the last walk
+// (zeroWalk(), flowWalk() or rebaseWalk()).
+std::vector<MlAsm::opt_state_t::code_block_t> MlAsm::opt_state_t::findBlocks()
+{
+	std::vector<code_block_t> blocks;
+	std::vector<bool> alloc_symbol = as.allocSymbols();
+
+	std::set<std::pair<int, int>> ranges;
+	for (auto &site : code_sites)
+		ranges.insert(std::make_pair(std::get<2>(site), std::get<3>(site)));
+
+	for (auto &range : ranges)
+	{
+		code_block_t blk;
+		blk.first = range.first;
+		blk.len = range.second;
+		int end = blk.first + blk.len;
+		bool ok = blk.len > 1;
+
+		for (int k = blk.first; ok && k < end; k++) {
+			auto it = at.find(4*k);
+			ok = it != at.end() && ml_isa_op(as.insns[it->second].opcode).compute() &&
+					!seq_run[k] && !partial_exec[k] && !coeff_word[k];
+			if (ok)
+				blk.insns.push_back(it->second);
+		}
+
+		if (!ok)
+			continue;
+
+		std::set<int> loads, execs;
+		for (auto &site : code_sites)
+			if (std::get<2>(site) < end && blk.first < std::get<2>(site) + std::get<3>(site))
+				loads.insert(std::get<0>(site));
+		for (auto &site : exec_sites)
+			if (std::get<1>(site) < end && blk.first < std::get<1>(site) + std::get<2>(site))
+				execs.insert(std::get<0>(site));
+
+		for (auto &site : code_sites)
+			if (loads.count(std::get<0>(site))) {
+				ok = ok && std::get<1>(site) >= 0 && std::get<2>(site) == blk.first && std::get<3>(site) == blk.len;
+				blk.loads.push_back(std::get<0>(site));
+				blk.cls.push_back(std::get<1>(site));
+			}
+		for (auto &site : exec_sites)
+			if (execs.count(std::get<0>(site)))
+				ok = ok && std::get<1>(site) == blk.first && std::get<2>(site) == blk.len;
+		blk.execs.assign(execs.begin(), execs.end());
+
+		for (int sym = 0; ok && sym < int(as.symbols.size()); sym++)
+			ok = alloc_symbol[sym] || as.symbols[sym].position <= 4*blk.first || as.symbols[sym].position >= 4*end;
+
+		if (ok)
+			blocks.push_back(blk);
+	}
+
+	return blocks;
+}
+
+// Compute code loaded by LoadCode can lose instructions when the block is
+// always loaded and run as a whole (see findBlocks()). edit() kills
+// instructions of the block and removes them from the list, the rest move
+// up and the ContinueLoad and Execute lengths shrink.
+template<typename F>
+void MlAsm::opt_state_t::editBlocks(F edit)
+{
+	for (auto &blk : findBlocks())
+	{
+		std::vector<int> block = blk.insns;
+
+		for (int idx : block)
+			at.erase(as.insns[idx].position);
+
+		edit(block);
+
+		if (block.empty()) {
+			fprintf(stderr, "MlAsm internal error: Removed all compute code at %d.\n", 4*blk.first);
+			exit(1);
+		}
+
+		for (int i = 0; i < int(block.size()); i++) {
+			as.insns[block[i]].position = 4*(blk.first + i);
+			at[4*(blk.first + i)] = block[i];
+		}
+
+		if (int(block.size()) == blk.len)
+			continue;
+
+		for (int cl : blk.cls)
+			setField(cl, FIELD_MADDR, block.size() - 1);
+		for (int ex : blk.execs)
+			setField(ex, FIELD_MADDR, block.size());
+	}
+}
+
+// Sparsity: pruned networks have coefficient words that are zero in both
+// banks, and a MACC or MMAX that only reads such words does not change the
+// accumulators. The sequencer is followed from the entry point with the
+// value of CBP and the main memory words that code and coefficient memory
+// were loaded from, like in the static analysis, and each MACC/MMAX that
+// reads zero coefficients every time it runs is removed:
+//
+// - from sequencer code, and
+// - from compute code loaded by LoadCode, see editBlocks().
+//
+// A MACCZ/MMAXZ with zero coefficients only resets the accumulators. It is
+// removed when the next instruction that uses the accumulators in the same
+// block sets them anyway (LdSet, MACCZ, ...), or when that instruction is a
+// MACC/MMAX that becomes a MACCZ/MMAXZ instead.
+//
+// Afterwards coefficient memory entries that no remaining MACC reads are
+// trimmed from the start and end of LoadCoeff0/LoadCoeff1 bursts, and
+// bursts that only load such entries are removed from sequencer code.
+// Coefficient data in .input/.output tensors is never considered zero, the
+// program must not overwrite the coefficient data it loads.
+bool MlAsm::opt_state_t::zeroCoeffs(int addr) const
+{
+	if (addr < 0 || addr % 4 != 0 || addr/4 + 1 >= int(as.data.size()))
+		return false;
+
+	for (int k = addr/4; k < addr/4 + 2; k++)
+		if (!as.data_valid[k] || as.data[k] != 0 || tensor_word[k])
+			return false;
+
+	// written by the program before it is loaded
+	for (int b = addr; b < addr + 8; b++)
+		if (b >= as.arch.mem_size || mem_stored[b])
+			return false;
+
+	return true;
+}
+
+// A compute instruction run by the sequencer or by Execute, from the given
+// main memory word (-1 = unknown).
+void MlAsm::opt_state_t::zeroCompute(int word)
+{
+	auto it = word >= 0 ? at.find(4*word) : at.end();
+	int idx = it != at.end() ? it->second : -1;
+	int opcode = -1, caddr = 0;
+
+	if (idx >= 0) {
+		opcode = as.insns[idx].opcode;
+		caddr = as.insns[idx].caddr;
+	} else if (word >= 0 && word < int(as.data.size()) && as.data_valid[word]) {
+		opcode = as.arch.insn_op(as.data[word]);
+		caddr = as.arch.insn_caddr(as.data[word]);
+	}
+
+	const MlIsa::op_t &op = ml_isa_op(opcode);
+	const int caddr_mask = as.arch.caddr_mask();
+	const int size = as.arch.coeff_size;
+
+	if (!op.compute()) {
+		cbp = -1;
+		coeff_read_all = true;
+		return;
+	}
+
+	if (op.kind == MlIsa::KIND_SETBP && op.reg == MlIsa::REG_CBP) {
+		if ((op.flags & MlIsa::FLAG_ADD) == 0)
+			cbp = caddr & caddr_mask;
+		else if (cbp >= 0)
+			cbp = (cbp + caddr) & caddr_mask;
+		return;
+	}
+
+	if (op.kind != MlIsa::KIND_MACC)
+		return;
+
+	int entry = cbp < 0 ? -1 : (cbp + caddr) & caddr_mask;
+
+	if (idx >= 0)
+		macc_seen[idx] = true;
+
+	if (entry < 0 || entry >= size) {
+		coeff_read_all = true;
+		if (idx >= 0)
+			macc_needed[idx] = true;
+		return;
+	}
+
+	for (int bank = 0; bank < 2; bank++) {
+		coeff_readers[bank*size + entry].insert(idx);
+		if (idx >= 0 && !zeroCoeffs(coeff_src[bank*size + entry]))
+			macc_needed[idx] = true;
+	}
+}
+
+bool MlAsm::opt_state_t::zeroWalk(int addr, int depth)
+{
+	// a subroutine does the same for the same address and state
+	auto key = std::make_tuple(addr, cbp, code_gen, coeff_gen);
+	auto memo = zero_subs.find(key);
+
+	if (memo != zero_subs.end()) {
+		const zero_sub_t &sub = memo->second;
+		cbp = sub.cbp;
+		if (sub.code_gen != code_gen) {
+			code_gen = sub.code_gen;
+			code_src = sub.code_src;
+		}
+		if (sub.coeff_gen != coeff_gen) {
+			coeff_gen = sub.coeff_gen;
+			coeff_src = sub.coeff_src;
+		}
+		return true;
+	}
+
+	if (depth > as.arch.callstack_size)
+		return false;
+
+	while (1)
+	{
+		auto it = at.find(addr);
+		if (it == at.end())
+			break;
+
+		int idx = it->second;
+		const insn_t &insn = as.insns[idx];
+		const MlIsa::op_t &op = ml_isa_op(insn.opcode);
+		seq_run[addr/4] = true;
+
+		if (op.kind == MlIsa::KIND_RETURN || op.kind == MlIsa::KIND_CONTLOAD)
+			break;
+
+		if (op.kind == MlIsa::KIND_CALL)
+		{
+			if (!zeroWalk(insn.maddr & maddr_mask, depth+1))
+				return false;
+		}
+		else if (op.kind == MlIsa::KIND_EXECUTE)
+		{
+			int len = insn.maddr & maddr_mask;
+			int first = insn.caddr < as.arch.code_size ? code_src[insn.caddr] : -1;
+			bool consecutive = first >= 0;
+
+			for (int i = insn.caddr; i < insn.caddr + len; i++) {
+				int src = i < as.arch.code_size ? code_src[i] : -1;
+				consecutive = consecutive && src == first + 4*(i - insn.caddr);
+				zeroCompute(src < 0 ? -1 : src/4);
+			}
+
+			exec_sites.insert(std::make_tuple(idx, consecutive ? first/4 : -1, len));
+			if (!consecutive)
+				for (int i = insn.caddr; i < insn.caddr + len && i < as.arch.code_size; i++)
+					if (code_src[i] >= 0 && code_src[i]/4 < int(partial_exec.size()))
+						partial_exec[code_src[i]/4] = true;
+		}
+		else if (op.kind == MlIsa::KIND_LOAD)
+		{
+			int len = 1, cl = -1;
+			auto next = at.find(addr+4);
+			if (next != at.end() && as.insns[next->second].opcode == 7) {
+				cl = next->second;
+				len += as.insns[cl].maddr & maddr_mask;
+				addr += 4;
+				seq_run[addr/4] = true;
+			}
+
+			int start = insn.maddr & maddr_mask;
+			bool changed = false;
+
+			if (op.lanes == 0) {
+				for (int i = 0; i < len && insn.caddr + i < as.arch.code_size; i++) {
+					changed = changed || code_src[insn.caddr + i] != start + 4*i;
+					code_src[insn.caddr + i] = start + 4*i;
+				}
+				if (changed)
+					code_gen = num_gens++;
+				code_sites.insert(std::make_tuple(idx, cl, start/4, len));
+			} else {
+				int base = (op.lanes - 1) * as.arch.coeff_size;
+				for (int i = 0; i < len && insn.caddr + i < as.arch.coeff_size; i++) {
+					changed = changed || coeff_src[base + insn.caddr + i] != start + 8*i;
+					coeff_src[base + insn.caddr + i] = start + 8*i;
+				}
+				if (changed)
+					coeff_gen = num_gens++;
+				for (int k = start/4; k < start/4 + 2*len && k < int(coeff_word.size()); k++)
+					coeff_word[k] = true;
+			}
+		}
+		else if (op.compute())
+		{
+			zeroCompute(addr/4);
+		}
+
+		addr += 4;
+	}
+
+	zero_sub_t sub;
+	sub.cbp = cbp;
+	sub.code_gen = code_gen;
+	sub.coeff_gen = coeff_gen;
+	if (code_gen != std::get<2>(key))
+		sub.code_src = code_src;
+	if (coeff_gen != std::get<3>(key))
+		sub.coeff_src = coeff_src;
+	zero_subs[key] = sub;
+	return true;
+}
+
+// Remove the MACCs with zero coefficients from a block of straight-line
+// code, seq is set for sequencer code (where labels may be entry points).
+bool MlAsm::opt_state_t::zeroBlock(std::vector<int> &block, bool seq)
+{
+	bool changed = false;
+
+	auto zero = [&](int idx) {
+		return macc_seen[idx] && !macc_needed[idx];
+	};
+
+	auto remove = [&](int i) {
+		for (int j = i+1; seq && j < int(block.size()); j++)
+			if (as.insns[block[j]].opcode >= 0) {
+				moveAnchors(block[i], block[j]);
+				break;
+			}
+		killInsn(block[i]);
+		zero_maccs++;
+		changed = true;
+	};
+
+	for (int i = 0; i < int(block.size()); i++) {
+		const MlIsa::op_t &op = ml_isa_op(as.insns[block[i]].opcode);
+		if (op.kind == MlIsa::KIND_MACC && (op.flags & (MlIsa::FLAG_ZERO | MlIsa::FLAG_NEG)) == 0 && zero(block[i]))
+			remove(i);
+	}
+
+	for (int i = 0; i < int(block.size()); i++)
+	{
+		const MlIsa::op_t &op = ml_isa_op(as.insns[block[i]].opcode);
+		if (op.kind != MlIsa::KIND_MACC || (op.flags & MlIsa::FLAG_ZERO) == 0 || !zero(block[i]))
+			continue;
+
+		int j = i+1;
+		for (; j < int(block.size()); j++) {
+			if (seq && anchors.count(block[j]))
+				break;
+			int opcode = as.insns[block[j]].opcode;
+			const MlIsa::op_t &o = ml_isa_op(opcode);
+			if (opcode >= 0 && o.kind != MlIsa::KIND_SETBP && o.kind != MlIsa::KIND_SYNC)
+				break;
+		}
+
+		if (j == int(block.size()) || (seq && anchors.count(block[j])))
+			continue;
+
+		insn_t &next = as.insns[block[j]];
+		const MlIsa::op_t &o = ml_isa_op(next.opcode);
+
+		if (o.kind == MlIsa::KIND_MACC && (o.flags & (MlIsa::FLAG_ZERO | MlIsa::FLAG_NEG)) == 0) {
+			next.opcode += 2;  // MACC -> MACCZ, MMAX -> MMAXZ
+			zero_converted++;
+		} else if (o.kind != MlIsa::KIND_MACC && !(o.kind == MlIsa::KIND_LDACC &&
+				(o.flags & MlIsa::FLAG_ADD) == 0 && o.lanes == 3)) {
+			continue;
+		}
+
+		remove(i);
+	}
+
+	std::vector<int> live;
+	for (int idx : block)
+		if (as.insns[idx].opcode >= 0)
+			live.push_back(idx);
+	block.swap(live);
+	return changed;
+}
+
+void MlAsm::opt_state_t::sparsity()
+{
+	const int size = as.arch.coeff_size;
+	int num_insns = as.insns.size();
+
+	// the bytes the program writes (mem_stored), the coefficients it loads
+	// from them are not known
+	flowReset();
+	if (!flowWalk(entry_addr, 0)) {
+		if (as.verbose)
+			printf("not removing MACCs with zero coefficients, the program can not be followed.\n");
+		return;
+	}
+
+	code_src.assign(as.arch.code_size, -1);
+	coeff_src.assign(2*size, -1);
+	coeff_readers.resize(2*size);
+	macc_seen.resize(num_insns);
+	macc_needed.resize(num_insns);
+	code_sites.clear();
+	exec_sites.clear();
+	partial_exec.assign(as.data.size(), false);
+	seq_run.assign(as.data.size(), false);
+	coeff_word.assign(as.data.size(), false);
+	tensor_word.resize(as.data.size());
+
+	for (auto &t : as.tensors)
+	{
+		char *endptr = nullptr;
+		int addr = strtol(t.addr_sym.c_str(), &endptr, 0);
+
+		if (!endptr || *endptr) {
+			int idx = as.findSymbol(t.addr_sym);
+			addr = idx < 0 ? 0 : as.symbols[idx].position;
+		}
+
+		int bytes = 1;
+		for (int dim : t.shape)
+			bytes *= dim;
+
+		for (int k = std::max(addr/4, 0); k < (addr + bytes + 3)/4 && k < int(tensor_word.size()); k++)
+			tensor_word[k] = true;
+	}
+
+	if (!zeroWalk(entry_addr, 0))
+		return;
+
+	for (auto &seg : segments)
+		zeroBlock(seg.chunks[0], true);
+
+	// compute code loaded by LoadCode, at least one instruction stays
+	editBlocks([&](std::vector<int> &block) {
+		int num_zero = 0;
+		for (int idx : block)
+			num_zero += macc_seen[idx] && !macc_needed[idx];
+		if (num_zero < int(block.size()))
+			zeroBlock(block, false);
+	});
+
+	// coefficient loads
+	auto unused = [&](int bank, int entry) {
+		if (coeff_read_all || entry >= size)
+			return false;
+		for (int r : coeff_readers[bank*size + entry])
+			if (r < 0 || as.insns[r].opcode >= 0)
+				return false;
+		return true;
+	};
+
+	auto load_len = [&](int idx, int &cl) {
+		auto next = at.find(as.insns[idx].position + 4);
+		cl = next != at.end() && as.insns[next->second].opcode == 7 ? next->second : -1;
+		return 1 + (cl >= 0 ? as.insns[cl].maddr & maddr_mask : 0);
+	};
+
+	for (auto &seg : segments)
+	{
+		auto &chunk = seg.chunks[0];
+
+		for (int i = 0; i < int(chunk.size()); i++)
+		{
+			int idx = chunk[i], cl;
+			const insn_t &insn = as.insns[idx];
+			if ((insn.opcode != 5 && insn.opcode != 6) || !fixedInsn(idx))
+				continue;
+
+			int len = load_len(idx, cl);
+			int n = cl >= 0 ? 2 : 1;
+			bool whole = i+n < int(chunk.size()) && (cl < 0 || chunk[i+1] == cl);
+			for (int k = 0; whole && k < len; k++)
+				whole = unused(insn.opcode - 5, insn.caddr + k);
+
+			if (!whole)
+				continue;
+
+			for (int k = 0; k < n; k++) {
+				moveAnchors(chunk[i+k], chunk[i+n]);
+				killInsn(chunk[i+k]);
+			}
+			trimmed_words += len;
+			trimmed_loads++;
+			i += n-1;
+		}
+
+		std::vector<int> live;
+		for (int idx : chunk)
+			if (as.insns[idx].opcode >= 0)
+				live.push_back(idx);
+		chunk.swap(live);
+	}
+
+	for (auto &it : at)
+	{
+		int idx = it.second, cl;
+		const insn_t &insn = as.insns[idx];
+		if ((insn.opcode != 5 && insn.opcode != 6) || !seq_run[it.first/4] || !fixedInsn(idx))
+			continue;
+
+		int len = load_len(idx, cl);
+		if (cl >= 0 && !fixedInsn(cl))
+			continue;
+
+		int bank = insn.opcode - 5, head = 0, tail = 0;
+		while (head < len && unused(bank, insn.caddr + head))
+			head++;
+		while (head < len && tail < len-head && unused(bank, insn.caddr + len-1 - tail))
+			tail++;
+
+		if (head == len || head + tail == 0)
+			continue;
+
+		if (head > 0) {
+			setField(idx, FIELD_MADDR, insn.maddr + 8*head);
+			setField(idx, FIELD_CADDR, insn.caddr + head);
+		}
+		setField(cl, FIELD_MADDR, len - head - tail - 1);
+		trimmed_words += head + tail;
+		trimmed_loads++;
+	}
+
+	if (as.verbose)
+		printf("removed %d MACCs with zero coefficients (%d others now reset the accumulators), "
+				"trimmed %d coefficient words from %d loads.\n", zero_maccs, zero_converted,
+				trimmed_words, trimmed_loads);
+}
+
+// Dead stores and loads: the sequencer is followed from the entry point
+// like the simulator does, with the values of the base pointers, so that
+// each Store/Save and each main memory read has an effective address. A
+// Store/Save is dead when every byte it writes is overwritten before it is
+// read (by MACC, LdSet/LdAdd, LoadCode/LoadCoeff*, the sequencer itself)
+// or only read by dead LdSets. An LdSet is dead when its accumulators are
+// set again (LdSet, MACCZ, MMAXZ, MMAXN) before anything uses them.
+// Everything left in main memory at the end is live, the accumulators and
+// the contents of code and coefficient memory are not.
+//
+// Dead instructions are removed from sequencer code and from compute code
+// loaded by LoadCode (see editBlocks()). Loads whose last words are never
+// run or read by a MACC before they are overwritten get a shorter
+// ContinueLoad, and loads in sequencer code that load nothing that is used
+// are removed.
+//
+// This follows every instruction the program runs, so it gives up (as it
+// does for base pointers or code memory it does not know) for programs
+// that run more than FLOW_MAX_STEPS instructions.
+bool MlAsm::opt_state_t::flowRead(int addr, int len, int ldset)
+{
+	if (addr < 0 || addr + len > as.arch.mem_size)
+		return false;
+
+	for (int b = addr; b < addr + len; b++) {
+		int w = mem_writer[b];
+		if (w < 0)
+			continue;
+		if (ldset >= 0)
+			store_ldsets[w].insert(ldset);
+		else
+			store_needed[w] = true;
+	}
+
+	return true;
+}
+
+bool MlAsm::opt_state_t::flowWrite(int addr, int len, int store)
+{
+	if (addr < 0 || addr + len > as.arch.mem_size)
+		return false;
+
+	for (int b = addr; b < addr + len; b++) {
+		mem_writer[b] = store;
+		mem_stored[b] = true;
+	}
+
+	return true;
+}
+
+// A code or coefficient memory entry is read.
+void MlAsm::opt_state_t::flowUse(int entry)
+{
+	int l = entry_load[entry];
+	if (l >= 0)
+		load_used[l] = std::max(load_used[l], entry_offset[entry] + 1);
+}
+
+// The accumulators are read.
+void MlAsm::opt_state_t::flowAcc(int lanes)
+{
+	for (int lane = 0; lane < 2; lane++)
+		if (((lanes >> lane) & 1) != 0 && acc_def[lane] >= 0)
+			ldset_needed[acc_def[lane]] = true;
+}
+
+bool MlAsm::opt_state_t::flowCompute(int word)
+{
+	auto it = word >= 0 ? at.find(4*word) : at.end();
+	int idx = -1, opcode = -1, maddr = 0, caddr = 0;
+
+	if (it != at.end() && as.insns[it->second].opcode >= 0) {
+		idx = it->second;
+		opcode = as.insns[idx].opcode;
+		maddr = as.insns[idx].maddr;
+		caddr = as.insns[idx].caddr;
+	} else if (word >= 0 && word < int(as.data.size()) && as.data_valid[word]) {
+		opcode = as.arch.insn_op(as.data[word]);
+		maddr = as.arch.insn_maddr(as.data[word]);
+		caddr = as.arch.insn_caddr(as.data[word]);
+	}
+
+	const MlIsa::op_t &op = ml_isa_op(opcode);
+	const int caddr_mask = as.arch.caddr_mask();
+
+	if (!op.compute() || ++flow_steps > FLOW_MAX_STEPS)
+		return false;
+
+	if (idx >= 0)
+		runs[idx]++;
+
+	if (op.kind == MlIsa::KIND_SETBP)
+	{
+		int r = op.reg;
+		int mask = r == MlIsa::REG_CBP ? caddr_mask : maddr_mask;
+		int value = (r == MlIsa::REG_CBP ? caddr : maddr) & mask;
+
+		if ((op.flags & MlIsa::FLAG_ADD) == 0)
+			flow_bp[r] = value;
+		else if (flow_bp[r] >= 0)
+			flow_bp[r] = (flow_bp[r] + value) & mask;
+		return true;
+	}
+
+	if (op.kind == MlIsa::KIND_STORE || op.kind == MlIsa::KIND_SAVE)
+	{
+		if (flow_bp[MlIsa::REG_SBP] < 0)
+			return false;
+
+		int addr = (flow_bp[MlIsa::REG_SBP] + maddr) & maddr_mask;
+		int width = op.kind == MlIsa::KIND_STORE ? 1 : 4;
+		flowAcc(op.lanes);
+
+		for (int lane = 0; lane < 2; lane++)
+			if (((op.lanes >> lane) & 1) != 0 && !flowWrite(addr + lane*width, width, idx >= 0 ? idx : -2))
+				return false;
+		return true;
+	}
+
+	if (op.kind == MlIsa::KIND_LDACC)
+	{
+		if (flow_bp[MlIsa::REG_LBP] < 0)
+			return false;
+
+		int addr = (flow_bp[MlIsa::REG_LBP] + maddr) & maddr_mask;
+		bool set = (op.flags & MlIsa::FLAG_ADD) == 0;
+
+		for (int lane = 0; lane < 2; lane++)
+			if (((op.lanes >> lane) & 1) != 0 && !flowRead(addr + 4*lane, 4, set ? idx : -1))
+				return false;
+
+		if (!set)
+			flowAcc(op.lanes);
+
+		for (int lane = 0; lane < 2; lane++)
+			if (((op.lanes >> lane) & 1) != 0)
+				acc_def[lane] = set ? idx : -1;
+		return true;
+	}
+
+	if (op.kind == MlIsa::KIND_MACC)
+	{
+		if (flow_bp[MlIsa::REG_VBP] < 0 || flow_bp[MlIsa::REG_CBP] < 0)
+			return false;
+
+		int addr = (flow_bp[MlIsa::REG_VBP] + maddr) & maddr_mask;
+		int entry = (flow_bp[MlIsa::REG_CBP] + caddr) & caddr_mask;
+
+		if (!flowRead(addr, 8, -1) || entry >= as.arch.coeff_size)
+			return false;
+
+		flowUse(as.arch.code_size + entry);
+		flowUse(as.arch.code_size + as.arch.coeff_size + entry);
+
+		if ((op.flags & (MlIsa::FLAG_ZERO | MlIsa::FLAG_NEG)) == 0)
+			flowAcc(3);
+
+		acc_def[0] = acc_def[1] = -1;
+		return true;
+	}
+
+	return true;
+}
+
+bool MlAsm::opt_state_t::flowWalk(int addr, int depth)
+{
+	if (depth > as.arch.callstack_size)
+		return false;
+
+	while (1)
+	{
+		auto it = at.find(addr);
+		if (it == at.end())
+			return false;
+
+		// removed by an earlier pass
+		int idx = it->second;
+		const insn_t &insn = as.insns[idx];
+		if (insn.opcode < 0) {
+			addr += 4;
+			continue;
+		}
+
+		const MlIsa::op_t &op = ml_isa_op(insn.opcode);
+		seq_run[addr/4] = true;
+
+		if (++flow_steps > FLOW_MAX_STEPS || !flowRead(addr, 4, -1))
+			return false;
+
+		if (op.kind == MlIsa::KIND_RETURN)
+			return true;
+
+		if (op.kind == MlIsa::KIND_CONTLOAD)
+			return false;
+
+		if (op.kind == MlIsa::KIND_CALL)
+		{
+			if (!flowWalk(insn.maddr & maddr_mask, depth+1))
+				return false;
+		}
+		else if (op.kind == MlIsa::KIND_EXECUTE)
+		{
+			int len = insn.maddr & maddr_mask;
+			int first = insn.caddr < as.arch.code_size ? code_src[insn.caddr] : -1;
+			bool consecutive = first >= 0;
+
+			for (int i = insn.caddr; i < insn.caddr + len; i++) {
+				if (i >= as.arch.code_size || code_src[i] < 0)
+					return false;
+				consecutive = consecutive && code_src[i] == first + 4*(i - insn.caddr);
+				flowUse(i);
+				if (!flowCompute(code_src[i]/4))
+					return false;
+			}
+
+			exec_sites.insert(std::make_tuple(idx, consecutive ? first/4 : -1, len));
+			if (!consecutive)
+				for (int i = insn.caddr; i < insn.caddr + len; i++)
+					partial_exec[code_src[i]/4] = true;
+		}
+		else if (op.kind == MlIsa::KIND_LOAD)
+		{
+			int len = 1, cl = -1;
+			auto next = at.find(addr+4);
+			if (next != at.end() && as.insns[next->second].opcode == 7) {
+				cl = next->second;
+				len += as.insns[cl].maddr & maddr_mask;
+			}
+
+			int start = insn.maddr & maddr_mask;
+			int width = op.lanes == 0 ? 4 : 8;
+			int size = op.lanes == 0 ? as.arch.code_size : as.arch.coeff_size;
+			int base = op.lanes == 0 ? 0 : as.arch.code_size + (op.lanes - 1) * as.arch.coeff_size;
+
+			for (int i = 0; i < len; i++) {
+				if (insn.caddr + i >= size || !flowRead(start + width*i, width, -1))
+					return false;
+				entry_load[base + insn.caddr + i] = idx;
+				entry_offset[base + insn.caddr + i] = i;
+				if (op.lanes == 0)
+					code_src[insn.caddr + i] = start + 4*i;
+			}
+
+			if (op.lanes == 0)
+				code_sites.insert(std::make_tuple(idx, cl, start/4, len));
+			else
+				for (int k = start/4; k < (start + 8*len)/4; k++)
+					coeff_word[k] = true;
+
+			if (cl >= 0) {
+				addr += 4;
+				seq_run[addr/4] = true;
+				if (!flowRead(addr, 4, -1))
+					return false;
+			}
+		}
+		else if (op.compute())
+		{
+			if (!flowCompute(addr/4))
+				return false;
+		}
+
+		addr += 4;
+	}
+}
+
+void MlAsm::opt_state_t::flowReset()
+{
+	int num_insns = as.insns.size();
+	int num_entries = as.arch.code_size + 2*as.arch.coeff_size;
+
+	for (int r = 0; r < 4; r++)
+		flow_bp[r] = -1;
+	acc_def[0] = acc_def[1] = -1;
+	flow_steps = 0;
+
+	code_src.assign(as.arch.code_size, -1);
+	entry_load.assign(num_entries, -1);
+	entry_offset.assign(num_entries, 0);
+	mem_writer.assign(as.arch.mem_size, -1);
+	mem_stored.assign(as.arch.mem_size, false);
+	load_used.assign(num_insns, 0);
+	runs.assign(num_insns, 0);
+	store_needed.assign(num_insns, false);
+	ldset_needed.assign(num_insns, false);
+
+	code_sites.clear();
+	exec_sites.clear();
+	partial_exec.assign(as.data.size(), false);
+	seq_run.assign(as.data.size(), false);
+	coeff_word.assign(as.data.size(), false);
+	store_ldsets.clear();
+}
+
+void MlAsm::opt_state_t::dataflow()
+{
+	int num_insns = as.insns.size();
+
+	flowReset();
+	if (!flowWalk(entry_addr, 0)) {
+		if (as.verbose)
+			printf("not removing dead stores and loads, the program can not be followed.\n");
+		return;
+	}
+
+	flow_done = true;
+
+	for (int w : mem_writer)
+		if (w >= 0)
+			store_needed[w] = true;
+
+	std::vector<bool> dead(num_insns);
+
+	for (int i = 0; i < num_insns; i++) {
+		const MlIsa::op_t &op = ml_isa_op(as.insns[i].opcode);
+		if (runs[i] > 0 && op.kind == MlIsa::KIND_LDACC && (op.flags & MlIsa::FLAG_ADD) == 0)
+			dead[i] = !ldset_needed[i];
+	}
+
+	for (int i = 0; i < num_insns; i++) {
+		const MlIsa::op_t &op = ml_isa_op(as.insns[i].opcode);
+		if (runs[i] == 0 || (op.kind != MlIsa::KIND_STORE && op.kind != MlIsa::KIND_SAVE))
+			continue;
+		bool needed = store_needed[i];
+		auto it = store_ldsets.find(i);
+		if (it != store_ldsets.end())
+			for (int r : it->second)
+				needed = needed || !dead[r];
+		dead[i] = !needed;
+	}
+
+	auto remove_dead = [&](std::vector<int> &block, bool seq) {
+		std::vector<int> live;
+		for (int i = 0; i < int(block.size()); i++) {
+			int idx = block[i];
+			if (!dead[idx]) {
+				live.push_back(idx);
+				continue;
+			}
+			for (int j = i+1; seq && j < int(block.size()); j++)
+				if (!dead[block[j]]) {
+					moveAnchors(idx, block[j]);
+					break;
+				}
+			if (ml_isa_op(as.insns[idx].opcode).kind == MlIsa::KIND_LDACC)
+				dead_loads++;
+			else
+				dead_stores++;
+			dead_runs += runs[idx];
+			killInsn(idx);
+		}
+		block.swap(live);
+	};
+
+	for (auto &seg : segments)
+		remove_dead(seg.chunks[0], true);
+
+	editBlocks([&](std::vector<int> &block) {
+		int num_dead = 0;
+		for (int idx : block)
+			num_dead += dead[idx];
+		if (num_dead < int(block.size()))
+			remove_dead(block, false);
+	});
+
+	// loads of words that are not used
+	for (auto &seg : segments)
+	{
+		auto &chunk = seg.chunks[0];
+		std::vector<int> live;
+
+		for (int i = 0; i < int(chunk.size()); i++)
+		{
+			int idx = chunk[i];
+			const MlIsa::op_t &op = ml_isa_op(as.insns[idx].opcode);
+			int n = i+1 < int(chunk.size()) && as.insns[chunk[i+1]].opcode == 7 ? 2 : 1;
+
+			if (op.kind != MlIsa::KIND_LOAD || load_used[idx] > 0 || !seq_run[as.insns[idx].position/4] ||
+					i+n >= int(chunk.size())) {
+				live.push_back(idx);
+				continue;
+			}
+
+			dead_words += 1 + (n == 2 ? as.insns[chunk[i+1]].maddr & maddr_mask : 0);
+			dead_bursts++;
+			for (int k = 0; k < n; k++) {
+				moveAnchors(chunk[i+k], chunk[i+n]);
+				killInsn(chunk[i+k]);
+			}
+			i += n-1;
+		}
+
+		chunk.swap(live);
+	}
+
+	for (auto &it : at)
+	{
+		int idx = it.second;
+		const insn_t &insn = as.insns[idx];
+		if (ml_isa_op(insn.opcode).kind != MlIsa::KIND_LOAD || !seq_run[it.first/4])
+			continue;
+
+		auto next = at.find(it.first + 4);
+		if (next == at.end() || as.insns[next->second].opcode != 7 || !fixedInsn(next->second))
+			continue;
+
+		int len = 1 + (as.insns[next->second].maddr & maddr_mask);
+		int used = std::max(load_used[idx], 1);
+		if (used < len) {
+			setField(next->second, FIELD_MADDR, used - 1);
+			dead_words += len - used;
+			dead_bursts++;
+		}
+	}
+
+	if (as.verbose)
+		printf("removed %d dead stores and %d dead loads (%lld instructions per run), "
+				"trimmed %d words from %d load bursts.\n", dead_stores, dead_loads, dead_runs,
+				dead_words, dead_bursts);
+}
+
+// Kernel deduplication: generators often emit one copy of a compute kernel
+// per output tile or channel group, each loaded by its own LoadCode, that
+// only differ in the main memory and coefficient addresses. Of two blocks
+// that are loaded and run as a whole (see findBlocks()) and differ by a
+// constant offset for each base pointer, the second one is not loaded
+// anymore and its Executes run the first one with shifted base pointers:
+//
+//   AddVBP dv; AddSBP ds; Execute <first block>; AddVBP -dv; AddSBP -ds
+//
+// The writes are folded into neighbouring base pointer writes where
+// possible, see rebaseChunk(). The program is followed again without the
+// dropped loads to make sure the first block is still in code memory at
+// every run of the rebased Executes, and a block is only rebased when all
+// its loads and Executes are in sequencer code that still fits its segment
+// afterwards.
+bool MlAsm::opt_state_t::rebaseMatch(const code_block_t &a, const code_block_t &b, rebase_t &rb) const
+{
+	const int caddr_mask = as.arch.caddr_mask();
+	bool known[4] = {false, false, false, false};
+	bool set[4] = {false, false, false, false};
+
+	if (a.len != b.len)
+		return false;
+
+	auto offset = [&](int r, int x, int y, int mask) {
+		int d = (y - x) & mask;
+		rb.uses[r] = true;
+		if (known[r] && rb.shift[r] != d)
+			return false;
+		known[r] = true;
+		rb.shift[r] = d;
+		return true;
+	};
+
+	for (int i = 0; i < a.len; i++)
+	{
+		const insn_t &x = as.insns[a.insns[i]];
+		const insn_t &y = as.insns[b.insns[i]];
+		const MlIsa::op_t &op = ml_isa_op(x.opcode);
+
+		if (x.opcode != y.opcode)
+			return false;
+
+		if (op.kind == MlIsa::KIND_SETBP) {
+			if (((x.maddr - y.maddr) & maddr_mask) != 0 || ((x.caddr - y.caddr) & caddr_mask) != 0)
+				return false;
+			rb.uses[op.reg] = true;
+			set[op.reg] = set[op.reg] || (op.flags & MlIsa::FLAG_ADD) == 0;
+			continue;
+		}
+
+		if (op.kind == MlIsa::KIND_MACC) {
+			if (!offset(MlIsa::REG_VBP, x.maddr, y.maddr, maddr_mask) ||
+					!offset(MlIsa::REG_CBP, x.caddr, y.caddr, caddr_mask))
+				return false;
+			continue;
+		}
+
+		int r = op.kind == MlIsa::KIND_STORE || op.kind == MlIsa::KIND_SAVE ? MlIsa::REG_SBP :
+				op.kind == MlIsa::KIND_LDACC ? MlIsa::REG_LBP : -1;
+
+		if (r < 0 ? ((x.maddr - y.maddr) & maddr_mask) != 0 : !offset(r, x.maddr, y.maddr, maddr_mask))
+			return false;
+		if (x.caddr != y.caddr)
+			return false;
+	}
+
+	for (int r = 0; r < 4; r++)
+		if (set[r] && rb.shift[r] != 0)
+			return false;
+
+	return true;
+}
+
+bool MlAsm::opt_state_t::rebaseWalk(int addr, int depth)
+{
+	if (depth > as.arch.callstack_size)
+		return false;
+
+	while (1)
+	{
+		auto it = at.find(addr);
+		if (it == at.end())
+			return true;
+
+		// removed by an earlier pass
+		int idx = it->second;
+		const insn_t &insn = as.insns[idx];
+		if (insn.opcode < 0) {
+			addr += 4;
+			continue;
+		}
+
+		const MlIsa::op_t &op = ml_isa_op(insn.opcode);
+		seq_run[addr/4] = true;
+
+		if (++flow_steps > FLOW_MAX_STEPS)
+			return false;
+
+		if (op.kind == MlIsa::KIND_RETURN || op.kind == MlIsa::KIND_CONTLOAD)
+			return true;
+
+		if (op.kind == MlIsa::KIND_CALL)
+		{
+			if (!rebaseWalk(insn.maddr & maddr_mask, depth+1))
+				return false;
+		}
+		else if (op.kind == MlIsa::KIND_EXECUTE && rebase_exec.count(idx))
+		{
+			const code_block_t &t = blocks[rebased[rebase_exec.at(idx)].target];
+			std::set<int> found;
+
+			for (int l : t.loads) {
+				int c = as.insns[l].caddr;
+				bool match = c + t.len <= as.arch.code_size;
+				for (int i = 0; match && i < t.len; i++)
+					match = code_src[c + i] == 4*(t.first + i);
+				if (match)
+					found.insert(c);
+			}
+
+			auto ins = rebase_caddr.emplace(idx, found);
+			if (!ins.second) {
+				std::set<int> both;
+				for (int c : ins.first->second)
+					if (found.count(c))
+						both.insert(c);
+				ins.first->second.swap(both);
+			}
+		}
+		else if (op.kind == MlIsa::KIND_EXECUTE)
+		{
+			int len = insn.maddr & maddr_mask;
+			int first = insn.caddr < as.arch.code_size ? code_src[insn.caddr] : -1;
+			bool consecutive = first >= 0;
+
+			for (int i = insn.caddr; i < insn.caddr + len; i++) {
+				int src = i < as.arch.code_size ? code_src[i] : -1;
+				consecutive = consecutive && src == first + 4*(i - insn.caddr);
+			}
+
+			exec_sites.insert(std::make_tuple(idx, consecutive ? first/4 : -1, len));
+			if (!consecutive)
+				for (int i = insn.caddr; i < insn.caddr + len && i < as.arch.code_size; i++)
+					if (code_src[i] >= 0 && code_src[i]/4 < int(partial_exec.size()))
+						partial_exec[code_src[i]/4] = true;
+		}
+		else if (op.kind == MlIsa::KIND_LOAD)
+		{
+			int len = 1, cl = -1;
+			auto next = at.find(addr+4);
+			if (next != at.end() && as.insns[next->second].opcode == 7) {
+				cl = next->second;
+				len += as.insns[cl].maddr & maddr_mask;
+				addr += 4;
+				seq_run[addr/4] = true;
+			}
+
+			int start = insn.maddr & maddr_mask;
+
+			if (rebase_skip.count(idx)) {
+				// dropped
+			} else if (op.lanes == 0) {
+				for (int i = 0; i < len && insn.caddr + i < as.arch.code_size; i++)
+					code_src[insn.caddr + i] = start + 4*i;
+				code_sites.insert(std::make_tuple(idx, cl, start/4, len));
+			} else {
+				for (int k = start/4; k < start/4 + 2*len && k < int(coeff_word.size()); k++)
+					coeff_word[k] = true;
+			}
+		}
+
+		addr += 4;
+	}
+}
+
+// Shift the base pointers for the rebased Executes in a chunk of sequencer
+// code, and drop the loads of rebased blocks. The shift of a base pointer is
+// 0 wherever anything but a rebased Execute may use it: compute instructions,
+// other Executes, Call, Return and labels. It changes at the last write of
+// the base pointer before the next use when that write has a known value
+// (SetXBP x becomes SetXBP x+d, an AddXBP that adds 0 is removed), or with
+// an AddXBP right before the use. Returns the size of the chunk afterwards,
+// the chunk is only changed when apply is set.
+int MlAsm::opt_state_t::rebaseChunk(std::vector<int> &chunk, bool apply)
+{
+	const int caddr_mask = as.arch.caddr_mask();
+	std::vector<int> code;
+	std::set<int> labels;
+	int size = 0;
+	int cur[4] = {0, 0, 0, 0}, slot[4] = {-1, -1, -1, -1}, slot_value[4] = {0, 0, 0, 0};
+	bool slot_add[4] = {false, false, false, false};
+
+	for (int idx : chunk)
+		if (anchors.count(idx))
+			labels.insert(idx);
+
+	auto mask = [&](int r) {
+		return r == MlIsa::REG_CBP ? caddr_mask : maddr_mask;
+	};
+
+	auto shift = [&](int r, int value, int i, bool label) {
+		if (cur[r] == value)
+			return;
+
+		int delta = (value - cur[r]) & mask(r);
+		field_t field = r == MlIsa::REG_CBP ? FIELD_CADDR : FIELD_MADDR;
+		cur[r] = value;
+
+		if (slot[r] >= 0) {
+			slot_value[r] = (slot_value[r] + delta) & mask(r);
+			if (slot_add[r] && slot_value[r] == 0 && !labels.count(slot[r])) {
+				if (apply)
+					killInsn(slot[r]);
+				slot[r] = -1;
+				size--;
+			} else if (apply) {
+				setField(slot[r], field, slot_value[r]);
+			}
+			return;
+		}
+
+		size++;
+		if (apply) {
+			int n = addInsn(9 + 2*r, field == FIELD_MADDR ? delta : 0, field == FIELD_CADDR ? delta : 0,
+					as.insns[chunk[i]].linenr);
+			if (label)
+				moveAnchors(chunk[i], n);
+			code.push_back(n);
+			rebased_writes++;
+		}
+	};
+
+	for (int i = 0; i < int(chunk.size()); i++)
+	{
+		int idx = chunk[i];
+		const insn_t &insn = as.insns[idx];
+		const MlIsa::op_t &op = ml_isa_op(insn.opcode);
+		bool label = labels.count(idx) != 0;
+
+		// the code might be entered here with the base pointers not shifted
+		if (label)
+			for (int r = 0; r < 4; r++) {
+				shift(r, 0, i, false);
+				slot[r] = -1;
+			}
+
+		if (rebase_skip.count(idx)) {
+			int j = i+1;
+			while (j < int(chunk.size()) && rebase_skip.count(chunk[j]))
+				j++;
+			if (label && j < int(chunk.size())) {
+				labels.insert(chunk[j]);
+				if (apply)
+					moveAnchors(idx, chunk[j]);
+			}
+			if (apply)
+				killInsn(idx);
+			continue;
+		}
+
+		bool uses[4] = {false, false, false, false};
+		int value[4] = {0, 0, 0, 0};
+
+		if (rebase_exec.count(idx)) {
+			const rebase_t &rb = rebased[rebase_exec.at(idx)];
+			for (int r = 0; r < 4; r++) {
+				uses[r] = rb.uses[r];
+				value[r] = rb.shift[r];
+			}
+		} else if (op.kind == MlIsa::KIND_CALL || op.kind == MlIsa::KIND_RETURN || op.kind == MlIsa::KIND_EXECUTE) {
+			uses[0] = uses[1] = uses[2] = uses[3] = true;
+		} else if (op.kind == MlIsa::KIND_MACC) {
+			uses[MlIsa::REG_VBP] = uses[MlIsa::REG_CBP] = true;
+		} else if (op.kind == MlIsa::KIND_STORE || op.kind == MlIsa::KIND_SAVE) {
+			uses[MlIsa::REG_SBP] = true;
+		} else if (op.kind == MlIsa::KIND_LDACC) {
+			uses[MlIsa::REG_LBP] = true;
+		}
+
+		for (int r = 0; r < 4; r++)
+			if (uses[r]) {
+				shift(r, value[r], i, label);
+				slot[r] = -1;
+			}
+
+		if (op.kind == MlIsa::KIND_SETBP)
+		{
+			int r = op.reg;
+			bool add = (op.flags & MlIsa::FLAG_ADD) != 0;
+
+			if (!add) {
+				cur[r] = 0;
+				slot[r] = -1;
+			}
+
+			if (fixedInsn(idx)) {
+				slot[r] = idx;
+				slot_add[r] = add;
+				slot_value[r] = (r == MlIsa::REG_CBP ? insn.caddr : insn.maddr) & mask(r);
+			}
+		}
+
+		size++;
+		if (apply)
+			code.push_back(idx);
+	}
+
+	if (apply) {
+		std::vector<int> live;
+		for (int idx : code)
+			if (as.insns[idx].opcode >= 0)
+				live.push_back(idx);
+		chunk.swap(live);
+	}
+
+	return size;
+}
+
+void MlAsm::opt_state_t::rebase()
+{
+	auto walk = [&]() {
+		code_src.assign(as.arch.code_size, -1);
+		code_sites.clear();
+		exec_sites.clear();
+		partial_exec.assign(as.data.size(), false);
+		seq_run.assign(as.data.size(), false);
+		coeff_word.assign(as.data.size(), false);
+		rebase_caddr.clear();
+		flow_steps = 0;
+		return rebaseWalk(entry_addr, 0);
+	};
+
+	if (!walk()) {
+		if (as.verbose)
+			printf("not deduplicating compute blocks, the program can not be followed.\n");
+		return;
+	}
+
+	blocks = findBlocks();
+
+	std::map<int, int> insn_seg;
+	for (int s = 0; s < int(segments.size()); s++)
+		for (auto &chunk : segments[s].chunks)
+			for (int idx : chunk)
+				insn_seg[idx] = s;
+
+	// Each block is compared with the blocks that are not rebased before it.
+	std::vector<int> targets;
+	for (int j = 0; j < int(blocks.size()); j++)
+	{
+		const code_block_t &b = blocks[j];
+		bool fixed = true, editable = true;
+
+		for (int idx : b.insns)
+			fixed = fixed && fixedInsn(idx);
+		for (auto list : {&b.loads, &b.cls, &b.execs})
+			for (int idx : *list)
+				editable = editable && insn_seg.count(idx);
+
+		if (!fixed)
+			continue;
+
+		bool matched = false;
+		for (int t = 0; editable && !matched && t < int(targets.size()); t++) {
+			rebase_t rb;
+			if (rebaseMatch(blocks[targets[t]], b, rb)) {
+				rb.block = j;
+				rb.target = targets[t];
+				rebased.push_back(rb);
+				matched = true;
+			}
+		}
+
+		if (!matched)
+			targets.push_back(j);
+	}
+
+	// Drop rebased blocks until all rebased Executes find the block they
+	// run and all segments fit.
+	while (!rebased.empty())
+	{
+		rebase_exec.clear();
+		rebase_skip.clear();
+		for (int k = 0; k < int(rebased.size()); k++) {
+			const code_block_t &b = blocks[rebased[k].block];
+			for (int e : b.execs)
+				rebase_exec[e] = k;
+			rebase_skip.insert(b.loads.begin(), b.loads.end());
+			rebase_skip.insert(b.cls.begin(), b.cls.end());
+		}
+
+		if (!walk()) {
+			rebased.clear();
+			break;
+		}
+
+		int bad = -1;
+		for (int k = 0; k < int(rebased.size()); k++)
+			for (int e : blocks[rebased[k].block].execs)
+				if (!rebase_caddr.count(e) || rebase_caddr.at(e).empty())
+					bad = k;
+
+		for (int s = 0; bad < 0 && s < int(segments.size()); s++) {
+			int size = 0;
+			for (auto &chunk : segments[s].chunks)
+				size += rebaseChunk(chunk, false);
+			if (size <= (segments[s].limit - segments[s].start) / 4)
+				continue;
+			for (int k = 0; k < int(rebased.size()); k++)
+				for (int e : blocks[rebased[k].block].execs)
+					if (insn_seg.at(e) == s)
+						bad = k;
+		}
+
+		if (bad < 0)
+			break;
+		rebased.erase(rebased.begin() + bad);
+	}
+
+	rebase_exec.clear();
+	rebase_skip.clear();
+	for (int k = 0; k < int(rebased.size()); k++) {
+		const code_block_t &b = blocks[rebased[k].block];
+		for (int e : b.execs)
+			rebase_exec[e] = k;
+		rebase_skip.insert(b.loads.begin(), b.loads.end());
+		rebase_skip.insert(b.cls.begin(), b.cls.end());
+		rebased_loads += b.loads.size();
+		rebased_words += b.loads.size() * b.len;
+	}
+
+	if (!rebased.empty())
+		for (auto &seg : segments)
+			for (auto &chunk : seg.chunks)
+				rebaseChunk(chunk, true);
+
+	// run the block where it is, prefer the address the Execute already has
+	for (auto &it : rebase_exec) {
+		const insn_t &insn = as.insns[it.first];
+		const std::set<int> &found = rebase_caddr.at(it.first);
+		int c = found.count(insn.caddr) ? insn.caddr : *found.begin();
+		setField(it.first, FIELD_CADDR, c);
+		executes.push_back(std::make_pair(c, insn.maddr & maddr_mask));
+		rebased_sites++;
+	}
+
+	if (as.verbose)
+		printf("rebased %d compute blocks onto identical ones (%d Executes, %d base pointer writes added), "
+				"dropped %d loads of %d words.\n", int(rebased.size()), rebased_sites, rebased_writes,
+				rebased_loads, rebased_words);
+}
+
+// Coefficient prefetch: generated code often waits for the results of a
+// layer with a Sync, then loads the coefficients of the next layer and
+// waits for them with a second Sync before it uses them. Coefficient loads
+// between two such Syncs (with only base pointer writes around them) are
+// moved in front of the first one. They are then issued while the compute
+// instructions of the previous layer are still in the pipeline, the first
+// Sync waits for both, and the second one is dropped by peephole().
+//
+// The loads do not move across any instruction that uses the compute core,
+// so the coefficient memory they write is not read in between. A load is
+// only moved when no Store/Save in the program writes the main memory it
+// reads (as seen by dataflow()): the first Sync might be what makes it read
+// the results of a Store that is still in the pipeline.
+void MlAsm::opt_state_t::prefetch()
+{
+	if (!flow_done) {
+		if (as.verbose)
+			printf("not moving coefficient loads, the program can not be followed.\n");
+		return;
+	}
+
+	auto stored = [&](int addr, int len) {
+		for (int b = addr; b < addr + len; b++)
+			if (b >= as.arch.mem_size || mem_stored[b])
+				return true;
+		return false;
+	};
+
+	for (auto &seg : segments)
+		for (auto &chunk : seg.chunks)
+		{
+			std::vector<int> code;
+
+			for (int i = 0; i < int(chunk.size()); i++)
+			{
+				int idx = chunk[i];
+				code.push_back(idx);
+
+				if (as.insns[idx].opcode != 0 || anchors.count(idx))
+					continue;
+
+				std::vector<int> loads, rest;
+				int j = i+1, num = 0, words = 0;
+				bool ok = true;
+
+				for (; ok && j < int(chunk.size()); j++)
+				{
+					int k = chunk[j];
+					const MlIsa::op_t &op = ml_isa_op(as.insns[k].opcode);
+
+					if (anchors.count(k) || op.kind == MlIsa::KIND_SYNC)
+						break;
+
+					if (as.insns[k].opcode < 0 || op.kind == MlIsa::KIND_SETBP) {
+						rest.push_back(k);
+						continue;
+					}
+
+					ok = op.kind == MlIsa::KIND_LOAD && op.lanes != 0;
+					if (!ok)
+						break;
+
+					int cl = j+1 < int(chunk.size()) && as.insns[chunk[j+1]].opcode == 7 ? chunk[j+1] : -1;
+					int len = 1 + (cl >= 0 ? as.insns[cl].maddr & maddr_mask : 0);
+
+					ok = !stored(as.insns[k].maddr & maddr_mask, 8*len) && (cl < 0 || !anchors.count(cl));
+					if (!ok)
+						break;
+
+					loads.push_back(k);
+					if (cl >= 0)
+						loads.push_back(chunk[++j]);
+					words += len;
+					num++;
+				}
+
+				if (!ok || loads.empty() || j == int(chunk.size()) || as.insns[chunk[j]].opcode != 0 ||
+						anchors.count(chunk[j]))
+					continue;
+
+				code.pop_back();
+				code.insert(code.end(), loads.begin(), loads.end());
+				code.push_back(idx);
+				code.insert(code.end(), rest.begin(), rest.end());
+				prefetched_loads += num;
+				prefetched_words += words;
+				prefetched_syncs++;
+				i = j-1;
+			}
+
+			chunk.swap(code);
+		}
+
+	if (as.verbose)
+		printf("moved %d coefficient loads (%d words) in front of the Sync before them at %d places.\n",
+				prefetched_loads, prefetched_words, prefetched_syncs);
+}
+
+// Peephole optimizations on straight-line code:
+//
+// - A load that continues the previous load of the same kind (next main
+//   memory word to the next code or coefficient memory word) becomes part
+//   of its ContinueLoad burst.
+// - SetXBP/AddXBP writes that are not used before the next write to the same
+//   base pointer are folded into it (Set x; Add y -> Set x+y) or dropped
+//   (Set x; Set y -> Set y). Writes of the value the base pointer already has
+//   and adding 0 are dropped.
+// - A Sync with only base pointer writes since the previous Sync is dropped.
+//
+// Labels (the code might be entered there), Call and Execute end what is
+// known about the base pointers.
+void MlAsm::opt_state_t::peephole()
+{
+	for (auto &seg : segments)
+		for (auto &chunk : seg.chunks)
+			peepholeChunk(chunk);
+
+	if (as.verbose)
+		printf("merged %d loads, folded or dropped %d base pointer writes and dropped %d syncs.\n",
+				merged_loads, folded_writes, dropped_syncs);
+}
+
+void MlAsm::opt_state_t::peepholeChunk(std::vector<int> &chunk)
+{
+	std::vector<int> code;
+	int pending[4], known[4];
+	bool known_valid[4], synced = false;
+
+	auto forget = [&]() {
+		for (int r = 0; r < 4; r++) {
+			pending[r] = -1;
+			known[r] = 0;
+			known_valid[r] = false;
+		}
+	};
+
+	auto last = [&]() {
+		while (!code.empty() && as.insns[code.back()].opcode < 0)
+			code.pop_back();
+		return code.empty() ? -1 : code.back();
+	};
+
+	forget();
+
+	for (int i = 0; i < int(chunk.size()); i++)
+	{
+		int idx = chunk[i];
+		int opcode = as.insns[idx].opcode;
+		const MlIsa::op_t &op = ml_isa_op(opcode);
+		bool entry = anchors.count(idx) != 0;
+
+		if (entry)
+			forget();
+
+		if (entry || (op.kind != MlIsa::KIND_SYNC && op.kind != MlIsa::KIND_SETBP))
+			synced = false;
+
+		if (op.kind == MlIsa::KIND_SYNC && synced) {
+			killInsn(idx);
+			dropped_syncs++;
+			continue;
+		}
+
+		if (op.kind == MlIsa::KIND_SYNC)
+			synced = true;
+
+		if (op.kind == MlIsa::KIND_LOAD && !entry && last() >= 0 && fixedInsn(idx))
+		{
+			int prev = last(), prev_cl = -1;
+			if (as.insns[prev].opcode == 7 && code.size() > 1 && fixedInsn(prev)) {
+				prev_cl = prev;
+				prev = code[code.size()-2];
+			}
+
+			int cl = i+1 < int(chunk.size()) && as.insns[chunk[i+1]].opcode == 7 ? chunk[i+1] : -1;
+			int word_size = op.lanes == 0 ? 4 : 8;
+			int mem_size = op.lanes == 0 ? as.arch.code_size : as.arch.coeff_size;
+
+			if (as.insns[prev].opcode == opcode && fixedInsn(prev) && (cl < 0 || fixedInsn(cl)))
+			{
+				const insn_t &p = as.insns[prev];
+				const insn_t &insn = as.insns[idx];
+				int prev_len = 1 + (prev_cl >= 0 ? as.insns[prev_cl].maddr & maddr_mask : 0);
+				int len = 1 + (cl >= 0 ? as.insns[cl].maddr & maddr_mask : 0);
+
+				if ((insn.maddr & maddr_mask) == (p.maddr & maddr_mask) + word_size*prev_len &&
+						insn.caddr == p.caddr + prev_len && p.caddr + prev_len + len <= mem_size &&
+						prev_len + len - 1 <= maddr_mask)
+				{
+					if (prev_cl >= 0) {
+						setField(prev_cl, FIELD_MADDR, prev_len + len - 1);
+					} else {
+						int linenr = as.insns[idx].linenr;
+						code.push_back(addInsn(7, prev_len + len - 1, 0, linenr));
+					}
+					killInsn(idx);
+					if (cl >= 0) {
+						killInsn(cl);
+						i++;
+					}
+					merged_loads++;
+					continue;
+				}
+			}
+		}
+
+		if (op.kind == MlIsa::KIND_SETBP)
+		{
+			int r = op.reg;
+			bool add = (op.flags & MlIsa::FLAG_ADD) != 0;
+			field_t field = r == MlIsa::REG_CBP ? FIELD_CADDR : FIELD_MADDR;
+			int mask = r == MlIsa::REG_CBP ? as.arch.caddr_mask() : maddr_mask;
+			int value = (field == FIELD_CADDR ? as.insns[idx].caddr : as.insns[idx].maddr) & mask;
+
+			if (!fixedInsn(idx)) {
+				pending[r] = -1;
+				known_valid[r] = false;
+				code.push_back(idx);
+				continue;
+			}
+
+			if (!entry && (add ? value == 0 : known_valid[r] && known[r] == value)) {
+				killInsn(idx);
+				folded_writes++;
+				continue;
+			}
+
+			known[r] = add ? (known[r] + value) & mask : value;
+			known_valid[r] = known_valid[r] || !add;
+
+			if (pending[r] >= 0)
+			{
+				int prev = pending[r];
+				if (!add) {
+					killInsn(prev);
+				} else {
+					const insn_t &p = as.insns[prev];
+					int sum = ((field == FIELD_CADDR ? p.caddr : p.maddr) + value) & mask;
+					setField(prev, field, sum);
+					killInsn(idx);
+					if ((ml_isa_op(p.opcode).flags & MlIsa::FLAG_ADD) != 0 && sum == 0) {
+						killInsn(prev);
+						pending[r] = -1;
+					}
+					folded_writes++;
+					continue;
+				}
+				folded_writes++;
+			}
+
+			pending[r] = entry ? -1 : idx;
+			code.push_back(idx);
+			continue;
+		}
+
+		if (op.kind == MlIsa::KIND_MACC) {
+			pending[MlIsa::REG_VBP] = -1;
+			pending[MlIsa::REG_CBP] = -1;
+		}
+
+		if (op.kind == MlIsa::KIND_STORE || op.kind == MlIsa::KIND_SAVE)
+			pending[MlIsa::REG_SBP] = -1;
+
+		if (op.kind == MlIsa::KIND_LDACC)
+			pending[MlIsa::REG_LBP] = -1;
+
+		if (op.kind == MlIsa::KIND_CALL || op.kind == MlIsa::KIND_RETURN || op.kind == MlIsa::KIND_EXECUTE)
+			forget();
+
+		code.push_back(idx);
+	}
+
+	std::vector<int> live;
+	for (int idx : code)
+		if (as.insns[idx].opcode >= 0)
+			live.push_back(idx);
+	chunk.swap(live);
+}
+
+// Repeated sequences of non-negative tokens in text, found with a suffix
+// array: each lcp interval is a sequence of lcp[] tokens that starts at each
+// suffix in the interval. Returns the max_candidates sequences of at least
+// min_len tokens that save the most when each occurrence but one is
+// replaced by a single token, (count-1)*len - count, with the start
+// positions in ascending order (they may overlap).
+std::vector<MlAsm::opt_state_t::repeat_t> MlAsm::opt_state_t::findRepeats(const std::vector<int> &text,
+		int min_len, int max_candidates)
+{
+	int n = text.size();
+	std::vector<repeat_t> candidates;
+
+	if (n == 0)
+		return candidates;
+
+	// suffix array by prefix doubling
+	std::vector<int> sa(n), rank(text), tmp(n);
+	for (int i = 0; i < n; i++)
+		sa[i] = i;
+
+	for (int k = 1;; k *= 2)
+	{
+		auto less = [&](int a, int b) {
+			if (rank[a] != rank[b])
+				return rank[a] < rank[b];
+			int ra = a+k < n ? rank[a+k] : INT_MIN;
+			int rb = b+k < n ? rank[b+k] : INT_MIN;
+			return ra < rb;
+		};
+		std::sort(sa.begin(), sa.end(), less);
+		tmp[sa[0]] = 0;
+		for (int i = 1; i < n; i++)
+			tmp[sa[i]] = tmp[sa[i-1]] + less(sa[i-1], sa[i]);
+		rank.swap(tmp);
+		if (rank[sa[n-1]] == n-1)
+			break;
+	}
+
+	// longest common prefix of neighbouring suffixes (Kasai et al.)
+	std::vector<int> lcp(n+1);
+	for (int i = 0, h = 0; i < n; i++) {
+		if (rank[i] == 0) {
+			h = 0;
+			continue;
+		}
+		int j = sa[rank[i]-1];
+		while (i+h < n && j+h < n && text[i+h] == text[j+h] && text[i+h] >= 0)
+			h++;
+		lcp[rank[i]] = h;
+		if (h > 0)
+			h--;
+	}
+
+	struct interval_t {
+		int score, len, lb, rb;
+	};
+	std::vector<interval_t> intervals;
+	std::vector<std::pair<int, int>> stack;
+
+	for (int i = 1; i <= n; i++)
+	{
+		int lb = i-1;
+		while (!stack.empty() && stack.back().first > lcp[i]) {
+			int len = stack.back().first;
+			lb = stack.back().second;
+			stack.pop_back();
+			if (len >= min_len)
+				intervals.push_back(interval_t{(i-lb-1)*len - (i-lb), len, lb, i-1});
+		}
+		if (i < n && (stack.empty() || stack.back().first < lcp[i]))
+			stack.push_back(std::make_pair(lcp[i], lb));
+	}
+
+	std::sort(intervals.begin(), intervals.end(), [](const interval_t &a, const interval_t &b) {
+		return a.score > b.score;
+	});
+	if (int(intervals.size()) > max_candidates)
+		intervals.resize(max_candidates);
+
+	for (auto &iv : intervals) {
+		repeat_t r;
+		r.len = iv.len;
+		r.pos.assign(sa.begin() + iv.lb, sa.begin() + iv.rb + 1);
+		std::sort(r.pos.begin(), r.pos.end());
+		candidates.push_back(r);
+	}
+
+	return candidates;
+}
+
+// Outlining: sequences of instructions that occur several times in the
+// sequencer code are moved to a subroutine ending in Return, and each
+// occurrence is replaced by a Call. Each round outlines the best candidates
+// from findRepeats() and then looks for repeated sequences again. Each
+// outlined sequence saves count*len - count (one Call each) - len - 1 (the
+// subroutine) words. Outlined code is not outlined
+// again, so each call frame of the original program gets at most one more
+// frame: the call depth grows to at most 2*max_depth+1.
+void MlAsm::opt_state_t::outline()
+{
+	if (2*max_depth + 1 > as.arch.callstack_size) {
+		if (as.verbose)
+			printf("not outlining, call depth %d is too close to the %d entries call stack.\n",
+					max_depth, as.arch.callstack_size);
+		return;
+	}
+
+	for (int round = 0; round < OUTLINE_ROUNDS; round++)
+		if (!outlineRound())
+			break;
+}
+
+bool MlAsm::opt_state_t::outlineRound()
+{
+	// One token per instruction in the original code of all segments.
+	// Instructions that must not be outlined and segment ends get unique
+	// negative tokens, so no repeated sequence contains them.
+	std::vector<int> text, text_insn;
+	std::map<std::string, int> ids;
+	int unique = -1;
+
+	for (auto &seg : segments) {
+		for (int idx : seg.chunks[0]) {
+			if (no_outline[idx] || as.insns[idx].opcode == 2)
+				text.push_back(unique--);
+			else
+				text.push_back(ids.emplace(insnKey(idx), ids.size()).first->second);
+			text_insn.push_back(idx);
+		}
+		text.push_back(unique--);
+		text_insn.push_back(-1);
+	}
+
+	int n = text.size();
+	std::vector<repeat_t> candidates = findRepeats(text, OUTLINE_MIN_LEN, OUTLINE_CANDIDATES);
+
+	std::vector<bool> touched(n);
+
+	// Occurrences that do not overlap each other or code changed earlier in
+	// this round. Labels may only point to the first instruction (they move
+	// to the Call), and loads must stay together with their ContinueLoad.
+	auto occurrences = [&](const repeat_t &c) {
+		std::vector<int> occ;
+		int last_end = -1;
+		for (int p : c.pos) {
+			if (p < last_end)
+				continue;
+			bool ok = as.insns[text_insn[p]].opcode != 7 &&
+					(text_insn[p+c.len] < 0 || as.insns[text_insn[p+c.len]].opcode != 7);
+			for (int t = p; ok && t < p+c.len; t++)
+				ok = !touched[t] && (t == p || !anchors.count(text_insn[t]));
+			if (ok) {
+				occ.push_back(p);
+				last_end = p + c.len;
+			}
+		}
+		return occ;
+	};
+
+	for (auto &c : candidates) {
+		int count = occurrences(c).size();
+		c.saved = (count-1)*c.len - count - 1;
+	}
+
+	std::stable_sort(candidates.begin(), candidates.end(), [](const repeat_t &a, const repeat_t &b) {
+		return a.saved > b.saved;
+	});
+
+	std::vector<int> seg_size;
+	for (auto &seg : segments)
+		seg_size.push_back(seg.size());
+
+	std::vector<int> text_seg;
+	for (int s = 0; s < int(segments.size()); s++)
+		text_seg.insert(text_seg.end(), segments[s].chunks[0].size() + 1, s);
+
+	std::map<int, int> replace;
+	bool changed = false;
+
+	for (auto &c : candidates)
+	{
+		std::vector<int> occ = occurrences(c);
+		int count = occ.size();
+		if ((count-1)*c.len - count - 1 <= 0)
+			continue;
+
+		// the subroutine goes to the segment with the most free space
+		for (int p : occ)
+			seg_size[text_seg[p]] -= c.len - 1;
+
+		int target = -1, target_free = c.len;
+		for (int s = 0; s < int(segments.size()); s++) {
+			int free = (segments[s].limit - segments[s].start) / 4 - seg_size[s];
+			if (free > target_free)
+				target = s, target_free = free;
+		}
+
+		if (target < 0) {
+			for (int p : occ)
+				seg_size[text_seg[p]] += c.len - 1;
+			continue;
+		}
+
+		std::vector<int> body;
+		for (int t = 0; t < c.len; t++)
+			body.push_back(cloneInsn(text_insn[occ[0] + t]));
+		body.push_back(addInsn(2, 0, 0, as.insns[body.back()].linenr));
+		seg_size[target] += body.size();
+
+		int sym = addLabel("_outlined_", body.front());
+		as.exprs.push_back(expr_t{'$', sym, 0});
+		int expr = as.exprs.size()-1;
+
+		for (int p : occ) {
+			int call = addInsn(1, 0, 0, as.insns[text_insn[p]].linenr);
+			addFixup(call, expr, FIELD_MADDR);
+			no_outline[call] = true;
+			moveAnchors(text_insn[p], call);
+			replace[text_insn[p]] = call;
+			for (int t = p; t < p+c.len; t++) {
+				killInsn(text_insn[t]);
+				touched[t] = true;
+			}
+		}
+
+		segments[target].chunks.push_back(body);
+		changed = true;
+
+		if (as.verbose)
+			printf("outlined %d instructions from line %d at %d call sites, saving %d words.\n",
+					c.len, as.insns[body.front()].linenr, count, (count-1)*c.len - count - 1);
+	}
+
+	for (auto &seg : segments) {
+		std::vector<int> code;
+		for (int idx : seg.chunks[0]) {
+			if (replace.count(idx))
+				code.push_back(replace.at(idx));
+			else if (as.insns[idx].opcode >= 0)
+				code.push_back(idx);
+		}
+		seg.chunks[0].swap(code);
+	}
+
+	return changed;
+}
+
+// List scheduling of straight-line compute code: runs of compute
+// instructions in the sequencer code, and the compute code loaded by
+// LoadCode, split wherever an Execute starts or ends. Instructions are
+// reordered so that fewer of them stall in the compute pipeline (mlpipe.h),
+// most importantly MACCs and loads that would use the main memory port in
+// the same cycle as an earlier LdSet/LdAdd or Store/Save.
+//
+// The order of instructions that depend on each other is kept: base pointer
+// writes and their users, main memory writes and accesses to overlapping
+// addresses (relative to the same base pointer value), and instructions
+// using the same accumulator. Accumulating instructions of the same kind
+// (MACC/LdAdd add, MMAX takes the maximum) can be swapped, the result is
+// the same in any order.
+
+namespace
+{
+enum lane_use_t {
+	LANE_NONE,
+	LANE_READ,
+	LANE_ADD,
+	LANE_MAX,
+	LANE_SET
+};
+
+struct sched_insn_t {
+	int opcode = 0;
+	int reads = 0, writes = 0;
+	lane_use_t lanes[2] = {LANE_NONE, LANE_NONE};
+	int mem_root = -1, mem_addr = 0, mem_size = 0;
+	bool mem_write = false;
+};
+
+bool sched_depends(const sched_insn_t &a, const sched_insn_t &b, int maddr_mask)
+{
+	if ((a.writes & (b.reads | b.writes)) || (a.reads & b.writes))
+		return true;
+
+	for (int l = 0; l < 2; l++) {
+		lane_use_t la = a.lanes[l], lb = b.lanes[l];
+		if (la == LANE_NONE || lb == LANE_NONE || (la == LANE_READ && lb == LANE_READ))
+			continue;
+		if (la == lb && (la == LANE_ADD || la == LANE_MAX))
+			continue;
+		return true;
+	}
+
+	if (a.mem_root >= 0 && b.mem_root >= 0 && (a.mem_write || b.mem_write)) {
+		if (a.mem_root != b.mem_root)
+			return true;
+		int d = (b.mem_addr - a.mem_addr) & maddr_mask;
+		if (d < a.mem_size || maddr_mask + 1 - d < b.mem_size)
+			return true;
+	}
+
+	return false;
+}
+
+// Stall cycles of the block when it runs right after itself, compute code
+// is usually run many times by consecutive Execute instructions.
+int sched_stalls(const std::vector<sched_insn_t> &info, const std::vector<int> &order)
+{
+	MlPipe pipe;
+	int stalls = 0;
+	for (int i : order)
+		pipe.issue(info[i].opcode);
+	for (int i : order)
+		stalls += pipe.issue(info[i].opcode);
+	return stalls;
+}
+}
+
+bool MlAsm::opt_state_t::scheduleBlock(std::vector<int> &block)
+{
+	int n = block.size();
+	if (n < 2)
+		return false;
+
+	// base pointer values relative to their (unknown) value at the start of
+	// the block, root 0 is an absolute address
+	int root[4], offset[4];
+	for (int r = 0; r < 4; r++) {
+		root[r] = r+1;
+		offset[r] = 0;
+	}
+
+	std::vector<sched_insn_t> info(n);
+
+	for (int i = 0; i < n; i++)
+	{
+		const insn_t &insn = as.insns[block[i]];
+		const MlIsa::op_t &op = ml_isa_op(insn.opcode);
+		sched_insn_t &si = info[i];
+		si.opcode = insn.opcode;
+
+		auto lanes = [&](lane_use_t use) {
+			for (int l = 0; l < 2; l++)
+				if (op.lanes & (1 << l))
+					si.lanes[l] = use;
+		};
+
+		auto access = [&](int reg, int size, bool write) {
+			si.reads |= 1 << reg;
+			si.mem_root = root[reg];
+			si.mem_addr = (offset[reg] + insn.maddr) & maddr_mask;
+			si.mem_size = size;
+			si.mem_write = write;
+		};
+
+		switch (op.kind)
+		{
+		case MlIsa::KIND_SETBP:
+			si.writes |= 1 << op.reg;
+			if (op.reg != MlIsa::REG_CBP) {
+				if (op.flags & MlIsa::FLAG_ADD) {
+					offset[op.reg] = (offset[op.reg] + insn.maddr) & maddr_mask;
+				} else {
+					root[op.reg] = 0;
+					offset[op.reg] = insn.maddr & maddr_mask;
+				}
+			}
+			break;
+
+		case MlIsa::KIND_STORE:
+			access(MlIsa::REG_SBP, 2, true);
+			lanes(LANE_READ);
+			break;
+
+		case MlIsa::KIND_SAVE:
+			access(MlIsa::REG_SBP, 8, true);
+			lanes(LANE_READ);
+			break;
+
+		case MlIsa::KIND_LDACC:
+			access(MlIsa::REG_LBP, 8, false);
+			lanes(op.flags & MlIsa::FLAG_ADD ? LANE_ADD : LANE_SET);
+			break;
+
+		case MlIsa::KIND_MACC:
+			access(MlIsa::REG_VBP, 8, false);
+			si.reads |= 1 << MlIsa::REG_CBP;
+			if (op.flags & (MlIsa::FLAG_ZERO | MlIsa::FLAG_NEG)) {
+				lanes(LANE_SET);
+			} else {
+				lanes(LANE_ADD);
+				if (op.flags & MlIsa::FLAG_MAX)
+					si.lanes[0] = LANE_MAX;
+			}
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	std::vector<std::vector<int>> succs(n);
+	std::vector<int> npreds(n), height(n, 1);
+
+	for (int i = 0; i < n; i++)
+		for (int j = i+1; j < n; j++)
+			if (sched_depends(info[i], info[j], maddr_mask)) {
+				succs[i].push_back(j);
+				npreds[j]++;
+			}
+
+	for (int i = n-1; i >= 0; i--)
+		for (int j : succs[i])
+			height[i] = std::max(height[i], height[j] + 1);
+
+	// Greedy: issue the ready instruction with the fewest stall cycles,
+	// then the one with the longest chain of dependent instructions after
+	// it, then the one that came first.
+	std::vector<int> orig(n);
+	for (int i = 0; i < n; i++)
+		orig[i] = i;
+
+	// start with the pipeline state after a run of the original block
+	std::vector<int> order, ready;
+	MlPipe pipe;
+	for (int i : orig)
+		pipe.issue(info[i].opcode);
+
+	for (int i = 0; i < n; i++)
+		if (npreds[i] == 0)
+			ready.push_back(i);
+
+	while (!ready.empty())
+	{
+		int best = -1, best_stalls = 0;
+		for (int k = 0; k < int(ready.size()); k++) {
+			MlPipe p = pipe;
+			int stalls = p.issue(info[ready[k]].opcode);
+			int i = ready[k], b = best < 0 ? -1 : ready[best];
+			if (best < 0 || stalls < best_stalls || (stalls == best_stalls &&
+					(height[i] > height[b] || (height[i] == height[b] && i < b))))
+				best = k, best_stalls = stalls;
+		}
+
+		int i = ready[best];
+		ready.erase(ready.begin() + best);
+		pipe.issue(info[i].opcode);
+		order.push_back(i);
+
+		for (int j : succs[i])
+			if (--npreds[j] == 0)
+				ready.push_back(j);
+	}
+
+	int saved = sched_stalls(info, orig) - sched_stalls(info, order);
+	if (saved <= 0)
+		return false;
+
+	std::vector<int> new_block;
+	for (int i : order)
+		new_block.push_back(block[i]);
+	block.swap(new_block);
+
+	scheduled_blocks++;
+	saved_stalls += saved;
+	return true;
+}
+
+void MlAsm::opt_state_t::schedule()
+{
+	const int max_block = 256;
+	int num_blocks = 0;
+
+	auto schedulable = [&](int idx) {
+		return ml_isa_op(as.insns[idx].opcode).compute() && fixedInsn(idx);
+	};
+
+	// sequencer code
+	for (auto &seg : segments)
+		for (auto &chunk : seg.chunks)
+			for (int i = 0; i < int(chunk.size());)
+			{
+				int j = i;
+				while (j < int(chunk.size()) && j-i < max_block && schedulable(chunk[j]) &&
+						(j == i || !anchors.count(chunk[j])))
+					j++;
+
+				// a label at the first instruction stays at the start
+				if (j > i) {
+					std::vector<int> block(chunk.begin()+i, chunk.begin()+j);
+					if (scheduleBlock(block)) {
+						moveAnchors(chunk[i], block[0]);
+						std::copy(block.begin(), block.end(), chunk.begin()+i);
+					}
+					num_blocks++;
+					i = j;
+				} else {
+					i++;
+				}
+			}
+
+	// Compute code loaded by LoadCode. Blocks start and end where an
+	// Execute starts or ends and at symbols.
+	std::sort(code_loads.begin(), code_loads.end(), [](const load_t &a, const load_t &b) {
+		return std::make_tuple(a.maddr, a.caddr, a.len) < std::make_tuple(b.maddr, b.caddr, b.len);
+	});
+	code_loads.erase(std::unique(code_loads.begin(), code_loads.end(), [](const load_t &a, const load_t &b) {
+		return a.maddr == b.maddr && a.caddr == b.caddr && a.len == b.len;
+	}), code_loads.end());
+
+	std::sort(executes.begin(), executes.end());
+	executes.erase(std::unique(executes.begin(), executes.end()), executes.end());
+
+	std::set<int> bounds;
+	std::vector<bool> executed(as.data.size());
+
+	for (auto &ld : code_loads)
+		for (auto &ex : executes) {
+			int lo = std::max(ld.caddr, ex.first);
+			int hi = std::min(ld.caddr + ld.len, ex.first + ex.second);
+			if (lo >= hi)
+				continue;
+			bounds.insert(ld.maddr + 4*(lo - ld.caddr));
+			bounds.insert(ld.maddr + 4*(hi - ld.caddr));
+			for (int k = ld.maddr/4 + lo - ld.caddr; k < ld.maddr/4 + hi - ld.caddr && k < int(executed.size()); k++)
+				executed[k] = true;
+		}
+
+	for (auto &sym : as.symbols)
+		bounds.insert(sym.position);
+
+	std::vector<int> block;
+	int next_pos = -1;
+
+	auto flush = [&]() {
+		if (block.empty())
+			return;
+		std::vector<int> positions;
+		for (int idx : block)
+			positions.push_back(as.insns[idx].position);
+		if (scheduleBlock(block))
+			for (int k = 0; k < int(block.size()); k++)
+				as.insns[block[k]].position = positions[k];
+		num_blocks++;
+		block.clear();
+	};
+
+	for (auto &it : at)
+	{
+		int pos = it.first, idx = it.second;
+		bool ok = pos >= 0 && pos/4 < int(executed.size()) && executed[pos/4] &&
+				!reached[idx] && schedulable(idx);
+
+		if (!ok || pos != next_pos || bounds.count(pos) || int(block.size()) == max_block)
+			flush();
+
+		if (ok)
+			block.push_back(idx);
+		next_pos = pos + 4;
+	}
+
+	flush();
+
+	if (as.verbose)
+		printf("scheduled %d of %d compute blocks, saving %d stall cycles per run of each.\n",
+				scheduled_blocks, num_blocks, saved_stalls);
+}
+
+// Placement of compute code: runs of compute instructions that occur several
+// times in the sequencer code are copied to the unused code memory above
+// everything the program loads itself. One LoadCode (with ContinueLoad) at
+// the entry point loads them, and each occurrence becomes an Execute. The
+// compute pipeline runs the same instructions either way, so only sequencer
+// fetches and main memory are saved: a block of len instructions at count
+// sites saves count*len words, and costs count Execute words plus len words
+// for the copy loaded by LoadCode. Blocks are placed in order of the saved
+// words while they fit into code memory.
+void MlAsm::opt_state_t::place()
+{
+	int code_hw = 0;
+	for (auto &ld : code_loads)
+		code_hw = std::max(code_hw, ld.caddr + ld.len);
+
+	// The loader goes in front of the instruction the entry label points
+	// to, or to the start of the segment at a numeric entry point.
+	auto entry_insn = [&]() {
+		if (entry_symbol >= 0 && movable[entry_symbol])
+			for (auto &it : anchors)
+				if (std::count(it.second.begin(), it.second.end(), entry_symbol))
+					return it.first;
+		return -1;
+	};
+
+	int entry_seg = -1;
+	for (int s = 0; s < int(segments.size()); s++) {
+		auto &code = segments[s].chunks[0];
+		if (entry_insn() >= 0 ? std::count(code.begin(), code.end(), entry_insn()) != 0 :
+				segments[s].start == entry_addr)
+			entry_seg = s;
+	}
+
+	if (entry_seg < 0 || code_hw >= as.arch.code_size)
+		return;
+
+	// one token per instruction, all but compute instructions are unique
+	std::vector<int> text, text_insn, text_seg;
+	std::map<std::string, int> ids;
+	int unique = -1;
+
+	for (int s = 0; s < int(segments.size()); s++)
+		for (auto &chunk : segments[s].chunks) {
+			for (int idx : chunk) {
+				if (ml_isa_op(as.insns[idx].opcode).compute() && fixedInsn(idx))
+					text.push_back(ids.emplace(insnKey(idx), ids.size()).first->second);
+				else
+					text.push_back(unique--);
+				text_insn.push_back(idx);
+				text_seg.push_back(s);
+			}
+			text.push_back(unique--);
+			text_insn.push_back(-1);
+			text_seg.push_back(s);
+		}
+
+	std::vector<repeat_t> candidates = findRepeats(text, 2, OUTLINE_CANDIDATES);
+	std::vector<bool> touched(text.size());
+
+	// occurrences that do not overlap, labels only at the first instruction
+	auto occurrences = [&](const repeat_t &c) {
+		std::vector<int> occ;
+		int last_end = -1;
+		for (int p : c.pos) {
+			bool ok = p >= last_end;
+			for (int t = p; ok && t < p+c.len; t++)
+				ok = !touched[t] && (t == p || !anchors.count(text_insn[t]));
+			if (ok) {
+				occ.push_back(p);
+				last_end = p + c.len;
+			}
+		}
+		return occ;
+	};
+
+	for (auto &c : candidates) {
+		int count = occurrences(c).size();
+		c.saved = count*c.len - count - c.len;
+	}
+
+	std::stable_sort(candidates.begin(), candidates.end(), [](const repeat_t &a, const repeat_t &b) {
+		return a.saved > b.saved;
+	});
+
+	// The copies go to one segment, the loader (one or two words) to the
+	// segment with the entry point.
+	std::vector<int> seg_size;
+	for (auto &seg : segments)
+		seg_size.push_back(seg.size());
+
+	std::vector<std::pair<int, std::vector<int>>> placed;
+	int total = 0;
+
+	for (auto &c : candidates)
+	{
+		std::vector<int> occ = occurrences(c);
+		int count = occ.size();
+		if (count*c.len - count - c.len <= 0 || code_hw + total + c.len > as.arch.code_size)
+			continue;
+
+		std::vector<int> new_size = seg_size;
+		for (int p : occ)
+			new_size[text_seg[p]] -= c.len - 1;
+		new_size[entry_seg] += 2 - (total > 1 ? 2 : total);
+
+		int best_free = 0;
+		for (int s = 0; s < int(segments.size()); s++)
+			best_free = std::max(best_free, (segments[s].limit - segments[s].start) / 4 - new_size[s]);
+		if (best_free < total + c.len)
+			continue;
+
+		for (int p : occ)
+			for (int t = p; t < p+c.len; t++)
+				touched[t] = true;
+
+		seg_size = new_size;
+		placed.push_back(std::make_pair(c.len, occ));
+		total += c.len;
+	}
+
+	if (placed.empty())
+		return;
+
+	int target = 0, target_free = -1;
+	for (int s = 0; s < int(segments.size()); s++) {
+		int free = (segments[s].limit - segments[s].start) / 4 - seg_size[s];
+		if (free > target_free)
+			target = s, target_free = free;
+	}
+
+	std::vector<int> copy;
+	std::map<int, int> replace;
+	int caddr = code_hw, sites = 0;
+
+	for (auto &it : placed)
+	{
+		int len = it.first;
+		const std::vector<int> &occ = it.second;
+
+		for (int t = occ.front(); t < occ.front() + len; t++)
+			copy.push_back(cloneInsn(text_insn[t]));
+
+		for (int p : occ) {
+			int exec = addInsn(3, len, caddr, as.insns[text_insn[p]].linenr);
+			moveAnchors(text_insn[p], exec);
+			replace[text_insn[p]] = exec;
+			for (int t = p; t < p+len; t++)
+				killInsn(text_insn[t]);
+			sites++;
+		}
+
+		caddr += len;
+	}
+
+	for (auto &seg : segments)
+		for (auto &chunk : seg.chunks) {
+			std::vector<int> code;
+			for (int idx : chunk) {
+				if (replace.count(idx))
+					code.push_back(replace.at(idx));
+				else if (as.insns[idx].opcode >= 0)
+					code.push_back(idx);
+			}
+			chunk.swap(code);
+		}
+
+	int sym = addLabel("_placed_", copy.front());
+	as.exprs.push_back(expr_t{'$', sym, 0});
+
+	auto &entry_chunk = segments[entry_seg].chunks[0];
+	int entry_pos = 0;
+	if (entry_insn() >= 0)
+		entry_pos = std::find(entry_chunk.begin(), entry_chunk.end(), entry_insn()) - entry_chunk.begin();
+
+	int linenr = as.insns[entry_chunk[entry_pos]].linenr;
+	int load = addInsn(4, 0, code_hw, linenr);
+	addFixup(load, as.exprs.size()-1, FIELD_MADDR);
+	moveAnchors(entry_chunk[entry_pos], load);
+
+	std::vector<int> loader = {load};
+	if (total > 1)
+		loader.push_back(addInsn(7, total-1, 0, linenr));
+	entry_chunk.insert(entry_chunk.begin() + entry_pos, loader.begin(), loader.end());
+
+	segments[target].chunks.push_back(copy);
+
+	if (as.verbose)
+		printf("placed %d compute blocks (%d words) in code memory at %d, replacing %d sites.\n",
+				int(placed.size()), total, code_hw, sites);
+}
+
+// The main memory bytes that a run of the program may write with Store and
+// Save (the scratch sections of the image), all of main memory when the
+// dataflow walk can not follow the program.
+std::vector<bool> MlAsm::storedBytes()
+{
+	opt_state_t st(*this);
+
+	if (st.prepare()) {
+		st.flowReset();
+		if (st.flowWalk(st.entry_addr, 0))
+			return st.mem_stored;
+	}
+
+	return std::vector<bool>(arch.mem_size, true);
+}
+
+void MlAsm::optimizeCode()
+{
+	opt_state_t st(*this);
+
+	if (!st.prepare()) {
+		if (verbose)
+			printf("not optimizing, the sequencer can not be followed from the entry point.\n");
+		return;
+	}
+
+	st.sparsity();
+	st.dataflow();
+	st.rebase();
+	st.prefetch();
+	st.peephole();
+	st.schedule();
+	st.place();
+	st.outline();
+	st.finish();
+}
@@ -0,0 +1,53 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// Layers pass their results through activation buffers. The third layer
+// reads both a (through LBP) and b, so they get disjoint addresses, and c
+// shares memory with them.
+
+.buffer a, 8, 8
+.buffer b, 8, 8
+.buffer c, 8, 8
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetCBP 0
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7000, 0
+SetLBP 0x8040
+SetVBP 0x8020
+SetSBP a
+Sync
+LdSet 0
+MACC 0, 0
+Save 0
+SetVBP 0x8028
+SetSBP b
+LdSet 0
+MACC 0, 0
+Save 0
+Sync
+SetLBP a
+SetVBP b
+SetSBP c
+LdSet 0
+MACC 0, 0
+Store 0, 0
+Sync
+SetLBP 0x8040
+SetVBP c
+SetSBP 0x8000
+LdSet 0
+MACC 0, 0
+Store 0, 0
+Return
+
+.data 0x7000
+1 0 0 0 1 0 0 0
+
+.data 0x8020
+3 1 4 1 5 9 2 6
+1 0 0 0 2 0 0 0
+
+.data 0x8040
+0 0 0 0 0 0 0 0
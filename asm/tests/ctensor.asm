@@ -0,0 +1,60 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// Coefficient tensors placed by the allocator: w1 and w2 are needed at the
+// same time and get disjoint coefficient memory, and the second load of the
+// mask is dropped because it stays resident.
+
+.ctensor w1, 2, w1_data, w1_data+16
+.ctensor w2, 1, w2_data, w2_data
+.ctensor mask, 1, mask_data, -
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetSBP 0x8000
+SetVBP 0x8020
+LoadCoeff w1
+LoadCoeff w2
+LoadCoeff mask
+Sync
+SetCBP w1
+LdSet 0
+MACC 0, 0
+MACC 8, 1
+Store 0, 0
+SetCBP w2
+LdSet 0
+MACC 0, 0
+Store 2, 0
+Call pool
+LoadCoeff mask
+Sync
+Call pool
+Return
+
+pool:
+SetCBP mask
+MMAXN 0, 0
+MMAX 8, 0
+Store0 4, 0
+AddSBP 1
+Return
+
+.data 0x7000
+w1_data:
+1 2 3 4 5 6 7 8
+8 7 6 5 4 3 2 1
+1 1 1 1 2 2 2 2
+3 3 3 3 1 0 1 0
+w2_data:
+2 0 2 0 2 0 2 0
+mask_data:
+1 1 1 1 1 1 1 1
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+
+.data 0x8040
+0 0 0 0 0 0 0 0
@@ -0,0 +1,39 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// The first LdSet is followed by another one, the first Store is overwritten
+// before anything reads it, and coefficient entry 1 of the first burst is
+// loaded again before it is used. The dead store analysis removes the LdSet
+// and the Store and shortens the first ContinueLoad.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetSBP 0x8000
+SetVBP 0x8020
+SetCBP 0
+LoadCoeff0 0x7000, 0
+ContinueLoad 1
+LoadCoeff0 0x7010, 1
+LoadCoeff1 0x7000, 0
+ContinueLoad 1
+Sync
+LdSet 0
+LdSet 8
+MACC 0, 0
+MACC 8, 1
+Store 0, 0
+MACC 8, 0
+Store 0, 0
+Return
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+8 7 6 5 4 3 2 1
+1 1 1 1 1 1 1 1
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+0 0 0 0 0 0 0 0
+5 0 0 0 6 0 0 0
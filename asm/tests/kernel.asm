@@ -0,0 +1,46 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// Kernels placed in code memory by the overlay manager: k0 and k1 get
+// disjoint code memory, and k0 stays resident for its second Execute, so
+// that load is dropped.
+
+.kernel k0, 3, k0_code
+.kernel k1, 3, k1_code
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetSBP 0x8000
+SetVBP 0x8020
+SetCBP 0
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7000, 0
+Sync
+Execute k0
+Execute k1
+AddVBP 8
+AddSBP 4
+Execute k0
+Return
+
+k0_code:
+LdSet 0
+MACC 0, 0
+Store 0, 0
+
+k1_code:
+LdSet 8
+MACC 0, 0
+Store 2, 0
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+
+.data 0x8040
+0 0 0 0 0 0 0 0
+5 0 0 0 6 0 0 0
@@ -0,0 +1,49 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// The same sequence of loads, base pointer writes and compute instructions
+// runs for three tiles. The outlining pass moves it into a subroutine that
+// the three places call.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetSBP 0x8000
+SetCBP 0
+
+SetVBP 0x8020
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7008, 0
+Sync
+LdSet 0
+MACC 0, 0
+Store 0, 0
+
+AddSBP 2
+SetVBP 0x8028
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7008, 0
+Sync
+LdSet 0
+MACC 0, 0
+Store 0, 0
+
+AddSBP 2
+SetVBP 0x8030
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7008, 0
+Sync
+LdSet 0
+MACC 0, 0
+Store 0, 0
+Return
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+8 7 6 5 4 3 2 1
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+0 3 0 3 0 3 0 3
+0 0 0 0 0 0 0 0
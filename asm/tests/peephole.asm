@@ -0,0 +1,39 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// The peephole pass merges the second coefficient load into the burst of
+// the first, folds SetVBP + AddVBP into one write, drops the SetSBP that is
+// overwritten before it is used and the Sync with only base pointer writes
+// since the previous one.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetCBP 0
+LoadCoeff0 0x7000, 0
+LoadCoeff0 0x7008, 1
+LoadCoeff1 0x7010, 0
+ContinueLoad 1
+Sync
+SetSBP 0x8010
+SetVBP 0x8020
+AddVBP 8
+Sync
+SetSBP 0x8000
+LdSet 0
+MACC 0, 0
+MACC 8, 1
+Store 0, 0
+Return
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+8 7 6 5 4 3 2 1
+1 1 1 1 2 2 2 2
+3 3 3 3 1 0 1 0
+
+.data 0x8020
+9 9 9 9 9 9 9 9
+1 2 1 2 1 2 1 2
+3 0 3 0 3 0 3 0
+0 0 0 0 0 0 0 0
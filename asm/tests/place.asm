@@ -0,0 +1,54 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// The same four compute instructions run at four places of the sequencer
+// code. The placement pass copies them to code memory once and replaces
+// each place by an Execute.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetSBP 0x8000
+SetCBP 0
+SetVBP 0x8020
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7008, 0
+Sync
+LdSet 0
+MACC 0, 0
+MACC 8, 0
+Store 0, 0
+AddVBP 8
+AddSBP 2
+LdSet 0
+MACC 0, 0
+MACC 8, 0
+Store 0, 0
+AddVBP 8
+AddSBP 2
+Sync
+LdSet 0
+MACC 0, 0
+MACC 8, 0
+Store 0, 0
+AddVBP -16
+AddSBP 2
+Call sub
+Return
+
+sub:
+LdSet 0
+MACC 0, 0
+MACC 8, 0
+Store 0, 0
+Return
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+8 7 6 5 4 3 2 1
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+0 3 0 3 0 3 0 3
+0 1 0 1 0 1 0 1
@@ -0,0 +1,40 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// The second layer loads its coefficients after the Sync for the results of
+// the first layer. The prefetch pass moves the loads in front of that Sync,
+// into the pipeline tail of the first layer, and drops the second Sync.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetSBP 0x8000
+SetVBP 0x8020
+SetCBP 0
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7000, 0
+Sync
+LdSet 0
+MACC 0, 0
+Store 0, 0
+Sync
+LoadCoeff0 0x7008, 1
+LoadCoeff1 0x7008, 1
+SetVBP 0x8028
+SetSBP 0x8002
+Sync
+LdSet 0
+MACC 0, 1
+Store 0, 0
+Return
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+8 7 6 5 4 3 2 1
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+
+.data 0x8040
+0 0 0 0 0 0 0 0
@@ -0,0 +1,52 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// Two compute blocks differ only in their LBP, VBP and SBP offsets. Kernel
+// deduplication drops the LoadCode of the second block and runs the first
+// one with shifted base pointers instead, folding the shifts into the base
+// pointer writes before the Execute.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetCBP 0
+LoadCoeff0 0x7000, 0
+LoadCoeff1 0x7000, 0
+LoadCode block0, 0
+ContinueLoad 2
+LoadCode block1, 3
+ContinueLoad 2
+SetLBP 0x8040
+SetSBP 0x8000
+SetVBP 0x8020
+Sync
+Execute 0, 3
+SetLBP 0x8040
+SetSBP 0x8000
+SetVBP 0x8020
+Execute 3, 3
+Sync
+SetLBP 0
+SetSBP 0
+SetVBP 0
+Return
+
+block0:
+LdSet 0
+MACC 0, 0
+Store 0, 0
+
+block1:
+LdSet 8
+MACC 8, 0
+Store 2, 0
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+
+.data 0x8040
+0 0 0 0 0 0 0 0
+5 0 0 0 6 0 0 0
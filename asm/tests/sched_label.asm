@@ -0,0 +1,27 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// The compute instructions of sub0 are reordered by the scheduler to avoid
+// stalls. The label must stay at the first instruction of the reordered
+// block, so that the Call still runs all of them.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetVBP 0x8010
+SetSBP 0x8000
+SetLBP 0x8020
+LdSet 0
+Call sub0
+Return
+
+sub0:
+AddVBP -4
+Store 0, 2
+LdSet1 110
+Save 2
+Save1 40
+SetCBP 27
+Return
+
+.data 0x8020
+1 2 3 4 5 6 7 8
@@ -0,0 +1,38 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// Coefficient word 1 is zero in both banks, so the sparsity pass removes the
+// MACC that reads it and trims the word from the end of the load bursts.
+// The MACCZ that reads it becomes unnecessary because the next MACC becomes
+// a MACCZ.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8040
+SetSBP 0x8000
+SetVBP 0x8020
+SetCBP 0
+LoadCoeff0 0x7000, 0
+ContinueLoad 1
+LoadCoeff1 0x7010, 0
+ContinueLoad 1
+Sync
+LdSet 0
+MACC 0, 0
+MACC 8, 1
+Store 0, 0
+MACCZ 0, 1
+MACC 8, 0
+Store 2, 0
+Return
+
+.data 0x7000
+1 2 3 4 5 6 7 8
+0 0 0 0 0 0 0 0
+8 7 6 5 4 3 2 1
+0 0 0 0 0 0 0 0
+
+.data 0x8020
+1 1 1 1 1 1 1 1
+2 0 2 0 2 0 2 0
+0 0 0 0 0 0 0 0
@@ -0,0 +1,31 @@
+// mlasm -O must produce the same results as without -O ("make check").
+//
+// The coefficients at 0x6000 are zero in the image, but the program stores
+// ones to them before they are loaded. The sparsity pass must keep the MACC.
+
+.output out, 0x8000, 64, b
+
+.code 0
+SetLBP 0x8020
+SetSBP 0x6000
+LdSet 0
+Store 0, 0
+Store 2, 0
+Sync
+LoadCoeff0 0x6000, 0
+LoadCoeff1 0x6000, 0
+SetVBP 0x8020
+SetCBP 0
+SetSBP 0x8000
+Sync
+LdSet 8
+MACC 0, 0
+Store 0, 0
+Return
+
+.data 0x6000
+0 0 0 0 0 0 0 0
+
+.data 0x8020
+1 0 0 0 1 0 0 0
+0 0 0 0 0 0 0 0
@@ -0,0 +1,140 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "mlarch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+bool MlArch::setParam(const std::string &name, const std::string &value)
+{
+	char *endptr = nullptr;
+	int val = strtol(value.c_str(), &endptr, 0);
+
+	if (value.empty() || !endptr || *endptr)
+		return false;
+
+	if (name == "mem_size")
+		mem_size = val;
+	else if (name == "maddr_bits")
+		maddr_bits = val;
+	else if (name == "caddr_bits")
+		caddr_bits = val;
+	else if (name == "code_size")
+		code_size = val;
+	else if (name == "coeff_size")
+		coeff_size = val;
+	else if (name == "callstack_size")
+		callstack_size = val;
+	else if (name == "sync_cycles")
+		sync_cycles = val;
+	else if (name == "contld_cycles")
+		contld_cycles = val;
+	else if (name == "fetch_cycles")
+		fetch_cycles = val;
+	else
+		return false;
+
+	return true;
+}
+
+void MlArch::parseParam(const char *arg)
+{
+	const char *p = strchr(arg, '=');
+
+	if (p == nullptr || !setParam(std::string(arg, p), p+1)) {
+		fprintf(stderr, "MlArch error: Invalid parameter setting '%s'.\n", arg);
+		exit(1);
+	}
+}
+
+void MlArch::readFile(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	char buffer[1024];
+	int linenr = 0;
+
+	if (f == nullptr) {
+		perror("Open architecture file");
+		exit(1);
+	}
+
+	while (fgets(buffer, 1024, f))
+	{
+		char *strtok_saveptr;
+		linenr++;
+
+		char *name = strtok_r(buffer, " \t\r\n", &strtok_saveptr);
+		if (name == nullptr || name[0] == '#' || !strcmp(name, "//"))
+			continue;
+
+		char *value = strtok_r(nullptr, " \t\r\n", &strtok_saveptr);
+		char *extra = strtok_r(nullptr, " \t\r\n", &strtok_saveptr);
+
+		if (value == nullptr || (extra != nullptr && extra[0] != '#') || !setParam(name, value)) {
+			fprintf(stderr, "MlArch syntax error in %s line %d.\n", filename, linenr);
+			exit(1);
+		}
+	}
+
+	fclose(f);
+}
+
+void MlArch::check() const
+{
+	if (maddr_bits < 8 || caddr_bits < 1 || 6 + caddr_bits + maddr_bits > 32) {
+		fprintf(stderr, "MlArch error: MADDR (%d bits) and CADDR (%d bits) fields "
+				"do not fit in a 32 bit instruction word.\n", maddr_bits, caddr_bits);
+		exit(1);
+	}
+
+	if (mem_size <= 0 || mem_size % 8 != 0 || mem_size > (1 << maddr_bits)) {
+		fprintf(stderr, "MlArch error: Main memory size %d is not a multiple of 8 "
+				"or not addressable with %d bits.\n", mem_size, maddr_bits);
+		exit(1);
+	}
+
+	if (code_size <= 0 || code_size > (1 << caddr_bits)) {
+		fprintf(stderr, "MlArch error: Code memory size %d is not addressable "
+				"with %d bits.\n", code_size, caddr_bits);
+		exit(1);
+	}
+
+	if (coeff_size <= 0 || coeff_size > (1 << caddr_bits)) {
+		fprintf(stderr, "MlArch error: Coefficient memory size %d is not addressable "
+				"with %d bits.\n", coeff_size, caddr_bits);
+		exit(1);
+	}
+
+	if (callstack_size <= 0 || sync_cycles < 0 || contld_cycles < 0 || fetch_cycles < 0) {
+		fprintf(stderr, "MlArch error: Invalid call stack size or cycle costs.\n");
+		exit(1);
+	}
+}
+
+void MlArch::print(FILE *f) const
+{
+	fprintf(f, "mem_size       %d\n", mem_size);
+	fprintf(f, "maddr_bits     %d\n", maddr_bits);
+	fprintf(f, "caddr_bits     %d\n", caddr_bits);
+	fprintf(f, "code_size      %d\n", code_size);
+	fprintf(f, "coeff_size     %d\n", coeff_size);
+	fprintf(f, "callstack_size %d\n", callstack_size);
+	fprintf(f, "sync_cycles    %d\n", sync_cycles);
+	fprintf(f, "contld_cycles  %d\n", contld_cycles);
+	fprintf(f, "fetch_cycles   %d\n", fetch_cycles);
+}
@@ -0,0 +1,65 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef MLARCH_H
+#define MLARCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// Architecture parameters shared by the assembler and the simulator. The
+// defaults describe the iCE40UP5K reference implementation in rtl/.
+struct MlArch
+{
+	int mem_size = 128 * 1024;
+	int maddr_bits = 17;
+	int caddr_bits = 9;
+	int code_size = 512;
+	int coeff_size = 512;
+	int callstack_size = 256;
+	int sync_cycles = 8;
+	int contld_cycles = 1;
+	int fetch_cycles = 4;
+
+	int maddr_mask() const { return (1 << maddr_bits) - 1; }
+	int caddr_mask() const { return (1 << caddr_bits) - 1; }
+
+	// Instructions are 32 bits wide: the opcode in bits 5..0, followed by
+	// the CADDR field and then the MADDR field. Wider address fields are
+	// only possible as long as all three fields fit in the word.
+	int caddr_shift() const { return 6; }
+	int maddr_shift() const { return 6 + caddr_bits; }
+
+	int insn_op(uint32_t x) const { return x & 0x3f; }
+	int insn_maddr(uint32_t x) const { return (x >> maddr_shift()) & maddr_mask(); }
+	int insn_caddr(uint32_t x) const { return (x >> caddr_shift()) & caddr_mask(); }
+
+	uint32_t insn_encode(int opcode, int maddr, int caddr) const
+	{
+		return (uint32_t(maddr & maddr_mask()) << maddr_shift()) |
+				(uint32_t(caddr & caddr_mask()) << caddr_shift()) | (opcode & 0x3f);
+	}
+
+	bool setParam(const std::string &name, const std::string &value);
+	void parseParam(const char *arg);
+	void readFile(const char *filename);
+	void check() const;
+	void print(FILE *f) const;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "mlfile.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint8_t *ml_map_file(const char *filename, size_t &len, std::vector<uint8_t> &buffer, const char *what)
+{
+	char msg[64];
+
+	if (filename == nullptr) {
+		int c;
+		while ((c = fgetc(stdin)) >= 0)
+			buffer.push_back(c);
+		len = buffer.size();
+		return buffer.data();
+	}
+
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		snprintf(msg, sizeof(msg), "Open %s file", what);
+		perror(msg);
+		exit(1);
+	}
+
+	len = st.st_size;
+	if (len == 0) {
+		close(fd);
+		return buffer.data();
+	}
+
+	void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		snprintf(msg, sizeof(msg), "Map %s file", what);
+		perror(msg);
+		exit(1);
+	}
+
+	return (const uint8_t*)p;
+}
@@ -0,0 +1,214 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef MLIMAGE_H
+#define MLIMAGE_H
+
+#include <stdint.h>
+
+// MARLANN program image (.mli), written by "mlasm -i" and read by mlsim, mlqpid
+// and the firmware driver (demo/mldrv.c). This header is plain C so that it can
+// be used on the control SoC.
+//
+// The file starts with the header, followed by the section table, the symbol
+// table, the string table and the section contents. All fields are little
+// endian. Every table and every section content starts at a MLIMG_ALIGN
+// aligned file offset, so a loader can mmap() the file (or run it from flash)
+// and use all structures in place.
+//
+// Each section describes one contiguous range of main memory. Sections with
+// content are uploaded to their address before Run, output sections only
+// describe a region the host reads back afterwards, and scratch sections the
+// other regions the program may write. The hash is the FNV-1a hash of the
+// content, so a loader can skip sections that are still present in main
+// memory from an earlier upload and not overwritten by a run since.
+
+#define MLIMG_MAGIC 0x4d494c4d // "MLIM"
+#define MLIMG_VERSION 1
+#define MLIMG_ALIGN 64
+
+#define MLIMG_SEC_SEQ    1 // sequencer code
+#define MLIMG_SEC_CODE   2 // compute code (source of LoadCode)
+#define MLIMG_SEC_COEFF  3 // coefficients (source of LoadCoeff0/LoadCoeff1)
+#define MLIMG_SEC_DATA   4 // constant data
+#define MLIMG_SEC_INPUT  5 // input data, written by the host before each run
+#define MLIMG_SEC_OUTPUT 6 // output data, read by the host after each run
+#define MLIMG_SEC_SCRATCH 7 // other memory written by the program (no content)
+
+struct mlimg_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t file_size;
+	uint32_t entry;        // start address for Run
+	uint32_t mem_size;     // main memory size the image was assembled for
+	uint32_t sec_offset;
+	uint32_t sec_count;
+	uint32_t sym_offset;
+	uint32_t sym_count;
+	uint32_t str_offset;
+	uint32_t str_size;
+	uint32_t reserved[5];
+};
+
+struct mlimg_section {
+	uint32_t type;         // MLIMG_SEC_*
+	uint32_t name;         // string table offset
+	uint32_t addr;         // main memory address
+	uint32_t size;         // size in bytes (multiple of 4)
+	uint32_t offset;       // file offset of the content, 0 for output sections
+	uint32_t hash;         // FNV-1a hash of the content
+	uint32_t layout;       // string table offset of the input/output layout
+	uint32_t reserved;
+	uint32_t shape[4];     // dimensions of input/output sections, unused are 0
+};
+
+struct mlimg_symbol {
+	uint32_t name;         // string table offset
+	uint32_t value;
+	int32_t section;       // index of the containing section, or -1
+	uint32_t reserved;
+};
+
+static inline uint32_t mlimg_hash(const uint8_t *data, uint32_t len)
+{
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < len; i++)
+		h = (h ^ data[i]) * 16777619u;
+	return h;
+}
+
+static inline const struct mlimg_header *mlimg_hdr(const void *image)
+{
+	return (const struct mlimg_header*)image;
+}
+
+static inline const struct mlimg_section *mlimg_sections(const void *image)
+{
+	return (const struct mlimg_section*)((const uint8_t*)image + mlimg_hdr(image)->sec_offset);
+}
+
+static inline const struct mlimg_symbol *mlimg_symbols(const void *image)
+{
+	return (const struct mlimg_symbol*)((const uint8_t*)image + mlimg_hdr(image)->sym_offset);
+}
+
+static inline const char *mlimg_string(const void *image, uint32_t offset)
+{
+	return (const char*)image + mlimg_hdr(image)->str_offset + offset;
+}
+
+static inline const uint8_t *mlimg_content(const void *image, const struct mlimg_section *sec)
+{
+	return sec->offset ? (const uint8_t*)image + sec->offset : 0;
+}
+
+static inline const char *mlimg_type_name(uint32_t type)
+{
+	switch (type) {
+	case MLIMG_SEC_SEQ: return "seq";
+	case MLIMG_SEC_CODE: return "code";
+	case MLIMG_SEC_COEFF: return "coeff";
+	case MLIMG_SEC_DATA: return "data";
+	case MLIMG_SEC_INPUT: return "input";
+	case MLIMG_SEC_OUTPUT: return "output";
+	case MLIMG_SEC_SCRATCH: return "scratch";
+	}
+	return "unknown";
+}
+
+static inline int mlimg_has_content(uint32_t type)
+{
+	return type != MLIMG_SEC_OUTPUT && type != MLIMG_SEC_SCRATCH;
+}
+
+// Find a section by name, returns 0 if there is none.
+static inline const struct mlimg_section *mlimg_find(const void *image, const char *name)
+{
+	uint32_t i;
+
+	for (i = 0; i < mlimg_hdr(image)->sec_count; i++) {
+		const struct mlimg_section *sec = mlimg_sections(image) + i;
+		const char *p = mlimg_string(image, sec->name), *q = name;
+		while (*p && *p == *q)
+			p++, q++;
+		if (*p == *q)
+			return sec;
+	}
+
+	return 0;
+}
+
+// Returns 1 if the first bytes look like an image, so that loaders can fall
+// back to reading a flat bin file.
+static inline int mlimg_is_image(const void *data, uint32_t len)
+{
+	return len >= 4 && mlimg_hdr(data)->magic == MLIMG_MAGIC;
+}
+
+// Check that all tables, strings and section contents are within the len bytes
+// at image and properly aligned. Returns 0 on success, or a short description
+// of the problem. Does not verify the content hashes.
+static inline const char *mlimg_check(const void *image, uint32_t len)
+{
+	const struct mlimg_header *hdr = mlimg_hdr(image);
+	uint32_t i;
+
+	if (len < sizeof(struct mlimg_header) || hdr->magic != MLIMG_MAGIC)
+		return "bad magic";
+	if (hdr->version != MLIMG_VERSION)
+		return "unsupported version";
+	if (hdr->header_size < sizeof(struct mlimg_header) || hdr->file_size > len)
+		return "truncated file";
+	len = hdr->file_size;
+
+	if (hdr->sec_offset % MLIMG_ALIGN || hdr->sym_offset % MLIMG_ALIGN || hdr->str_offset % MLIMG_ALIGN)
+		return "misaligned table";
+	if (hdr->sec_offset > len || hdr->sec_count > (len - hdr->sec_offset) / sizeof(struct mlimg_section))
+		return "section table out of range";
+	if (hdr->sym_offset > len || hdr->sym_count > (len - hdr->sym_offset) / sizeof(struct mlimg_symbol))
+		return "symbol table out of range";
+	if (hdr->str_offset > len || hdr->str_size > len - hdr->str_offset)
+		return "string table out of range";
+	if (hdr->str_size == 0 || mlimg_string(image, hdr->str_size - 1)[0] != 0)
+		return "unterminated string table";
+
+	for (i = 0; i < hdr->sec_count; i++) {
+		const struct mlimg_section *sec = mlimg_sections(image) + i;
+		if (sec->name >= hdr->str_size || sec->layout >= hdr->str_size)
+			return "section name out of range";
+		if (sec->addr % 4 || sec->size % 4 || sec->addr > hdr->mem_size || sec->size > hdr->mem_size - sec->addr)
+			return "section outside of main memory";
+		if (sec->offset % MLIMG_ALIGN || sec->offset > len || sec->size > len - sec->offset)
+			return "section content out of range";
+		if ((sec->offset != 0) != mlimg_has_content(sec->type))
+			return "section content does not match type";
+	}
+
+	for (i = 0; i < hdr->sym_count; i++) {
+		const struct mlimg_symbol *sym = mlimg_symbols(image) + i;
+		if (sym->name >= hdr->str_size)
+			return "symbol name out of range";
+		if (sym->section < -1 || sym->section >= (int32_t)hdr->sec_count)
+			return "symbol section out of range";
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef MLISA_H
+#define MLISA_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Instruction set description shared by the assembler, the simulator, the
+// static analyzer and the disassembler (see docs/isa.md). There is one entry
+// per opcode, with the mnemonic, the operands in assembler order, the
+// accumulator lanes or coefficient banks used, and the compute pipeline issue
+// properties used by MlPipe.
+struct MlIsa
+{
+	enum kind_t {
+		KIND_INVALID,
+		KIND_SYNC,
+		KIND_CALL,
+		KIND_RETURN,
+		KIND_EXECUTE,
+		KIND_LOAD,      // LoadCode, LoadCoeff0, LoadCoeff1
+		KIND_CONTLOAD,
+		KIND_SETBP,     // SetXBP, AddXBP (compute instructions from here on)
+		KIND_STORE,     // Store*, ReLU*
+		KIND_SAVE,
+		KIND_LDACC,     // LdSet*, LdAdd*
+		KIND_MACC,      // MACC, MMAX, MACCZ, MMAXZ, MMAXN
+		KIND_NUM
+	};
+
+	// Operands, stored in the MADDR field (MADDR, LEN) or the CADDR field
+	// (CADDR, ARG).
+	enum arg_t {
+		ARG_NONE,
+		ARG_MADDR,
+		ARG_CADDR,
+		ARG_LEN,
+		ARG_ARG
+	};
+
+	enum flags_t {
+		FLAG_ADD  = 1,   // AddXBP, LdAdd*
+		FLAG_RELU = 2,   // ReLU*
+		FLAG_ZERO = 4,   // MACCZ, MMAXZ
+		FLAG_MAX  = 8,   // MMAX*
+		FLAG_NEG  = 16   // MMAXN
+	};
+
+	enum reg_t {
+		REG_VBP,
+		REG_LBP,
+		REG_SBP,
+		REG_CBP
+	};
+
+	struct op_t {
+		const char *name;
+		int opcode;
+		kind_t kind;
+		arg_t args[2];
+		int flags;
+		int reg;        // base pointer of SETBP
+		int lanes;      // accumulators (bit 0 = acc0, bit 1 = acc1) or LOAD target (0 = code, 1/2 = coeff0/1)
+
+		// compute pipeline (see mlpipe.h)
+		int mem_stage;  // stage that accesses main memory, or -1
+		bool simd;      // counts as SIMD op in the performance counters
+		bool acc_write; // modifies the accumulators
+		bool acc_wait;  // must not directly follow an instruction that modifies the accumulators
+
+		constexpr int nargs() const { return (args[0] != ARG_NONE) + (args[1] != ARG_NONE); }
+		constexpr bool valid() const { return kind != KIND_INVALID; }
+		constexpr bool compute() const { return kind >= KIND_SETBP; }
+		constexpr bool uses_maddr() const { return args[0] == ARG_MADDR || args[0] == ARG_LEN || args[1] == ARG_MADDR || args[1] == ARG_LEN; }
+		constexpr bool uses_caddr() const { return args[0] == ARG_CADDR || args[0] == ARG_ARG || args[1] == ARG_CADDR || args[1] == ARG_ARG; }
+	};
+
+	static constexpr op_t op(const char *name, int opcode, kind_t kind, arg_t arg0 = ARG_NONE,
+			arg_t arg1 = ARG_NONE, int flags = 0, int reg = 0, int lanes = 0)
+	{
+		return op_t{name, opcode, kind, {arg0, arg1}, flags, reg, lanes,
+				kind == KIND_LOAD || kind == KIND_MACC ? 0 : kind == KIND_LDACC ? 4 :
+						kind == KIND_STORE || kind == KIND_SAVE ? 9 : -1,
+				kind == KIND_MACC, kind == KIND_LDACC || kind == KIND_MACC,
+				kind == KIND_MACC && (flags & FLAG_MAX) != 0};
+	}
+
+	// Mnemonic lookup uses a perfect hash: the FNV-1a hash with this seed
+	// maps all mnemonics to different slots (checked at compile time below).
+	enum { HASH_SEED = 13445, HASH_SLOTS = 128 };
+
+	static constexpr int hash(const char *name, int len)
+	{
+		uint32_t h = HASH_SEED;
+		for (int i = 0; i < len; i++)
+			h = (h ^ uint8_t(name[i])) * 16777619u;
+		return h >> 25;
+	}
+
+	static constexpr int length(const char *name)
+	{
+		int len = 0;
+		while (name[len])
+			len++;
+		return len;
+	}
+
+	struct table_t {
+		op_t ops[64];
+		int slots[HASH_SLOTS];
+		bool collision;
+	};
+
+	static constexpr table_t make_table()
+	{
+		constexpr op_t list[] = {
+			op("Sync",         0, KIND_SYNC),
+			op("Call",         1, KIND_CALL,     ARG_MADDR),
+			op("Return",       2, KIND_RETURN),
+			op("Execute",      3, KIND_EXECUTE,  ARG_CADDR, ARG_LEN),
+			op("LoadCode",     4, KIND_LOAD,     ARG_MADDR, ARG_CADDR, 0, 0, 0),
+			op("LoadCoeff0",   5, KIND_LOAD,     ARG_MADDR, ARG_CADDR, 0, 0, 1),
+			op("LoadCoeff1",   6, KIND_LOAD,     ARG_MADDR, ARG_CADDR, 0, 0, 2),
+			op("ContinueLoad", 7, KIND_CONTLOAD, ARG_LEN),
+
+			op("SetVBP",  8, KIND_SETBP, ARG_MADDR, ARG_NONE, 0,        REG_VBP),
+			op("AddVBP",  9, KIND_SETBP, ARG_MADDR, ARG_NONE, FLAG_ADD, REG_VBP),
+			op("SetLBP", 10, KIND_SETBP, ARG_MADDR, ARG_NONE, 0,        REG_LBP),
+			op("AddLBP", 11, KIND_SETBP, ARG_MADDR, ARG_NONE, FLAG_ADD, REG_LBP),
+			op("SetSBP", 12, KIND_SETBP, ARG_MADDR, ARG_NONE, 0,        REG_SBP),
+			op("AddSBP", 13, KIND_SETBP, ARG_MADDR, ARG_NONE, FLAG_ADD, REG_SBP),
+			op("SetCBP", 14, KIND_SETBP, ARG_CADDR, ARG_NONE, 0,        REG_CBP),
+			op("AddCBP", 15, KIND_SETBP, ARG_CADDR, ARG_NONE, FLAG_ADD, REG_CBP),
+
+			op("Store",  16, KIND_STORE, ARG_MADDR, ARG_ARG, 0,         0, 3),
+			op("Store0", 17, KIND_STORE, ARG_MADDR, ARG_ARG, 0,         0, 1),
+			op("Store1", 18, KIND_STORE, ARG_MADDR, ARG_ARG, 0,         0, 2),
+			op("ReLU",   20, KIND_STORE, ARG_MADDR, ARG_ARG, FLAG_RELU, 0, 3),
+			op("ReLU0",  21, KIND_STORE, ARG_MADDR, ARG_ARG, FLAG_RELU, 0, 1),
+			op("ReLU1",  22, KIND_STORE, ARG_MADDR, ARG_ARG, FLAG_RELU, 0, 2),
+
+			op("Save",   24, KIND_SAVE,  ARG_MADDR, ARG_NONE, 0,        0, 3),
+			op("Save0",  25, KIND_SAVE,  ARG_MADDR, ARG_NONE, 0,        0, 1),
+			op("Save1",  26, KIND_SAVE,  ARG_MADDR, ARG_NONE, 0,        0, 2),
+			op("LdSet",  28, KIND_LDACC, ARG_MADDR, ARG_NONE, 0,        0, 3),
+			op("LdSet0", 29, KIND_LDACC, ARG_MADDR, ARG_NONE, 0,        0, 1),
+			op("LdSet1", 30, KIND_LDACC, ARG_MADDR, ARG_NONE, 0,        0, 2),
+			op("LdAdd",  32, KIND_LDACC, ARG_MADDR, ARG_NONE, FLAG_ADD, 0, 3),
+			op("LdAdd0", 33, KIND_LDACC, ARG_MADDR, ARG_NONE, FLAG_ADD, 0, 1),
+			op("LdAdd1", 34, KIND_LDACC, ARG_MADDR, ARG_NONE, FLAG_ADD, 0, 2),
+
+			op("MACC",   40, KIND_MACC,  ARG_MADDR, ARG_CADDR, 0,                    0, 3),
+			op("MMAX",   41, KIND_MACC,  ARG_MADDR, ARG_CADDR, FLAG_MAX,             0, 3),
+			op("MACCZ",  42, KIND_MACC,  ARG_MADDR, ARG_CADDR, FLAG_ZERO,            0, 3),
+			op("MMAXZ",  43, KIND_MACC,  ARG_MADDR, ARG_CADDR, FLAG_MAX | FLAG_ZERO, 0, 3),
+			op("MMAXN",  45, KIND_MACC,  ARG_MADDR, ARG_CADDR, FLAG_MAX | FLAG_NEG,  0, 3),
+		};
+
+		table_t t = {};
+		t.collision = false;
+
+		for (int i = 0; i < 64; i++)
+			t.ops[i] = op(nullptr, i, KIND_INVALID);
+
+		for (int i = 0; i < HASH_SLOTS; i++)
+			t.slots[i] = -1;
+
+		for (auto &o : list) {
+			int slot = hash(o.name, length(o.name));
+			t.collision = t.collision || t.slots[slot] >= 0;
+			t.slots[slot] = o.opcode;
+			t.ops[o.opcode] = o;
+		}
+
+		return t;
+	}
+};
+
+constexpr MlIsa::table_t ml_isa = MlIsa::make_table();
+static_assert(!ml_isa.collision, "MlIsa mnemonic hash collision, choose a different HASH_SEED");
+
+inline const MlIsa::op_t &ml_isa_op(int opcode)
+{
+	return ml_isa.ops[opcode & 63];
+}
+
+// Returns the instruction with the given mnemonic, or nullptr.
+inline const MlIsa::op_t *ml_isa_lookup(const char *name, int len)
+{
+	int opcode = ml_isa.slots[MlIsa::hash(name, len)];
+	if (opcode < 0)
+		return nullptr;
+
+	const MlIsa::op_t &o = ml_isa.ops[opcode];
+	if (strncmp(o.name, name, len) || o.name[len] != 0)
+		return nullptr;
+	return &o;
+}
+
+#endif
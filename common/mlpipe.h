@@ -0,0 +1,77 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#ifndef MLPIPE_H
+#define MLPIPE_H
+
+#include <stdint.h>
+
+#include "mlisa.h"
+
+// Issue model of the compute pipeline (rtl/compute.v), shared by the simulator
+// and the static analyzer. Each instruction reserves the main memory port for
+// the pipeline stage that accesses it, and MMAX-type instructions must not
+// directly follow an instruction that modifies the accumulators. Instructions
+// stall in stage 1 until there is no conflict. The per-instruction properties
+// are in the ISA table (mlisa.h).
+struct MlPipe
+{
+	// stages 0 to 9, an instruction leaves the pipeline DEPTH cycles after
+	// its issue cycle
+	enum { DEPTH = 10 };
+
+	uint32_t memlock_res = 0;
+	bool maxlock_q = false;
+
+	static bool simd(int op)
+	{
+		return ml_isa_op(op).simd;
+	}
+
+	void idle(int cycles)
+	{
+		memlock_res = cycles < 32 ? memlock_res >> cycles : 0;
+		if (cycles > 0)
+			maxlock_q = false;
+	}
+
+	// Issue one instruction. Returns the number of stall cycles before the
+	// issue cycle.
+	int issue(int op)
+	{
+		const MlIsa::op_t &o = ml_isa_op(op);
+		uint32_t mask = o.mem_stage >= 0 ? 1 << o.mem_stage : 0;
+		int stalls = 0;
+
+		while ((memlock_res & mask) != 0 || (o.acc_wait && maxlock_q)) {
+			idle(1);
+			stalls++;
+		}
+
+		memlock_res |= mask;
+		maxlock_q = false;
+		idle(1);
+
+		if (o.acc_write)
+			maxlock_q = true;
+
+		return stalls;
+	}
+};
+
+#endif
@@ -22,6 +22,7 @@
 #include <stdbool.h>
 
 #include "camera/camera.h"
+#include "mldrv.h"
 
 // a pointer to this is a null pointer, but the compiler does not
 // know that because "sram" is a linker symbol from sections.lds.
@@ -29,18 +30,14 @@ extern uint32_t sram;
 
 #define RUN_LOOP          0
 #define SER_TIMEOUT 1500000
-#define ML_TIMEOUT      100
 #define NUM_IMAGES       10
 #define IMAGE_NOPS    10000
 #define ENABLE_CAMERA     1
 
 #define reg_leds  (*(volatile uint32_t*)0x02000000)
 #define reg_uart  (*(volatile uint32_t*)0x02000004)
-#define reg_qpio  (*(volatile uint32_t*)0x02000008)
 #define reg_reset (*(volatile uint32_t*)0x0200000c)
 
-#include "demodat.inc"
-
 // --------------------------------------------------------
 
 void *memset(void *s, int c, size_t n)
@@ -182,274 +179,6 @@ char getchar()
 
 // --------------------------------------------------------
 
-void ml_start()
-{
-#if 0
-	putchar('<');
-	putchar('B');
-	putchar('E');
-	putchar('G');
-	putchar('>');
-#endif
-
-	reg_qpio = 0x80020000;
-	reg_qpio = 0x80000000;
-}
-
-void ml_send(uint8_t byte)
-{
-#if 0
-	putchar('<');
-	putchar('S');
-	puthex(byte);
-	putchar('>');
-#endif
-
-	reg_qpio = 0x80000f00 | (byte >> 4);
-	reg_qpio = 0x80010f00 | (byte >> 4);
-	reg_qpio = 0x80000f00 | (byte & 15);
-	reg_qpio = 0x80010f00 | (byte & 15);
-}
-
-uint8_t ml_recv()
-{
-	uint8_t byte = 0;
-
-	reg_qpio = 0x80000000;
-	reg_qpio = 0x80010000;
-	byte |= (reg_qpio & 15) << 4;
-	reg_qpio = 0x80000000;
-	reg_qpio = 0x80010000;
-	byte |= reg_qpio & 15;
-
-#if 0
-	putchar('<');
-	putchar('R');
-	puthex(byte);
-	putchar('>');
-#endif
-
-	return byte;
-}
-
-void ml_stop()
-{
-#if 0
-	putchar('<');
-	putchar('E');
-	putchar('N');
-	putchar('D');
-	putchar('>');
-#endif
-
-	reg_qpio = 0x80000fff;
-	reg_qpio = 0x80020000;
-}
-
-void ml_finish()
-{
-	reg_qpio = 0x00000000;
-}
-
-void ml_clear_setup()
-{
-	ml_start();
-	ml_send(0x21);
-	for (int i = 0; i < 1024; i++)
-		ml_send(0x00);
-	ml_stop();
-	ml_finish();
-}
-
-void ml_clear_block(int offset, int len)
-{
-	ml_start();
-	ml_send(0x23);
-	ml_send(offset >> 1);
-	ml_send(offset >> 9);
-	ml_send(len >> 2);
-	ml_recv();
-	for (int i = 0; ml_recv() != 0; i++)
-		if (i == ML_TIMEOUT) {
-			ml_stop();
-			ml_finish();
-			print("TIMEOUT");
-			error();
-		}
-	ml_stop();
-	ml_finish();
-}
-
-void ml_upload(int offset, const char *data, int len)
-{
-	ml_start();
-	ml_send(0x21);
-	for (int i = 0; i < len; i++)
-		ml_send(data[i]);
-	ml_stop();
-
-	ml_start();
-	ml_send(0x23);
-	ml_send(offset >> 1);
-	ml_send(offset >> 9);
-	ml_send(len >> 2);
-	ml_recv();
-	for (int i = 0; ml_recv() != 0; i++)
-		if (i == ML_TIMEOUT) {
-			ml_stop();
-			ml_finish();
-			print("TIMEOUT");
-			error();
-		}
-	ml_stop();
-
-	ml_finish();
-}
-
-void ml_upload_buf(int offset, const char *data, int len)
-{
-	char buffer[1024];
-	for (int i = 0; i < len; i++)
-		buffer[i] = data[i];
-
-	ml_start();
-	ml_send(0x21);
-	for (int i = 0; i < len; i++)
-		ml_send(buffer[i]);
-	ml_stop();
-
-	ml_start();
-	ml_send(0x23);
-	ml_send(offset >> 1);
-	ml_send(offset >> 9);
-	ml_send(len >> 2);
-	ml_recv();
-	for (int i = 0; ml_recv() != 0; i++)
-		if (i == ML_TIMEOUT) {
-			ml_stop();
-			ml_finish();
-			print("TIMEOUT");
-			error();
-		}
-	ml_stop();
-
-	ml_finish();
-}
-
-void ml_download(int offset, char *data, int len)
-{
-	ml_start();
-	ml_send(0x24);
-	ml_send(offset >> 1);
-	ml_send(offset >> 9);
-	ml_send(len >> 2);
-	ml_recv();
-	for (int i = 0; ml_recv() != 0; i++)
-		if (i == ML_TIMEOUT) {
-			ml_stop();
-			ml_finish();
-			print("TIMEOUT");
-			error();
-		}
-	ml_stop();
-
-	ml_start();
-	ml_send(0x22);
-	ml_recv();
-	for (int j = 0; j < len; j++)
-		data[j] = ml_recv();
-	ml_stop();
-
-	ml_finish();
-}
-
-void ml_run(int start)
-{
-	ml_start();
-	ml_send(0x25);
-	ml_send(start >> 1);
-	ml_send(start >> 9);
-	ml_stop();
-
-	ml_start();
-	ml_send(0x20);
-	ml_recv();
-	while (ml_recv() != 0) { }
-	ml_stop();
-
-	ml_finish();
-}
-
-void ml_test()
-{
-	for (int i = 0; i < 4; i++)
-	{
-		char buffer[128];
-		char buffer2[128];
-		char *p;
-
-		if (i == 0) {
-			print("<QPI_TEST_PATTERN_0> ");
-			p = "Testing QPI connection to accelerator.\n";
-		}
-
-		if (i == 1) {
-			p = "This is QPI test message two of four.\n";
-			print("<QPI_TEST_PATTERN_1> ");
-		}
-
-		if (i == 2) {
-			p = "And this is the third QPI test message.\n";
-			print("<QPI_TEST_PATTERN_2> ");
-		}
-
-		if (i == 3) {
-			p = "If you can read this then QPI works fine, maybe.\n";
-			print("<QPI_TEST_PATTERN_3> ");
-		}
-
-		for (int j = 0; j < 128; j++)
-			if ((buffer[j] = *(p++)) == 0)
-				break;
-
-		ml_start();
-		ml_send(0x21);
-		for (int i = 0; buffer[i]; i++)
-			ml_send(buffer[i]);
-		ml_send(0);
-		ml_stop();
-
-		p = buffer2;
-
-		ml_start();
-		ml_send(0x22);
-		ml_recv();
-		for (int i = 0; i < 128; i++) {
-			char c = ml_recv();
-			*(p++) = c;
-			if (!c) break;
-			putchar(c);
-		}
-		ml_stop();
-
-		ml_finish();
-
-		for (int i = 0; buffer[i]; i++)
-			if (buffer[i] != buffer2[i]) {
-				print("Error in byte ");
-				print_dec(i);
-				print(": got ");
-				print_dec(buffer2[i]);
-				print(", expected ");
-				print_dec(buffer[i]);
-				print(".\n");
-				error();
-			}
-	}
-}
-
-// --------------------------------------------------------
-
 void print_image() {
     uint8_t buf[30*40];
     print("Acquiring image\n");
@@ -495,170 +224,7 @@ void main()
 
 	ml_test();
 	print("\n");
-	print("Clearing..\n");
-
-	ml_clear_setup();
-
-	for (int i = 0; i < (int)sizeof(demo_hex_data); i += 1024)
-	{
-		int len = sizeof(demo_hex_data) - i;
-		if (len > 1024)
-			len = 1024;
-
-		print("  clearing ");
-		print_dec(len);
-		print(" bytes at 0x");
-		print_hex(demo_hex_start+i, 5);
-		print(".\n");
-
-		ml_clear_block(demo_hex_start+i, len);
-	}
-
-	for (int i = 0; i < (int)sizeof(demo_out_hex_data); i += 1024)
-	{
-		int len = sizeof(demo_out_hex_data) - i;
-		if (len > 1024)
-			len = 1024;
-
-		print("  clearing ");
-		print_dec(len);
-		print(" bytes at 0x");
-		print_hex(demo_out_hex_start+i, 5);
-		print(".\n");
-
-		ml_clear_block(demo_out_hex_start+i, len);
-	}
-
-	print("Uploading..\n");
-	for (int i = 0; i < (int)sizeof(demo_hex_data); i += 1024)
-	{
-		int len = sizeof(demo_hex_data) - i;
-		if (len > 1024)
-			len = 1024;
-
-		print("  writing ");
-		print_dec(len);
-		print(" bytes to 0x");
-		print_hex(demo_hex_start+i, 5);
-		print(".\n");
-
-		ml_upload_buf(demo_hex_start+i, demo_hex_data+i, len);
-	}
-
-	print("Checking..\n");
-	for (int i = 0; i < (int)sizeof(demo_hex_data); i += 1024)
-	{
-		int len = sizeof(demo_hex_data) - i;
-		if (len > 1024)
-			len = 1024;
-
-		print("  checking ");
-		print_dec(len);
-		print(" bytes at 0x");
-		print_hex(demo_hex_start+i, 5);
-		print(":");
-
-		char buffer[1024];
-		ml_download(demo_hex_start+i, buffer, len);
-
-		int errcount = 0;
-		for (int j = 0; j < len; j++) {
-			if (buffer[j] != demo_hex_data[i+j])
-				errcount++;
-		}
-
-		if (errcount != 0) {
-			print(" detected ");
-			print_dec(errcount);
-			print(" errors!\n");
-			print("      /----------------- readback ------------------\\");
-			print("      /------------------ original -----------------\\\n");
-			for (int j = 0; j < len; j += 16)
-			{
-				print("     ");
-				for (int k = 0; k < 16; k++) {
-					print(" ");
-					if (i+j+k >= (int)sizeof(demo_out_hex_data))
-						print("XX");
-					else if (buffer[j+k] == demo_hex_data[i+j+k])
-						print("--");
-					else
-						print_hex(buffer[j+k], 2);
-				}
-				print("     ");
-				for (int k = 0; k < 16; k++) {
-					print(" ");
-					if (i+j+k >= (int)sizeof(demo_out_hex_data))
-						print("XX");
-					else
-						print_hex(demo_hex_data[i+j+k], 2);
-				}
-				print("\n");
-			}
-			error();
-		} else {
-			print(" ok\n");
-		}
-	}
-
-	print("Running..\n");
-	ml_run(0);
-
-	print("Downloading..\n");
-	for (int i = 0; i < (int)sizeof(demo_out_hex_data); i += 1024)
-	{
-		int len = sizeof(demo_out_hex_data) - i;
-		if (len > 1024)
-			len = 1024;
-
-		print("  checking ");
-		print_dec(len);
-		print(" bytes at 0x");
-		print_hex(demo_out_hex_start+i, 5);
-		print(":");
-
-		char buffer[1024];
-		ml_download(demo_out_hex_start+i, buffer, len);
-
-		int errcount = 0;
-		for (int j = 0; j < len; j++) {
-			if (buffer[j] != demo_out_hex_data[i+j])
-				errcount++;
-		}
-
-		if (errcount != 0) {
-			print(" detected ");
-			print_dec(errcount);
-			print(" errors!\n");
-			print("      /----------------- readback ------------------\\");
-			print("      /------------------ original -----------------\\\n");
-			for (int j = 0; j < len; j += 16)
-			{
-				print("     ");
-				for (int k = 0; k < 16; k++) {
-					print(" ");
-					if (i+j+k >= (int)sizeof(demo_out_hex_data))
-						print("XX");
-					else if (buffer[j+k] == demo_out_hex_data[i+j+k])
-						print("--");
-					else
-						print_hex(buffer[j+k], 2);
-				}
-				print("     ");
-				for (int k = 0; k < 16; k++) {
-					print(" ");
-					if (i+j+k >= (int)sizeof(demo_out_hex_data))
-						print("XX");
-					else
-						print_hex(demo_out_hex_data[i+j+k], 2);
-				}
-				print("\n");
-			}
-			error();
-		} else {
-			print(" ok\n");
-		}
-	}
+	ml_demo();
 
 	print("Check PASSED. Reboot.\n");
 	reg_reset = 1;
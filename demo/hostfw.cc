@@ -0,0 +1,253 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "mldrv.h"
+#include "mlqpi.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Host build of the control SoC firmware's ML driver (mldrv.c, mldemo.c).
+// The HAL shim below decodes the reg_qpio bit-banging into QPI bytes for
+// MlQpi, and charges each register access with the picorv32 cycles of the
+// instructions around it: picorv32 as configured in ctrlsoc.v takes about 4
+// cycles per ALU instruction and 7 cycles per load or store (one SRAM wait
+// state for fetch and data). A write in ml_send() is one store plus about one
+// instruction computing the value, a read in ml_recv() is one load plus mask,
+// shift and or. Everything else the firmware does is not counted.
+
+struct hal_t {
+	MlQpi *qpi = nullptr;
+	double cpu_mhz = 12.0;
+	int write_cycles = 11;
+	int read_cycles = 19;
+
+	long long cpu_cycles = 0;
+	long long reg_writes = 0;
+	long long reg_reads = 0;
+
+	// register state after reset: CSB and CLK high, QPI pins owned by flash
+	bool overwrite = false, csb = true, clk = true;
+	int oe = 0, dout = 0, din = 0;
+	int nibble_idx = 0;
+	uint8_t byte = 0;
+
+	void tick(int cycles)
+	{
+		cpu_cycles += cycles;
+		qpi->now_us = std::max(qpi->now_us, cpu_cycles / cpu_mhz);
+	}
+} hal;
+
+extern "C" void ml_hal_write(uint32_t value)
+{
+	bool last_csb = hal.csb, last_clk = hal.clk;
+
+	hal.tick(hal.write_cycles);
+	hal.reg_writes++;
+
+	hal.overwrite = (value >> 31) & 1;
+	hal.csb = !hal.overwrite || ((value >> 17) & 1);
+	hal.clk = (value >> 16) & 1;
+	hal.oe = (value >> 8) & 15;
+	hal.dout = value & 15;
+
+	if (!hal.csb && last_csb) {
+		hal.qpi->begin();
+		hal.nibble_idx = 0;
+	}
+
+	if (hal.csb && !last_csb)
+		hal.qpi->end();
+
+	// MARLANN samples and drives one nibble per rising SCLK edge
+	if (!hal.csb && hal.clk && !last_clk) {
+		if (hal.oe != 0) {
+			if (hal.nibble_idx == 0)
+				hal.byte = hal.dout << 4;
+			else
+				hal.qpi->xfer(hal.byte | hal.dout);
+		} else {
+			if (hal.nibble_idx == 0)
+				hal.byte = hal.qpi->xfer(0xff);
+			hal.din = hal.nibble_idx == 0 ? hal.byte >> 4 : hal.byte & 15;
+		}
+		hal.nibble_idx ^= 1;
+	}
+
+	if (hal.oe != 0)
+		hal.din = hal.dout;
+}
+
+extern "C" uint32_t ml_hal_read()
+{
+	hal.tick(hal.read_cycles);
+	hal.reg_reads++;
+
+	return (hal.overwrite << 31) | (hal.csb << 17) | (hal.clk << 16) | (hal.oe << 8) | hal.din;
+}
+
+extern "C" void print(const char *p)
+{
+	fputs(p, stdout);
+}
+
+extern "C" void print_hex(uint32_t v, int digits)
+{
+	printf("%0*x", digits, v);
+}
+
+extern "C" void print_dec(uint32_t v)
+{
+	printf("%u", v);
+}
+
+extern "C" void error()
+{
+	printf("<ERROR>\n");
+	exit(1);
+}
+
+void help(const char *progname, int rc)
+{
+	printf("\n");
+	printf("Usage: %s [options]\n", progname);
+	printf("\n");
+	printf("  -h\n");
+	printf("    print help message\n");
+	printf("\n");
+	printf("  -v\n");
+	printf("    verbose output\n");
+	printf("\n");
+	printf("  -c mhz\n");
+	printf("    control SoC clock frequency (default = 12)\n");
+	printf("\n");
+	printf("  -w cycles\n");
+	printf("    picorv32 cycles per reg_qpio write (default = 11)\n");
+	printf("\n");
+	printf("  -r cycles\n");
+	printf("    picorv32 cycles per reg_qpio read (default = 19)\n");
+	printf("\n");
+	printf("  -a filename\n");
+	printf("    read architecture description file\n");
+	printf("\n");
+	printf("  -p name=value\n");
+	printf("    set architecture parameter (overrides -a for later options)\n");
+	printf("\n");
+	printf("  -Q name=value\n");
+	printf("    set QPI timing parameter (clk_mhz, copy_cycles)\n");
+	printf("\n");
+	printf("  -i filename\n");
+	printf("    instead of the demo, load and run this program image (.mli)\n");
+	printf("    with ml_load_image() twice (the second load skips unchanged sections)\n");
+	printf("\n");
+	exit(rc);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	bool verbose = false;
+	std::vector<const char*> timing_params;
+	std::vector<uint8_t> image;
+	MlArch arch;
+
+	while ((opt = getopt(argc, argv, "hvc:w:r:a:p:Q:i:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			help(argv[0], 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'c':
+			hal.cpu_mhz = atof(optarg);
+			break;
+		case 'w':
+			hal.write_cycles = atoi(optarg);
+			break;
+		case 'r':
+			hal.read_cycles = atoi(optarg);
+			break;
+		case 'a':
+			arch.readFile(optarg);
+			break;
+		case 'p':
+			arch.parseParam(optarg);
+			break;
+		case 'Q':
+			timing_params.push_back(optarg);
+			break;
+		case 'i': {
+			FILE *f = fopen(optarg, "rb");
+			if (f == nullptr) {
+				perror("Open image file");
+				exit(1);
+			}
+			for (int c; (c = fgetc(f)) >= 0;)
+				image.push_back(c);
+			fclose(f);
+			break;
+		}
+		default:
+			help(argv[0], 1);
+		}
+	}
+
+	if (optind != argc || hal.cpu_mhz <= 0)
+		help(argv[0], 1);
+
+	arch.check();
+
+	MlSim sim(arch);
+	MlQpi qpi({&sim});
+
+	for (auto p : timing_params)
+		qpi.setTiming(p);
+
+	// SCLK is generated by the firmware, the HAL advances the timeline
+	qpi.timing.sclk_mhz = 0;
+	qpi.verbose = verbose;
+	hal.qpi = &qpi;
+
+	if (!image.empty()) {
+		for (int i = 0; i < 2; i++) {
+			double t = qpi.now_us;
+			int entry = ml_load_image(image.data(), image.size());
+			printf("load %d: %.1f us, ", i, qpi.now_us - t);
+			t = qpi.now_us;
+			ml_run(entry);
+			printf("run %d: %.1f us\n", i, qpi.now_us - t);
+		}
+	} else {
+		ml_test();
+		print("\n");
+		ml_demo();
+		print("Check PASSED.\n");
+	}
+
+	printf("\n");
+	printf("picorv32: %lld cycles (%.1f us at %.2f MHz), %lld reg_qpio writes, %lld reads\n",
+			hal.cpu_cycles, hal.cpu_cycles / hal.cpu_mhz, hal.cpu_mhz, hal.reg_writes, hal.reg_reads);
+	qpi.printStats(stdout);
+
+	return 0;
+}
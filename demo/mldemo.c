@@ -0,0 +1,187 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "mldrv.h"
+#include "demodat.inc"
+
+void ml_demo()
+{
+	print("Clearing..\n");
+
+	ml_clear_setup();
+
+	for (int i = 0; i < (int)sizeof(demo_hex_data); i += 1024)
+	{
+		int len = sizeof(demo_hex_data) - i;
+		if (len > 1024)
+			len = 1024;
+
+		print("  clearing ");
+		print_dec(len);
+		print(" bytes at 0x");
+		print_hex(demo_hex_start+i, 5);
+		print(".\n");
+
+		ml_clear_block(demo_hex_start+i, len);
+	}
+
+	for (int i = 0; i < (int)sizeof(demo_out_hex_data); i += 1024)
+	{
+		int len = sizeof(demo_out_hex_data) - i;
+		if (len > 1024)
+			len = 1024;
+
+		print("  clearing ");
+		print_dec(len);
+		print(" bytes at 0x");
+		print_hex(demo_out_hex_start+i, 5);
+		print(".\n");
+
+		ml_clear_block(demo_out_hex_start+i, len);
+	}
+
+	print("Uploading..\n");
+	for (int i = 0; i < (int)sizeof(demo_hex_data); i += 1024)
+	{
+		int len = sizeof(demo_hex_data) - i;
+		if (len > 1024)
+			len = 1024;
+
+		print("  writing ");
+		print_dec(len);
+		print(" bytes to 0x");
+		print_hex(demo_hex_start+i, 5);
+		print(".\n");
+
+		ml_upload_buf(demo_hex_start+i, demo_hex_data+i, len);
+	}
+
+	print("Checking..\n");
+	for (int i = 0; i < (int)sizeof(demo_hex_data); i += 1024)
+	{
+		int len = sizeof(demo_hex_data) - i;
+		if (len > 1024)
+			len = 1024;
+
+		print("  checking ");
+		print_dec(len);
+		print(" bytes at 0x");
+		print_hex(demo_hex_start+i, 5);
+		print(":");
+
+		char buffer[1024];
+		ml_download(demo_hex_start+i, buffer, len);
+
+		int errcount = 0;
+		for (int j = 0; j < len; j++) {
+			if (buffer[j] != demo_hex_data[i+j])
+				errcount++;
+		}
+
+		if (errcount != 0) {
+			print(" detected ");
+			print_dec(errcount);
+			print(" errors!\n");
+			print("      /----------------- readback ------------------\\");
+			print("      /------------------ original -----------------\\\n");
+			for (int j = 0; j < len; j += 16)
+			{
+				print("     ");
+				for (int k = 0; k < 16; k++) {
+					print(" ");
+					if (i+j+k >= (int)sizeof(demo_out_hex_data))
+						print("XX");
+					else if (buffer[j+k] == demo_hex_data[i+j+k])
+						print("--");
+					else
+						print_hex(buffer[j+k], 2);
+				}
+				print("     ");
+				for (int k = 0; k < 16; k++) {
+					print(" ");
+					if (i+j+k >= (int)sizeof(demo_out_hex_data))
+						print("XX");
+					else
+						print_hex(demo_hex_data[i+j+k], 2);
+				}
+				print("\n");
+			}
+			error();
+		} else {
+			print(" ok\n");
+		}
+	}
+
+	print("Running..\n");
+	ml_run(0);
+
+	print("Downloading..\n");
+	for (int i = 0; i < (int)sizeof(demo_out_hex_data); i += 1024)
+	{
+		int len = sizeof(demo_out_hex_data) - i;
+		if (len > 1024)
+			len = 1024;
+
+		print("  checking ");
+		print_dec(len);
+		print(" bytes at 0x");
+		print_hex(demo_out_hex_start+i, 5);
+		print(":");
+
+		char buffer[1024];
+		ml_download(demo_out_hex_start+i, buffer, len);
+
+		int errcount = 0;
+		for (int j = 0; j < len; j++) {
+			if (buffer[j] != demo_out_hex_data[i+j])
+				errcount++;
+		}
+
+		if (errcount != 0) {
+			print(" detected ");
+			print_dec(errcount);
+			print(" errors!\n");
+			print("      /----------------- readback ------------------\\");
+			print("      /------------------ original -----------------\\\n");
+			for (int j = 0; j < len; j += 16)
+			{
+				print("     ");
+				for (int k = 0; k < 16; k++) {
+					print(" ");
+					if (i+j+k >= (int)sizeof(demo_out_hex_data))
+						print("XX");
+					else if (buffer[j+k] == demo_out_hex_data[i+j+k])
+						print("--");
+					else
+						print_hex(buffer[j+k], 2);
+				}
+				print("     ");
+				for (int k = 0; k < 16; k++) {
+					print(" ");
+					if (i+j+k >= (int)sizeof(demo_out_hex_data))
+						print("XX");
+					else
+						print_hex(demo_out_hex_data[i+j+k], 2);
+				}
+				print("\n");
+			}
+			error();
+		} else {
+			print(" ok\n");
+		}
+	}
+}
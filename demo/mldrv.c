@@ -0,0 +1,341 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "mldrv.h"
+#include "mlimage.h"
+
+#define ML_LOADED_MAX 16
+
+// sections uploaded by ml_load_image() that are still in main memory
+static struct {
+	uint32_t addr, size, hash;
+} ml_loaded[ML_LOADED_MAX];
+static int ml_loaded_cnt;
+
+void ml_start()
+{
+	ml_hal_write(0x80020000);
+	ml_hal_write(0x80000000);
+}
+
+void ml_send(uint8_t byte)
+{
+	ml_hal_write(0x80000f00 | (byte >> 4));
+	ml_hal_write(0x80010f00 | (byte >> 4));
+	ml_hal_write(0x80000f00 | (byte & 15));
+	ml_hal_write(0x80010f00 | (byte & 15));
+}
+
+uint8_t ml_recv()
+{
+	uint8_t byte = 0;
+
+	ml_hal_write(0x80000000);
+	ml_hal_write(0x80010000);
+	byte |= (ml_hal_read() & 15) << 4;
+	ml_hal_write(0x80000000);
+	ml_hal_write(0x80010000);
+	byte |= ml_hal_read() & 15;
+
+	return byte;
+}
+
+void ml_stop()
+{
+	ml_hal_write(0x80000fff);
+	ml_hal_write(0x80020000);
+}
+
+void ml_finish()
+{
+	ml_hal_write(0x00000000);
+}
+
+void ml_clear_setup()
+{
+	ml_start();
+	ml_send(0x21);
+	for (int i = 0; i < 1024; i++)
+		ml_send(0x00);
+	ml_stop();
+	ml_finish();
+}
+
+void ml_clear_block(int offset, int len)
+{
+	ml_start();
+	ml_send(0x23);
+	ml_send(offset >> 1);
+	ml_send(offset >> 9);
+	ml_send(len >> 2);
+	ml_recv();
+	for (int i = 0; ml_recv() != 0; i++)
+		if (i == ML_TIMEOUT) {
+			ml_stop();
+			ml_finish();
+			print("TIMEOUT");
+			error();
+		}
+	ml_stop();
+	ml_finish();
+}
+
+void ml_upload(int offset, const char *data, int len)
+{
+	ml_start();
+	ml_send(0x21);
+	for (int i = 0; i < len; i++)
+		ml_send(data[i]);
+	ml_stop();
+
+	ml_start();
+	ml_send(0x23);
+	ml_send(offset >> 1);
+	ml_send(offset >> 9);
+	ml_send(len >> 2);
+	ml_recv();
+	for (int i = 0; ml_recv() != 0; i++)
+		if (i == ML_TIMEOUT) {
+			ml_stop();
+			ml_finish();
+			print("TIMEOUT");
+			error();
+		}
+	ml_stop();
+
+	ml_finish();
+}
+
+void ml_upload_buf(int offset, const char *data, int len)
+{
+	char buffer[1024];
+	for (int i = 0; i < len; i++)
+		buffer[i] = data[i];
+
+	ml_start();
+	ml_send(0x21);
+	for (int i = 0; i < len; i++)
+		ml_send(buffer[i]);
+	ml_stop();
+
+	ml_start();
+	ml_send(0x23);
+	ml_send(offset >> 1);
+	ml_send(offset >> 9);
+	ml_send(len >> 2);
+	ml_recv();
+	for (int i = 0; ml_recv() != 0; i++)
+		if (i == ML_TIMEOUT) {
+			ml_stop();
+			ml_finish();
+			print("TIMEOUT");
+			error();
+		}
+	ml_stop();
+
+	ml_finish();
+}
+
+void ml_download(int offset, char *data, int len)
+{
+	ml_start();
+	ml_send(0x24);
+	ml_send(offset >> 1);
+	ml_send(offset >> 9);
+	ml_send(len >> 2);
+	ml_recv();
+	for (int i = 0; ml_recv() != 0; i++)
+		if (i == ML_TIMEOUT) {
+			ml_stop();
+			ml_finish();
+			print("TIMEOUT");
+			error();
+		}
+	ml_stop();
+
+	ml_start();
+	ml_send(0x22);
+	ml_recv();
+	for (int j = 0; j < len; j++)
+		data[j] = ml_recv();
+	ml_stop();
+
+	ml_finish();
+}
+
+void ml_run(int start)
+{
+	ml_start();
+	ml_send(0x25);
+	ml_send(start >> 1);
+	ml_send(start >> 9);
+	ml_stop();
+
+	ml_start();
+	ml_send(0x20);
+	ml_recv();
+	while (ml_recv() != 0) { }
+	ml_stop();
+
+	ml_finish();
+}
+
+void ml_test()
+{
+	for (int i = 0; i < 4; i++)
+	{
+		char buffer[128];
+		char buffer2[128];
+		char *p;
+
+		if (i == 0) {
+			print("<QPI_TEST_PATTERN_0> ");
+			p = "Testing QPI connection to accelerator.\n";
+		}
+
+		if (i == 1) {
+			p = "This is QPI test message two of four.\n";
+			print("<QPI_TEST_PATTERN_1> ");
+		}
+
+		if (i == 2) {
+			p = "And this is the third QPI test message.\n";
+			print("<QPI_TEST_PATTERN_2> ");
+		}
+
+		if (i == 3) {
+			p = "If you can read this then QPI works fine, maybe.\n";
+			print("<QPI_TEST_PATTERN_3> ");
+		}
+
+		for (int j = 0; j < 128; j++)
+			if ((buffer[j] = *(p++)) == 0)
+				break;
+
+		ml_start();
+		ml_send(0x21);
+		for (int i = 0; buffer[i]; i++)
+			ml_send(buffer[i]);
+		ml_send(0);
+		ml_stop();
+
+		p = buffer2;
+
+		ml_start();
+		ml_send(0x22);
+		ml_recv();
+		for (int i = 0; i < 128; i++) {
+			char c = ml_recv();
+			*(p++) = c;
+			if (!c) break;
+		}
+		ml_stop();
+
+		ml_finish();
+
+		buffer2[127] = 0;
+		print(buffer2);
+
+		for (int i = 0; buffer[i]; i++)
+			if (buffer[i] != buffer2[i]) {
+				print("Error in byte ");
+				print_dec(i);
+				print(": got ");
+				print_dec(buffer2[i]);
+				print(", expected ");
+				print_dec(buffer[i]);
+				print(".\n");
+				error();
+			}
+	}
+}
+
+void ml_forget_image()
+{
+	ml_loaded_cnt = 0;
+}
+
+static void ml_forget_range(uint32_t addr, uint32_t size)
+{
+	for (int i = 0; i < ml_loaded_cnt; i++)
+		if (ml_loaded[i].addr < addr + size && addr < ml_loaded[i].addr + ml_loaded[i].size)
+			ml_loaded[i--] = ml_loaded[--ml_loaded_cnt];
+}
+
+// Sequencer code, compute code and coefficients are only read by the
+// program, so they are uploaded again only when they changed. Data sections
+// may be written by the program (Store/Save) and are uploaded every time.
+static int ml_is_cached(const struct mlimg_section *sec)
+{
+	return sec->type == MLIMG_SEC_SEQ || sec->type == MLIMG_SEC_CODE || sec->type == MLIMG_SEC_COEFF;
+}
+
+static int ml_is_loaded(const struct mlimg_section *sec)
+{
+	for (int i = 0; i < ml_loaded_cnt; i++)
+		if (ml_loaded[i].addr == sec->addr && ml_loaded[i].size == sec->size && ml_loaded[i].hash == sec->hash)
+			return 1;
+	return 0;
+}
+
+int ml_load_image(const void *image, int len)
+{
+	const char *err = mlimg_check(image, len);
+
+	if (err) {
+		print("Invalid image: ");
+		print(err);
+		print("\n");
+		error();
+	}
+
+	const struct mlimg_header *hdr = mlimg_hdr(image);
+	const struct mlimg_section *sections = mlimg_sections(image);
+
+	for (int i = 0; i < (int)hdr->sec_count; i++)
+	{
+		const struct mlimg_section *sec = &sections[i];
+
+		if (!mlimg_has_content(sec->type))
+			continue;
+
+		if (ml_is_cached(sec) && ml_is_loaded(sec))
+			continue;
+
+		ml_forget_range(sec->addr, sec->size);
+
+		const char *content = (const char*)mlimg_content(image, sec);
+		for (int k = 0; k < (int)sec->size; k += 1024) {
+			int n = sec->size - k < 1024 ? sec->size - k : 1024;
+			ml_upload(sec->addr + k, content + k, n);
+		}
+
+		if (ml_is_cached(sec) && ml_loaded_cnt < ML_LOADED_MAX) {
+			ml_loaded[ml_loaded_cnt].addr = sec->addr;
+			ml_loaded[ml_loaded_cnt].size = sec->size;
+			ml_loaded[ml_loaded_cnt].hash = sec->hash;
+			ml_loaded_cnt++;
+		}
+	}
+
+	// the runs of the program overwrite its output and scratch sections
+	for (int i = 0; i < (int)hdr->sec_count; i++)
+		if (!mlimg_has_content(sections[i].type))
+			ml_forget_range(sections[i].addr, sections[i].size);
+
+	return hdr->entry;
+}
@@ -0,0 +1,85 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef MLDRV_H
+#define MLDRV_H
+
+#include <stdint.h>
+
+// Driver for a MARLANN core connected to the flash I/O pins of the control
+// SoC. The QPI protocol is bit-banged through the reg_qpio register. When
+// compiled with ML_HOST the register accesses go to a HAL shim instead (see
+// hostfw.cc), so the same driver runs natively against the simulator.
+
+#define ML_TIMEOUT 100
+
+#ifdef ML_HOST
+#  ifdef __cplusplus
+extern "C" {
+#  endif
+uint32_t ml_hal_read();
+void ml_hal_write(uint32_t value);
+#  ifdef __cplusplus
+}
+#  endif
+#else
+#  define reg_qpio (*(volatile uint32_t*)0x02000008)
+static inline uint32_t ml_hal_read() { return reg_qpio; }
+static inline void ml_hal_write(uint32_t value) { reg_qpio = value; }
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// console functions provided by the firmware
+void print(const char *p);
+void print_hex(uint32_t v, int digits);
+void print_dec(uint32_t v);
+void error();
+
+void ml_start();
+void ml_send(uint8_t byte);
+uint8_t ml_recv();
+void ml_stop();
+void ml_finish();
+
+void ml_clear_setup();
+void ml_clear_block(int offset, int len);
+void ml_upload(int offset, const char *data, int len);
+void ml_upload_buf(int offset, const char *data, int len);
+void ml_download(int offset, char *data, int len);
+void ml_run(int start);
+void ml_test();
+
+// Upload the sections of a program image (common/mlimage.h) and return its
+// entry point. Sequencer code, compute code and coefficient sections that are
+// still in main memory from an earlier ml_load_image() with the same hash are
+// skipped, data and input sections are always uploaded. Sections in the output
+// and scratch ranges the program writes are not skipped later. Use
+// ml_forget_image() after anything else modified main memory.
+int ml_load_image(const void *image, int len);
+void ml_forget_image();
+
+// clear, upload, check, run, and check the output of the demo program (mldemo.c)
+void ml_demo();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "mlarch.h"
+#include "mlfile.h"
+#include "mlimage.h"
+#include "mlisa.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Word types: the image section types, or WORD_RAW for words from .bin and
+// .hex files, which are disassembled if they decode as valid instruction.
+enum {
+	WORD_NONE = 0,
+	WORD_RAW = 0xff
+};
+
+MlArch arch;
+bool source = false;
+
+std::vector<uint32_t> mem;
+std::vector<uint8_t> mem_type;
+std::map<int, std::vector<std::string>> labels;
+
+struct tensor_t {
+	bool output;
+	int addr;
+	std::string name;
+	std::string shape;
+	std::string layout;
+};
+
+std::vector<tensor_t> tensors;
+int entry = -1;
+
+void help(const char *progname, int rc)
+{
+	printf("\n");
+	printf("Usage: %s [options] [bin-hex-or-image-file]\n", progname);
+	printf("\n");
+	printf("  -h\n");
+	printf("    print help message\n");
+	printf("\n");
+	printf("  -s\n");
+	printf("    write assembler source instead of a listing with addresses and words\n");
+	printf("\n");
+	printf("  -o filename\n");
+	printf("    write output to this file (default = stdout)\n");
+	printf("\n");
+	printf("  -a filename\n");
+	printf("    read architecture description file\n");
+	printf("\n");
+	printf("  -p name=value\n");
+	printf("    set architecture parameter (overrides -a for later options)\n");
+	printf("\n");
+	exit(rc);
+}
+
+void set_byte(int addr, uint8_t value)
+{
+	if (addr < 0 || addr >= arch.mem_size) {
+		fprintf(stderr, "MlDis error: Input exceeds the %d bytes main memory.\n", arch.mem_size);
+		exit(1);
+	}
+
+	mem[addr/4] |= uint32_t(value) << (8*(addr%4));
+	mem_type[addr/4] = WORD_RAW;
+}
+
+void read_image(const uint8_t *image, int len)
+{
+	const char *err = mlimg_check(image, len);
+
+	if (err == nullptr && int(mlimg_hdr(image)->mem_size) > arch.mem_size)
+		err = "image is for a larger main memory";
+
+	if (err != nullptr) {
+		fprintf(stderr, "MlDis error: Invalid program image: %s.\n", err);
+		exit(1);
+	}
+
+	auto hdr = mlimg_hdr(image);
+	entry = hdr->entry;
+
+	for (int i = 0; i < int(hdr->sec_count); i++)
+	{
+		auto sec = mlimg_sections(image) + i;
+		auto content = mlimg_content(image, sec);
+
+		if (sec->type == MLIMG_SEC_INPUT || sec->type == MLIMG_SEC_OUTPUT) {
+			tensor_t t;
+			t.output = sec->type == MLIMG_SEC_OUTPUT;
+			t.addr = sec->addr;
+			t.name = mlimg_string(image, sec->name);
+			t.layout = mlimg_string(image, sec->layout);
+			for (int k = 0; k < 4 && sec->shape[k] != 0; k++)
+				t.shape += (k ? "x" : "") + std::to_string(sec->shape[k]);
+			tensors.push_back(t);
+		}
+
+		if (content == nullptr)
+			continue;
+
+		for (int k = 0; k < int(sec->size); k++)
+			set_byte(sec->addr + k, content[k]);
+		for (int k = 0; k < int(sec->size); k += 4)
+			mem_type[(sec->addr + k)/4] = sec->type;
+	}
+
+	for (int i = 0; i < int(hdr->sym_count); i++) {
+		auto sym = mlimg_symbols(image) + i;
+		labels[sym->value].push_back(mlimg_string(image, sym->name));
+	}
+}
+
+void read_hex(const uint8_t *text, int len)
+{
+	int cursor = 0;
+
+	for (int i = 0; i < len;)
+	{
+		if (strchr(" \t\r\n", text[i])) {
+			i++;
+			continue;
+		}
+
+		bool addr = text[i] == '@';
+		int value = 0, j = addr ? i+1 : i;
+
+		for (; j < len && !strchr(" \t\r\n", text[j]); j++) {
+			int c = text[j];
+			int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+					c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+			if (d < 0) {
+				fprintf(stderr, "MlDis error: Invalid character '%c' in hex file.\n", c);
+				exit(1);
+			}
+			value = 16*value + d;
+		}
+
+		if (addr)
+			cursor = value;
+		else
+			set_byte(cursor++, value);
+		i = j;
+	}
+}
+
+// Disassemble one instruction word. Returns false for unknown opcodes and
+// for words with bits set outside of the fields used by the instruction.
+bool disassemble(uint32_t x, std::string &out)
+{
+	const MlIsa::op_t &isa = ml_isa_op(arch.insn_op(x));
+	int maddr = arch.insn_maddr(x);
+	int caddr = arch.insn_caddr(x);
+
+	int used_bits = arch.maddr_shift() + arch.maddr_bits;
+
+	if (!isa.valid() || (used_bits < 32 && (x >> used_bits) != 0) ||
+			(!isa.uses_maddr() && maddr != 0) || (!isa.uses_caddr() && caddr != 0))
+		return false;
+
+	// absolute main memory addresses are printed as labels where possible
+	bool absolute = isa.kind == MlIsa::KIND_CALL || isa.kind == MlIsa::KIND_LOAD ||
+			(isa.kind == MlIsa::KIND_SETBP && !(isa.flags & MlIsa::FLAG_ADD));
+
+	char buffer[64];
+	out = isa.name;
+
+	for (int i = 0; i < isa.nargs(); i++)
+	{
+		out += i ? ", " : " ";
+
+		switch (isa.args[i])
+		{
+		case MlIsa::ARG_MADDR:
+			snprintf(buffer, sizeof(buffer), "0x%05x", maddr);
+			if (absolute && labels.count(maddr)) {
+				if (source) {
+					out += labels.at(maddr).back();
+					continue;
+				}
+				out += buffer;
+				out += " <" + labels.at(maddr).back() + ">";
+				continue;
+			}
+			break;
+		case MlIsa::ARG_CADDR:
+			snprintf(buffer, sizeof(buffer), "0x%03x", caddr);
+			break;
+		case MlIsa::ARG_LEN:
+			snprintf(buffer, sizeof(buffer), "%d", maddr);
+			break;
+		case MlIsa::ARG_ARG:
+			snprintf(buffer, sizeof(buffer), "%d", caddr);
+			break;
+		default:
+			buffer[0] = 0;
+		}
+
+		out += buffer;
+	}
+
+	return true;
+}
+
+bool is_insn_word(int i)
+{
+	return mem_type[i] == MLIMG_SEC_SEQ || mem_type[i] == MLIMG_SEC_CODE || mem_type[i] == WORD_RAW;
+}
+
+void write_listing(FILE *f)
+{
+	std::string text;
+
+	for (int i = 0; i < int(mem.size()); i++)
+	{
+		if (mem_type[i] == WORD_NONE)
+			continue;
+
+		if (labels.count(4*i))
+			for (auto &name : labels.at(4*i))
+				fprintf(f, "%s:\n", name.c_str());
+
+		if (!is_insn_word(i) || !disassemble(mem[i], text)) {
+			uint32_t w = mem[i];
+			char buffer[64];
+			snprintf(buffer, sizeof(buffer), ".data 0x%02x 0x%02x 0x%02x 0x%02x",
+					w & 0xff, (w >> 8) & 0xff, (w >> 16) & 0xff, w >> 24);
+			text = buffer;
+		}
+
+		fprintf(f, "%05x: %08x  %s\n", 4*i, mem[i], text.c_str());
+	}
+}
+
+void write_source(FILE *f)
+{
+	std::string text;
+	int state = WORD_NONE;
+	int cursor = -1;
+
+	if (entry >= 0) {
+		if (labels.count(entry))
+			fprintf(f, ".entry %s\n", labels.at(entry).back().c_str());
+		else
+			fprintf(f, ".entry 0x%05x\n", entry);
+	}
+
+	for (auto &t : tensors)
+		fprintf(f, "%s %s, 0x%05x, %s%s%s\n", t.output ? ".output" : ".input",
+				t.name.c_str(), t.addr, t.shape.c_str(), t.layout.empty() ? "" : ", ", t.layout.c_str());
+
+	for (int i = 0; i < int(mem.size()); i++)
+	{
+		if (mem_type[i] == WORD_NONE)
+			continue;
+
+		bool insn = is_insn_word(i) && disassemble(mem[i], text);
+
+		if (cursor != 4*i || state != (insn ? 1 : 2)) {
+			fprintf(f, "\n%s 0x%05x\n", insn ? ".code" : ".data", 4*i);
+			state = insn ? 1 : 2;
+		}
+
+		if (labels.count(4*i))
+			for (auto &name : labels.at(4*i))
+				fprintf(f, "%s:\n", name.c_str());
+
+		if (insn) {
+			fprintf(f, "\t%s\n", text.c_str());
+		} else {
+			uint32_t w = mem[i];
+			fprintf(f, "\t0x%02x 0x%02x 0x%02x 0x%02x\n", w & 0xff, (w >> 8) & 0xff, (w >> 16) & 0xff, w >> 24);
+		}
+
+		cursor = 4*i + 4;
+	}
+
+	// symbols that do not point to a word of the program
+	for (auto &it : labels)
+		if (it.first < 0 || it.first >= 4*int(mem.size()) || mem_type[it.first/4] == WORD_NONE || it.first % 4 != 0)
+			for (auto &name : it.second)
+				fprintf(f, ".sym %s %d\n", name.c_str(), it.first);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	const char *input_filename = nullptr;
+	std::string output_filename;
+
+	while ((opt = getopt(argc, argv, "hso:a:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			help(argv[0], 0);
+			break;
+		case 's':
+			source = true;
+			break;
+		case 'o':
+			output_filename = optarg;
+			break;
+		case 'a':
+			arch.readFile(optarg);
+			break;
+		case 'p':
+			arch.parseParam(optarg);
+			break;
+		default:
+			help(argv[0], 1);
+		}
+	}
+
+	if (optind+1 == argc)
+		input_filename = argv[optind++];
+
+	if (optind != argc)
+		help(argv[0], 1);
+
+	arch.check();
+
+	mem.resize(arch.mem_size / 4);
+	mem_type.resize(arch.mem_size / 4);
+
+	size_t input_len = 0;
+	std::vector<uint8_t> input_buffer;
+	const uint8_t *input = ml_map_file(input_filename, input_len, input_buffer, "input");
+	int n = input_filename ? strlen(input_filename) : 0;
+
+	if (mlimg_is_image(input, input_len)) {
+		read_image(input, input_len);
+	} else if (n > 4 && !strcmp(input_filename + n - 4, ".hex")) {
+		read_hex(input, input_len);
+	} else {
+		for (int i = 0; i < int(input_len); i++)
+			set_byte(i, input[i]);
+	}
+
+	FILE *f = stdout;
+	if (!output_filename.empty() && output_filename != "-") {
+		f = fopen(output_filename.c_str(), "wt");
+		if (f == nullptr) {
+			perror("Open output file");
+			exit(1);
+		}
+	}
+
+	if (source)
+		write_source(f);
+	else
+		write_listing(f);
+
+	if (f != stdout)
+		fclose(f);
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+
+#include "mlasm.h"
+#include "mlfile.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void help(const char *progname, int rc)
+{
+	printf("\n");
+	printf("Usage: %s [options] object-file[@addr]...\n", progname);
+	printf("\n");
+	printf("Link objects written with \"mlasm -c\". Each object is placed at the given\n");
+	printf("address, or at the next 64-byte boundary after the previous object.\n");
+	printf("\n");
+	printf("  -h\n");
+	printf("    print help message\n");
+	printf("\n");
+	printf("  -v\n");
+	printf("    verbose output\n");
+	printf("\n");
+	printf("  -o filename\n");
+	printf("    write Verilog .hex file\n");
+	printf("\n");
+	printf("  -b filename\n");
+	printf("    write binary file\n");
+	printf("\n");
+	printf("  -i filename\n");
+	printf("    write program image (.mli) file\n");
+	printf("\n");
+	printf("  -H filename\n");
+	printf("    write C/C++ header with the entry point and input/output tensor offsets\n");
+	printf("\n");
+	printf("  -P prefix\n");
+	printf("    prefix for the names in the -H header (default = header file name)\n");
+	printf("\n");
+	printf("  -m filename\n");
+	printf("    write .sym definitions of the allocated buffers, coefficient tensors and kernels\n");
+	printf("\n");
+	printf("  -s filename\n");
+	printf("    write static cycle analysis report (cycles, call depth, memory usage)\n");
+	printf("\n");
+	printf("  -l\n");
+	printf("    include the source listing annotated with cycles in the -s report\n");
+	printf("\n");
+	printf("  -d cycles\n");
+	printf("    fail if the static analysis exceeds this number of cycles\n");
+	printf("\n");
+	printf("  -O\n");
+	printf("    optimize sequencer code (see docs/asm.md)\n");
+	printf("\n");
+	printf("  -a filename\n");
+	printf("    read architecture description file\n");
+	printf("\n");
+	printf("  -p name=value\n");
+	printf("    set architecture parameter (overrides -a for later options)\n");
+	printf("\n");
+	exit(rc);
+}
+
+FILE *open_output(const std::string &filename, const char *mode, const char *what)
+{
+	if (filename == "-")
+		return stdout;
+
+	FILE *f = fopen(filename.c_str(), mode);
+	if (f == nullptr) {
+		perror(what);
+		exit(1);
+	}
+	return f;
+}
+
+void close_output(FILE *f)
+{
+	if (f != stdout)
+		fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	bool verbose = false;
+	std::string hex_filename;
+	std::string bin_filename;
+	std::string image_filename;
+	std::string header_filename;
+	std::string header_prefix;
+	bool header_prefix_set = false;
+	std::string report_filename;
+	std::string plan_filename;
+	bool report_listing = false;
+	long long deadline = -1;
+	bool optimize = false;
+	MlArch arch;
+
+	while ((opt = getopt(argc, argv, "hvo:b:i:H:P:m:s:ld:Oa:p:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			help(argv[0], 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'o':
+			hex_filename = optarg;
+			break;
+		case 'b':
+			bin_filename = optarg;
+			break;
+		case 'i':
+			image_filename = optarg;
+			break;
+		case 'H':
+			header_filename = optarg;
+			break;
+		case 'P':
+			header_prefix = optarg;
+			header_prefix_set = true;
+			break;
+		case 'm':
+			plan_filename = optarg;
+			break;
+		case 's':
+			report_filename = optarg;
+			break;
+		case 'l':
+			report_listing = true;
+			break;
+		case 'd':
+			deadline = atoll(optarg);
+			break;
+		case 'O':
+			optimize = true;
+			break;
+		case 'a':
+			arch.readFile(optarg);
+			break;
+		case 'p':
+			arch.parseParam(optarg);
+			break;
+		default:
+			help(argv[0], 1);
+		}
+	}
+
+	if (optind == argc)
+		help(argv[0], 1);
+
+	arch.check();
+
+	MlAsm worker(arch);
+
+	if (verbose)
+		worker.verbose = true;
+
+	if (optimize)
+		worker.optimize = true;
+
+	for (; optind < argc; optind++)
+	{
+		// "prog.mlo@0x2000" places the object at 0x2000
+		std::string filename = argv[optind];
+		int base = -1;
+
+		size_t at = filename.rfind('@');
+		if (at != std::string::npos) {
+			char *endptr = nullptr;
+			base = strtol(filename.c_str() + at + 1, &endptr, 0);
+			if (at+1 == filename.size() || *endptr || base < 0) {
+				fprintf(stderr, "MlLd error: Invalid address in '%s'.\n", argv[optind]);
+				exit(1);
+			}
+			filename = filename.substr(0, at);
+		}
+
+		// the object stays mapped, the linked program refers to its text
+		size_t len = 0;
+		std::vector<uint8_t> buffer;
+		const char *text = (const char*)ml_map_file(filename.c_str(), len, buffer, "object");
+		worker.linkObject(text, len, filename.c_str(), base);
+	}
+
+	worker.assemble();
+
+	if (!report_filename.empty() || deadline >= 0) {
+		FILE *fOut = report_filename.empty() ? nullptr : open_output(report_filename, "wt", "Open output report file");
+		long long cycles = worker.analyze(fOut, report_listing);
+		if (fOut != nullptr)
+			close_output(fOut);
+		if (deadline >= 0 && cycles > deadline) {
+			fprintf(stderr, "MlLd analysis error: Program takes %lld cycles, exceeding "
+					"the deadline of %lld cycles.\n", cycles, deadline);
+			exit(1);
+		}
+	}
+
+	if (!hex_filename.empty()) {
+		FILE *fOut = open_output(hex_filename, "wt", "Open output hex file");
+		worker.writeHexFile(fOut);
+		close_output(fOut);
+	}
+
+	if (!bin_filename.empty()) {
+		FILE *fOut = open_output(bin_filename, "wt", "Open output bin file");
+		worker.writeBinFile(fOut);
+		close_output(fOut);
+	}
+
+	if (!image_filename.empty()) {
+		FILE *fOut = open_output(image_filename, "wb", "Open output image file");
+		worker.writeImageFile(fOut);
+		close_output(fOut);
+	}
+
+	if (!plan_filename.empty()) {
+		FILE *fOut = open_output(plan_filename, "wt", "Open output plan file");
+		worker.writePlanFile(fOut);
+		close_output(fOut);
+	}
+
+	if (!header_filename.empty()) {
+		FILE *fOut = open_output(header_filename, "wt", "Open output header file");
+		if (!header_prefix_set) {
+			// "path/demo_prog.h" -> "demo_prog_"
+			std::string base = header_filename.substr(header_filename.find_last_of('/') + 1);
+			base = base.substr(0, base.find('.'));
+			header_prefix.clear();
+			for (char ch : base)
+				header_prefix += isalnum(ch) ? ch : '_';
+			if (!header_prefix.empty())
+				header_prefix += "_";
+		}
+		worker.writeHeaderFile(fOut, header_prefix);
+		close_output(fOut);
+	}
+
+	return 0;
+}
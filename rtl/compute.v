@@ -35,7 +35,8 @@ module marlann_compute #(
 	input  [63:0] mem_rdata,
 
 	output        tick_simd,
-	output        tick_nosimd
+	output        tick_nosimd,
+	output        tick_stall
 );
 	integer i;
 
@@ -175,6 +176,7 @@ module marlann_compute #(
 	end
 
 	assign cmd_ready = !s1_stall;
+	assign tick_stall = s1_en && s1_stall;
 
 	assign busy = |{s1_en, s2_en, s3_en, s5_en, s6_en, s7_en, s8_en, s9_en};
 
@@ -60,7 +60,23 @@ module marlann_memory_spram (
 	input  [15:0] wdata,
 	output [15:0] rdata
 );
-`ifdef RADIANT
+`ifdef VERILATOR
+	// behavioral model of the SPRAM for Verilator: the output register
+	// only updates on reads
+	reg [15:0] mem [0:16383];
+	reg [15:0] rdata_q;
+
+	always @(posedge clock) begin
+		if (|wen) begin
+			if (wen[0]) mem[addr][ 7:0] <= wdata[ 7:0];
+			if (wen[1]) mem[addr][15:8] <= wdata[15:8];
+		end else begin
+			rdata_q <= mem[addr];
+		end
+	end
+
+	assign rdata = rdata_q;
+`elsif RADIANT
 	(* keep *)
 	SP256K spram (
 		.AD(addr[13:0]),
@@ -0,0 +1,432 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "Vmarlann_top.h"
+#include "verilated.h"
+
+#if VM_TRACE
+#  include "verilated_fst_c.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Verilator testbench for marlann_top (built with -DQPI -DVERILATOR). Same
+// flow as testbench_qpi.v: upload the program, read it back, run it, and
+// optionally compare the results against an expected .hex file.
+
+std::unique_ptr<VerilatedContext> context;
+std::unique_ptr<Vmarlann_top> top;
+
+#if VM_TRACE
+std::unique_ptr<VerilatedFstC> tracer;
+#endif
+
+long long cycle_cnt = 0;
+int sclk_div = 2;
+bool verbose = false;
+
+void eval()
+{
+	top->eval();
+#if VM_TRACE
+	if (tracer)
+		tracer->dump(context->time());
+#endif
+}
+
+void tick(int cycles = 1)
+{
+	for (int i = 0; i < cycles; i++) {
+		context->timeInc(5);
+		top->clock = 0;
+		eval();
+		context->timeInc(5);
+		top->clock = 1;
+		eval();
+		cycle_cnt++;
+	}
+}
+
+// ---- QPI driver model ----
+
+void qpi_negedge()
+{
+	tick(sclk_div);
+	top->qpi_clk = 0;
+	eval();
+}
+
+void qpi_posedge()
+{
+	tick(sclk_div);
+	top->qpi_clk = 1;
+	eval();
+}
+
+void qpi_start()
+{
+	tick(sclk_div);
+	top->qpi_csb = 0;
+	eval();
+}
+
+void qpi_stop()
+{
+	qpi_negedge();
+	tick(sclk_div);
+	top->qpi_csb = 1;
+	eval();
+	tick(sclk_div);
+	top->qpi_clk = 1;
+	eval();
+}
+
+void qpi_send(uint8_t byte)
+{
+	qpi_negedge();
+	top->qpi_io_in = byte >> 4;
+	qpi_posedge();
+
+	qpi_negedge();
+	top->qpi_io_in = byte & 15;
+	qpi_posedge();
+}
+
+// dummy byte for transfering control of the I/O lines to MARLANN
+void qpi_wait()
+{
+	qpi_negedge();
+	qpi_posedge();
+	qpi_negedge();
+	qpi_posedge();
+}
+
+uint8_t qpi_recv()
+{
+	uint8_t byte;
+
+	qpi_negedge();
+	qpi_posedge();
+	byte = top->qpi_io_out << 4;
+
+	qpi_negedge();
+	qpi_posedge();
+	byte |= top->qpi_io_out & 15;
+
+	return byte;
+}
+
+void qpi_copy(uint8_t cmd, int addr, int len)
+{
+	qpi_start();
+	qpi_send(cmd);
+	qpi_send(addr >> 1);
+	qpi_send(addr >> 9);
+	qpi_send(len >> 2);
+	qpi_wait();
+	while (qpi_recv() != 0) { }
+	qpi_stop();
+}
+
+void qpi_upload(int addr, const uint8_t *data, int len)
+{
+	qpi_start();
+	qpi_send(0x21);
+	for (int i = 0; i < len; i++)
+		qpi_send(data[i]);
+	qpi_stop();
+
+	qpi_copy(0x23, addr, len);
+}
+
+void qpi_download(int addr, uint8_t *data, int len)
+{
+	qpi_copy(0x24, addr, len);
+
+	qpi_start();
+	qpi_send(0x22);
+	qpi_wait();
+	for (int i = 0; i < len; i++)
+		data[i] = qpi_recv();
+	qpi_stop();
+}
+
+long long qpi_run(int addr)
+{
+	qpi_start();
+	qpi_send(0x25);
+	qpi_send(addr >> 1);
+	qpi_send(addr >> 9);
+	qpi_stop();
+
+	long long start_cycle = cycle_cnt;
+
+	qpi_start();
+	qpi_send(0x20);
+	qpi_wait();
+	while (qpi_recv() != 0) { }
+	qpi_stop();
+
+	return cycle_cnt - start_cycle;
+}
+
+// ---- program files ----
+
+void read_hex(const char *filename, std::map<int, uint8_t> &mem)
+{
+	FILE *f = fopen(filename, "r");
+	char token[64];
+	int cursor = 0;
+
+	if (f == nullptr) {
+		perror("Open hex file");
+		exit(1);
+	}
+
+	while (fscanf(f, "%63s", token) == 1) {
+		if (token[0] == '@')
+			cursor = strtol(token+1, nullptr, 16);
+		else
+			mem[cursor++] = strtol(token, nullptr, 16);
+	}
+
+	fclose(f);
+}
+
+void read_bin(const char *filename, std::map<int, uint8_t> &mem)
+{
+	FILE *f = fopen(filename, "rb");
+	int c, cursor = 0;
+
+	if (f == nullptr) {
+		perror("Open bin file");
+		exit(1);
+	}
+
+	while ((c = fgetc(f)) >= 0)
+		mem[cursor++] = c;
+
+	fclose(f);
+}
+
+void read_program(const char *filename, std::map<int, uint8_t> &mem)
+{
+	int n = strlen(filename);
+
+	if (n > 4 && !strcmp(filename + n - 4, ".hex"))
+		read_hex(filename, mem);
+	else
+		read_bin(filename, mem);
+}
+
+// split defined bytes into 4-byte aligned chunks of at most 1kB
+std::vector<std::pair<int, int>> regions(const std::map<int, uint8_t> &mem)
+{
+	std::vector<std::pair<int, int>> result;
+
+	for (auto it = mem.begin(); it != mem.end();) {
+		int start = it->first & ~3, end = start;
+		while (it != mem.end() && it->first < end + 4 && it->first < start + 1024) {
+			end = (it->first & ~3) + 4;
+			++it;
+		}
+		result.push_back(std::make_pair(start, end - start));
+	}
+
+	return result;
+}
+
+int check(const std::map<int, uint8_t> &mem, const char *what)
+{
+	std::vector<uint8_t> buffer(1024);
+	int errors = 0;
+
+	for (auto &r : regions(mem)) {
+		if (verbose)
+			printf("  downloading %4d bytes from 0x%05x\n", r.second, r.first);
+		qpi_download(r.first, buffer.data(), r.second);
+		for (int i = 0; i < r.second; i++) {
+			auto it = mem.find(r.first + i);
+			if (it != mem.end() && it->second != buffer[i]) {
+				if (errors++ < 10)
+					printf("ERROR in %s at 0x%05x: expected 0x%02x, got 0x%02x\n",
+							what, r.first + i, it->second, buffer[i]);
+			}
+		}
+	}
+
+	return errors;
+}
+
+void help(const char *progname, int rc)
+{
+	printf("\n");
+	printf("Usage: %s [options] program.{bin,hex}\n", progname);
+	printf("\n");
+	printf("  -h\n");
+	printf("    print help message\n");
+	printf("\n");
+	printf("  -v\n");
+	printf("    verbose output\n");
+	printf("\n");
+	printf("  -r addr\n");
+	printf("    start address (default = 0)\n");
+	printf("\n");
+	printf("  -n count\n");
+	printf("    run the program count times (default = 1)\n");
+	printf("\n");
+	printf("  -c filename\n");
+	printf("    compare results against this .hex file\n");
+	printf("\n");
+	printf("  -d cycles\n");
+	printf("    core clock cycles per half SCLK period (default = 2)\n");
+	printf("\n");
+#if VM_TRACE
+	printf("  -f filename\n");
+	printf("    write FST trace file\n");
+	printf("\n");
+#endif
+	exit(rc);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int start_addr = 0;
+	int run_count = 1;
+	std::string check_filename;
+	std::string trace_filename;
+
+	context.reset(new VerilatedContext);
+	context->commandArgs(argc, argv);
+
+	while ((opt = getopt(argc, argv, "hvr:n:c:d:f:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			help(argv[0], 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'r':
+			start_addr = strtol(optarg, nullptr, 0);
+			break;
+		case 'n':
+			run_count = atoi(optarg);
+			break;
+		case 'c':
+			check_filename = optarg;
+			break;
+		case 'd':
+			sclk_div = atoi(optarg);
+			break;
+#if VM_TRACE
+		case 'f':
+			trace_filename = optarg;
+			break;
+#endif
+		default:
+			help(argv[0], 1);
+		}
+	}
+
+	if (optind+1 != argc || run_count < 1 || sclk_div < 1)
+		help(argv[0], 1);
+
+	std::map<int, uint8_t> program, expected;
+	read_program(argv[optind], program);
+
+	if (!check_filename.empty())
+		read_hex(check_filename.c_str(), expected);
+
+	top.reset(new Vmarlann_top(context.get()));
+
+#if VM_TRACE
+	if (!trace_filename.empty()) {
+		context->traceEverOn(true);
+		tracer.reset(new VerilatedFstC);
+		top->trace(tracer.get(), 99);
+		tracer->open(trace_filename.c_str());
+	}
+#endif
+
+	top->clock = 1;
+	top->qpi_csb = 1;
+	top->qpi_clk = 1;
+	top->qpi_io_in = 0;
+	eval();
+
+	// wait for the reset generator
+	tick(32);
+
+	printf("Uploading program.\n");
+	for (auto &r : regions(program)) {
+		std::vector<uint8_t> buffer(r.second);
+		for (int i = 0; i < r.second; i++) {
+			auto it = program.find(r.first + i);
+			buffer[i] = it != program.end() ? it->second : 0;
+		}
+		if (verbose)
+			printf("  uploading %4d bytes to 0x%05x\n", r.second, r.first);
+		qpi_upload(r.first, buffer.data(), r.second);
+	}
+	long long upload_cycles = cycle_cnt;
+
+	printf("Readback.\n");
+	int errors = check(program, "readback");
+
+	long long total_run_cycles = 0;
+	for (int i = 0; i < run_count; i++) {
+		long long cycles = qpi_run(start_addr);
+		printf("Run %d: %lld cycles.\n", i, cycles);
+		total_run_cycles += cycles;
+	}
+
+	if (!expected.empty()) {
+		printf("Checking results.\n");
+		errors += check(expected, "results");
+	}
+
+	tick(100);
+
+	printf("-------------------\n");
+	printf("Upload:            %12lld cycles\n", upload_cycles);
+	printf("Run (avg):         %12lld cycles\n", total_run_cycles / run_count);
+	printf("Total:             %12lld cycles\n", cycle_cnt);
+	printf("Errors:            %12d\n", errors);
+	printf("-------------------\n");
+
+	top->final();
+
+#if VM_TRACE
+	if (tracer)
+		tracer->close();
+#endif
+
+	return errors ? 1 : 0;
+}
@@ -21,10 +21,16 @@ module marlann_top (
 `ifdef QPI
 	input  qpi_csb,
 	input  qpi_clk,
+`ifdef VERILATOR
+	input  [3:0] qpi_io_in,
+	output [3:0] qpi_io_out,
+	output [3:0] qpi_io_en,
+`else
 	inout  qpi_io0,
 	inout  qpi_io1,
 	inout  qpi_io2,
 	inout  qpi_io3,
+`endif
 	output qpi_rdy,
 	output qpi_err
 `elsif SPI
@@ -78,6 +84,7 @@ module marlann_top (
 	wire        comp_busy;
 	wire        comp_simd;
 	wire        comp_nosimd;
+	wire        comp_stall;
 
 	wire        cmem_ren;
 	wire [ 7:0] cmem_wen;
@@ -107,7 +114,11 @@ module marlann_top (
 	wire [3:0] qpi_io_do;
 	wire [3:0] qpi_io_di;
 
-	`ifdef RADIANT
+	`ifdef VERILATOR
+		assign qpi_io_di = qpi_io_in;
+		assign qpi_io_out = qpi_io_do;
+		assign qpi_io_en = qpi_io_oe;
+	`elsif RADIANT
 		BB_B qpi_io_buf [3:0] (
 			.B({qpi_io3, qpi_io2, qpi_io1, qpi_io0}),
 			.T_N(qpi_io_oe),
@@ -129,7 +140,10 @@ module marlann_top (
 	wire qpi_csb_di;
 	wire qpi_clk_di;
 
-	`ifdef RADIANT
+	`ifdef VERILATOR
+		assign qpi_csb_di = qpi_csb;
+		assign qpi_clk_di = qpi_clk;
+	`elsif RADIANT
 		assign qpi_csb_di = qpi_csb;
 		assign qpi_clk_di = qpi_clk;
 	`else
@@ -231,6 +245,8 @@ module marlann_top (
 	localparam integer state_run0   = 12;
 	localparam integer state_run1   = 13;
 
+	localparam integer state_perf   = 14;
+
 	localparam [7:0] cmd_status = 8'h 20;
 	localparam [7:0] cmd_wbuf   = 8'h 21;
 	localparam [7:0] cmd_rbuf   = 8'h 22;
@@ -238,10 +254,17 @@ module marlann_top (
 	localparam [7:0] cmd_rmem   = 8'h 24;
 	localparam [7:0] cmd_run    = 8'h 25;
 	localparam [7:0] cmd_stop   = 8'h 26;
+	localparam [7:0] cmd_perf   = 8'h 27;
+	localparam [7:0] cmd_perfrst = 8'h 28;
+
+	reg perf_reset;
+	reg [4:0] perf_ptr;
+	wire [191:0] perf_data;
 
 	always @(posedge clock) begin
 		seq_start <= 0;
 		seq_stop <= 0;
+		perf_reset <= 0;
 
 		`ifdef QPI
 		if (!qpi_active || din_start) begin
@@ -282,6 +305,14 @@ module marlann_top (
 						seq_stop <= 1;
 						state <= state_halt;
 					end
+					cmd_perf: begin
+						perf_ptr <= 0;
+						state <= state_perf;
+					end
+					cmd_perfrst: begin
+						perf_reset <= 1;
+						state <= state_halt;
+					end
 				endcase
 			end else begin
 				case (state)
@@ -351,6 +382,13 @@ module marlann_top (
 					dout_data <= buffer[buffer_ptr[9:1]][15:8];
 			end
 
+			if (state == state_perf) begin
+				dout_valid <= !dout_ready;
+				if (dout_ready)
+					perf_ptr <= perf_ptr == 23 ? 0 : perf_ptr + 1;
+				dout_data <= perf_data[8*perf_ptr +: 8];
+			end
+
 			if (state == state_wmem3) begin
 				if (qmem_done) begin
 					buffer_ptr <= buffer_ptr + 2;
@@ -432,7 +470,8 @@ module marlann_top (
 		.mem_rdata   (cmem_rdata ),
 
 		.tick_simd   (comp_simd  ),
-		.tick_nosimd (comp_nosimd)
+		.tick_nosimd (comp_nosimd),
+		.tick_stall  (comp_stall )
 	);
 
 	reg [3:0] busy_q;
@@ -446,6 +485,35 @@ module marlann_top (
 
 	assign busy = busy_q || seq_busy || comp_busy;
 
+	/********** Performance Counters **********/
+
+	reg [31:0] perf_busy;
+	reg [31:0] perf_simd;
+	reg [31:0] perf_nosimd;
+	reg [31:0] perf_stall;
+	reg [31:0] perf_fetch;
+	reg [31:0] perf_sync;
+
+	always @(posedge clock) begin
+		perf_busy <= perf_busy + busy;
+		perf_simd <= perf_simd + comp_simd;
+		perf_nosimd <= perf_nosimd + comp_nosimd;
+		perf_stall <= perf_stall + comp_stall;
+		perf_fetch <= perf_fetch + smem_valid;
+		perf_sync <= perf_sync + (comp_valid && comp_ready && comp_insn[5:0] == 0);
+
+		if (reset || perf_reset) begin
+			perf_busy <= 0;
+			perf_simd <= 0;
+			perf_nosimd <= 0;
+			perf_stall <= 0;
+			perf_fetch <= 0;
+			perf_sync <= 0;
+		end
+	end
+
+	assign perf_data = {perf_sync, perf_fetch, perf_stall, perf_nosimd, perf_simd, perf_busy};
+
 `ifdef TRACE
 	reg perfcount_active;
 	integer perfcount_cycles;
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Print assembler source annotated with the cycles spent on each line, from a
+# debug map written by "mlasm -g" and an execution profile written by "mlsim -P".
+#
+# Usage:
+#
+#   ../asm/mlasm -g demo.map ../asm/demo.asm
+#   ./mlsim -P demo.prof ../asm/demo.bin
+#   python3 annotate.py demo.map demo.prof [source.asm]
+#
+# Compute code run by Execute is attributed to the line of the word that was
+# copied into code memory by LoadCode.
+
+import os
+import sys
+
+def read_map(filename):
+    source = None
+    lines = dict()
+    with open(filename) as f:
+        for line in f:
+            tok = line.split()
+            if not tok or tok[0].startswith("#"):
+                continue
+            if tok[0] == "source":
+                source = line.split(None, 1)[1].strip()
+            else:
+                lines[int(tok[0], 16)] = int(tok[1])
+    return source, lines
+
+def read_profile(filename):
+    prof = dict()
+    with open(filename) as f:
+        for line in f:
+            tok = line.split()
+            if not tok or tok[0].startswith("#"):
+                continue
+            prof[int(tok[0], 16)] = (int(tok[1]), int(tok[2]))
+    return prof
+
+if __name__ == "__main__":
+    if len(sys.argv) not in (3, 4):
+        print("Usage: %s map-file profile-file [source-file]" % sys.argv[0])
+        sys.exit(1)
+
+    source, addr_lines = read_map(sys.argv[1])
+    prof = read_profile(sys.argv[2])
+
+    if len(sys.argv) > 3:
+        source = sys.argv[3]
+    elif source is None or source == "-":
+        print("Source file name not in map file, please pass it on the command line.")
+        sys.exit(1)
+    elif not os.path.exists(source):
+        source = os.path.join(os.path.dirname(sys.argv[1]), source)
+
+    with open(source) as f:
+        src_lines = [line.rstrip("\r\n") for line in f]
+
+    line_hits = dict()
+    line_cycles = dict()
+    unmapped = 0
+    total = 0
+
+    for addr, (hits, cycles) in prof.items():
+        total += cycles
+        if addr not in addr_lines:
+            unmapped += cycles
+            continue
+        nr = addr_lines[addr]
+        line_hits[nr] = line_hits.get(nr, 0) + hits
+        line_cycles[nr] = line_cycles.get(nr, 0) + cycles
+
+    def percent(n):
+        return 100.0 * n / total if total else 0.0
+
+    print("Source: %s, %d cycles" % (source, total))
+    print()
+    print("%12s %7s %10s  %5s" % ("cycles", "%", "hits", "line"))
+
+    for nr, text in enumerate(src_lines, 1):
+        if nr in line_hits:
+            print("%12d %6.2f%% %10d  %5d: %s" % (line_cycles[nr], percent(line_cycles[nr]), line_hits[nr], nr, text))
+        else:
+            print("%12s %7s %10s  %5d: %s" % ("", "", "", nr, text))
+
+    if unmapped:
+        print()
+        print("%d cycles (%.2f%%) at addresses not in the map file." % (unmapped, percent(unmapped)))
+
+    print()
+    print("Hottest lines:")
+    for nr in sorted(line_cycles, key=lambda nr: -line_cycles[nr])[:10]:
+        print("%12d %6.2f%%  %5d: %s" % (line_cycles[nr], percent(line_cycles[nr]), nr, src_lines[nr-1].strip()))
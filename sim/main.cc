@@ -15,8 +15,11 @@
  *
  */
 
-#include "mlsim.h"
+#include "mlqpi.h"
+#include "mlimage.h"
+#include "mlfile.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,7 +29,7 @@
 void help(const char *progname, int rc)
 {
 	printf("\n");
-	printf("Usage: %s [options] [bin-file]\n", progname);
+	printf("Usage: %s [options] [bin-or-image-file]\n", progname);
 	printf("\n");
 	printf("  -h\n");
 	printf("    print help message\n");
@@ -35,31 +38,173 @@ void help(const char *progname, int rc)
 	printf("    verbose output\n");
 	printf("\n");
 	printf("  -r addr\n");
-	printf("    start address (default = 0)\n");
+	printf("    start address (default = 0, or the entry point of an image file)\n");
 	printf("\n");
 	printf("  -t filename\n");
 	printf("    write instruction trace file\n");
 	printf("\n");
+	printf("  -P filename\n");
+	printf("    write execution profile (hits and cycles per address, see annotate.py)\n");
+	printf("\n");
 	printf("  -o filename\n");
 	printf("    write Verilog .hex file\n");
 	printf("\n");
 	printf("  -b filename\n");
 	printf("    write binary file\n");
 	printf("\n");
+	printf("  -a filename\n");
+	printf("    read architecture description file\n");
+	printf("\n");
+	printf("  -p name=value\n");
+	printf("    set architecture parameter (overrides -a for later options)\n");
+	printf("\n");
+	printf("  -q\n");
+	printf("    upload, run, and download through the QPI model like the demo\n");
+	printf("    firmware does, and print an end-to-end timing breakdown\n");
+	printf("\n");
+	printf("  -I name=filename\n");
+	printf("    write the contents of the file into the named input tensor before running\n");
+	printf("\n");
+	printf("  -O name=filename\n");
+	printf("    write the named output tensor to the file after running\n");
+	printf("\n");
+	printf("  -Q name=value\n");
+	printf("    set QPI timing parameter (sclk_mhz, clk_mhz, cs_cycles, copy_cycles), implies -q\n");
+	printf("\n");
 	exit(rc);
 }
 
+// Host side of the QPI protocol, following ml_upload(), ml_download() and
+// ml_run() in demo/firmware.c.
+
+void qpi_copy(MlQpi &qpi, uint8_t cmd, int addr, int len)
+{
+	qpi.begin();
+	qpi.xfer(cmd);
+	qpi.xfer(addr >> 1);
+	qpi.xfer(addr >> 9);
+	qpi.xfer(len >> 2);
+	qpi.xfer(0xff);
+	while (qpi.xfer(0xff) != 0) { }
+	qpi.end();
+}
+
+void qpi_upload(MlQpi &qpi, int addr, const uint8_t *data, int len)
+{
+	qpi.begin();
+	qpi.xfer(0x21);
+	for (int i = 0; i < len; i++)
+		qpi.xfer(data[i]);
+	qpi.end();
+
+	qpi_copy(qpi, 0x23, addr, len);
+}
+
+void qpi_download(MlQpi &qpi, int addr, uint8_t *data, int len)
+{
+	qpi_copy(qpi, 0x24, addr, len);
+
+	qpi.begin();
+	qpi.xfer(0x22);
+	qpi.xfer(0xff);
+	for (int i = 0; i < len; i++)
+		data[i] = qpi.xfer(0xff);
+	qpi.end();
+}
+
+void qpi_run(MlQpi &qpi, int addr)
+{
+	qpi.begin();
+	qpi.xfer(0x25);
+	qpi.xfer(addr >> 1);
+	qpi.xfer(addr >> 9);
+	qpi.end();
+
+	qpi.begin();
+	qpi.xfer(0x20);
+	qpi.xfer(0xff);
+	while (qpi.xfer(0xff) != 0) { }
+	qpi.end();
+}
+
+void qpi_session(MlSim &worker, const void *image, int bin_len, int start_addr,
+		const std::vector<const char*> &timing_params)
+{
+	MlQpi qpi({&worker});
+
+	for (auto p : timing_params)
+		qpi.setTiming(p);
+
+	// upload the program in 1 kB chunks: only the sections of an image file,
+	// or everything up to the end of a bin file
+	std::vector<std::pair<int, int>> regions;
+
+	if (image != nullptr) {
+		for (int i = 0; i < int(mlimg_hdr(image)->sec_count); i++) {
+			auto sec = mlimg_sections(image) + i;
+			if (mlimg_has_content(sec->type))
+				regions.push_back(std::make_pair(sec->addr, sec->size));
+		}
+	} else {
+		regions.push_back(std::make_pair(0, (bin_len + 3) & ~3));
+	}
+
+	std::vector<uint8_t> mem_copy = worker.main_mem;
+	std::fill(worker.main_mem.begin(), worker.main_mem.end(), 0);
+
+	for (auto &r : regions)
+		for (int i = 0; i < r.second; i += 1024)
+			qpi_upload(qpi, r.first + i, mem_copy.data() + r.first + i, std::min(1024, r.second - i));
+
+	qpi_run(qpi, start_addr);
+
+	// download the output tensors, or all memory regions written by the
+	// program if there are none
+	std::vector<uint8_t> buffer(1024);
+	bool have_outputs = false;
+
+	for (auto &it : worker.tensors) {
+		if (!it.second.output)
+			continue;
+		for (int i = 0; i < it.second.size; i += 1024)
+			qpi_download(qpi, it.second.addr + i, buffer.data(), std::min(1024, it.second.size - i));
+		have_outputs = true;
+	}
+
+	for (int i = 0; !have_outputs && i < int(worker.main_mem_tags.size()); i += 4)
+	{
+		int len = 0;
+		while (len < 1024 && i + len < int(worker.main_mem_tags.size()) &&
+				(worker.main_mem_tags[i+len] || worker.main_mem_tags[i+len+1] ||
+				 worker.main_mem_tags[i+len+2] || worker.main_mem_tags[i+len+3]))
+			len += 4;
+
+		if (len != 0) {
+			qpi_download(qpi, i, buffer.data(), len);
+			i += len - 4;
+		}
+	}
+
+	qpi.printStats(stdout);
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
-	FILE *fIn = stdin;
+	const char *input_filename = nullptr;
 	bool verbose = false;
-	int start_addr = 0;
+	int start_addr = -1;
 	std::string trace_filename;
+	std::string profile_filename;
 	std::string hex_filename;
 	std::string bin_filename;
+	std::vector<const char*> timing_params;
+	std::vector<std::pair<std::string, std::string>> inject_tensors;
+	std::vector<std::pair<std::string, std::string>> extract_tensors;
+	bool qpi_mode = false;
+	MlArch arch;
 
-	while ((opt = getopt(argc, argv, "hvr:t:o:b:")) != -1)
+	while ((opt = getopt(argc, argv, "hvr:t:P:o:b:a:p:I:O:qQ:")) != -1)
 	{
 		switch (opt)
 		{
@@ -75,34 +220,61 @@ int main(int argc, char **argv)
 		case 't':
 			trace_filename = optarg;
 			break;
+		case 'P':
+			profile_filename = optarg;
+			break;
 		case 'o':
 			hex_filename = optarg;
 			break;
 		case 'b':
 			bin_filename = optarg;
 			break;
+		case 'a':
+			arch.readFile(optarg);
+			break;
+		case 'p':
+			arch.parseParam(optarg);
+			break;
+		case 'I':
+		case 'O': {
+			const char *p = strchr(optarg, '=');
+			if (p == nullptr)
+				help(argv[0], 1);
+			auto item = std::make_pair(std::string(optarg, p - optarg), std::string(p+1));
+			if (opt == 'I')
+				inject_tensors.push_back(item);
+			else
+				extract_tensors.push_back(item);
+			break;
+		}
+		case 'q':
+			qpi_mode = true;
+			break;
+		case 'Q':
+			timing_params.push_back(optarg);
+			qpi_mode = true;
+			break;
 		default:
 			help(argv[0], 1);
 		}
 	}
 
 	if (optind+1 == argc)
-	{
-		fIn = fopen(argv[optind++], "r");
-		if (fIn == nullptr) {
-			perror("Open input file");
-			exit(1);
-		}
-	}
+		input_filename = argv[optind++];
 
 	if (optind != argc)
 		help(argv[0], 1);
 
-	MlSim worker;
+	arch.check();
+
+	MlSim worker(arch);
 
 	if (verbose)
 		worker.verbose = true;
 
+	if (!profile_filename.empty())
+		worker.profile = true;
+
 	if (!trace_filename.empty()) {
 		worker.trace = stdout;
 		if (trace_filename != "-") {
@@ -114,15 +286,77 @@ int main(int argc, char **argv)
 		}
 	}
 
-	worker.readBinFile(fIn);
+	std::vector<uint8_t> input_buffer;
+	size_t input_len = 0;
+	int bin_len = 0;
+	const uint8_t *input = ml_map_file(input_filename, input_len, input_buffer, "input");
+	const void *image = nullptr;
+
+	if (mlimg_is_image(input, input_len)) {
+		image = input;
+		int entry = worker.readImage(image, input_len);
+		if (start_addr < 0)
+			start_addr = entry;
+	} else {
+		bin_len = std::min(int(input_len), int(worker.main_mem.size()));
+		std::copy(input, input + bin_len, worker.main_mem.begin());
+		if (verbose)
+			printf("read %d bytes from bin file.\n", bin_len);
+	}
+
+	if (start_addr < 0)
+		start_addr = 0;
+
+	for (auto &it : inject_tensors) {
+		FILE *f = fopen(it.second.c_str(), "rb");
+		if (f == nullptr) {
+			perror("Open input tensor file");
+			exit(1);
+		}
+		std::vector<uint8_t> data;
+		for (int c; (c = fgetc(f)) >= 0;)
+			data.push_back(c);
+		fclose(f);
+		worker.injectTensor(it.first, data);
+	}
 
-	worker.run(start_addr);
+	if (qpi_mode)
+		qpi_session(worker, image, bin_len, start_addr, timing_params);
+	else
+		worker.run(start_addr);
 
 	if (verbose) {
 		printf("simulation finished.\n");
 		printf("est %d cycles, avg %f ops/cycle, %.1f%% utilization\n",
 				worker.cycle_cnt, (16.0*worker.ops_cnt) / worker.cycle_cnt,
 				(100.0*worker.ops_cnt) / worker.cycle_cnt);
+		printf("counters: busy=%u simd=%u nosimd=%u stall=%u fetch=%u sync=%u\n",
+				worker.perf.busy, worker.perf.simd, worker.perf.nosimd,
+				worker.perf.stall, worker.perf.fetch, worker.perf.sync);
+		if (worker.coeff_words)
+			printf("loaded %d coefficient words, %d (%.1f%%) overlapped with compute.\n",
+					worker.coeff_words, worker.coeff_overlap, (100.0*worker.coeff_overlap) / worker.coeff_words);
+	}
+
+	if (!profile_filename.empty()) {
+		FILE *f = fopen(profile_filename.c_str(), "wt");
+		if (f == nullptr) {
+			perror("Open output profile file");
+			exit(1);
+		}
+		worker.writeProfile(f);
+		fclose(f);
+	}
+
+	for (auto &it : extract_tensors) {
+		auto data = worker.extractTensor(it.first);
+		FILE *f = fopen(it.second.c_str(), "wb");
+		if (f == nullptr) {
+			perror("Open output tensor file");
+			exit(1);
+		}
+		fwrite(data.data(), data.size(), 1, f);
+		fclose(f);
 	}
 
 	if (!hex_filename.empty()) {
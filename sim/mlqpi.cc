@@ -0,0 +1,423 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "mlqpi.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+MlQpi::MlQpi(const std::vector<MlSim*> &sims)
+{
+	assert(!sims.empty() && sims.size() <= 4);
+
+	chips.resize(sims.size());
+
+	for (int i = 0; i < int(sims.size()); i++) {
+		chips[i].sim = sims[i];
+		chips[i].buffer.resize(1024);
+	}
+}
+
+bool MlQpi::driving(const chip_t &chip) const
+{
+	// The first byte after the command (or after the arguments) is the
+	// dummy byte that transfers control of the I/O lines to MARLANN.
+	if (chip.state == STATE_STATUS || chip.state == STATE_RBUF || chip.state == STATE_PERF)
+		return chip.byte_idx >= 1;
+
+	if (chip.state == STATE_WMEM || chip.state == STATE_RMEM)
+		return chip.byte_idx >= 4;
+
+	return false;
+}
+
+uint8_t MlQpi::dout(const chip_t &chip) const
+{
+	if (chip.state == STATE_STATUS)
+		return running(chip) ? 0xff : 0x00;
+
+	if (chip.state == STATE_RBUF)
+		return chip.buffer[chip.buffer_ptr % 1024];
+
+	if (chip.state == STATE_PERF) {
+		// busy, simd, nosimd, stall, fetch, sync (32 bits each, LSB first)
+		const auto &perf = chip.sim->perf;
+		uint32_t counters[6] = {perf.busy, perf.simd, perf.nosimd, perf.stall, perf.fetch, perf.sync};
+		int idx = chip.buffer_ptr % 24;
+		return counters[idx / 4] >> (8 * (idx % 4));
+	}
+
+	// Write/Read main memory: the copy has already been performed, but the
+	// core stays busy until the modeled copy time has elapsed
+	return now_us < chip.busy_until ? 0xff : 0x00;
+}
+
+void MlQpi::select(int idx)
+{
+	auto &chip = chips[idx];
+
+	chip.cs = true;
+	chip.byte_idx = 0;
+	chip.buffer_ptr = 0;
+
+	if (chip.xfer_armed >= 0) {
+		chip.state = STATE_CAPTURE;
+		chip.args[0] = chip.xfer_armed;
+		chip.xfer_armed = -1;
+	} else {
+		chip.state = STATE_CMD;
+	}
+}
+
+void MlQpi::copyMem(chip_t &chip, bool write)
+{
+	int addr = (chip.args[0] | (chip.args[1] << 8)) << 1;
+	int len = chip.args[2] ? 4*chip.args[2] : 1024;
+
+	if (addr + len > int(chip.sim->main_mem.size())) {
+		if (verbose)
+			printf("qpi: main memory access out of range: %d bytes at 0x%05x\n", len, addr);
+		err = true;
+		return;
+	}
+
+	if (verbose)
+		printf("qpi: %s %d bytes at 0x%05x\n", write ? "write" : "read", len, addr);
+
+	for (int i = 0; i < len; i++) {
+		if (write)
+			chip.sim->main_mem[addr+i] = chip.buffer[i];
+		else
+			chip.buffer[i] = chip.sim->main_mem[addr+i];
+	}
+
+	chip.busy_until = now_us + (len/2) * timing.copy_cycles / timing.clk_mhz;
+}
+
+double MlQpi::computeUntil() const
+{
+	double t = 0;
+	for (auto &chip : chips)
+		t = std::max(t, chip.run_until);
+	return t;
+}
+
+void MlQpi::command(int idx, uint8_t cmd)
+{
+	auto &chip = chips[idx];
+
+	chip.byte_idx = 0;
+	chip.state = STATE_IGNORE;
+
+	if (verbose)
+		printf("qpi: chip %d command %02x\n", idx, cmd);
+
+	if (txn_cat == CAT_NONE) {
+		if (cmd == 0x21 || cmd == 0x23)
+			txn_cat = CAT_UPLOAD;
+		else if (cmd == 0x22 || cmd == 0x24)
+			txn_cat = CAT_DOWNLOAD;
+		else if (cmd == 0x25)
+			txn_cat = CAT_RUN;
+		else if (cmd == 0x20)
+			txn_cat = CAT_POLL;
+		else if (cmd >= 0x20)
+			txn_cat = CAT_OTHER;
+	}
+
+	// Select
+	if (cmd <= 0x03) {
+		if (cmd == 0x00)
+			chip.state = STATE_CMD;
+		else if (idx == 0 && cmd < int(chips.size()))
+			select(cmd);
+		return;
+	}
+
+	// RdyOn, RdyOff
+	if (cmd == 0x04 || cmd == 0x05) {
+		chip.rdy_enabled = cmd == 0x04;
+		return;
+	}
+
+	// Broadcast
+	if ((cmd & 0xf0) == 0x10) {
+		if (idx != 0)
+			return;
+		for (int i = 1; i < int(chips.size()); i++)
+			if ((cmd & (1 << i)) != 0)
+				select(i);
+		if ((cmd & 1) != 0)
+			chip.state = STATE_CMD;
+		return;
+	}
+
+	// Xfer
+	if ((cmd & 0xf0) == 0x30) {
+		chip.xfer_armed = cmd & 15;
+		return;
+	}
+
+	switch (cmd)
+	{
+	case 0x20:
+		chip.state = STATE_STATUS;
+		break;
+	case 0x21:
+		chip.state = STATE_WBUF;
+		chip.buffer_ptr = 0;
+		break;
+	case 0x22:
+		chip.state = STATE_RBUF;
+		chip.buffer_ptr = 0;
+		break;
+	case 0x23:
+		chip.state = STATE_WMEM;
+		break;
+	case 0x24:
+		chip.state = STATE_RMEM;
+		break;
+	case 0x25:
+		chip.state = STATE_RUN;
+		break;
+	case 0x26:
+		chip.run_until = std::min(chip.run_until, now_us);
+		break;
+	case 0x27:
+		chip.state = STATE_PERF;
+		chip.buffer_ptr = 0;
+		break;
+	case 0x28:
+		chip.sim->perf = MlSim::perf_t();
+		break;
+	default:
+		if (verbose)
+			printf("qpi: unsupported command %02x\n", cmd);
+		err = true;
+	}
+}
+
+void MlQpi::consume(int idx, uint8_t data)
+{
+	auto &chip = chips[idx];
+
+	switch (chip.state)
+	{
+	case STATE_CMD:
+		command(idx, data);
+		return;
+
+	case STATE_IGNORE:
+		return;
+
+	case STATE_CAPTURE:
+		if (chip.args[0] > 0)
+			chip.args[0]--;
+		else
+			chip.buffer[chip.buffer_ptr++ % 1024] = data;
+		return;
+
+	case STATE_STATUS:
+		break;
+
+	case STATE_WBUF:
+		chip.buffer[chip.buffer_ptr++ % 1024] = data;
+		break;
+
+	case STATE_RBUF:
+	case STATE_PERF:
+		if (chip.byte_idx >= 1)
+			chip.buffer_ptr++;
+		break;
+
+	case STATE_WMEM:
+	case STATE_RMEM:
+		if (chip.byte_idx < 3)
+			chip.args[chip.byte_idx] = data;
+		if (chip.byte_idx == 2)
+			copyMem(chip, chip.state == STATE_WMEM);
+		break;
+
+	case STATE_RUN:
+		chip.args[chip.byte_idx] = data;
+		if (chip.byte_idx == 1) {
+			int addr = (chip.args[0] | (chip.args[1] << 8)) << 1;
+			chip.state = STATE_IGNORE;
+			if (addr % 4 != 0 || addr >= int(chip.sim->main_mem.size())) {
+				if (verbose)
+					printf("qpi: invalid start address 0x%05x\n", addr);
+				err = true;
+				return;
+			}
+			if (verbose)
+				printf("qpi: chip %d run at 0x%05x\n", idx, addr);
+			int cycles = chip.sim->cycle_cnt;
+			chip.sim->run(addr);
+			cycles = chip.sim->cycle_cnt - cycles;
+			compute_cycles += cycles;
+			chip.run_until = now_us + cycles / timing.clk_mhz;
+			return;
+		}
+		break;
+	}
+
+	chip.byte_idx++;
+}
+
+void MlQpi::begin()
+{
+	assert(!active);
+
+	active = true;
+	select(0);
+
+	txn_cat = CAT_NONE;
+	txn_start = now_us;
+	txn_bytes = 0;
+
+	if (timing.sclk_mhz > 0)
+		now_us += timing.cs_cycles / timing.sclk_mhz;
+}
+
+uint8_t MlQpi::xfer(uint8_t din)
+{
+	bool cs[4] = {false, false, false, false};
+	int drivers = 0;
+	uint8_t bus = din;
+
+	assert(active);
+
+	for (int i = 0; i < int(chips.size()); i++) {
+		cs[i] = chips[i].cs;
+		if (cs[i] && driving(chips[i])) {
+			if (drivers++ == 0)
+				bus = dout(chips[i]);
+			else
+				err = true;
+		}
+	}
+
+	// QPI transfers one nibble per SCLK cycle
+	if (timing.sclk_mhz > 0)
+		now_us += 2 / timing.sclk_mhz;
+	txn_bytes++;
+
+	for (int i = 0; i < int(chips.size()); i++)
+		if (cs[i])
+			consume(i, bus);
+
+	return bus;
+}
+
+void MlQpi::end()
+{
+	assert(active);
+
+	for (auto &chip : chips)
+		chip.cs = false;
+
+	active = false;
+	err = false;
+
+	category_t cat = txn_cat == CAT_NONE ? CAT_OTHER : txn_cat;
+	double t = now_us - txn_start;
+
+	// Status polls issued while a kernel is still running are attributed
+	// to the run time, only the remainder is polling overhead.
+	if (cat == CAT_POLL) {
+		double t_run = std::min(std::max(computeUntil() - txn_start, 0.0), t);
+		stats[CAT_RUN].time_us += t_run;
+		t -= t_run;
+	}
+
+	stats[cat].time_us += t;
+	stats[cat].transactions++;
+	stats[cat].bytes += txn_bytes;
+}
+
+bool MlQpi::rdy() const
+{
+	for (auto &chip : chips)
+		if (chip.rdy_enabled && !running(chip))
+			return true;
+	return false;
+}
+
+void MlQpi::waitRdy()
+{
+	assert(!active);
+
+	// an idle chip with RdyOn already asserts RDY
+	if (rdy())
+		return;
+
+	double t = computeUntil();
+	for (auto &chip : chips)
+		if (chip.rdy_enabled && now_us < chip.run_until)
+			t = std::min(t, chip.run_until);
+
+	if (t > now_us) {
+		stats[CAT_RUN].time_us += t - now_us;
+		now_us = t;
+	}
+}
+
+void MlQpi::setTiming(const char *arg)
+{
+	const char *p = strchr(arg, '=');
+	char *endptr = nullptr;
+	double val = p ? strtod(p+1, &endptr) : 0;
+	std::string name = p ? std::string(arg, p) : "";
+
+	if (p == nullptr || !p[1] || *endptr || val < 0)
+		name = "";
+
+	if (name == "sclk_mhz" && val > 0)
+		timing.sclk_mhz = val;
+	else if (name == "clk_mhz" && val > 0)
+		timing.clk_mhz = val;
+	else if (name == "cs_cycles")
+		timing.cs_cycles = val;
+	else if (name == "copy_cycles")
+		timing.copy_cycles = val;
+	else {
+		fprintf(stderr, "MlQpi error: Invalid timing parameter setting '%s'.\n", arg);
+		exit(1);
+	}
+}
+
+void MlQpi::printStats(FILE *f) const
+{
+	const char *names[CAT_NUM] = { "upload", "run", "poll", "download", "other" };
+
+	if (timing.sclk_mhz > 0)
+		fprintf(f, "QPI host timeline (SCLK %.2f MHz, core clock %.2f MHz):\n",
+				timing.sclk_mhz, timing.clk_mhz);
+	else
+		fprintf(f, "QPI host timeline (SCLK generated by host, core clock %.2f MHz):\n",
+				timing.clk_mhz);
+
+	for (int i = 0; i < CAT_NUM; i++)
+		fprintf(f, "  %-8s %12.1f us %5.1f%% %8d bytes %6d transactions\n", names[i],
+				stats[i].time_us, now_us > 0 ? 100.0 * stats[i].time_us / now_us : 0.0,
+				stats[i].bytes, stats[i].transactions);
+
+	fprintf(f, "  %-8s %12.1f us (%lld compute cycles = %.1f us)\n", "total", now_us,
+			compute_cycles, compute_cycles / timing.clk_mhz);
+}
@@ -0,0 +1,132 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef MLQPI_H
+#define MLQPI_H
+
+#include "mlsim.h"
+
+// Byte-level model of the QPI host interface (see docs/qpi.md) for up to
+// four cascaded MARLANN cores. The host side calls begin() when asserting
+// chip-select, xfer() for each byte clocked over the I/O lines, and end()
+// when releasing chip-select.
+//
+// The model also keeps a host-side timeline: every transferred byte costs two
+// SCLK periods, every transaction additionally costs cs_cycles SCLK periods,
+// and the core is busy for copy_cycles core clock cycles per 16-bit word
+// copied between the transfer buffer and main memory, and for the number of
+// cycles reported by MlSim after Run. The host observes this through the
+// status bytes, and the time spent is accumulated per transaction category.
+// With sclk_mhz = 0 the byte and chip-select costs are not added and the host
+// advances now_us itself.
+class MlQpi
+{
+public:
+	enum state_t {
+		STATE_CMD,
+		STATE_IGNORE,
+		STATE_CAPTURE,
+		STATE_STATUS,
+		STATE_WBUF,
+		STATE_RBUF,
+		STATE_WMEM,
+		STATE_RMEM,
+		STATE_RUN,
+		STATE_PERF
+	};
+
+	enum category_t {
+		CAT_UPLOAD,
+		CAT_RUN,
+		CAT_POLL,
+		CAT_DOWNLOAD,
+		CAT_OTHER,
+		CAT_NUM,
+		CAT_NONE = CAT_NUM
+	};
+
+	struct timing_t {
+		double sclk_mhz = 1.0;
+		double clk_mhz = 20.0;
+		int cs_cycles = 2;
+		int copy_cycles = 3;
+	};
+
+	struct stats_t {
+		double time_us = 0;
+		int transactions = 0;
+		int bytes = 0;
+	};
+
+	struct chip_t {
+		MlSim *sim = nullptr;
+		std::vector<uint8_t> buffer;
+		double run_until = 0;
+		double busy_until = 0;
+		bool rdy_enabled = true;
+		int xfer_armed = -1;
+
+		bool cs = false;
+		state_t state = STATE_CMD;
+		int byte_idx = 0;
+		int buffer_ptr = 0;
+		int args[3] = {0, 0, 0};
+	};
+
+private:
+	bool active = false;
+	bool err = false;
+
+	category_t txn_cat = CAT_NONE;
+	double txn_start = 0;
+	int txn_bytes = 0;
+
+	bool driving(const chip_t &chip) const;
+	uint8_t dout(const chip_t &chip) const;
+	void select(int idx);
+	void consume(int idx, uint8_t data);
+	void command(int idx, uint8_t cmd);
+	void copyMem(chip_t &chip, bool write);
+	double computeUntil() const;
+
+public:
+	std::vector<chip_t> chips;
+	bool verbose = false;
+
+	timing_t timing;
+	stats_t stats[CAT_NUM];
+	double now_us = 0;
+	long long compute_cycles = 0;
+
+	MlQpi(const std::vector<MlSim*> &sims);
+
+	void begin();
+	uint8_t xfer(uint8_t din);
+	void end();
+
+	bool rdy() const;
+	bool error() const { return err; }
+	bool running(const chip_t &chip) const { return now_us < chip.run_until; }
+
+	// Advance the host timeline until the next kernel finishes.
+	void waitRdy();
+
+	void setTiming(const char *arg);
+	void printStats(FILE *f) const;
+};
+
+#endif
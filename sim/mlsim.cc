@@ -16,298 +16,272 @@
  */
 
 #include "mlsim.h"
+#include "mlimage.h"
 
+#include <algorithm>
 #include <assert.h>
 
+void MlSim::idle(int cycles)
+{
+	cycle_cnt += cycles;
+	perf.busy += cycles;
+	pipe.idle(cycles);
+
+	if (profile)
+		prof_cycles[prof_addr/4] += cycles;
+}
+
+// The sequencer fetches a word from main memory, nothing is issued meanwhile.
+void MlSim::fetch(int addr)
+{
+	hit(addr);
+	perf.fetch += arch.fetch_cycles;
+	idle(arch.fetch_cycles);
+}
+
+void MlSim::issue(int op)
+{
+	int stalls = pipe.issue(op);
+
+	cycle_cnt += stalls + 1;
+	perf.busy += stalls + 1;
+	perf.stall += stalls;
+
+	if (profile)
+		prof_cycles[prof_addr/4] += stalls + 1;
+
+	if (MlPipe::simd(op))
+		perf.simd++;
+	else
+		perf.nosimd++;
+}
+
+void MlSim::coeffLoad()
+{
+	coeff_words++;
+	if (cycle_cnt <= compute_end)
+		coeff_overlap++;
+}
+
 void MlSim::exec(insn_t insn)
 {
-	cycle_cnt++;
+	// handlers for the compute instruction kinds of the ISA table
+	static const exec_fn handlers[MlIsa::KIND_NUM] = {
+		nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+		&MlSim::execSetBP,
+		&MlSim::execStore,
+		&MlSim::execSave,
+		&MlSim::execLdAcc,
+		&MlSim::execMacc
+	};
+
+	const MlIsa::op_t &isa = ml_isa_op(insn.op());
+	issue(insn.op());
+	if (isa.kind != MlIsa::KIND_SETBP)
+		compute_end = cycle_cnt + MlPipe::DEPTH - 1;
 
 	if (verbose)
 		printf("exec:       %08x (maddr=%05x, caddr=%03x, op=%d)\n",
 				insn.x, insn.maddr(), insn.caddr(), insn.op());
 
-	// SetVBP
-	if (insn.op() == 8) {
-		assert(insn.caddr() == 0);
-		VBP = insn.maddr();
-		if (trace)
-			fprintf(trace, "SetVBP 0x%05x // -> 0x%05x\n", insn.maddr(), VBP);
-		return;
-	}
+	if (handlers[isa.kind] == nullptr)
+		abort();
 
-	// AddVBP
-	if (insn.op() == 9) {
-		assert(insn.caddr() == 0);
-		VBP = (VBP + insn.maddr()) & 0x1ffff;
-		if (trace)
-			fprintf(trace, "AddVBP 0x%05x // -> 0x%05x\n", insn.maddr(), VBP);
-		return;
-	}
+	(this->*handlers[isa.kind])(insn, isa);
+}
 
-	// SetLBP
-	if (insn.op() == 10) {
-		assert(insn.caddr() == 0);
-		LBP = insn.maddr();
-		if (trace)
-			fprintf(trace, "SetLBP 0x%05x // -> 0x%05x\n", insn.maddr(), LBP);
-		return;
-	}
+// SetVBP/AddVBP/SetLBP/AddLBP/SetSBP/AddSBP/SetCBP/AddCBP
+void MlSim::execSetBP(insn_t insn, const MlIsa::op_t &isa)
+{
+	bool add = (isa.flags & MlIsa::FLAG_ADD) != 0;
 
-	// AddLBP
-	if (insn.op() == 11) {
-		assert(insn.caddr() == 0);
-		LBP = (LBP + insn.maddr()) & 0x1ffff;
+	if (isa.reg == MlIsa::REG_CBP) {
+		assert(insn.maddr() == 0);
+		CBP = add ? (CBP + insn.caddr()) & arch.caddr_mask() : insn.caddr();
 		if (trace)
-			fprintf(trace, "AddLBP 0x%05x // -> 0x%05x\n", insn.maddr(), LBP);
+			fprintf(trace, "%s 0x%03x // -> 0x%03x\n", isa.name, insn.caddr(), CBP);
 		return;
 	}
 
-	// SetSBP
-	if (insn.op() == 12) {
-		assert(insn.caddr() == 0);
-		SBP = insn.maddr();
-		if (trace)
-			fprintf(trace, "SetSBP 0x%05x // -> 0x%05x\n", insn.maddr(), SBP);
-		return;
-	}
+	int32_t &BP = isa.reg == MlIsa::REG_VBP ? VBP : isa.reg == MlIsa::REG_LBP ? LBP : SBP;
 
-	// AddSBP
-	if (insn.op() == 13) {
-		assert(insn.caddr() == 0);
-		SBP = (SBP + insn.maddr()) & 0x1ffff;
-		if (trace)
-			fprintf(trace, "AddSBP 0x%05x // -> 0x%05x\n", insn.maddr(), SBP);
-		return;
-	}
+	assert(insn.caddr() == 0);
+	BP = add ? (BP + insn.maddr()) & arch.maddr_mask() : insn.maddr();
+	if (trace)
+		fprintf(trace, "%s 0x%05x // -> 0x%05x\n", isa.name, insn.maddr(), BP);
+}
 
-	// SetCBP
-	if (insn.op() == 14) {
-		assert(insn.maddr() == 0);
-		CBP = insn.caddr();
-		if (trace)
-			fprintf(trace, "SetCBP 0x%03x // -> 0x%03x\n", insn.caddr(), CBP);
-		return;
+// Store/ReLU
+void MlSim::execStore(insn_t insn, const MlIsa::op_t &isa)
+{
+	int maddr = (SBP + insn.maddr()) & arch.maddr_mask();
+	assert(maddr+2 <= int(main_mem.size()));
+
+	assert(insn.caddr() < 32);
+	int32_t v0 = acc0 >> insn.caddr();
+	int32_t v1 = acc1 >> insn.caddr();
+
+	v0 = std::min(v0, 127);
+	v1 = std::min(v1, 127);
+
+	if (isa.flags & MlIsa::FLAG_RELU) {
+		v0 = std::max(v0, 0);
+		v1 = std::max(v1, 0);
+	} else {
+		v0 = std::max(v0, -128);
+		v1 = std::max(v1, -128);
 	}
 
-	// AddCBP
-	if (insn.op() == 15) {
-		assert(insn.maddr() == 0);
-		CBP = (CBP + insn.caddr()) & 0x1ff;
-		if (trace)
-			fprintf(trace, "AddCBP 0x%03x // -> 0x%03x\n", insn.caddr(), CBP);
-		return;
+	if (isa.lanes & 1) {
+		if (verbose)
+			printf("write: %02x @%05x\n", v0, maddr);
+		main_mem_tags[maddr] = true;
+		main_mem[maddr] = v0;
 	}
 
-	// Store/ReLu
-	if (insn.op() == 16 || insn.op() == 17 || insn.op() == 18 || insn.op() == 20 || insn.op() == 21 || insn.op() == 22)
-	{
-		int maddr = (SBP + insn.maddr()) & 0x1ffff;
-
-		assert(insn.caddr() < 32);
-		int32_t v0 = acc0 >> insn.caddr();
-		int32_t v1 = acc1 >> insn.caddr();
+	if (isa.lanes & 2) {
+		if (verbose)
+			printf("write: %02x @%05x\n", v1, maddr+1);
+		main_mem_tags[maddr+1] = true;
+		main_mem[maddr+1] = v1;
+	}
 
-		v0 = std::min(v0, 127);
-		v1 = std::min(v1, 127);
+	if (trace) {
+		if (isa.lanes == 3)
+			fprintf(trace, "%s 0x%05x, 0x%03x // 0x%08x 0x%08x -> 0x%02x 0x%02x @ 0x%05x\n", isa.name, insn.maddr(), insn.caddr(), acc0, acc1, v0, v1, maddr);
+		if (isa.lanes == 1)
+			fprintf(trace, "%s 0x%05x, 0x%03x // 0x%08x -> 0x%02x @ 0x%05x\n", isa.name, insn.maddr(), insn.caddr(), acc0, v0, maddr);
+		if (isa.lanes == 2)
+			fprintf(trace, "%s 0x%05x, 0x%03x // 0x%08x -> 0x%02x @ 0x%05x\n", isa.name, insn.maddr(), insn.caddr(), acc1, v1, maddr+1);
+	}
+}
 
-		if (insn.op() == 20 || insn.op() == 21 || insn.op() == 22) {
-			v0 = std::max(v0, 0);
-			v1 = std::max(v1, 0);
-		} else {
-			v0 = std::max(v0, -128);
-			v1 = std::max(v1, -128);
-		}
+// Save
+void MlSim::execSave(insn_t insn, const MlIsa::op_t &isa)
+{
+	int maddr = (SBP + insn.maddr()) & arch.maddr_mask();
+	assert(maddr+8 <= int(main_mem.size()));
+	assert(maddr % 2 == 0);
 
-		if (insn.op() == 16 || insn.op() == 17 || insn.op() == 20 || insn.op() == 21) {
-			if (verbose)
-				printf("write: %02x @%05x\n", v0, maddr);
-			main_mem_tags[maddr] = true;
-			main_mem[maddr] = v0;
-		}
+	if (isa.lanes & 1)
+	{
+		main_mem_tags[maddr] = true;
+		main_mem_tags[maddr+1] = true;
+		main_mem_tags[maddr+2] = true;
+		main_mem_tags[maddr+3] = true;
+
+		main_mem[maddr] = acc0;
+		main_mem[maddr+1] = acc0 >> 8;
+		main_mem[maddr+2] = acc0 >> 16;
+		main_mem[maddr+3] = acc0 >> 24;
+	}
 
-		if (insn.op() == 16 || insn.op() == 18 || insn.op() == 20 || insn.op() == 22) {
-			if (verbose)
-				printf("write: %02x @%05x\n", v1, maddr+1);
-			main_mem_tags[maddr+1] = true;
-			main_mem[maddr+1] = v1;
-		}
+	if (isa.lanes & 2)
+	{
+		main_mem_tags[maddr+4] = true;
+		main_mem_tags[maddr+5] = true;
+		main_mem_tags[maddr+6] = true;
+		main_mem_tags[maddr+7] = true;
+
+		main_mem[maddr+4] = acc1;
+		main_mem[maddr+5] = acc1 >> 8;
+		main_mem[maddr+6] = acc1 >> 16;
+		main_mem[maddr+7] = acc1 >> 24;
+	}
 
-		if (trace) {
-			if (insn.op() == 16)
-				fprintf(trace, "Store 0x%05x, 0x%03x // 0x%08x 0x%08x -> 0x%02x 0x%02x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc0, acc1, v0, v1, maddr);
-			if (insn.op() == 17)
-				fprintf(trace, "Store0 0x%05x, 0x%03x // 0x%08x -> 0x%02x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc0, v0, maddr);
-			if (insn.op() == 18)
-				fprintf(trace, "Store1 0x%05x, 0x%03x // 0x%08x -> 0x%02x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc1, v1, maddr+1);
-			if (insn.op() == 20)
-				fprintf(trace, "ReLU 0x%05x, 0x%03x // 0x%08x 0x%08x -> 0x%02x 0x%02x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc0, acc1, v0, v1, maddr);
-			if (insn.op() == 21)
-				fprintf(trace, "ReLU0 0x%05x, 0x%03x // 0x%08x -> 0x%02x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc0, v0, maddr);
-			if (insn.op() == 22)
-				fprintf(trace, "ReLU1 0x%05x, 0x%03x // 0x%08x -> 0x%02x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc1, v1, maddr+1);
-		}
-		return;
+	if (trace) {
+		if (isa.lanes == 3)
+			fprintf(trace, "%s 0x%05x, 0x%03x // 0x%08x 0x%08x -> 0x%08x 0x%08x @ 0x%05x\n", isa.name, insn.maddr(), insn.caddr(), acc0, acc1, acc0, acc1, maddr);
+		if (isa.lanes == 1)
+			fprintf(trace, "%s 0x%05x, 0x%03x // 0x%08x -> 0x%08x @ 0x%05x\n", isa.name, insn.maddr(), insn.caddr(), acc0, acc0, maddr);
+		if (isa.lanes == 2)
+			fprintf(trace, "%s 0x%05x, 0x%03x // 0x%08x -> 0x%08x @ 0x%05x\n", isa.name, insn.maddr(), insn.caddr(), acc1, acc1, maddr+4);
 	}
+}
 
-	// Save
-	if (insn.op() == 24 || insn.op() == 25 || insn.op() == 26)
-	{
-		int maddr = (SBP + insn.maddr()) & 0x1ffff;
-		assert(maddr % 2 == 0);
+// LdSet/LdAdd
+void MlSim::execLdAcc(insn_t insn, const MlIsa::op_t &isa)
+{
+	int maddr = (LBP + insn.maddr()) & arch.maddr_mask();
+	assert(maddr+8 <= int(main_mem.size()));
+	assert(maddr % 2 == 0);
+
+	int32_t v0 = 0;
+	v0 |= main_mem[maddr];
+	v0 |= main_mem[maddr+1] << 8;
+	v0 |= main_mem[maddr+2] << 16;
+	v0 |= main_mem[maddr+3] << 24;
+
+	int32_t v1 = 0;
+	v1 |= main_mem[maddr+4];
+	v1 |= main_mem[maddr+5] << 8;
+	v1 |= main_mem[maddr+6] << 16;
+	v1 |= main_mem[maddr+7] << 24;
+
+	bool add = (isa.flags & MlIsa::FLAG_ADD) != 0;
+
+	if (isa.lanes & 1)
+		acc0 = add ? acc0 + v0 : v0;
+
+	if (isa.lanes & 2)
+		acc1 = add ? acc1 + v1 : v1;
+
+	if (trace) {
+		if (isa.lanes == 3)
+			fprintf(trace, "%s 0x%05x // -> 0x%08x 0x%08x\n", isa.name, insn.maddr(), acc0, acc1);
+		if (isa.lanes == 1)
+			fprintf(trace, "%s 0x%05x // -> 0x%08x\n", isa.name, insn.maddr(), acc0);
+		if (isa.lanes == 2)
+			fprintf(trace, "%s 0x%05x // -> 0x%08x\n", isa.name, insn.maddr(), acc1);
+	}
+}
 
-		if (insn.op() == 24 || insn.op() == 25)
-		{
-			main_mem_tags[maddr] = true;
-			main_mem_tags[maddr+1] = true;
-			main_mem_tags[maddr+2] = true;
-			main_mem_tags[maddr+3] = true;
-
-			main_mem[maddr] = acc0;
-			main_mem[maddr+1] = acc0 >> 8;
-			main_mem[maddr+2] = acc0 >> 16;
-			main_mem[maddr+3] = acc0 >> 24;
-		}
+// MACC/MMAX/MACCZ/MMAXZ/MMAXN
+void MlSim::execMacc(insn_t insn, const MlIsa::op_t &isa)
+{
+	int maddr = (VBP + insn.maddr()) & arch.maddr_mask();
+	int caddr = (CBP + insn.caddr()) & arch.caddr_mask();
+	assert(maddr+8 <= int(main_mem.size()));
+	assert(caddr < arch.coeff_size);
+	assert(maddr % 2 == 0);
 
-		if (insn.op() == 24 || insn.op() == 26)
-		{
-			main_mem_tags[maddr+4] = true;
-			main_mem_tags[maddr+5] = true;
-			main_mem_tags[maddr+6] = true;
-			main_mem_tags[maddr+7] = true;
-
-			main_mem[maddr+4] = acc1;
-			main_mem[maddr+5] = acc1 >> 8;
-			main_mem[maddr+6] = acc1 >> 16;
-			main_mem[maddr+7] = acc1 >> 24;
-		}
+	ops_cnt++;
 
-		if (trace) {
-			if (insn.op() == 24)
-				fprintf(trace, "Save 0x%05x, 0x%03x // 0x%08x 0x%08x -> 0x%08x 0x%08x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc0, acc1, acc0, acc1, maddr);
-			if (insn.op() == 25)
-				fprintf(trace, "Save0 0x%05x, 0x%03x // 0x%08x -> 0x%08x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc0, acc0, maddr);
-			if (insn.op() == 26)
-				fprintf(trace, "Save1 0x%05x, 0x%03x // 0x%08x -> 0x%08x @ 0x%05x\n", insn.maddr(), insn.caddr(), acc1, acc1, maddr+4);
-		}
-		return;
+	if (isa.flags & MlIsa::FLAG_ZERO) {
+		acc0 = 0;
+		acc1 = 0;
 	}
 
-	// LdSet/LdAdd
-	if (insn.op() == 28 || insn.op() == 29 || insn.op() == 30 ||
-			insn.op() == 32 || insn.op() == 33 || insn.op() == 34)
-	{
-		int maddr = (LBP + insn.maddr()) & 0x1ffff;
-		assert(maddr % 2 == 0);
-
-		int32_t v0 = 0;
-		v0 |= main_mem[maddr];
-		v0 |= main_mem[maddr+1] << 8;
-		v0 |= main_mem[maddr+2] << 16;
-		v0 |= main_mem[maddr+3] << 24;
-
-		int32_t v1 = 0;
-		v1 |= main_mem[maddr+4];
-		v1 |= main_mem[maddr+5] << 8;
-		v1 |= main_mem[maddr+6] << 16;
-		v1 |= main_mem[maddr+7] << 24;
-
-		if (insn.op() == 28 || insn.op() == 29)
-			acc0 = v0;
-
-		if (insn.op() == 28 || insn.op() == 30)
-			acc1 = v1;
-
-		if (insn.op() == 32 || insn.op() == 33)
-			acc0 += v0;
-
-		if (insn.op() == 32 || insn.op() == 34)
-			acc1 += v1;
-
-		if (trace) {
-			if (insn.op() == 28)
-				fprintf(trace, "LdSet 0x%05x // -> 0x%08x 0x%08x\n", insn.maddr(), acc0, acc1);
-			if (insn.op() == 29)
-				fprintf(trace, "LdSet0 0x%05x // -> 0x%08x\n", insn.maddr(), acc0);
-			if (insn.op() == 30)
-				fprintf(trace, "LdSet1 0x%05x // -> 0x%08x\n", insn.maddr(), acc1);
-			if (insn.op() == 32)
-				fprintf(trace, "LdAdd 0x%05x // -> 0x%08x 0x%08x\n", insn.maddr(), acc0, acc1);
-			if (insn.op() == 33)
-				fprintf(trace, "LdAdd0 0x%05x // -> 0x%08x\n", insn.maddr(), acc0);
-			if (insn.op() == 34)
-				fprintf(trace, "LdAdd1 0x%05x // -> 0x%08x\n", insn.maddr(), acc1);
-		}
-		return;
+	if (isa.flags & MlIsa::FLAG_NEG) {
+		acc0 = 0x80000000;
+		acc1 = 0;
 	}
 
-	// MACC/MMAX
-	if (insn.op() == 40 || insn.op() == 41 || insn.op() == 42 || insn.op() == 43 || insn.op() == 45)
+	for (int i = 0; i < 8; i ++)
 	{
-		int maddr = (VBP + insn.maddr()) & 0x1ffff;
-		int caddr = (CBP + insn.caddr()) & 0x1ff;
-		assert(maddr % 2 == 0);
-
-		ops_cnt++;
-
-		// MACCZ/MMAXZ
-		if ((insn.op() & 2) != 0) {
-			acc0 = 0;
-			acc1 = 0;
-		}
-
-		// MMAXN
-		if ((insn.op() & 4) != 0) {
-			acc0 = 0x80000000;
-			acc1 = 0;
+		int32_t c0 = int8_t(coeff0_mem[caddr] >> (i*8));
+		int32_t c1 = int8_t(coeff1_mem[caddr] >> (i*8));
+		int32_t m = int8_t(main_mem[maddr+i]);
+		int32_t p0 = c0*m, p1 = c1*m;
+
+		if (isa.flags & MlIsa::FLAG_MAX) {
+			if (uint8_t(c0) != 0x00)
+				acc0 = std::max(acc0, p0);
+			acc1 += p1;
+		} else {
+			acc0 += p0;
+			acc1 += p1;
 		}
+	}
 
+	if (trace) {
+		uint64_t mdata = 0;
 		for (int i = 0; i < 8; i ++)
-		{
-			int32_t c0 = int8_t(coeff0_mem[caddr] >> (i*8));
-			int32_t c1 = int8_t(coeff1_mem[caddr] >> (i*8));
-			int32_t m = int8_t(main_mem[maddr+i]);
-			int32_t p0 = c0*m, p1 = c1*m;
-
-			if ((insn.op() & 1) != 0) {
-				if (uint8_t(c0) != 0x00)
-					acc0 = std::max(acc0, p0);
-				acc1 += p1;
-			} else {
-				acc0 += p0;
-				acc1 += p1;
-			}
-		}
-
-		if (trace) {
-			uint64_t mdata = 0;
-			for (int i = 0; i < 8; i ++)
-				mdata |= uint64_t(main_mem[maddr+i]) << (8*i);
-			if (insn.op() == 40)
-				fprintf(trace, "MACC 0x%05x, 0x%03x // 0x%016llx @ 0x%05x, 0x%016llx 0x%016llx @ 0x%03x -> 0x%08x 0x%08x\n",
-						insn.maddr(), insn.caddr(), (long long)mdata, maddr, (long long)coeff0_mem[caddr],
-						(long long)coeff1_mem[caddr], caddr, acc0, acc1);
-			if (insn.op() == 41)
-				fprintf(trace, "MMAX 0x%05x, 0x%03x // 0x%016llx @ 0x%05x, 0x%016llx 0x%016llx @ 0x%03x -> 0x%08x 0x%08x\n",
-						insn.maddr(), insn.caddr(), (long long)mdata, maddr, (long long)coeff0_mem[caddr],
-						(long long)coeff1_mem[caddr], caddr, acc0, acc1);
-			if (insn.op() == 42)
-				fprintf(trace, "MACCZ 0x%05x, 0x%03x // 0x%016llx @ 0x%05x, 0x%016llx 0x%016llx @ 0x%03x -> 0x%08x 0x%08x\n",
-						insn.maddr(), insn.caddr(), (long long)mdata, maddr, (long long)coeff0_mem[caddr],
-						(long long)coeff1_mem[caddr], caddr, acc0, acc1);
-			if (insn.op() == 43)
-				fprintf(trace, "MMAXZ 0x%05x, 0x%03x // 0x%016llx @ 0x%05x, 0x%016llx 0x%016llx @ 0x%03x -> 0x%08x 0x%08x\n",
-						insn.maddr(), insn.caddr(), (long long)mdata, maddr, (long long)coeff0_mem[caddr],
-						(long long)coeff1_mem[caddr], caddr, acc0, acc1);
-			if (insn.op() == 45)
-				fprintf(trace, "MMAXN 0x%05x, 0x%03x // 0x%016llx @ 0x%05x, 0x%016llx 0x%016llx @ 0x%03x -> 0x%08x 0x%08x\n",
-						insn.maddr(), insn.caddr(), (long long)mdata, maddr, (long long)coeff0_mem[caddr],
-						(long long)coeff1_mem[caddr], caddr, acc0, acc1);
-		}
-		return;
+			mdata |= uint64_t(main_mem[maddr+i]) << (8*i);
+		fprintf(trace, "%s 0x%05x, 0x%03x // 0x%016llx @ 0x%05x, 0x%016llx 0x%016llx @ 0x%03x -> 0x%08x 0x%08x\n",
+				isa.name, insn.maddr(), insn.caddr(), (long long)mdata, maddr, (long long)coeff0_mem[caddr],
+				(long long)coeff1_mem[caddr], caddr, acc0, acc1);
 	}
-
-	abort();
 }
 
 void MlSim::run(int addr)
@@ -315,7 +289,7 @@ void MlSim::run(int addr)
 	assert(addr < int(main_mem.size()));
 	assert(addr % 4 == 0);
 
-	insn_t insn;
+	insn_t insn(&arch);
 	insn.x |= main_mem[addr];
 	insn.x |= main_mem[addr+1] << 8;
 	insn.x |= main_mem[addr+2] << 16;
@@ -325,9 +299,14 @@ void MlSim::run(int addr)
 		printf("seq: @%05x %08x (maddr=%05x, caddr=%03x, op=%d)\n",
 				addr, insn.x, insn.maddr(), insn.caddr(), insn.op());
 
+	fetch(addr);
+
 	// Sync
 	if (insn.op() == 0) {
-		cycle_cnt += 8;
+		perf.nosimd++;
+		perf.sync++;
+		idle(arch.sync_cycles);
+		compute_end = 0;
 		return run(addr+4);
 	}
 
@@ -348,26 +327,34 @@ void MlSim::run(int addr)
 	// Execute
 	if (insn.op() == 3) {
 		int len = insn.maddr();
-		assert(len <= 512);
-		for (int i = insn.caddr(); i < insn.caddr()+len; i++)
-			exec(code_mem[i]);
+		assert(len <= arch.code_size);
+		assert(insn.caddr()+len <= arch.code_size);
+		for (int i = insn.caddr(); i < insn.caddr()+len; i++) {
+			hit(code_src[i]);
+			exec(insn_t(&arch, code_mem[i]));
+		}
 		return run(addr+4);
 	}
 
 	// LoadCode
 	if (insn.op() == 4) {
+		assert(insn.maddr()+4 <= int(main_mem.size()));
+		assert(insn.caddr() < arch.code_size);
 		uint32_t v = 0;
 		v |= main_mem[insn.maddr()];
 		v |= main_mem[insn.maddr()+1] << 8;
 		v |= main_mem[insn.maddr()+2] << 16;
 		v |= main_mem[insn.maddr()+3] << 24;
 		code_mem[insn.caddr()] = v;
-		cycle_cnt++;
+		code_src[insn.caddr()] = insn.maddr();
+		issue(insn.op());
 		goto continueLoad;
 	}
 
 	// LoadCoeff
 	if (insn.op() == 5 || insn.op() == 6) {
+		assert(insn.maddr()+8 <= int(main_mem.size()));
+		assert(insn.caddr() < arch.coeff_size);
 		uint64_t v = 0;
 		v |= uint64_t(main_mem[insn.maddr()]);
 		v |= uint64_t(main_mem[insn.maddr()+1]) << 8;
@@ -381,14 +368,15 @@ void MlSim::run(int addr)
 			coeff0_mem[insn.caddr()] = v;
 		else
 			coeff1_mem[insn.caddr()] = v;
-		cycle_cnt++;
+		issue(insn.op());
+		coeffLoad();
 		goto continueLoad;
 	}
 
 	// ContinueLoad
 	if (0) {
 continueLoad:;
-		insn_t insn2;
+		insn_t insn2(&arch);
 		insn2.x |= main_mem[addr+4];
 		insn2.x |= main_mem[addr+5] << 8;
 		insn2.x |= main_mem[addr+6] << 16;
@@ -401,12 +389,21 @@ continueLoad:;
 						addr+4, insn2.x, insn2.maddr(), insn2.caddr(), insn2.op());
 
 			int len = insn2.maddr();
-			assert(len < 512);
+			int size = insn.op() == 4 ? arch.code_size : arch.coeff_size;
+			assert(insn.caddr()+len < size);
+			assert(insn.maddr()+(insn.op() == 4 ? 4 : 8)*(len+1) <= int(main_mem.size()));
 
-			cycle_cnt += len;
+			fetch(addr+4);
 
 			for (int i = 1; i <= len; i++)
 			{
+				if (arch.contld_cycles > 0) {
+					issue(insn.op());
+					idle(arch.contld_cycles - 1);
+				} else {
+					perf.nosimd++;
+				}
+
 				// LoadCode
 				if (insn.op() == 4) {
 					uint32_t v = 0;
@@ -415,6 +412,7 @@ continueLoad:;
 					v |= main_mem[insn.maddr()+4*i+2] << 16;
 					v |= main_mem[insn.maddr()+4*i+3] << 24;
 					code_mem[insn.caddr()+i] = v;
+					code_src[insn.caddr()+i] = insn.maddr()+4*i;
 				}
 
 				// LoadCoeff
@@ -432,6 +430,7 @@ continueLoad:;
 						coeff0_mem[insn.caddr()+i] = v;
 					else
 						coeff1_mem[insn.caddr()+i] = v;
+					coeffLoad();
 				}
 
 			}
@@ -446,17 +445,114 @@ continueLoad:;
 	return run(addr+4);
 }
 
-void MlSim::readBinFile(FILE *f)
+void MlSim::hit(int addr)
+{
+	if (!profile || addr < 0)
+		return;
+
+	if (prof_hits.empty()) {
+		prof_hits.resize(main_mem.size() / 4);
+		prof_cycles.resize(main_mem.size() / 4);
+	}
+
+	prof_addr = addr;
+	prof_hits[addr/4]++;
+}
+
+void MlSim::writeProfile(FILE *f)
+{
+	fprintf(f, "# address hits cycles\n");
+	for (int i = 0; i < int(prof_hits.size()); i++)
+		if (prof_hits[i] != 0)
+			fprintf(f, "%05x %u %llu\n", 4*i, prof_hits[i], (unsigned long long)prof_cycles[i]);
+}
+
+int MlSim::readBinFile(FILE *f)
 {
 	for (int i = 0; i < int(main_mem.size()); i++) {
 		int c = fgetc(f);
 		if (c < 0) {
 			if (verbose)
 				printf("read %d bytes from bin file.\n", i);
-			break;
+			return i;
 		}
 		main_mem[i] = c;
 	}
+	return main_mem.size();
+}
+
+int MlSim::readImage(const void *image, int len)
+{
+	const char *err = mlimg_check(image, len);
+
+	if (err == nullptr && int(mlimg_hdr(image)->mem_size) > arch.mem_size)
+		err = "image is for a larger main memory";
+
+	if (err != nullptr) {
+		fprintf(stderr, "MlSim error: Invalid program image: %s.\n", err);
+		exit(1);
+	}
+
+	auto hdr = mlimg_hdr(image);
+
+	for (int i = 0; i < int(hdr->sec_count); i++) {
+		auto sec = mlimg_sections(image) + i;
+		auto content = mlimg_content(image, sec);
+		if (verbose)
+			printf("%s section %s: %d bytes at 0x%05x.\n", mlimg_type_name(sec->type),
+					mlimg_string(image, sec->name), int(sec->size), int(sec->addr));
+		if (content != nullptr)
+			std::copy(content, content + sec->size, main_mem.begin() + sec->addr);
+
+		if (sec->type == MLIMG_SEC_INPUT || sec->type == MLIMG_SEC_OUTPUT) {
+			auto &t = tensors[mlimg_string(image, sec->name)];
+			t.output = sec->type == MLIMG_SEC_OUTPUT;
+			t.addr = sec->addr;
+			t.size = sec->size;
+			t.layout = mlimg_string(image, sec->layout);
+			t.shape.clear();
+			for (int k = 0; k < 4 && sec->shape[k] != 0; k++)
+				t.shape.push_back(sec->shape[k]);
+		}
+	}
+
+	return hdr->entry;
+}
+
+void MlSim::injectTensor(const std::string &name, const std::vector<uint8_t> &data)
+{
+	if (tensors.count(name) == 0 || tensors.at(name).output) {
+		fprintf(stderr, "MlSim error: Program has no input tensor %s.\n", name.c_str());
+		exit(1);
+	}
+
+	auto &t = tensors.at(name);
+
+	if (int(data.size()) > t.size) {
+		fprintf(stderr, "MlSim error: %d bytes of data for the %d bytes input tensor %s.\n",
+				int(data.size()), t.size, name.c_str());
+		exit(1);
+	}
+
+	if (verbose)
+		printf("inject %d bytes into %s at 0x%05x.\n", int(data.size()), name.c_str(), t.addr);
+
+	std::copy(data.begin(), data.end(), main_mem.begin() + t.addr);
+}
+
+std::vector<uint8_t> MlSim::extractTensor(const std::string &name)
+{
+	if (tensors.count(name) == 0 || !tensors.at(name).output) {
+		fprintf(stderr, "MlSim error: Program has no output tensor %s.\n", name.c_str());
+		exit(1);
+	}
+
+	auto &t = tensors.at(name);
+
+	if (verbose)
+		printf("extract %d bytes from %s at 0x%05x.\n", t.size, name.c_str(), t.addr);
+
+	return std::vector<uint8_t>(main_mem.begin() + t.addr, main_mem.begin() + t.addr + t.size);
 }
 
 void MlSim::writeHexFile(FILE *f)
@@ -494,7 +590,7 @@ void MlSim::writeHexFile(FILE *f)
 void MlSim::writeBinFile(FILE *f)
 {
 	if (verbose)
-		printf("writing 128 kB bin file.\n");
+		printf("writing %d bytes bin file.\n", int(main_mem.size()));
 
-	fwrite(main_mem.data(), 128*1024, 1, f);
+	fwrite(main_mem.data(), main_mem.size(), 1, f);
 }
@@ -24,49 +24,114 @@
 #include <string>
 #include <map>
 
+#include "mlarch.h"
+#include "mlisa.h"
+#include "mlpipe.h"
+
 class MlSim
 {
+public:
+	struct insn_t;
+
 private:
+	typedef void (MlSim::*exec_fn)(insn_t insn, const MlIsa::op_t &isa);
+
+	void execSetBP(insn_t insn, const MlIsa::op_t &isa);
+	void execStore(insn_t insn, const MlIsa::op_t &isa);
+	void execSave(insn_t insn, const MlIsa::op_t &isa);
+	void execLdAcc(insn_t insn, const MlIsa::op_t &isa);
+	void execMacc(insn_t insn, const MlIsa::op_t &isa);
 
 public:
 	struct insn_t {
 		uint32_t x;
+		const MlArch *arch;
+
+		insn_t(const MlArch *arch, uint32_t x = 0) : x(x), arch(arch) { }
 
-		insn_t(uint32_t x = 0) : x(x) { }
+		int op() { return arch->insn_op(x); }
+		int maddr() { return arch->insn_maddr(x); }
+		int caddr() { return arch->insn_caddr(x); }
+	};
 
-		int op() { return x & 0x3f; }
-		int maddr() { return x >> 15; }
-		int caddr() { return (x >> 6) & 0x1ff; }
+	// input/output tensors of the loaded program image
+	struct tensor_t {
+		bool output = false;
+		int addr = 0;
+		int size = 0;
+		std::string layout;
+		std::vector<int> shape;
 	};
 
+	const MlArch arch;
+	std::map<std::string, tensor_t> tensors;
+
 	FILE *trace = nullptr;
 	bool verbose = false;
 	int cycle_cnt = 0;
 	int ops_cnt = 0;
 
+	// Same counters as the QPI "Read counters" command (see docs/qpi.md)
+	struct perf_t {
+		uint32_t busy = 0;
+		uint32_t simd = 0;
+		uint32_t nosimd = 0;
+		uint32_t stall = 0;
+		uint32_t fetch = 0;
+		uint32_t sync = 0;
+	} perf;
+
+	// Coefficient words loaded, and how many of them were issued while
+	// compute instructions other than base pointer writes were still in the
+	// pipeline (less than MlPipe::DEPTH cycles after the last one, with no
+	// Sync in between), i.e. overlapped with the tail of the compute work.
+	int coeff_words = 0;
+	int coeff_overlap = 0;
+	int compute_end = 0;
+
+	MlPipe pipe;
+
+	// Per main memory word execution counts and cycles, with compute code run
+	// by Execute attributed to the address it was loaded from (see -P)
+	bool profile = false;
+	int prof_addr = 0;
+	std::vector<uint32_t> prof_hits;
+	std::vector<uint64_t> prof_cycles;
+
 	std::vector<uint8_t> main_mem;
 	std::vector<bool> main_mem_tags;
 
 	std::vector<uint32_t> code_mem;
+	std::vector<int> code_src;
 	std::vector<uint64_t> coeff0_mem;
 	std::vector<uint64_t> coeff1_mem;
 
 	int32_t VBP = 0, LBP = 0, SBP = 0, CBP = 0;
 	int32_t acc0 = 0, acc1 = 0;
 
-	MlSim()
+	MlSim(const MlArch &arch = MlArch()) : arch(arch)
 	{
-		main_mem.resize(128 * 1024);
-		main_mem_tags.resize(128 * 1024);
+		main_mem.resize(arch.mem_size);
+		main_mem_tags.resize(arch.mem_size);
 
-		code_mem.resize(512);
-		coeff0_mem.resize(512);
-		coeff1_mem.resize(512);
+		code_mem.resize(arch.code_size);
+		code_src.resize(arch.code_size, -1);
+		coeff0_mem.resize(arch.coeff_size);
+		coeff1_mem.resize(arch.coeff_size);
 	}
 
+	void idle(int cycles);
+	void fetch(int addr);
+	void issue(int op);
+	void coeffLoad();
 	void exec(insn_t insn);
 	void run(int addr);
-	void readBinFile(FILE *f);
+	void hit(int addr);
+	void writeProfile(FILE *f);
+	int readBinFile(FILE *f);
+	int readImage(const void *image, int len);
+	void injectTensor(const std::string &name, const std::vector<uint8_t> &data);
+	std::vector<uint8_t> extractTensor(const std::string &name);
 	void writeHexFile(FILE *f);
 	void writeBinFile(FILE *f);
 };
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+#
+# Client for the mlqpid QPI device emulator (see docs/qpi.md)
+#
+# Usage as a script:
+#
+#   ./mlqpid -s mlqpi.sock &
+#   python3 qpiclient.py mlqpi.sock ../asm/demo.hex ../sim/demo_out.hex
+#
+# Uploads the program in the first hex file, runs it, and compares the
+# memory regions given in the second hex file.
+
+import socket
+import struct
+import sys
+
+MAX_DATA = 1024
+
+class QpiClient:
+    def __init__(self, path):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.connect(path)
+        self.rdy = False
+        self.err = False
+
+    def recv_exact(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            if not chunk:
+                raise IOError("connection to mlqpid closed")
+            data += chunk
+        return data
+
+    # one chip-select cycle: send wdata, then clock in rlen bytes
+    def xfer(self, wdata, rlen=0):
+        wdata = bytes(wdata)
+        self.sock.sendall(struct.pack("<HH", len(wdata), rlen) + wdata)
+        data = self.recv_exact(rlen + 1)
+        self.rdy = (data[-1] & 1) != 0
+        self.err = (data[-1] & 2) != 0
+        if self.err:
+            raise IOError("MARLANN asserted ERR")
+        return data[:-1]
+
+    def pins(self):
+        self.xfer(b"")
+        return self.rdy, self.err
+
+    def wait_ack(self, cmd):
+        # first byte is the dummy byte, then FFh while busy and 00h when done.
+        # Re-issuing the command restarts the copy, so read more status
+        # bytes each time.
+        rlen = 64
+        while 0 not in self.xfer(cmd, rlen)[1:]:
+            rlen *= 2
+
+    def send_data(self, cursor, data):
+        assert len(data) <= MAX_DATA and len(data) % 4 == 0
+        self.xfer([0x21] + list(data))
+        self.wait_ack([0x23, (cursor >> 1) & 0xff, cursor >> 9, (len(data) >> 2) & 0xff])
+
+    def get_data(self, cursor, d_len):
+        assert d_len <= MAX_DATA and d_len % 4 == 0
+        self.wait_ack([0x24, (cursor >> 1) & 0xff, cursor >> 9, (d_len >> 2) & 0xff])
+        return self.xfer([0x22], d_len + 1)[1:]
+
+    def start_kernel(self, addr=0):
+        self.xfer([0x25, (addr >> 1) & 0xff, addr >> 9])
+
+    def wait_for_kernel(self):
+        while self.xfer([0x20], 2)[1] != 0:
+            pass
+
+    # busy, simd, nosimd, stall, fetch, sync
+    def read_counters(self):
+        return struct.unpack("<6I", self.xfer([0x27], 25)[1:])
+
+    def reset_counters(self):
+        self.xfer([0x28])
+
+def read_hex(filename):
+    mem = dict()
+    cursor = 0
+    with open(filename) as f:
+        for line in f:
+            for tok in line.split():
+                if tok.startswith("@"):
+                    cursor = int(tok[1:], 16)
+                else:
+                    mem[cursor] = int(tok, 16)
+                    cursor += 1
+    return mem
+
+def regions(mem):
+    addrs = sorted(mem.keys())
+    i = 0
+    while i < len(addrs):
+        start = addrs[i] & ~3
+        end = start
+        while i < len(addrs) and addrs[i] < end + 4 and addrs[i] < start + MAX_DATA:
+            end = (addrs[i] & ~3) + 4
+            i += 1
+        yield start, end - start
+
+if __name__ == "__main__":
+    client = QpiClient(sys.argv[1])
+    prog = read_hex(sys.argv[2])
+
+    for cursor, d_len in regions(prog):
+        client.send_data(cursor, [prog.get(cursor + i, 0) for i in range(d_len)])
+
+    client.start_kernel(0)
+    client.wait_for_kernel()
+
+    errors = 0
+    if len(sys.argv) > 3:
+        expected = read_hex(sys.argv[3])
+        for cursor, d_len in regions(expected):
+            data = client.get_data(cursor, d_len)
+            for i in range(d_len):
+                if cursor + i in expected and expected[cursor + i] != data[i]:
+                    errors += 1
+
+    print("counters: busy=%d simd=%d nosimd=%d stall=%d fetch=%d sync=%d" % client.read_counters())
+    print("%d errors." % errors)
+    sys.exit(1 if errors else 0)
@@ -0,0 +1,295 @@
+/*
+ *  Copyright (C) 2018  Clifford Wolf <clifford@symbioticeda.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include "mlqpi.h"
+#include "mlimage.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Frame format on the socket (see docs/qpi.md):
+//
+//   request:  wlen (2 bytes, LSB first), rlen (2 bytes, LSB first), wlen data bytes
+//   response: rlen data bytes, status byte (bit 0 = RDY asserted, bit 1 = ERR asserted)
+//
+// Each request with wlen+rlen > 0 is one chip-select cycle. A request with
+// wlen = rlen = 0 just samples RDY/ERR without asserting chip-select.
+
+struct client_t {
+	int fd;
+	std::vector<uint8_t> inbuf;
+};
+
+void help(const char *progname, int rc)
+{
+	printf("\n");
+	printf("Usage: %s [options]\n", progname);
+	printf("\n");
+	printf("  -h\n");
+	printf("    print help message\n");
+	printf("\n");
+	printf("  -v\n");
+	printf("    verbose output\n");
+	printf("\n");
+	printf("  -s filename\n");
+	printf("    path of the unix domain socket (default = mlqpi.sock)\n");
+	printf("\n");
+	printf("  -n chips\n");
+	printf("    number of cascaded MARLANN cores (1..4, default = 1)\n");
+	printf("\n");
+	printf("  -l filename\n");
+	printf("    preload bin or image file into main memory of the first core\n");
+	printf("\n");
+	printf("  -a filename\n");
+	printf("    read architecture description file\n");
+	printf("\n");
+	printf("  -p name=value\n");
+	printf("    set architecture parameter (overrides -a for later options)\n");
+	printf("\n");
+	printf("  -Q name=value\n");
+	printf("    set QPI timing parameter (sclk_mhz, clk_mhz, cs_cycles, copy_cycles)\n");
+	printf("\n");
+	exit(rc);
+}
+
+bool process_frames(MlQpi &qpi, client_t &client)
+{
+	while (client.inbuf.size() >= 4)
+	{
+		int wlen = client.inbuf[0] | (client.inbuf[1] << 8);
+		int rlen = client.inbuf[2] | (client.inbuf[3] << 8);
+
+		if (int(client.inbuf.size()) < 4 + wlen)
+			break;
+
+		std::vector<uint8_t> response;
+
+		// A host sampling RDY outside of a transaction is waiting for
+		// the running kernel to finish.
+		if (wlen + rlen > 0)
+			qpi.begin();
+		else
+			qpi.waitRdy();
+
+		for (int i = 0; i < wlen; i++)
+			qpi.xfer(client.inbuf[4+i]);
+
+		for (int i = 0; i < rlen; i++)
+			response.push_back(qpi.xfer(0xff));
+
+		response.push_back((qpi.rdy() ? 1 : 0) | (qpi.error() ? 2 : 0));
+
+		if (wlen + rlen > 0)
+			qpi.end();
+
+		client.inbuf.erase(client.inbuf.begin(), client.inbuf.begin() + 4 + wlen);
+
+		for (int i = 0; i < int(response.size());) {
+			int rc = write(client.fd, response.data() + i, response.size() - i);
+			if (rc <= 0) {
+				if (rc < 0 && errno == EINTR)
+					continue;
+				return false;
+			}
+			i += rc;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	bool verbose = false;
+	int num_chips = 1;
+	std::string socket_filename = "mlqpi.sock";
+	std::string preload_filename;
+	std::vector<const char*> timing_params;
+	MlArch arch;
+
+	while ((opt = getopt(argc, argv, "hvs:n:l:a:p:Q:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			help(argv[0], 0);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 's':
+			socket_filename = optarg;
+			break;
+		case 'n':
+			num_chips = atoi(optarg);
+			break;
+		case 'l':
+			preload_filename = optarg;
+			break;
+		case 'a':
+			arch.readFile(optarg);
+			break;
+		case 'p':
+			arch.parseParam(optarg);
+			break;
+		case 'Q':
+			timing_params.push_back(optarg);
+			break;
+		default:
+			help(argv[0], 1);
+		}
+	}
+
+	if (optind != argc || num_chips < 1 || num_chips > 4)
+		help(argv[0], 1);
+
+	arch.check();
+
+	std::vector<MlSim> sims(num_chips, MlSim(arch));
+	std::vector<MlSim*> sim_ptrs;
+
+	for (auto &sim : sims)
+		sim_ptrs.push_back(&sim);
+
+	if (!preload_filename.empty()) {
+		FILE *f = fopen(preload_filename.c_str(), "rb");
+		if (f == nullptr) {
+			perror("Open preload file");
+			exit(1);
+		}
+		std::vector<uint8_t> data;
+		for (int c; (c = fgetc(f)) >= 0;)
+			data.push_back(c);
+		fclose(f);
+		if (mlimg_is_image(data.data(), data.size()))
+			sims[0].readImage(data.data(), data.size());
+		else
+			std::copy(data.begin(), data.begin() + std::min(data.size(), sims[0].main_mem.size()),
+					sims[0].main_mem.begin());
+	}
+
+	MlQpi qpi(sim_ptrs);
+	qpi.verbose = verbose;
+
+	for (auto p : timing_params)
+		qpi.setTiming(p);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		perror("Create socket");
+		exit(1);
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socket_filename.size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path '%s' is too long.\n", socket_filename.c_str());
+		exit(1);
+	}
+
+	strcpy(addr.sun_path, socket_filename.c_str());
+	unlink(socket_filename.c_str());
+
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("Bind socket");
+		exit(1);
+	}
+
+	if (listen(listen_fd, 16) < 0) {
+		perror("Listen on socket");
+		exit(1);
+	}
+
+	if (verbose)
+		printf("listening on %s with %d core(s).\n", socket_filename.c_str(), num_chips);
+
+	std::vector<client_t> clients;
+
+	while (1)
+	{
+		std::vector<struct pollfd> fds(1 + clients.size());
+
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+
+		for (int i = 0; i < int(clients.size()); i++) {
+			fds[i+1].fd = clients[i].fd;
+			fds[i+1].events = POLLIN;
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Poll");
+			exit(1);
+		}
+
+		// Clients are served one complete frame at a time, so every chip-select
+		// cycle is atomic, just like on a shared bus.
+		for (int i = int(clients.size())-1; i >= 0; i--)
+		{
+			if (fds[i+1].revents == 0)
+				continue;
+
+			uint8_t buffer[4096];
+			int rc = read(clients[i].fd, buffer, sizeof(buffer));
+
+			if (rc > 0) {
+				clients[i].inbuf.insert(clients[i].inbuf.end(), buffer, buffer + rc);
+				if (process_frames(qpi, clients[i]))
+					continue;
+			} else if (rc < 0 && errno == EINTR) {
+				continue;
+			}
+
+			if (verbose) {
+				printf("client %d disconnected.\n", clients[i].fd);
+				qpi.printStats(stdout);
+			}
+
+			close(clients[i].fd);
+			clients.erase(clients.begin() + i);
+		}
+
+		if (fds[0].revents != 0) {
+			int fd = accept(listen_fd, nullptr, nullptr);
+			if (fd >= 0) {
+				if (verbose)
+					printf("client %d connected.\n", fd);
+				clients.push_back(client_t());
+				clients.back().fd = fd;
+			}
+		}
+
+		fflush(stdout);
+	}
+
+	return 0;
+}